@@ -0,0 +1,820 @@
+// ===============================================
+//  Benchmark.c — micro/macro benchmarks
+//  - deterministic synthetic book generator (quotes, commas,
+//    Thai text, duplicate phones — same mix as contacts.csv)
+//  - micro: parseCsv4 vs. the schema-generated contactParse,
+//           contactFormat, escapeCSV, unescapeCSV, normalizePhone
+//           vs. the E.164 phone key, normalizeKey, validateEmail,
+//           validateColumns
+//  - macro: list / search / structured query / ranked top-K search /
+//           keyset pages / delete / update on the generated book,
+//           one in-place row edit through the row index vs. the
+//           range-copy rewrite it falls back to,
+//           load / point get / compaction of the segmented store,
+//           import / fan-out query / phone lookup / delete on a
+//           sharded copy of the book,
+//           concurrent key map inserts on 1..32 threads and the
+//           parallel phone / email index build from the book,
+//           the fgets scan loop vs. the read / parse / match / format
+//           pipeline, inline and on its own threads,
+//           pack / parallel scan of the block-compressed book,
+//           uniqueness index build vs. loading its saved image,
+//           B+tree build / point / prefix / range, and a prefix query
+//           through it vs. a scan,
+//           the company / domain / phone-prefix group-by report,
+//           as-you-type search: index, first key, each further key
+//           and each backspace
+//  Results are printed and written as JSON to bench_output.txt
+// ===============================================
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "test.h"
+#include "schema.h"
+
+// ===== externs from main.c =====
+extern void listContacts(void);
+extern void searchContact(void);
+extern void deleteContact(void);
+extern void updateContact(void);
+
+extern const char* getContactsFile(void);
+extern void setContactsFile(const char* path);
+
+extern void escapeCSV(const char *input, char *output, size_t output_size);
+extern void unescapeCSV(char *str);
+extern int  validateEmail(const char *email);
+extern size_t validateColumns(const char *const *phones, const char *const *emails, size_t n, unsigned long long *invalid);
+extern void parseCsv4(const char *srcLine,
+                      char *f1, size_t n1, char *f2, size_t n2,
+                      char *f3, size_t n3, char *f4, size_t n4);
+extern void normalizePhone(const char *in, char *out, size_t out_size);
+extern long long phoneE164(const char *phone);
+extern void normalizeKey(char *s);
+extern long long nowNs(void);
+
+extern void setLsmOptions(int memtable_rows, long long rate_bytes_per_s);
+extern int  lsmOpen(const char *dir);
+extern void lsmClose(void);
+extern int  lsmPut(const char *company, const char *person, const char *phone, const char *email);
+extern int  lsmGet(const char *company, const char *person, char *phone, size_t np, char *email, size_t ne);
+extern int  lsmCompactNow(void);
+extern void lsmDestroy(const char *dir);
+
+extern int  shardOpen(const char *dir, int nshards);
+extern void shardClose(void);
+extern void shardDestroy(const char *dir);
+extern long shardImport(const char *csv);
+extern long shardQuery(const char *text,
+                       void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+                       void *ctx, char *plan, size_t plan_size);
+extern long shardFindPhone(const char *phone,
+                           void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                                      void *ctx),
+                           void *ctx);
+extern long shardDelete(const char *text);
+
+typedef struct KeyMap KeyMap;
+extern KeyMap* keyMapCreate(size_t expect);
+extern void keyMapFree(KeyMap *m);
+extern int  keyMapPut(KeyMap *m, unsigned long long key, unsigned long long val, unsigned long long *old);
+extern long keyMapBuildBook(const char *path, KeyMap *phone, KeyMap *email, int nthreads, long *dups);
+enum { PIPE_OFF = 0, PIPE_ON = 1, PIPE_AUTO = 2 };
+extern long scanPipeline(FILE *fp, int (*match)(const struct Contact *c, void *ctx), void *mctx,
+                         void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                                    void *ctx),
+                         void *ctx);
+extern void setScanPipeline(int mode);
+
+enum { BTREE_COMPANY = 1, BTREE_EMAIL = 2 };
+extern long btreeFind(const char *book, int field, const char *lo, const char *hi, int exact,
+                      void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                                 void *ctx),
+                      void *ctx);
+extern void setBtreeOptions(int fields, long long pool_bytes);
+extern void btreeClose(void);
+
+enum { REPORT_COMPANY, REPORT_DOMAIN, REPORT_PREFIX, REPORT_DIMS };
+typedef struct Report Report;
+extern Report* reportBuild(const char *path);
+extern size_t  reportGroups(const Report *r, int dim);
+extern void    reportFree(Report *r);
+
+typedef struct TypeAhead TypeAhead;
+extern TypeAhead* typeAheadOpen(const char *path);
+extern long   typeAheadSet(TypeAhead *ta, const char *key);
+extern unsigned long long typeAheadCounter(const TypeAhead *ta, const char *name);
+extern void   typeAheadClose(TypeAhead *ta);
+
+extern int    contactParse(const char *line, struct Contact *c);
+extern size_t contactFormat(const struct Contact *c, char *out, size_t cap);
+
+extern long cbkPack(const char *csv, const char *out, int sort);
+extern long cbkScan(const char *path, int (*fn)(char *line, void *ctx), void *ctx);
+
+extern void setUniquePolicy(int keys, int on_dup);
+enum { UNIQUE_PHONE = 1, UNIQUE_EMAIL = 2 };
+enum { DUP_WARN = 0, DUP_REJECT = 1 };
+extern int  uniqueWarmUp(void);
+extern int  uniquePersist(void);
+extern long queryBook(const char *path, const char *text,
+                      void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+                      void *ctx, char *plan, size_t plan_size);
+extern long searchTopK(const char *path, const char *key, int k,
+                       void (*fn)(int score, const char *company, const char *person, const char *phone,
+                                  const char *email, void *ctx),
+                       void *ctx, long *total, int *complete);
+extern long bookPage(const char *path, const char *query, const char *after, int limit,
+                     void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+                     void *ctx, char *next, size_t next_size);
+extern int  rowReplace(const char *path, long long off, const char *line, const char *repl);
+extern int  bookRewriteRow(const char *path, long long off, const char *line, const char *repl);
+extern int  appendContactRow(const char *company, const char *person, const char *phone, const char *email);
+
+// ===== Cross-platform stdin/stdout redirection =====
+#ifdef _WIN32
+  #include <io.h>
+  #define DUP    _dup
+  #define DUP2   _dup2
+  #define FILENO _fileno
+  #define CLOSE  _close
+  #define NULL_DEVICE "NUL"
+#else
+  #include <unistd.h>
+  #define DUP    dup
+  #define DUP2   dup2
+  #define FILENO fileno
+  #define CLOSE  close
+  #define NULL_DEVICE "/dev/null"
+#endif
+
+
+#define BENCH_FILE   "bench_contacts.csv"
+#define BENCH_JSON   "bench_output.txt"
+#define BENCH_LSM    "bench_contacts.lsm"
+#define LSM_GETS     1000
+#define BENCH_CBK    "bench_contacts.cbk"
+#define BENCH_SHARDS "bench_contacts.shards"
+#define SHARD_GETS   100
+#define KEYMAP_MAX_THREADS 32
+#define SAMPLE_ROWS  4096
+#define MICRO_OPS    (1L << 20)
+
+// ===============================================
+// Deterministic generator
+// ===============================================
+static unsigned long long bench_rng;
+static unsigned int bench_rand(void) {            // xorshift64*
+    bench_rng ^= bench_rng >> 12;
+    bench_rng ^= bench_rng << 25;
+    bench_rng ^= bench_rng >> 27;
+    return (unsigned int)((bench_rng * 2685821657736338717ULL) >> 32);
+}
+
+static const char *k_company_words[] = {
+    "Alpha", "Beta", "Nimbus", "Orion", "Quantum", "Zeta", "Delta", "Ocean & Sky",
+    "Data-Driven", "Retail", "Music", "Gadget", "Sunflower", "Code", "Travel+", "Mega"
+};
+static const char *k_company_suffix[] = { "Co.", "Ltd.", "Labs", "Group", "Inc", "Partners" };
+static const char *k_thai_company[] = { "บริษัท ไทยดี จำกัด", "ควิกเซอร์วิส", "การตลาดดี๊ดี", "บจ. ซอฟต์แวร์,เพื่อคุณ" };
+static const char *k_people[] = { "John Jr.", "Alice \"A.\"", "Somchai T.", "Jane Roe", "Ben Beta", "Mark O." };
+static const char *k_thai_people[] = { "กิตติคุณ ใจดี", "ปิ่น เกศ", "อลิสา เจ.", "ณัฐ ณรงค์", "ก้องภพ", "น้องอิง" };
+static const char *k_domains[] = { "co.th", "com", "io", "dev", "ai", "example" };
+static const char *k_phone_fmt[] = { "0%d-%03d-%04d", "+66 %d %03d %04d", "(0%d) %03d-%04d", "0%d.%03d.%04d" };
+
+static const char* pick(const char **arr, size_t n) { return arr[bench_rand() % n]; }
+#define PICK(arr) pick(arr, sizeof(arr) / sizeof(arr[0]))
+
+// Build one synthetic contact; every company carries its row index so it is unique.
+static void bench_make_row(long i, char *company, char *person, char *phone, char *email) {
+    unsigned int r = bench_rand() % 100;
+    if (r < 10)      snprintf(company, MAX_FIELD_LEN, "%s %ld", PICK(k_thai_company), i);
+    else if (r < 20) snprintf(company, MAX_FIELD_LEN, "%s, %s %s %ld", PICK(k_company_words), PICK(k_company_words), PICK(k_company_suffix), i);
+    else if (r < 30) snprintf(company, MAX_FIELD_LEN, "%s \"%s\" %ld", PICK(k_company_words), PICK(k_company_suffix), i);
+    else             snprintf(company, MAX_FIELD_LEN, "%s %s %ld", PICK(k_company_words), PICK(k_company_suffix), i);
+
+    snprintf(person, MAX_FIELD_LEN, "%s", (bench_rand() % 4 == 0) ? PICK(k_thai_people) : PICK(k_people));
+
+    // ~2% of rows reuse an earlier phone (duplicate-phone rows like contacts.csv)
+    long num = (bench_rand() % 50 == 0 && i > 0) ? (long)(bench_rand() % (unsigned)i) : i;
+    snprintf(phone, MAX_FIELD_LEN, PICK(k_phone_fmt), 80 + (int)(num % 10), (int)((num / 10) % 1000), (int)((num / 10000) % 10000));
+
+    snprintf(email, MAX_FIELD_LEN, "user%ld@example%u.%s", i, bench_rand() % 1000, PICK(k_domains));
+}
+
+// Writes `rows` rows; same seed => byte-identical file. Returns bytes written (or -1).
+long long generateSyntheticBook(const char *path, long rows, unsigned long long seed) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) return -1;
+    bench_rng = seed ? seed : 0x9E3779B97F4A7C15ULL;
+    long long bytes = 0;
+    char company[MAX_FIELD_LEN], person[MAX_FIELD_LEN], phone[MAX_FIELD_LEN], email[MAX_FIELD_LEN];
+    char a[MAX_FIELD_LEN*2], b[MAX_FIELD_LEN*2], c[MAX_FIELD_LEN*2], d[MAX_FIELD_LEN*2];
+    for (long i = 0; i < rows; i++) {
+        bench_make_row(i, company, person, phone, email);
+        escapeCSV(company, a, sizeof(a)); escapeCSV(person, b, sizeof(b));
+        escapeCSV(phone,   c, sizeof(c)); escapeCSV(email,  d, sizeof(d));
+        int n = fprintf(fp, "%s,%s,%s,%s\n", a, b, c, d);
+        if (n > 0) bytes += n;
+    }
+    fclose(fp);
+    return bytes;
+}
+
+// ===============================================
+// Result collection
+// ===============================================
+typedef struct {
+    const char *name;
+    const char *kind;        // "micro" / "macro"
+    long long   ops;
+    long long   ns;
+    long long   rows;        // rows processed (macro) or ops (micro)
+    long long   bytes;
+} BenchResult;
+
+static BenchResult bench_results[64];
+static int bench_nresults = 0;
+static volatile unsigned long bench_sink;   // keeps the optimizer honest
+
+static void bench_record(const char *name, const char *kind, long long ops, long long ns, long long rows, long long bytes) {
+    if (bench_nresults >= (int)(sizeof(bench_results) / sizeof(bench_results[0]))) return;
+    BenchResult *r = &bench_results[bench_nresults++];
+    r->name = name; r->kind = kind; r->ops = ops; r->ns = ns > 0 ? ns : 1; r->rows = rows; r->bytes = bytes;
+    printf("  %-16s %12.1f ns/op %14.0f rows/s %12.1f MB/s\n", name,
+           (double)r->ns / (double)ops, rows * 1e9 / (double)r->ns, bytes * 1e3 / (double)r->ns);
+}
+
+// ===============================================
+// Micro benchmarks
+// ===============================================
+static char (*bench_lines)[MAX_LINE_LEN];
+static char (*bench_fields)[4][MAX_FIELD_LEN];
+static char (*bench_escaped)[MAX_FIELD_LEN*2];     // escaped company, input for unescapeCSV
+
+static void bench_prepare_samples(void) {
+    bench_lines  = malloc(sizeof(*bench_lines)  * SAMPLE_ROWS);
+    bench_fields = malloc(sizeof(*bench_fields) * SAMPLE_ROWS);
+    bench_escaped = malloc(sizeof(*bench_escaped) * SAMPLE_ROWS);
+    if (!bench_lines || !bench_fields || !bench_escaped) return;
+    bench_rng = 0xC0FFEE;
+    char a[MAX_FIELD_LEN*2], b[MAX_FIELD_LEN*2], c[MAX_FIELD_LEN*2], d[MAX_FIELD_LEN*2];
+    for (int i = 0; i < SAMPLE_ROWS; i++) {
+        char *f[4] = { bench_fields[i][0], bench_fields[i][1], bench_fields[i][2], bench_fields[i][3] };
+        bench_make_row(i, f[0], f[1], f[2], f[3]);
+        escapeCSV(f[0], a, sizeof(a)); escapeCSV(f[1], b, sizeof(b));
+        escapeCSV(f[2], c, sizeof(c)); escapeCSV(f[3], d, sizeof(d));
+        if (snprintf(bench_lines[i], MAX_LINE_LEN, "%s,%s,%s,%s", a, b, c, d) >= MAX_LINE_LEN)
+            bench_lines[i][0] = '\0';
+        memcpy(bench_escaped[i], a, sizeof(a));
+    }
+}
+
+static long long bench_sample_bytes(int field) {   // field < 0 => whole line
+    long long total = 0;
+    for (int i = 0; i < SAMPLE_ROWS; i++)
+        total += (long long)strlen(field < 0 ? bench_lines[i] : bench_fields[i][field]);
+    return total * (MICRO_OPS / SAMPLE_ROWS);
+}
+
+static void bench_micro(void) {
+    char f1[MAX_FIELD_LEN], f2[MAX_FIELD_LEN], f3[MAX_FIELD_LEN], f4[MAX_FIELD_LEN];
+    char out[MAX_FIELD_LEN*2];
+    long long t0;
+
+    t0 = nowNs();
+    for (long i = 0; i < MICRO_OPS; i++) {
+        parseCsv4(bench_lines[i % SAMPLE_ROWS], f1, sizeof(f1), f2, sizeof(f2), f3, sizeof(f3), f4, sizeof(f4));
+        bench_sink += (unsigned char)f4[0];
+    }
+    bench_record("parseCsv4", "micro", MICRO_OPS, nowNs() - t0, MICRO_OPS, bench_sample_bytes(-1));
+
+    // same lines through the parser generated from the schema
+    struct Contact c;
+    t0 = nowNs();
+    for (long i = 0; i < MICRO_OPS; i++) {
+        contactParse(bench_lines[i % SAMPLE_ROWS], &c);
+        bench_sink += (unsigned char)c.email[0];
+    }
+    bench_record("contactParse", "micro", MICRO_OPS, nowNs() - t0, MICRO_OPS, bench_sample_bytes(-1));
+
+    char row[MAX_FIELD_LEN * 8 + 8];
+    t0 = nowNs();
+    for (long i = 0; i < MICRO_OPS; i++) bench_sink += contactFormat(&c, row, sizeof(row));
+    bench_record("contactFormat", "micro", MICRO_OPS, nowNs() - t0, MICRO_OPS, 0);
+
+    t0 = nowNs();
+    for (long i = 0; i < MICRO_OPS; i++) {
+        escapeCSV(bench_fields[i % SAMPLE_ROWS][0], out, sizeof(out));
+        bench_sink += (unsigned char)out[0];
+    }
+    bench_record("escapeCSV", "micro", MICRO_OPS, nowNs() - t0, MICRO_OPS, bench_sample_bytes(0));
+
+    // unescape works in place: copy the escaped company in first (copy cost included)
+    t0 = nowNs();
+    for (long i = 0; i < MICRO_OPS; i++) {
+        memcpy(out, bench_escaped[i % SAMPLE_ROWS], sizeof(out));
+        unescapeCSV(out);
+        bench_sink += (unsigned char)out[0];
+    }
+    bench_record("unescapeCSV", "micro", MICRO_OPS, nowNs() - t0, MICRO_OPS, bench_sample_bytes(0));
+
+    t0 = nowNs();
+    for (long i = 0; i < MICRO_OPS; i++) {
+        normalizePhone(bench_fields[i % SAMPLE_ROWS][2], out, sizeof(out));
+        bench_sink += (unsigned char)out[0];
+    }
+    bench_record("normalizePhone", "micro", MICRO_OPS, nowNs() - t0, MICRO_OPS, bench_sample_bytes(2));
+
+    // same phones to the integer every index keys on
+    t0 = nowNs();
+    for (long i = 0; i < MICRO_OPS; i++) bench_sink += (unsigned long)phoneE164(bench_fields[i % SAMPLE_ROWS][2]);
+    bench_record("phoneE164", "micro", MICRO_OPS, nowNs() - t0, MICRO_OPS, bench_sample_bytes(2));
+
+    t0 = nowNs();
+    for (long i = 0; i < MICRO_OPS; i++) {
+        memcpy(out, bench_fields[i % SAMPLE_ROWS][0], MAX_FIELD_LEN);
+        normalizeKey(out);
+        bench_sink += (unsigned char)out[0];
+    }
+    bench_record("normalizeKey", "micro", MICRO_OPS, nowNs() - t0, MICRO_OPS, bench_sample_bytes(0));
+
+    t0 = nowNs();
+    for (long i = 0; i < MICRO_OPS; i++) {
+        bench_sink += (unsigned long)validateEmail(bench_fields[i % SAMPLE_ROWS][3]);
+    }
+    bench_record("validateEmail", "micro", MICRO_OPS, nowNs() - t0, MICRO_OPS, bench_sample_bytes(3));
+
+    // same emails, one whole column per call
+    {
+        static const char *col[SAMPLE_ROWS];
+        static unsigned long long invalid[SAMPLE_ROWS / 64];
+        for (int i = 0; i < SAMPLE_ROWS; i++) col[i] = bench_fields[i][3];
+        t0 = nowNs();
+        for (long i = 0; i < MICRO_OPS; i += SAMPLE_ROWS)
+            bench_sink += (unsigned long)validateColumns(NULL, col, SAMPLE_ROWS, invalid);
+        bench_record("validateColumns", "micro", MICRO_OPS, nowNs() - t0, MICRO_OPS, bench_sample_bytes(3));
+    }
+}
+
+// ===============================================
+// Macro benchmarks (menu functions, stdout muted)
+// ===============================================
+static long long bench_run_quiet(const char *script, void (*fn)(void)) {
+    const char *tmp = "bench_stdin.txt";
+    FILE *f = fopen(tmp, "w");
+    if (!f) return -1;
+    fputs(script, f);
+    fclose(f);
+
+    fflush(stdout);
+    int saved_in = DUP(FILENO(stdin)), saved_out = DUP(FILENO(stdout));
+    if (saved_in < 0 || saved_out < 0) { remove(tmp); return -1; }
+    if (!freopen(tmp, "r", stdin) || !freopen(NULL_DEVICE, "w", stdout)) {
+        DUP2(saved_in, FILENO(stdin)); DUP2(saved_out, FILENO(stdout));
+        CLOSE(saved_in); CLOSE(saved_out); remove(tmp); return -1;
+    }
+
+    long long t0 = nowNs();
+    fn();
+    fflush(stdout);
+    long long ns = nowNs() - t0;
+
+    DUP2(saved_in, FILENO(stdin));   CLOSE(saved_in);
+    DUP2(saved_out, FILENO(stdout)); CLOSE(saved_out);
+    clearerr(stdin);
+    remove(tmp);
+    return ns;
+}
+
+static void bench_macro(long rows, long long bytes) {
+    char script[256];
+    long long ns;
+
+    ns = bench_run_quiet("\n", listContacts);
+    if (ns > 0) bench_record("list", "macro", 1, ns, rows, bytes);
+
+    ns = bench_run_quiet("nimbus\n", searchContact);
+    if (ns > 0) bench_record("search", "macro", 1, ns, rows, bytes);
+
+    long long t0 = nowNs();
+    long hits = queryBook(getContactsFile(), "company:nimbus* phone:08*", NULL, NULL, NULL, 0);
+    if (hits >= 0) bench_record("query", "macro", 1, nowNs() - t0, rows, bytes);
+    bench_sink += (unsigned long)hits;
+
+    long total = 0;
+    t0 = nowNs();
+    if (searchTopK(getContactsFile(), "nimbus", 20, NULL, NULL, &total, NULL) >= 0)
+        bench_record("search_top20", "macro", 1, nowNs() - t0, rows, bytes);
+    bench_sink += (unsigned long)total;
+
+    // 100 pages of 50 through cursors: each page costs its own rows, not the ones before it
+    char cursor[96] = "", next[96];
+    long pages = 0, paged = 0;
+    t0 = nowNs();
+    while (pages < 100) {
+        long n = bookPage(getContactsFile(), NULL, cursor, 50, NULL, NULL, next, sizeof(next));
+        if (n <= 0) break;
+        pages++; paged += n;
+        if (!*next) break;
+        strcpy(cursor, next);
+    }
+    if (pages) bench_record("page50", "macro", pages, nowNs() - t0, paged, 0);
+
+    // last generated company is unique ("... <rows-1>"), so update/delete hit exactly one row
+    char company[MAX_FIELD_LEN], person[MAX_FIELD_LEN], phone[MAX_FIELD_LEN], email[MAX_FIELD_LEN];
+    char line[MAX_LINE_LEN] = "";
+    FILE *fp = fopen(getContactsFile(), "r");
+    if (fp) {
+        char buf[MAX_LINE_LEN];
+        while (fgets(buf, sizeof(buf), fp)) strcpy(line, buf);
+        fclose(fp);
+    }
+    line[strcspn(line, "\n\r")] = '\0';
+    parseCsv4(line, company, sizeof(company), person, sizeof(person), phone, sizeof(phone), email, sizeof(email));
+
+    snprintf(script, sizeof(script), "%s\n4\nbench@update.example\ny\n", company);
+    ns = bench_run_quiet(script, updateContact);
+    if (ns > 0) bench_record("update", "macro", 1, ns, rows, bytes);
+
+    snprintf(script, sizeof(script), "bench@update.example\ny\n");
+    ns = bench_run_quiet(script, deleteContact);
+    if (ns > 0) bench_record("delete", "macro", 1, ns, rows, bytes);
+
+    // the write side alone: the first row rewritten over itself through the row index
+    fp = fopen(getContactsFile(), "r");
+    if (fp && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n\r")] = '\0';
+        int n = 0;
+        long long t0 = nowNs();
+        while (n < 100 && rowReplace(getContactsFile(), 0, line, line) == 1) n++;
+        if (n) bench_record("row_edit", "macro", n, nowNs() - t0, n, (long long)n * (long long)(strlen(line) + 1));
+
+        // and the full-rewrite fallback, which copies everything around the row kernel-side
+        t0 = nowNs();
+        if (bookRewriteRow(getContactsFile(), 0, line, line) == 1)
+            bench_record("row_rewrite", "macro", 1, nowNs() - t0, rows, bytes);
+    }
+    if (fp) fclose(fp);
+}
+
+// Load the generated book into a segmented store, then point gets on every
+// (rows / LSM_GETS)-th row and one full compaction (unthrottled).
+static void bench_lsm(long rows, long long bytes) {
+    static char keys[LSM_GETS][2][MAX_FIELD_LEN];
+    char line[MAX_LINE_LEN], company[MAX_FIELD_LEN], person[MAX_FIELD_LEN], phone[MAX_FIELD_LEN], email[MAX_FIELD_LEN];
+    long step = rows / LSM_GETS > 0 ? rows / LSM_GETS : 1, n = 0, nkeys = 0;
+    FILE *fp = fopen(getContactsFile(), "r");
+    if (!fp) return;
+    lsmDestroy(BENCH_LSM);
+    setLsmOptions(0, 0);
+    if (!lsmOpen(BENCH_LSM)) { fclose(fp); return; }
+
+    long long t0 = nowNs();
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n\r")] = '\0';
+        if (!*line) continue;
+        parseCsv4(line, company, sizeof(company), person, sizeof(person), phone, sizeof(phone), email, sizeof(email));
+        lsmPut(company, person, phone, email);
+        if (n++ % step == 0 && nkeys < LSM_GETS) {
+            strcpy(keys[nkeys][0], company);
+            strcpy(keys[nkeys][1], person);
+            nkeys++;
+        }
+    }
+    fclose(fp);
+    bench_record("lsm_load", "macro", 1, nowNs() - t0, rows, bytes);
+
+    t0 = nowNs();
+    for (long i = 0; i < nkeys; i++)
+        bench_sink += (unsigned long)lsmGet(keys[i][0], keys[i][1], phone, sizeof(phone), email, sizeof(email));
+    if (nkeys) bench_record("lsm_get", "macro", nkeys, nowNs() - t0, nkeys, 0);
+
+    t0 = nowNs();
+    if (lsmCompactNow()) bench_record("lsm_compact", "macro", 1, nowNs() - t0, rows, bytes);
+    lsmClose();
+    lsmDestroy(BENCH_LSM);
+    setLsmOptions(0, 32LL << 20);
+}
+
+// Spread the book over 8 shards, then one fan-out query, phone lookups on every
+// (rows / SHARD_GETS)-th row (one shard each) and a delete by phone.
+static void bench_shard(long rows, long long bytes) {
+    static char phones[SHARD_GETS][MAX_FIELD_LEN];
+    char line[MAX_LINE_LEN], company[MAX_FIELD_LEN], person[MAX_FIELD_LEN], email[MAX_FIELD_LEN];
+    long step = rows / SHARD_GETS > 0 ? rows / SHARD_GETS : 1, n = 0, nphones = 0;
+    FILE *fp = fopen(getContactsFile(), "r");
+    while (fp && nphones < SHARD_GETS && fgets(line, sizeof(line), fp)) {
+        if (n++ % step) continue;
+        line[strcspn(line, "\n\r")] = '\0';
+        parseCsv4(line, company, sizeof(company), person, sizeof(person), phones[nphones], MAX_FIELD_LEN,
+                  email, sizeof(email));
+        if (*phones[nphones]) nphones++;
+    }
+    if (fp) fclose(fp);
+    shardDestroy(BENCH_SHARDS);
+    if (!shardOpen(BENCH_SHARDS, 8)) return;
+
+    long long t0 = nowNs();
+    if (shardImport(getContactsFile()) >= 0) bench_record("shard_import", "macro", 1, nowNs() - t0, rows, bytes);
+    t0 = nowNs();
+    long hits = shardQuery("company:alpha* OR domain:co.th", NULL, NULL, NULL, 0);
+    if (hits >= 0) bench_record("shard_query", "macro", 1, nowNs() - t0, rows, bytes);
+    bench_sink += (unsigned long)hits;
+    t0 = nowNs();
+    for (long i = 0; i < nphones; i++) bench_sink += (unsigned long)shardFindPhone(phones[i], NULL, NULL);
+    if (nphones) bench_record("shard_phone", "macro", nphones, nowNs() - t0, nphones, 0);
+    if (nphones) {
+        char text[MAX_FIELD_LEN + 8];
+        snprintf(text, sizeof(text), "phone:\"%s\"", phones[0]);
+        t0 = nowNs();
+        if (shardDelete(text) >= 0) bench_record("shard_delete", "macro", 1, nowNs() - t0, rows / 8, bytes / 8);
+    }
+    shardClose();
+    shardDestroy(BENCH_SHARDS);
+}
+
+// Concurrent key map: the same rows keys put from 1, 2, ... 32 threads into a
+// map that starts small (so every run goes through its resizes), then the
+// phone + email maps built from the book on all cores.
+typedef struct { KeyMap *m; const unsigned long long *keys; long beg, end; } BenchKeyMapPart;
+
+static void* bench_keymap_put(void *arg) {
+    BenchKeyMapPart *p = (BenchKeyMapPart*)arg;
+    for (long i = p->beg; i < p->end; i++) keyMapPut(p->m, p->keys[i], (unsigned long long)i, NULL);
+    return NULL;
+}
+
+static void bench_keymap(long rows, long long bytes) {
+    static const char *names[] = { "keymap_put_t1", "keymap_put_t2", "keymap_put_t4", "keymap_put_t8",
+                                   "keymap_put_t16", "keymap_put_t32" };
+    unsigned long long *keys = (unsigned long long*)malloc((size_t)rows * sizeof(*keys));
+    if (!keys) return;
+    for (long i = 0; i < rows; i++) keys[i] = (unsigned long long)(i + 1) * 0x9E3779B97F4A7C15ULL;
+    for (int t = 1, run = 0; t <= KEYMAP_MAX_THREADS; t *= 2, run++) {
+        KeyMap *m = keyMapCreate(0);
+        if (!m) break;
+        pthread_t th[KEYMAP_MAX_THREADS];
+        BenchKeyMapPart part[KEYMAP_MAX_THREADS];
+        int started[KEYMAP_MAX_THREADS] = { 0 };
+        long long t0 = nowNs();
+        for (int i = 0; i < t; i++) {
+            part[i].m = m; part[i].keys = keys;
+            part[i].beg = rows * i / t; part[i].end = rows * (i + 1) / t;
+            started[i] = i > 0 && pthread_create(&th[i], NULL, bench_keymap_put, &part[i]) == 0;
+        }
+        bench_keymap_put(&part[0]);
+        for (int i = 1; i < t; i++) {
+            if (started[i]) pthread_join(th[i], NULL);
+            else bench_keymap_put(&part[i]);
+        }
+        bench_record(names[run], "macro", rows, nowNs() - t0, rows, 0);
+        keyMapFree(m);
+    }
+    free(keys);
+
+    KeyMap *phone = keyMapCreate(0), *email = keyMapCreate(0);
+    long long t0 = nowNs();
+    if (phone && email && keyMapBuildBook(getContactsFile(), phone, email, 0, NULL) >= 0)
+        bench_record("keymap_book", "macro", 1, nowNs() - t0, rows, bytes);
+    keyMapFree(phone);
+    keyMapFree(email);
+}
+
+// Whole-book scan with every row formatted (as list does, minus the terminal):
+// the one-thread fgets loop, then the pipeline inline and with its stages on
+// their own threads, then the menu list forced through the threaded pipeline.
+static void bench_pipe_row(const char *company, const char *person, const char *phone, const char *email, void *ctx) {
+    char out[MAX_LINE_LEN];
+    *(long*)ctx += snprintf(out, sizeof(out), "%-20.20s | %-20.20s | %-15.15s | %-30.30s\n", company, person, phone, email);
+}
+
+static void bench_pipeline(long rows, long long bytes) {
+    static const char *names[] = { "scan_pipe_inline", "scan_pipe_thread" };
+    long sink = 0;
+    long long t0 = nowNs();
+    FILE *fp = fopen(getContactsFile(), "r");
+    if (!fp) return;
+    char line[MAX_LINE_LEN], f[4][MAX_FIELD_LEN];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n\r")] = '\0';
+        if (!*line) continue;
+        parseCsv4(line, f[0], sizeof(f[0]), f[1], sizeof(f[1]), f[2], sizeof(f[2]), f[3], sizeof(f[3]));
+        bench_pipe_row(f[0], f[1], f[2], f[3], &sink);
+    }
+    fclose(fp);
+    bench_record("scan_fgets", "macro", 1, nowNs() - t0, rows, bytes);
+
+    for (int run = 0; run < 2; run++) {
+        setScanPipeline(run ? PIPE_ON : PIPE_OFF);
+        t0 = nowNs();
+        if (!(fp = fopen(getContactsFile(), "r"))) break;
+        long shown = scanPipeline(fp, NULL, NULL, bench_pipe_row, &sink);
+        fclose(fp);
+        if (shown >= 0) bench_record(names[run], "macro", 1, nowNs() - t0, rows, bytes);
+    }
+    long long ns = bench_run_quiet("\n", listContacts);
+    if (ns > 0) bench_record("list_pipe_thread", "macro", 1, ns, rows, bytes);
+    setScanPipeline(PIPE_AUTO);
+    bench_sink += (unsigned long)sink;
+}
+
+// B+tree on company: the build, then point / prefix / range walks, and the
+// same prefix query answered from the index vs. a scan.
+static void bench_btree(long rows, long long bytes) {
+    char side[300], line[MAX_LINE_LEN] = "", company[MAX_FIELD_LEN], f[3][MAX_FIELD_LEN];
+    snprintf(side, sizeof(side), "%s.company.bpt", getContactsFile());
+    FILE *fp = fopen(getContactsFile(), "r");
+    if (!fp) return;
+    if (fgets(line, sizeof(line), fp)) line[strcspn(line, "\n\r")] = '\0';
+    fclose(fp);
+    parseCsv4(line, company, sizeof(company), f[0], sizeof(f[0]), f[1], sizeof(f[1]), f[2], sizeof(f[2]));
+
+    long long t0 = nowNs();
+    if (btreeFind(getContactsFile(), BTREE_COMPANY, company, NULL, 1, NULL, NULL) < 0) return;
+    bench_record("btree_build", "macro", 1, nowNs() - t0, rows, bytes);
+    int n = 0;
+    t0 = nowNs();
+    for (; n < 1000; n++) bench_sink += (unsigned long)btreeFind(getContactsFile(), BTREE_COMPANY, company, NULL, 1, NULL, NULL);
+    bench_record("btree_point", "micro", n, nowNs() - t0, n, 0);
+    t0 = nowNs();
+    long hits = btreeFind(getContactsFile(), BTREE_COMPANY, "nimbus", "nimbus", 0, NULL, NULL);
+    if (hits >= 0) bench_record("btree_prefix", "macro", 1, nowNs() - t0, hits, 0);
+    t0 = nowNs();
+    hits = btreeFind(getContactsFile(), BTREE_COMPANY, "a", "c", 0, NULL, NULL);
+    if (hits >= 0) bench_record("btree_range_a_c", "macro", 1, nowNs() - t0, hits, 0);
+
+    for (int run = 0; run < 2; run++) {
+        setBtreeOptions(run ? BTREE_COMPANY : 0, 0);
+        t0 = nowNs();
+        hits = queryBook(getContactsFile(), "company:nimbus*", NULL, NULL, NULL, 0);
+        if (hits >= 0) bench_record(run ? "query_pfx_btree" : "query_pfx_scan", "macro", 1, nowNs() - t0, rows, bytes);
+    }
+    setBtreeOptions(0, 0);
+    btreeClose();
+    remove(side);
+}
+
+// Pack the book into compressed blocks, then decode + parse every row.
+static int bench_cbk_row(char *line, void *ctx) {
+    char f1[MAX_FIELD_LEN], f2[MAX_FIELD_LEN], f3[MAX_FIELD_LEN], f4[MAX_FIELD_LEN];
+    parseCsv4(line, f1, sizeof(f1), f2, sizeof(f2), f3, sizeof(f3), f4, sizeof(f4));
+    (*(long*)ctx) += (long)strlen(f4);
+    return 1;
+}
+
+static void bench_cbk(long rows, long long bytes) {
+    long long t0 = nowNs();
+    if (cbkPack(getContactsFile(), BENCH_CBK, 0) < 0) return;
+    bench_record("cbk_pack", "macro", 1, nowNs() - t0, rows, bytes);
+    FILE *fp = fopen(BENCH_CBK, "rb");
+    if (fp) {
+        fseek(fp, 0, SEEK_END);
+        printf("  %-16s %11.1f%% of %lld bytes\n", "cbk_size", 100.0 * (double)ftell(fp) / (double)bytes, bytes);
+        fclose(fp);
+    }
+    long sink = 0;
+    t0 = nowNs();
+    if (cbkScan(BENCH_CBK, bench_cbk_row, &sink) >= 0) bench_record("cbk_scan", "macro", 1, nowNs() - t0, rows, bytes);
+    bench_sink += (unsigned long)sink;
+    remove(BENCH_CBK);
+}
+
+// Uniqueness sets: full scan of the book vs. mapping "<book>.idx" at startup.
+static void bench_unique(long rows, long long bytes) {
+    char side[300];
+    snprintf(side, sizeof(side), "%s.idx", getContactsFile());
+    setUniquePolicy(UNIQUE_PHONE | UNIQUE_EMAIL, DUP_REJECT);
+    long long t0 = nowNs();
+    if (!uniqueWarmUp()) { setUniquePolicy(0, DUP_WARN); return; }
+    bench_record("unique_build", "macro", 1, nowNs() - t0, rows, bytes);
+    appendContactRow("Bench Unique", "P", "0800000000", "unique@bench.example");
+    if (uniquePersist()) {
+        setUniquePolicy(0, DUP_WARN);       // drop the in-memory sets, as a restart would
+        setUniquePolicy(UNIQUE_PHONE | UNIQUE_EMAIL, DUP_REJECT);
+        t0 = nowNs();
+        if (uniqueWarmUp()) bench_record("unique_load", "macro", 1, nowNs() - t0, rows, bytes);
+    }
+    setUniquePolicy(0, DUP_WARN);
+    remove(side);
+}
+
+// All three group-by counts in one parallel pass over the book.
+static void bench_report(long rows, long long bytes) {
+    long long t0 = nowNs();
+    Report *r = reportBuild(getContactsFile());
+    if (!r) return;
+    bench_record("report", "macro", 1, nowNs() - t0, rows, bytes);
+    bench_sink += (unsigned long)reportGroups(r, REPORT_COMPANY);
+    reportFree(r);
+}
+
+// Type "alpha co" and "081-2" a key at a time, then delete them again: the
+// first key, the keys that narrow its result and the backspaces are timed
+// apart (rows = rows tested).
+static void bench_typeahead(long rows, long long bytes) {
+    static const char *const typed[] = { "alpha co", "081-2" };
+    static const char *const names[] = { "isearch_first", "isearch_narrow", "isearch_back" };
+    long long t0 = nowNs();
+    TypeAhead *ta = typeAheadOpen(getContactsFile());
+    if (!ta) return;
+    bench_record("isearch_open", "macro", 1, nowNs() - t0, rows, bytes);
+    long long ns[3] = { 0 }, ops[3] = { 0 }, tested[3] = { 0 };
+    for (size_t t = 0; t < sizeof(typed) / sizeof(typed[0]); t++) {
+        char key[16];
+        size_t len = strlen(typed[t]);
+        typeAheadSet(ta, "");
+        for (size_t s = 1; s < 2 * len; s++) {
+            size_t k = s <= len ? s : 2 * len - s;
+            int kind = s == 1 ? 0 : s <= len ? 1 : 2;
+            memcpy(key, typed[t], k);
+            key[k] = '\0';
+            unsigned long long before = typeAheadCounter(ta, "tested");
+            t0 = nowNs();
+            bench_sink += (unsigned long)typeAheadSet(ta, key);
+            ns[kind] += nowNs() - t0;
+            ops[kind]++;
+            tested[kind] += (long long)(typeAheadCounter(ta, "tested") - before);
+        }
+    }
+    for (int i = 0; i < 3; i++) bench_record(names[i], "macro", ops[i], ns[i], tested[i], 0);
+    typeAheadClose(ta);
+}
+
+static void bench_write_json(const char *path, long rows) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) { printf("[ERROR] Cannot write %s\n", path); return; }
+    fprintf(fp, "{\n  \"build\": { \"compiler\": \"%s\", \"date\": \"%s %s\" },\n", __VERSION__, __DATE__, __TIME__);
+    fprintf(fp, "  \"rows\": %ld,\n  \"results\": [\n", rows);
+    for (int i = 0; i < bench_nresults; i++) {
+        BenchResult *r = &bench_results[i];
+        fprintf(fp, "    { \"name\": \"%s\", \"kind\": \"%s\", \"ops\": %lld, \"ns\": %lld, "
+                    "\"ns_per_op\": %.2f, \"rows_per_s\": %.0f, \"bytes_per_s\": %.0f }%s\n",
+                r->name, r->kind, r->ops, r->ns, (double)r->ns / (double)r->ops,
+                r->rows * 1e9 / (double)r->ns, r->bytes * 1e9 / (double)r->ns,
+                i + 1 < bench_nresults ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+    printf("\nResults written to %s\n", path);
+}
+
+// ===============================================
+// Public entry
+// ===============================================
+int runBenchmarkSuite(long rows, const char *json_path) {
+    if (rows <= 0) rows = 100000;
+    bench_nresults = 0;
+
+    printf("\n========================================\n");
+    printf("  BENCHMARKS - Contact Management\n");
+    printf("========================================\n");
+
+    printf("\nMicro (%ld ops each)\n", MICRO_OPS);
+    bench_prepare_samples();
+    if (bench_lines && bench_fields && bench_escaped) bench_micro();
+    free(bench_lines);   bench_lines = NULL;
+    free(bench_fields);  bench_fields = NULL;
+    free(bench_escaped); bench_escaped = NULL;
+
+    char saved_path[256];
+    snprintf(saved_path, sizeof(saved_path), "%s", getContactsFile());
+    setContactsFile(BENCH_FILE);
+
+    printf("\nMacro (%ld rows)\n", rows);
+    long long t0 = nowNs();
+    long long bytes = generateSyntheticBook(getContactsFile(), rows, 0);
+    if (bytes < 0) {
+        printf("[ERROR] Cannot create %s\n", BENCH_FILE);
+        setContactsFile(saved_path);
+        return 0;
+    }
+    bench_record("generate", "macro", 1, nowNs() - t0, rows, bytes);
+    bench_cbk(rows, bytes);
+    bench_macro(rows, bytes);
+    bench_lsm(rows, bytes);
+    bench_shard(rows, bytes);
+    bench_unique(rows, bytes);
+    bench_keymap(rows, bytes);
+    bench_pipeline(rows, bytes);
+    bench_btree(rows, bytes);
+    bench_report(rows, bytes);
+    bench_typeahead(rows, bytes);
+
+    remove(getContactsFile());
+    setContactsFile(saved_path);
+
+    bench_write_json(json_path && *json_path ? json_path : BENCH_JSON, rows);
+    return 1;
+}
+
+void runBenchmarks(void) {
+    char buf[64];
+    long rows = 100000;
+    printf("\nRows in synthetic book (Enter = %ld): ", rows);
+    if (fgets(buf, sizeof(buf), stdin) && atol(buf) > 0) rows = atol(buf);
+    runBenchmarkSuite(rows, BENCH_JSON);
+}
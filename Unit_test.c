@@ -2,7 +2,11 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <utime.h>
 #include "test.h"
+#include "schema.h"
 
 // ===== extern (from main.c) =====
 extern void addContact(void);
@@ -19,6 +23,295 @@ extern void escapeCSV(const char *input, char *output, size_t output_size);
 extern void unescapeCSV(char *str);
 extern int  validateEmail(const char *email);
 extern int  validatePhone(const char *phone);
+extern void parseCsv4(const char *srcLine, char *f1, size_t n1, char *f2, size_t n2, char *f3, size_t n3,
+                      char *f4, size_t n4);
+
+// append pipeline (group commit)
+extern void setFsyncPolicy(int policy, int interval_ms);
+extern long long enqueueContactRow(const char *company, const char *person, const char *phone, const char *email);
+extern int  commitAppends(long long upto_seq);
+extern unsigned long long getCommitCounter(const char *name);
+extern int  appendContactRow(const char *company, const char *person, const char *phone, const char *email);
+
+// hot-path counters
+extern unsigned long long getOpCounter(const char *op, const char *counter);
+extern int  exportStatsProm(const char *path);
+
+// tracing
+extern void setTraceEnabled(int on);
+extern int  traceFlush(const char *path);
+extern unsigned long long traceEventCount(void);
+
+// bloom filters (main.c)
+extern int  bloomMayContain(const char *filename, int which, const char *key);
+extern void bloomNoteFalsePositive(int which);
+extern int  bloomPersist(void);
+
+// uniqueness on add (main.c)
+extern void setUniquePolicy(int keys, int on_dup);
+extern long long enqueueContactRowChecked(const char *company, const char *person, const char *phone, const char *email,
+                                          int *conflict);
+extern unsigned long long getUniqueCounter(const char *name);
+extern int  uniqueWarmUp(void);
+extern int  uniquePersist(void);
+
+// structured query (main.c)
+extern int  isStructuredQuery(const char *text);
+extern long queryBook(const char *path, const char *text,
+                      void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+                      void *ctx, char *plan, size_t plan_size);
+extern unsigned long long getQueryCounter(const char *name);
+
+// ranked search (main.c)
+extern long searchTopK(const char *path, const char *key, int k,
+                       void (*fn)(int score, const char *company, const char *person, const char *phone,
+                                  const char *email, void *ctx),
+                       void *ctx, long *total, int *complete);
+extern void setSearchTopK(int k);
+
+// keyset pages (main.c)
+extern long bookPage(const char *path, const char *query, const char *after, int limit,
+                     void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+                     void *ctx, char *next, size_t next_size);
+extern void setPageSize(int rows);
+
+// row index (main.c)
+extern int  rowDelete(const char *path, long long off, const char *line);
+extern int  rowReplace(const char *path, long long off, const char *line, const char *repl);
+extern unsigned long long getRowCounter(const char *name);
+extern int  bookRewriteRow(const char *path, long long off, const char *line, const char *repl);
+
+// sharded book (main.c)
+extern int  shardOpen(const char *dir, int nshards);
+extern void shardClose(void);
+extern int  shardCount(void);
+extern void shardDestroy(const char *dir);
+extern int  shardAdd(const char *company, const char *person, const char *phone, const char *email);
+extern long shardImport(const char *csv);
+extern long shardExport(const char *csv);
+extern long shardQuery(const char *text,
+                       void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+                       void *ctx, char *plan, size_t plan_size);
+extern long shardFindPhone(const char *phone,
+                           void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                                      void *ctx),
+                           void *ctx);
+extern long shardDelete(const char *text);
+extern long shardUpdate(const char *text, const char *field, const char *value);
+extern unsigned long long getShardCounter(const char *name);
+
+// concurrent key map (main.c)
+typedef struct KeyMap KeyMap;
+extern KeyMap* keyMapCreate(size_t expect);
+extern void keyMapFree(KeyMap *m);
+extern int  keyMapPut(KeyMap *m, unsigned long long key, unsigned long long val, unsigned long long *old);
+extern int  keyMapGet(KeyMap *m, unsigned long long key, unsigned long long *val);
+extern void keyMapStats(KeyMap *m, size_t *count, size_t *cap, unsigned long long *resizes);
+extern void keyMapKeys(const char *phone, const char *email, unsigned long long key[2]);
+extern long keyMapBuildBook(const char *path, KeyMap *phone, KeyMap *email, int nthreads, long *dups);
+
+// pipelined scan (main.c)
+enum { PIPE_OFF = 0, PIPE_ON = 1, PIPE_AUTO = 2 };
+extern long scanPipeline(FILE *fp, int (*match)(const struct Contact *c, void *ctx), void *mctx,
+                         void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                                    void *ctx),
+                         void *ctx);
+extern void setScanPipeline(int mode);
+extern unsigned long long getPipeCounter(const char *name);
+
+// book streams (main.c)
+enum { BOOK_IO_AUTO = 0, BOOK_IO_STDIO = 1, BOOK_IO_URING = 2 };
+extern void setBookIo(int mode);
+extern unsigned long long getBookIoCounter(const char *name);
+
+// B+tree index (main.c)
+enum { BTREE_COMPANY = 1, BTREE_EMAIL = 2 };
+extern long btreeFind(const char *book, int field, const char *lo, const char *hi, int exact,
+                      void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                                 void *ctx),
+                      void *ctx);
+extern void setBtreeOptions(int fields, long long pool_bytes);
+extern void btreeClose(void);
+extern unsigned long long getBtreeCounter(const char *name);
+
+// row codec generated from the schema (main.c)
+extern int    contactParse(const char *line, struct Contact *c);
+extern size_t contactFormat(const struct Contact *c, char *out, size_t cap);
+extern int    contactCompare(const struct Contact *a, const struct Contact *b);
+
+// phone keys (main.c)
+extern void setPhoneCountry(int cc);
+extern long long phoneE164(const char *phone);
+extern void phoneKeyText(const char *phone, char *out, size_t cap);
+extern unsigned long long phoneKey(const char *phone);
+
+// group-by reports (main.c)
+extern void setScanThreads(int n);
+enum { REPORT_COMPANY, REPORT_DOMAIN, REPORT_PREFIX, REPORT_DIMS };
+typedef struct Report Report;
+extern Report* reportBuild(const char *path);
+extern long    reportRows(const Report *r);
+extern int     reportParts(const Report *r);
+extern size_t  reportGroups(const Report *r, int dim);
+extern size_t  reportTop(const Report *r, int dim, size_t n,
+                         void (*fn)(const char *key, long long count, void *ctx), void *ctx);
+extern int     reportExport(const Report *r, size_t n, const char *path);
+extern void    reportFree(Report *r);
+
+// as-you-type search (main.c)
+typedef struct TypeAhead TypeAhead;
+extern TypeAhead* typeAheadOpen(const char *path);
+extern long   typeAheadSet(TypeAhead *ta, const char *key);
+extern size_t typeAheadResults(const TypeAhead *ta, size_t n,
+                               void (*fn)(const char *company, const char *person, const char *phone,
+                                          const char *email, void *ctx),
+                               void *ctx);
+extern long   typeAheadRows(const TypeAhead *ta);
+extern unsigned long long typeAheadCounter(const TypeAhead *ta, const char *name);
+extern void   typeAheadClose(TypeAhead *ta);
+
+// batch validation (main.c)
+extern size_t validateColumns(const char *const *phones, const char *const *emails, size_t n, unsigned long long *invalid);
+
+// segmented storage (main.c)
+extern void setLsmOptions(int memtable_rows, long long rate_bytes_per_s);
+extern int  lsmOpen(const char *dir);
+extern void lsmClose(void);
+extern int  lsmPut(const char *company, const char *person, const char *phone, const char *email);
+extern int  lsmDelete(const char *company, const char *person);
+extern int  lsmGet(const char *company, const char *person, char *phone, size_t np, char *email, size_t ne);
+extern long lsmScan(void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+                    void *ctx);
+extern int  lsmFlush(void);
+extern int  lsmCompactNow(void);
+extern int  lsmSegmentCount(void);
+extern void lsmDestroy(const char *dir);
+extern unsigned long long getLsmCounter(const char *name);
+
+// block-compressed book (main.c)
+extern size_t lzBound(size_t n);
+extern size_t lzCompress(const char *src, size_t n, char *dst, size_t cap);
+extern long lzDecompress(const char *src, size_t n, char *dst, size_t cap);
+extern long cbkPack(const char *csv, const char *out, int sort);
+extern long cbkUnpack(const char *path, const char *csv);
+extern long cbkScan(const char *path, int (*fn)(char *line, void *ctx), void *ctx);
+extern long cbkFind(const char *path, const char *company, int (*fn)(char *line, void *ctx), void *ctx);
+extern unsigned long long getCbkCounter(const char *name);
+
+// lsmScan callback: counts rows and checks they arrive in key order
+typedef struct { long rows; int ordered; char last[256]; } LsmScanCheck;
+static void lsm_scan_check(const char *company, const char *person, const char *phone, const char *email, void *ctx) {
+    LsmScanCheck *sc = (LsmScanCheck*)ctx;
+    char key[256];
+    (void)phone; (void)email;
+    snprintf(key, sizeof(key), "%s\x1f%s", company, person);
+    for (char *k = key; *k; k++) *k = (char)tolower((unsigned char)*k);
+    if (sc->rows && strcmp(sc->last, key) >= 0) sc->ordered = 0;
+    snprintf(sc->last, sizeof(sc->last), "%s", key);
+    sc->rows++;
+}
+
+// lz round trip of n bytes; 1 if the data comes back unchanged
+static int lz_roundtrip(const char *src, size_t n, size_t *clen) {
+    char *c = malloc(lzBound(n)), *d = malloc(n + 1);
+    int ok = c && d;
+    if (ok) {
+        *clen = lzCompress(src, n, c, lzBound(n));
+        ok = lzDecompress(c, *clen, d, n) == (long)n && memcmp(src, d, n) == 0;
+    }
+    free(c); free(d);
+    return ok;
+}
+
+static int cbk_count_line(char *line, void *ctx) { (void)line; (*(long*)ctx)++; return 1; }
+
+// reportTop callback: "key=count|key=count|..." in rank order
+static void report_collect(const char *key, long long count, void *ctx) {
+    char *out = (char*)ctx;
+    size_t n = strlen(out);
+    snprintf(out + n, 512 - n, "%s%s=%lld", n ? "|" : "", key, count);
+}
+
+// searchTopK callback: "company|company|..." in the order the rows arrive
+static void rank_collect(int score, const char *company, const char *person, const char *phone, const char *email,
+                         void *ctx) {
+    char *out = (char*)ctx;
+    size_t n = strlen(out);
+    (void)score; (void)person; (void)phone; (void)email;
+    snprintf(out + n, 512 - n, "%s%s", n ? "|" : "", company);
+}
+
+// bookPage callback: "person|person|..." in the order the rows arrive
+static void page_collect(const char *company, const char *person, const char *phone, const char *email, void *ctx) {
+    char *out = (char*)ctx;
+    size_t n = strlen(out);
+    (void)company; (void)phone; (void)email;
+    snprintf(out + n, 512 - n, "%s%s", n ? "|" : "", person);
+}
+
+// keyMapPut from several threads: thread t puts keys [t * 5000, t * 5000 + 10000),
+// so every key but the first and last 5000 is raced for by two threads
+typedef struct { KeyMap *m; int t; long won; } KmRace;
+// one structured query on a short-lived thread: part 0 runs on the caller
+static void* stats_exit_worker(void *arg) {
+    (void)arg;
+    queryBook(getContactsFile(), "domain:group.com", NULL, NULL, NULL, 0);
+    return NULL;
+}
+
+static void* km_race(void *arg) {
+    KmRace *r = (KmRace*)arg;
+    for (unsigned long long k = (unsigned long long)r->t * 5000; k < (unsigned long long)r->t * 5000 + 10000; k++)
+        r->won += keyMapPut(r->m, (k + 1) * 0x9E3779B97F4A7C15ULL, k, NULL) == 1;
+    return NULL;
+}
+
+// scanPipeline callbacks: rows arrive as P<n> with n strictly increasing
+typedef struct { long rows, sum; int ordered; long last; } PipeCheck;
+static void pipe_check(const char *company, const char *person, const char *phone, const char *email, void *ctx) {
+    PipeCheck *pc = (PipeCheck*)ctx;
+    long n = atol(person + 1);
+    (void)company; (void)phone; (void)email;
+    if (n <= pc->last) pc->ordered = 0;
+    pc->last = n;
+    pc->rows++;
+    pc->sum += n;
+}
+static int pipe_every_other(const struct Contact *c, void *ctx) { (void)c; return (*(long*)ctx)++ % 2 == 0; }
+
+static PipeCheck pipe_scan(int mode, int (*match)(const struct Contact *c, void *ctx), long *ret) {
+    PipeCheck pc = { 0, 0, 1, -1 };
+    long calls = 0;
+    FILE *fp = fopen(getContactsFile(), "r");
+    setScanPipeline(mode);
+    *ret = fp ? scanPipeline(fp, match, &calls, pipe_check, &pc) : -1;
+    setScanPipeline(PIPE_AUTO);
+    if (fp) fclose(fp);
+    return pc;
+}
+
+static int files_equal(const char *a, const char *b) {
+    FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+    int same = fa && fb;
+    while (same) {
+        int ca = fgetc(fa), cb = fgetc(fb);
+        if (ca != cb) same = 0;
+        if (ca == EOF || cb == EOF) break;
+    }
+    if (fa) fclose(fa);
+    if (fb) fclose(fb);
+    return same;
+}
+
+// whole (small) file into buf, NUL-terminated; returns its length, -1 if unreadable
+static long read_file(const char *path, char *buf, size_t cap) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return -1;
+    size_t n = fread(buf, 1, cap - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+    return (long)n;
+}
 
 static void collapse_double_quotes(char *s) {
     if (!s) return;
@@ -61,8 +354,10 @@ static int quote_flexible_equals_ci(const char *a, const char *b) {
 }
 
 // ===== local config (mirror main.c) =====
-#define MAX_FIELD_LEN 100
-#define MAX_LINE_LEN  512
+enum { FSYNC_NONE = 0, FSYNC_INTERVAL = 1, FSYNC_ALWAYS = 2 };
+enum { BLOOM_PHONE = 0, BLOOM_EMAIL = 1 };
+enum { UNIQUE_PHONE = 1, UNIQUE_EMAIL = 2 };
+enum { DUP_WARN = 0, DUP_REJECT = 1, DUP_MERGE = 2 };
 
 // ===============================================
 // Internal helpers (local use)
@@ -149,8 +444,15 @@ int contactExistsByCompanyCI(const char *filename, const char *company) {
 }
 
 int contactExistsByPhoneNorm(const char *filename, const char *phone_raw) {
-    FILE *fp = fopen(filename, "r"); if (!fp) return 0;
     char key_norm[MAX_FIELD_LEN]; normalizePhone(phone_raw, key_norm, sizeof(key_norm));
+    // definite miss from the bloom filter: don't open the book at all
+    char key_local[MAX_FIELD_LEN] = "";
+    if (strlen(key_norm) == 11 && key_norm[0]=='6' && key_norm[1]=='6')
+        snprintf(key_local, sizeof(key_local), "0%s", key_norm + 2);
+    if (!bloomMayContain(filename, BLOOM_PHONE, key_norm) &&
+        (!*key_local || !bloomMayContain(filename, BLOOM_PHONE, key_local))) return 0;
+
+    FILE *fp = fopen(filename, "r"); if (!fp) return 0;
     char line[MAX_LINE_LEN];
 
     while (fgets(line, sizeof(line), fp)) {
@@ -187,15 +489,17 @@ int contactExistsByPhoneNorm(const char *filename, const char *phone_raw) {
 
     }
     fclose(fp);
+    if (*key_norm) bloomNoteFalsePositive(BLOOM_PHONE);
     return 0;
 }
 
 int contactExistsByEmailCI(const char *filename, const char *email_raw) {
-    FILE *fp = fopen(filename, "r"); if (!fp) return 0;
-
     char key_lower[MAX_FIELD_LEN];
     strncpy(key_lower, email_raw, MAX_FIELD_LEN-1); key_lower[MAX_FIELD_LEN-1] = '\0';
     for (int i=0; key_lower[i]; i++) key_lower[i] = (char)tolower((unsigned char)key_lower[i]);
+    if (!bloomMayContain(filename, BLOOM_EMAIL, key_lower)) return 0;
+
+    FILE *fp = fopen(filename, "r"); if (!fp) return 0;
 
     char line[MAX_LINE_LEN];
     while (fgets(line, sizeof(line), fp)) {
@@ -223,6 +527,7 @@ int contactExistsByEmailCI(const char *filename, const char *email_raw) {
         if (*email_lower && strcmp(email_lower, key_lower) == 0) { fclose(fp); return 1; }
     }
     fclose(fp);
+    if (*key_lower) bloomNoteFalsePositive(BLOOM_EMAIL);
     return 0;
 }
 
@@ -387,6 +692,23 @@ void runUnitTests(void) {
     TEST_ASSERT(ok && contactExistsByCompanyCI("test_contacts.csv", "A, B, C, D, Co."),
                 "C3: multiple commas in company");
 
+    {   // escapeCSV fast path (no quoting needed) vs slow path, at every load alignment
+        char in[64 + 16], out[160];
+        int plain_ok = 1, quoted_ok = 1;
+        for (int off = 0; off < 16; off++) {
+            strcpy(in + off, "plain field longer than one sixteen byte block");
+            escapeCSV(in + off, out, sizeof(out));
+            if (strcmp(out, "plain field longer than one sixteen byte block") != 0) plain_ok = 0;
+            strcpy(in + off, "abcdefghijklmnopqrstu\"v");
+            escapeCSV(in + off, out, sizeof(out));
+            if (strcmp(out, "\"abcdefghijklmnopqrstu\"\"v\"") != 0) quoted_ok = 0;
+        }
+        TEST_ASSERT(plain_ok, "C4: plain field copied verbatim");
+        TEST_ASSERT(quoted_ok, "C5: quote past the first block still escaped");
+        escapeCSV("abcdef", out, 4);
+        TEST_ASSERT(strcmp(out, "ab") == 0, "C6: plain field truncated like before");
+    }
+
     // -----------------------------
     // Group D: Email / Phone Validate edges
     // -----------------------------
@@ -404,6 +726,56 @@ void runUnitTests(void) {
     TEST_ASSERT(validatePhone("abc-1234") == 0,         "D10: letters not allowed");
     TEST_ASSERT(validatePhone("++--()") == 0,           "D11: only symbols no digits");
 
+    // -----------------------------
+    // Group D2: Batch validation == scalar validation
+    // -----------------------------
+    printf("\nGroup D2: Batch validation\n");
+    {
+        static const char *emails[] = {
+            "test@example.com", "invalid.email", "a@b.c", "User.Name+tag@sub.domain.co", "user@domain",
+            "@domain.com", "user@.com", "user@domain.", "userdomain.com", "", "a@@b.com", "a..b@c.com",
+            "a@b..com", "a@b.c.", ".a@b.com", "a@b@c.d", "a.@b.com", "averyveryverylonglocalpart.name@a-very-long-domain-name.example.co.th",
+            "x@y.z.", "a@bc", "a@.", "@", "a@b.", "first.last@sub..domain.com"
+        };
+        static const char *phones[] = {
+            "081-234-5678", "abc-def-ghij", "+66 81.234-5678", "(081) 234 5678", "abc-1234", "++--()", "",
+            "0812345678", "+66 (0) 81 234 5678 ext", "0", "- ", "081_234", "081-234-5678-081-234-5678-081-234-5678"
+        };
+        enum { NE = sizeof(emails) / sizeof(emails[0]), NP = sizeof(phones) / sizeof(phones[0]) };
+        char buf[128 + 16];
+        int same_e = 1, same_p = 1;
+        unsigned long long bits[1];
+        for (int off = 0; off < 16; off++) {          // every alignment of the SIMD loads
+            for (int i = 0; i < NE; i++) {
+                strcpy(buf + off, emails[i]);
+                const char *col[1] = { buf + off };
+                validateColumns(NULL, col, 1, bits);
+                if ((int)!(bits[0] & 1) != validateEmail(emails[i])) same_e = 0;
+            }
+            for (int i = 0; i < NP; i++) {
+                strcpy(buf + off, phones[i]);
+                const char *col[1] = { buf + off };
+                validateColumns(col, NULL, 1, bits);
+                if ((int)!(bits[0] & 1) != validatePhone(phones[i])) same_p = 0;
+            }
+        }
+        TEST_ASSERT(same_e, "D2.1: batch email verdicts match validateEmail");
+        TEST_ASSERT(same_p, "D2.2: batch phone verdicts match validatePhone");
+
+        const char *pc[70], *ec[70];
+        for (int i = 0; i < 70; i++) { pc[i] = phones[i % NP]; ec[i] = "ok@mail.com"; }
+        unsigned long long inv[2];
+        size_t nbad = validateColumns(pc, ec, 70, inv);
+        size_t want = 0;
+        int bits_ok = 1;
+        for (int i = 0; i < 70; i++) {
+            int bad = !validatePhone(pc[i]);
+            want += (size_t)bad;
+            if (((inv[i / 64] >> (i % 64)) & 1) != (unsigned long long)bad) bits_ok = 0;
+        }
+        TEST_ASSERT(bits_ok && nbad == want, "D2.3: bitmap across words + invalid count");
+    }
+
     // -----------------------------
     // Group E: Normalization Equivalence
     // -----------------------------
@@ -505,7 +877,1136 @@ void runUnitTests(void) {
     TEST_ASSERT(ok_script == 1, "H5: deleteContact() by phone then by company");
     TEST_ASSERT(countContactsTest(getContactsFile()) == 0, "H5.1: all rows deleted");
 
+    // -----------------------------
+    // Group I: Append pipeline (group commit)
+    // -----------------------------
+    printf("\nGroup I: Append pipeline (group commit)\n");
+    { FILE *init = fopen(getContactsFile(), "w"); if (init) fclose(init); }
+    setFsyncPolicy(FSYNC_ALWAYS, 0);
+    enqueueContactRow("Group A", "P1", "081-000-0001", "g1@group.com");
+    enqueueContactRow("Group B", "P2", "081-000-0002", "g2@group.com");
+    long long last_seq = enqueueContactRow("Group, C", "P3", "081-000-0003", "g3@group.com");
+    TEST_ASSERT(countContactsTest(getContactsFile()) == 0, "I1: queued rows not written before commit");
+    TEST_ASSERT(commitAppends(last_seq) == 1 && countContactsTest(getContactsFile()) == 3,
+                "I2: one commit writes the whole group");
+    TEST_ASSERT(contactExistsByCompanyCI(getContactsFile(), "Group, C"), "I3: grouped row escaped correctly");
+    setFsyncPolicy(FSYNC_INTERVAL, 50);
+    TEST_ASSERT(appendContactRow("Group D", "P4", "081-000-0004", "g4@group.com") == 1 &&
+                countContactsTest(getContactsFile()) == 4, "I4: single append with interval policy");
+    {   // a failed group stays failed for its waiter after a later group succeeds
+        char book[256];
+        snprintf(book, sizeof(book), "%s", getContactsFile());
+        setContactsFile("no_such_dir/test_commit.csv");
+        long long lost = enqueueContactRow("Lost", "P", "081-000-0009", "lost@group.com");
+        int first = commitAppends(lost);
+        setContactsFile("test_commit.csv");
+        long long kept = enqueueContactRow("Kept", "P", "081-000-0010", "kept@group.com");
+        TEST_ASSERT(first == 0 && commitAppends(kept) == 1 && commitAppends(lost) == 0 &&
+                    countContactsTest(getContactsFile()) == 1, "I5: commit errors are per group");
+
+        // the deferred fsync comes due without another commit
+        unsigned long long t0 = getCommitCounter("timer_syncs");
+        appendContactRow("Group E", "P5", "081-000-0005", "g5@group.com");
+        appendContactRow("Group F", "P6", "081-000-0006", "g6@group.com");
+        for (int i = 0; i < 100 && getCommitCounter("timer_syncs") == t0; i++) {
+            struct timespec ts = { 0, 10 * 1000000L };
+            nanosleep(&ts, NULL);
+        }
+        TEST_ASSERT(getCommitCounter("timer_syncs") > t0, "I6: interval policy syncs an idle book on a timer");
+        setFsyncPolicy(FSYNC_NONE, 0);
+        remove("test_commit.csv");
+        setContactsFile(book);
+    }
+
+    // -----------------------------
+    // Group J: Hot-path counters
+    // -----------------------------
+    printf("\nGroup J: Hot-path counters\n");
+    {
+        unsigned long long calls0 = getOpCounter("search", "calls");
+        unsigned long long rows0  = getOpCounter("search", "rows_scanned");
+        unsigned long long hits0  = getOpCounter("search", "matches");
+        unsigned long long rw0    = getOpCounter("delete", "rewrites");
+        unsigned long long tomb0  = getRowCounter("tombstones");
+        run_with_stdin_script("group\n", searchContact);
+        TEST_ASSERT(getOpCounter("search", "calls") == calls0 + 1, "J1: search call counted");
+        TEST_ASSERT(getOpCounter("search", "rows_scanned") == rows0 + 4, "J2: rows scanned = rows in file");
+        TEST_ASSERT(getOpCounter("search", "matches") == hits0 + 4, "J3: matches counted");
+        run_with_stdin_script("Group D\n" "y\n", deleteContact);
+        TEST_ASSERT(getOpCounter("delete", "rewrites") == rw0 && getRowCounter("tombstones") == tomb0 + 1,
+                    "J4: delete blanks the row in place, no rewrite");
+
+        int prom_ok = exportStatsProm("test_stats.prom");
+        FILE *pf = fopen("test_stats.prom", "r");
+        int has_metric = 0;
+        char pl[256];
+        while (pf && fgets(pl, sizeof(pl), pf))
+            if (strstr(pl, "contacts_op_rows_scanned_total{op=\"search\"}") == pl) has_metric = 1;
+        if (pf) fclose(pf);
+        TEST_ASSERT(prom_ok && has_metric, "J5: Prometheus textfile export");
+        remove("test_stats.prom");
+
+        unsigned long long q0 = getOpCounter("search", "rows_scanned");
+        stats_exit_worker(NULL);
+        unsigned long long per = getOpCounter("search", "rows_scanned") - q0;
+        for (int t = 0; t < 300; t++) {
+            pthread_t th;
+            if (pthread_create(&th, NULL, stats_exit_worker, NULL) == 0) pthread_join(th, NULL);
+        }
+        TEST_ASSERT(per > 0 && getOpCounter("search", "rows_scanned") == q0 + per * 301,
+                    "J6: counters of 300 exited threads survive them, no per-thread cap");
+    }
+
+    // -----------------------------
+    // Group K: Trace events
+    // -----------------------------
+    printf("\nGroup K: Trace events\n");
+    {
+        unsigned long long ev0 = traceEventCount();
+        run_with_stdin_script("group\n", searchContact);
+        TEST_ASSERT(traceEventCount() == ev0, "K1: tracing off records nothing");
+
+        setTraceEnabled(1);
+        run_with_stdin_script("group\n", searchContact);
+        run_with_stdin_script("Group A\n" "y\n", deleteContact);
+        setTraceEnabled(0);
+        TEST_ASSERT(traceEventCount() > ev0, "K2: spans recorded while tracing");
+
+        int flushed = traceFlush("test_trace.json");
+        int has_events = 0, has_scan = 0, has_patch = 0, has_stage = 0;
+        FILE *tf = fopen("test_trace.json", "r");
+        char tl[512];
+        while (tf && fgets(tl, sizeof(tl), tf)) {
+            if (strstr(tl, "\"traceEvents\""))        has_events = 1;
+            if (strstr(tl, "\"search.scan\""))        has_scan = 1;
+            if (strstr(tl, "\"delete.in_place\""))    has_patch = 1;
+            if (strstr(tl, "\"search.match.text\""))  has_stage = 1;
+        }
+        if (tf) fclose(tf);
+        TEST_ASSERT(flushed && has_events, "K3: Chrome trace JSON written");
+        TEST_ASSERT(has_scan && has_stage, "K4: scan loop and match stage spans present");
+        TEST_ASSERT(has_patch, "K5: in-place delete span present");
+        remove("test_trace.json");
+
+        setTraceEnabled(1);
+        ev0 = traceEventCount();
+        stats_exit_worker(NULL);
+        unsigned long long per = traceEventCount() - ev0;
+        for (int t = 0; t < 300; t++) {
+            pthread_t th;
+            if (pthread_create(&th, NULL, stats_exit_worker, NULL) == 0) pthread_join(th, NULL);
+        }
+        setTraceEnabled(0);
+        TEST_ASSERT(per > 0 && traceEventCount() == ev0 + per * 301,
+                    "K6: 300 exited threads reuse rings, none of their spans dropped");
+    }
+
+    // -----------------------------
+    // Group L: Bloom filters
+    // -----------------------------
+    printf("\nGroup L: Bloom filters\n");
+    {
+        appendContactRow("Bloom Co", "P5", "081-555-0005", "Bloom@Group.com");
+        TEST_ASSERT(bloomMayContain(getContactsFile(), BLOOM_PHONE, "0815550005") &&
+                    bloomMayContain(getContactsFile(), BLOOM_EMAIL, "bloom@group.com"), "L1: present keys answer maybe");
+        int misses = 0;
+        for (int i = 0; i < 100; i++) {
+            char k[32]; snprintf(k, sizeof(k), "09%08d", i);
+            if (!bloomMayContain(getContactsFile(), BLOOM_PHONE, k)) misses++;
+        }
+        TEST_ASSERT(misses >= 95, "L2: absent keys are definite misses");
+
+        FILE *ext = fopen(getContactsFile(), "a");   // write behind the filter's back
+        if (ext) { fprintf(ext, "Ext Co,P6,0817770007,ext@group.com\n"); fclose(ext); }
+        TEST_ASSERT(contactExistsByPhoneNorm(getContactsFile(), "+66817770007") &&
+                    contactExistsByEmailCI(getContactsFile(), "EXT@group.com"), "L3: outside write detected, filter rebuilt");
+        TEST_ASSERT(!contactExistsByEmailCI(getContactsFile(), "nobody@group.com"), "L4: miss answered");
+
+        char side[300];
+        snprintf(side, sizeof(side), "%s.bloom", getContactsFile());
+        bloomMayContain(getContactsFile(), BLOOM_PHONE, "0815550005");
+        FILE *sf = NULL;
+        TEST_ASSERT(bloomPersist() && (sf = fopen(side, "rb")) != NULL, "L5: filter persisted beside the book");
+        if (sf) fclose(sf);
+        remove(side);
+    }
+
+    // -----------------------------
+    // Group M: Uniqueness on add
+    // -----------------------------
+    printf("\nGroup M: Uniqueness on add\n");
+    {
+        { FILE *init = fopen(getContactsFile(), "w"); if (init) fclose(init); }
+        setUniquePolicy(UNIQUE_PHONE | UNIQUE_EMAIL, DUP_REJECT);
+        int conflict = 0;
+        TEST_ASSERT(appendContactRow("Uniq A", "P1", "+66 81 111 1111", "a@uniq.com") == 1, "M1: first row accepted");
+        TEST_ASSERT(enqueueContactRowChecked("Uniq B", "P2", "081-111-1111", "b@uniq.com", &conflict) == 0 &&
+                    conflict == UNIQUE_PHONE && countContactsTest(getContactsFile()) == 1,
+                    "M2: same phone (+66 vs 0 form) rejected");
+        TEST_ASSERT(appendContactRow("Uniq C", "P3", "081-111-2222", "A@Uniq.com") == 0 &&
+                    countContactsTest(getContactsFile()) == 1, "M3: same email (case-insensitive) rejected");
+
+        setUniquePolicy(UNIQUE_PHONE | UNIQUE_EMAIL, DUP_WARN);
+        long long seq = enqueueContactRowChecked("Uniq D", "P4", "0811111111", "d@uniq.com", &conflict);
+        TEST_ASSERT(seq > 0 && conflict == UNIQUE_PHONE && commitAppends(seq) &&
+                    countContactsTest(getContactsFile()) == 2, "M4: warn policy keeps the row and reports it");
+
+        setUniquePolicy(UNIQUE_EMAIL, DUP_MERGE);
+        seq = enqueueContactRowChecked("Uniq Merged", "P5", "081-999-0000", "a@uniq.com", &conflict);
+        TEST_ASSERT(seq > 0 && conflict == UNIQUE_EMAIL && commitAppends(seq) &&
+                    countContactsTest(getContactsFile()) == 2 &&
+                    contactExistsByCompanyCI(getContactsFile(), "Uniq Merged") &&
+                    !contactExistsByCompanyCI(getContactsFile(), "Uniq A") &&
+                    contactExistsByPhoneNorm(getContactsFile(), "0819990000"), "M5: merge updates the existing row");
+
+        // bulk: the index is built once and then maintained, never rescanned per row
+        setUniquePolicy(UNIQUE_PHONE, DUP_REJECT);
+        appendContactRow("Uniq E", "P6", "081-000-0000", "e@uniq.com");
+        unsigned long long rb0 = getUniqueCounter("rebuilds");
+        int accepted = 0;
+        for (int i = 0; i < 2000; i++) {
+            char ph[32]; snprintf(ph, sizeof(ph), "02-%07d", i % 1000);
+            if (enqueueContactRowChecked("Bulk", "P", ph, "bulk@uniq.com", NULL) > 0) accepted++;
+        }
+        commitAppends(-1);
+        TEST_ASSERT(accepted == 1000 && countContactsTest(getContactsFile()) == 1003, "M6: bulk insert dedups within the batch");
+        TEST_ASSERT(getUniqueCounter("rebuilds") == rb0, "M7: bulk insert never rescans the book");
+        setUniquePolicy(0, DUP_REJECT);
+    }
+
+    // -----------------------------
+    // Group N: Segmented storage (LSM)
+    // -----------------------------
+    printf("\nGroup N: Segmented storage (LSM)\n");
+    {
+        const char *dir = "test_contacts.lsm";
+        char ph[64] = "", em[64] = "";
+        lsmDestroy(dir);
+        setLsmOptions(100, 0);                // small memtable: flushes every 100 rows
+        int ok = lsmOpen(dir);
+        ok = ok && lsmPut("Acme", "John", "081-000-0001", "john@acme.com");
+        TEST_ASSERT(ok && lsmGet("ACME ", "john", ph, sizeof(ph), em, sizeof(em)) &&
+                    strcmp(em, "john@acme.com") == 0, "N1: put then get from the memtable");
+
+        for (int i = 0; i < 350 && ok; i++) {
+            char co[32], pe[32];
+            snprintf(co, sizeof(co), "Co %04d", (i * 7919) % 350);
+            snprintf(pe, sizeof(pe), "P%d", i % 3);
+            ok = lsmPut(co, pe, "02-000-0000", "x@co.com");
+        }
+        TEST_ASSERT(ok && lsmSegmentCount() >= 3 && lsmGet("Acme", "John", ph, sizeof(ph), em, sizeof(em)),
+                    "N2: full memtables become segments, old rows still found");
+
+        lsmPut("Acme", "John", "081-999-9999", "john@new.acme.com");   // newer version in the memtable
+        lsmDelete("Co 0007", "P2");
+        lsmFlush();
+        TEST_ASSERT(lsmGet("Acme", "John", ph, sizeof(ph), em, sizeof(em)) && strcmp(ph, "081-999-9999") == 0 &&
+                    !lsmGet("Co 0007", "P2", ph, sizeof(ph), em, sizeof(em)), "N3: newest version / tombstone wins");
+
+        LsmScanCheck sc = { 0, 1, "" };
+        long rows = lsmScan(lsm_scan_check, &sc);
+        TEST_ASSERT(rows == 350 && sc.rows == 350 && sc.ordered, "N4: scan merges segments in key order, no dups");
+
+        unsigned long long dropped = getLsmCounter("dropped");
+        TEST_ASSERT(lsmCompactNow() && lsmSegmentCount() == 1 && getLsmCounter("dropped") > dropped &&
+                    lsmScan(NULL, NULL) == 350, "N5: compaction merges into one segment, drops tombstones");
+
+        lsmPut("Wal Co", "Pending", "089-123-4567", "wal@co.com");   // only in WAL + memtable
+        lsmClose();
+        ok = lsmOpen(dir);
+        TEST_ASSERT(ok && lsmGet("wal co", "pending", ph, sizeof(ph), em, sizeof(em)) &&
+                    lsmScan(NULL, NULL) == 351, "N6: reopen restores segments and WAL");
+
+        setLsmOptions(0, 2LL << 20);          // 2 MB/s, before the background merges start
+        for (int i = 0; i < 4000 && ok; i++) {
+            char co[32];
+            snprintf(co, sizeof(co), "Rate %05d", i);
+            ok = lsmPut(co, "Limited Person Name", "02-000-0000", "rate-limited-row@example.com");
+        }
+        TEST_ASSERT(ok && lsmCompactNow() && getLsmCounter("throttle_ns") > 0 &&
+                    lsmScan(NULL, NULL) == 4351, "N7: compaction I/O is rate limited");
+        lsmClose();
+        lsmDestroy(dir);
+        setLsmOptions(4096, 32LL << 20);
+    }
+
+    // -----------------------------
+    // Group O: Block-compressed book
+    // -----------------------------
+    printf("\nGroup O: Block-compressed book\n");
+    {
+        static char buf[200000];
+        size_t n = 0, clen = 0;
+        for (int i = 0; n + 120 < sizeof(buf); i++)
+            n += (size_t)snprintf(buf + n, sizeof(buf) - n, "Nimbus Labs %d,Somchai T.,081-%03d-%04d,user%d@example.co.th\n",
+                                  i % 500, i % 1000, i, i);
+        int ok = lz_roundtrip(buf, n, &clen);
+        TEST_ASSERT(ok && clen < n / 3, "O1: CSV text round-trips and compresses");
+        unsigned long long x = 88172645463325252ULL;
+        for (size_t i = 0; i < 70000; i++) { x ^= x << 13; x ^= x >> 7; x ^= x << 17; buf[i] = (char)x; }
+        size_t c2;
+        TEST_ASSERT(lz_roundtrip(buf, 70000, &c2) && lz_roundtrip("", 0, &c2) && lz_roundtrip("a", 1, &c2),
+                    "O2: random / empty / 1-byte input round-trip");
+        memset(buf, 'a', 5000);
+        TEST_ASSERT(lz_roundtrip(buf, 5000, &c2) && c2 < 64, "O3: long run uses overlapping matches");
+        char junk[8] = { (char)0x0F, 'x' }, out[64];
+        TEST_ASSERT(lzDecompress(junk, 2, out, sizeof(out)) < 0, "O4: truncated input rejected");
+
+        FILE *fp = fopen(getContactsFile(), "w");
+        for (int i = 0; fp && i < 6000; i++)
+            fprintf(fp, "\"Co, %04d\",Person %d,081-000-%04d,p%d@co%d.com\n", (i * 37) % 6000, i, i, i, i % 7);
+        if (fp) fclose(fp);
+        const char *cbk = "test_contacts.cbk", *back = "test_contacts.back.csv";
+        long rows = 0;
+        TEST_ASSERT(cbkPack(getContactsFile(), cbk, 0) > 1 && cbkUnpack(cbk, back) == 6000 &&
+                    files_equal(getContactsFile(), back), "O5: pack + unpack is byte-identical");
+        TEST_ASSERT(cbkScan(cbk, cbk_count_line, &rows) == 6000 && rows == 6000, "O6: parallel scan sees every row");
+
+        unsigned long long b0 = 0;
+        long hits = -1;
+        if (cbkPack(getContactsFile(), cbk, 1) > 1) {
+            b0 = getCbkCounter("blocks_read");
+            hits = cbkFind(cbk, "co, 4242", NULL, NULL);
+        }
+        TEST_ASSERT(hits == 1 && getCbkCounter("blocks_read") - b0 == 1, "O7: sorted book finds a company in one block");
+
+        fp = fopen(cbk, "r+b");                 // flip a byte inside the first block
+        if (fp) { fseek(fp, 100, SEEK_SET); int c = fgetc(fp); fseek(fp, 100, SEEK_SET); fputc(c ^ 0x55, fp); fclose(fp); }
+        TEST_ASSERT(cbkScan(cbk, cbk_count_line, &rows) < 0, "O8: corrupted block detected");
+
+        // trailer: footer_off u64 | nblocks u32 | flags u32 | rows u64 | version u32 | "CBKF", little-endian
+        unsigned char tr[32];
+        long long size = -1, foot = 0;
+        unsigned nb = 0;
+        fp = fopen(cbk, "rb");
+        if (fp && fseek(fp, -32, SEEK_END) == 0 && (size = ftell(fp) + 32) > 0 && fread(tr, 1, 32, fp) == 32) {
+            for (int i = 7; i >= 0; i--) foot = foot << 8 | tr[i];
+            nb = tr[8] | tr[9] << 8 | tr[10] << 16 | (unsigned)tr[11] << 24;
+        }
+        if (fp) fclose(fp);
+        TEST_ASSERT(nb > 1 && tr[16] == (6000 & 0xff) && tr[17] == 6000 >> 8 && tr[24] == 2 && !memcmp(tr + 28, "CBKF", 4) &&
+                    foot + (long long)nb * (8 + 5 * 4 + 8 + 100) + 32 == size,
+                    "O9: footer and trailer are fixed-width little-endian fields");
+        remove(cbk);
+        remove(back);
+    }
+
+    // -----------------------------
+    // Group P: Uniqueness index snapshot
+    // -----------------------------
+    printf("\nGroup P: Uniqueness index snapshot\n");
+    {
+        char side[300];
+        snprintf(side, sizeof(side), "%s.idx", getContactsFile());
+        remove(side);
+        FILE *init = fopen(getContactsFile(), "w");
+        if (init) { fprintf(init, "Snap A,P1,0810000001,a@snap.com\nSnap B,P2,0810000002,b@snap.com\n"); fclose(init); }
+        setUniquePolicy(UNIQUE_PHONE | UNIQUE_EMAIL, DUP_REJECT);
+        uniqueWarmUp();
+        appendContactRow("Snap C", "P3", "0810000003", "c@snap.com");
+        FILE *sf = NULL;
+        TEST_ASSERT(uniquePersist() && (sf = fopen(side, "rb")) != NULL, "P1: index image written beside the book");
+        if (sf) fclose(sf);
+
+        unsigned long long rb0 = getUniqueCounter("rebuilds"), im0 = getUniqueCounter("image_loads");
+        setUniquePolicy(0, DUP_REJECT);                      // drop the in-memory sets
+        setUniquePolicy(UNIQUE_PHONE | UNIQUE_EMAIL, DUP_REJECT);
+        TEST_ASSERT(uniqueWarmUp() && getUniqueCounter("image_loads") == im0 + 1 &&
+                    getUniqueCounter("rebuilds") == rb0, "P2: restart maps the image instead of scanning");
+        TEST_ASSERT(appendContactRow("Dup", "P", "081-000-0003", "x@snap.com") == 0 &&
+                    appendContactRow("New", "P", "081-000-0004", "d@snap.com") == 1, "P3: mapped index answers and grows");
+
+        uniquePersist();
+        FILE *ext = fopen(getContactsFile(), "a");          // append behind the index's back
+        if (ext) { fprintf(ext, "Ext,P,0810000009,ext@snap.com\n"); fclose(ext); }
+        unsigned long long d0 = getUniqueCounter("delta_rows");
+        setUniquePolicy(0, DUP_REJECT);
+        setUniquePolicy(UNIQUE_PHONE | UNIQUE_EMAIL, DUP_REJECT);
+        TEST_ASSERT(uniqueWarmUp() && getUniqueCounter("rebuilds") == rb0 && getUniqueCounter("delta_rows") == d0 + 1 &&
+                    appendContactRow("Dup", "P", "0810000009", "y@snap.com") == 0, "P4: appended rows caught up from the tail");
+
+        uniquePersist();
+        init = fopen(getContactsFile(), "w");               // rewrite: the image no longer describes the book
+        if (init) { fprintf(init, "Other,P,0899999999,o@snap.com\n"); fclose(init); }
+        setUniquePolicy(0, DUP_REJECT);
+        setUniquePolicy(UNIQUE_PHONE | UNIQUE_EMAIL, DUP_REJECT);
+        TEST_ASSERT(uniqueWarmUp() && getUniqueCounter("rebuilds") == rb0 + 1 &&
+                    appendContactRow("Back", "P", "0810000001", "a@snap.com") == 1, "P5: rewritten book rebuilds");
+
+        uniquePersist();
+        im0 = getUniqueCounter("image_loads");
+        setUniquePolicy(UNIQUE_PHONE, DUP_REJECT);           // different constraint set
+        TEST_ASSERT(uniqueWarmUp() && getUniqueCounter("image_loads") == im0, "P6: image for other keys ignored");
+        setUniquePolicy(0, DUP_REJECT);
+        remove(side);
+    }
+
+    // -----------------------------
+    // Group Q: Structured query + planner
+    // -----------------------------
+    printf("\nGroup Q: Structured query\n");
+    {
+        FILE *init = fopen(getContactsFile(), "w");
+        if (init) {
+            fprintf(init, "Café 81,Ann,02-111-1111,ann@cafe.co.th\n"
+                          "Alpha Inc,Bob,081-222-2222,bob@mail.alpha.co.th\n"
+                          "Alpha Labs,Cid,089-333-3333,cid@alpha.com\n"
+                          "\"Beta, \"\"Q\"\"\",Dee,081-444-4444,dee@beta.com\n"
+                          "Gamma,Alpha Eve,081-555-5555,eve@gamma.co.th\n");
+            fclose(init);
+        }
+        char plan[256];
+        TEST_ASSERT(isStructuredQuery("company:alpha* phone:081*") && isStructuredQuery("a OR b") &&
+                    !isStructuredQuery("Café 81") && !isStructuredQuery("user@x.com"), "Q1: query syntax detected");
+        TEST_ASSERT(queryBook(getContactsFile(), "company:\"Café 81\"", NULL, NULL, plan, sizeof(plan)) == 1 &&
+                    queryBook(getContactsFile(), "company:alpha* phone:081*", NULL, NULL, plan, sizeof(plan)) == 1,
+                    "Q2: company with digits, AND across fields");
+        TEST_ASSERT(queryBook(getContactsFile(), "domain:co.th", NULL, NULL, plan, sizeof(plan)) == 3 &&
+                    queryBook(getContactsFile(), "domain:co.th AND (person:ann OR phone:0815555555)", NULL, NULL,
+                              plan, sizeof(plan)) == 2 &&
+                    queryBook(getContactsFile(), "alpha OR company:beta*", NULL, NULL, plan, sizeof(plan)) == 4,
+                    "Q3: domain suffix, OR and parentheses, bare words");
+
+        unsigned long long rows0 = getQueryCounter("rows"), idx0 = getQueryCounter("index_only");
+        TEST_ASSERT(queryBook(getContactsFile(), "email:nobody@none.example OR phone:0900000000", NULL, NULL,
+                              plan, sizeof(plan)) == 0 &&
+                    getQueryCounter("index_only") == idx0 + 1 && getQueryCounter("rows") == rows0,
+                    "Q4: bloom filter answers exact misses without reading the book");
+        unsigned long long pf0 = getQueryCounter("prefiltered");
+        TEST_ASSERT(queryBook(getContactsFile(), "email:cid@alpha.com OR email:nobody@none.example", NULL, NULL,
+                              plan, sizeof(plan)) == 1 &&
+                    getQueryCounter("prefiltered") - pf0 == 3, "Q5: prefilter skips rows before parsing (quoted rows checked)");
+        TEST_ASSERT(queryBook(getContactsFile(), "colour:red", NULL, NULL, plan, sizeof(plan)) < 0 && *plan &&
+                    queryBook(getContactsFile(), "(company:a", NULL, NULL, plan, sizeof(plan)) < 0,
+                    "Q6: bad queries rejected with a message");
+    }
+
+    // -----------------------------
+    // Group R: Ranked top-K search
+    // -----------------------------
+    printf("\nGroup R: Ranked search\n");
+    {
+        FILE *init = fopen(getContactsFile(), "w");
+        if (init) {
+            fprintf(init, "Subacmex,P1,02-000-0001,p1@x.com\n"
+                          "The Acme,P2,02-000-0002,p2@x.com\n"
+                          "Zz,P3,02-000-0003,acme@x.com\n"
+                          "Acme Holdings,P4,02-000-0004,p4@x.com\n"
+                          "Bacme,Acme,02-000-0005,p5@x.com\n"
+                          "ACME,P6,081-999-0006,p6@x.com\n"
+                          "Nothing,P7,02-000-0007,p7@x.com\n");
+            fclose(init);
+        }
+        char got[512] = "";
+        long total = 0;
+        int complete = 0;
+        long shown = searchTopK(getContactsFile(), " acme ", 10, rank_collect, got, &total, &complete);
+        TEST_ASSERT(shown == 6 && total == 6 && complete &&
+                    strcmp(got, "ACME|Bacme|Acme Holdings|Zz|The Acme|Subacmex") == 0,
+                    "R1: exact > prefix > word prefix > substring, company before person/email");
+        got[0] = '\0';
+        shown = searchTopK(getContactsFile(), "acme", 2, rank_collect, got, &total, &complete);
+        TEST_ASSERT(shown == 2 && total == 6 && strcmp(got, "ACME|Bacme") == 0, "R2: only the best K shown, total counted");
+        got[0] = '\0';
+        shown = searchTopK(getContactsFile(), "0819990006", 3, rank_collect, got, &total, &complete);
+        TEST_ASSERT(shown == 1 && strcmp(got, "ACME") == 0, "R3: digit keys rank against the phone");
+
+        init = fopen(getContactsFile(), "w");
+        for (int i = 0; init && i < 50; i++) fprintf(init, "Same Co,P%d,02-000-%04d,s%d@x.com\n", i, i, i);
+        if (init) fclose(init);
+        got[0] = '\0';
+        shown = searchTopK(getContactsFile(), "same co", 3, rank_collect, got, &total, &complete);
+        TEST_ASSERT(shown == 3 && !complete && total == 3, "R4: stops once K exact matches are held");
+
+        setSearchTopK(5);
+        unsigned long long calls0 = getOpCounter("search", "calls");
+        TEST_ASSERT(run_with_stdin_script("same\n", searchContact) == 1 &&
+                    getOpCounter("search", "calls") == calls0 + 1, "R5: menu search uses ranked results when enabled");
+        setSearchTopK(0);
+    }
+
+    // -----------------------------
+    // Group S: Keyset pages
+    // -----------------------------
+    printf("\nGroup S: Keyset pages\n");
+    {
+        FILE *init = fopen(getContactsFile(), "w");
+        for (int i = 0; init && i < 10; i++) fprintf(init, "%s,P%d,02-000-%04d,s%d@x.com\n", i == 4 ? "" : i % 2 ? "Odd" : "Even", i, i, i);
+        if (init) fclose(init);
+        char got[512] = "", cur[96] = "", next[96];
+        long n, pages = 0, rows = 0;
+        do {
+            n = bookPage(getContactsFile(), NULL, cur, 3, page_collect, got, next, sizeof(next));
+            if (n > 0) rows += n;
+            pages++;
+            strcpy(cur, next);
+        } while (n > 0 && *next && pages < 10);
+        TEST_ASSERT(rows == 9 && pages == 3 && strcmp(got, "P0|P1|P2|P3|P5|P6|P7|P8|P9") == 0,
+                    "S1: pages resume where the last one stopped, rows without a company skipped");
+
+        got[0] = '\0';
+        n = bookPage(getContactsFile(), "company:odd", NULL, 2, page_collect, got, next, sizeof(next));
+        strcpy(cur, next);
+        n += bookPage(getContactsFile(), "company:odd", cur, 2, page_collect, got, next, sizeof(next));
+        TEST_ASSERT(n == 4 && strcmp(got, "P1|P3|P5|P7") == 0 && *next, "S2: query results paged the same way");
+        strcpy(cur, next);
+
+        init = fopen(getContactsFile(), "a");
+        if (init) { fprintf(init, "Odd,P11,02-000-0011,s11@x.com\n"); fclose(init); }
+        got[0] = '\0';
+        n = bookPage(getContactsFile(), "company:odd", cur, 5, page_collect, got, next, sizeof(next));
+        TEST_ASSERT(n == 2 && strcmp(got, "P9|P11") == 0 && !*next, "S3: cursor survives appends and sees the new rows");
+
+        init = fopen(getContactsFile(), "w");
+        if (init) { fprintf(init, "Odd,P1,02-000-0001,s1@x.com\n"); fclose(init); }
+        TEST_ASSERT(bookPage(getContactsFile(), NULL, cur, 5, NULL, NULL, next, sizeof(next)) == -2 &&
+                    bookPage(getContactsFile(), NULL, "c1.zz", 5, NULL, NULL, next, sizeof(next)) == -1,
+                    "S4: rewritten book makes the cursor stale, junk cursors rejected");
+
+        init = fopen(getContactsFile(), "w");
+        for (int i = 0; init && i < 10; i++) fprintf(init, "Co%d,P%d,02-000-%04d,s%d@x.com\n", i, i, i, i);
+        if (init) fclose(init);
+        setPageSize(4);
+        TEST_ASSERT(run_with_stdin_script("\n\nq\n", listContacts) == 1,
+                    "S5: menu list pages through the book when a page size is set");
+        setPageSize(0);
+    }
+
+    // -----------------------------
+    // Group T: Row index (in-place edits)
+    // -----------------------------
+    printf("\nGroup T: Row index\n");
+    {
+        // rows at offsets 0, 21, 42
+        const char *book = "Aa,P1,0810000001,a@x\nBb,P2,0810000002,b@x\nCc,P3,0810000003,c@x\n";
+        FILE *init = fopen(getContactsFile(), "wb");
+        if (init) { fputs(book, init); fclose(init); }
+        char got[512];
+        TEST_ASSERT(rowDelete(getContactsFile(), 21, "Bb,P2,0810000002,b@x") == 1 &&
+                    read_file(getContactsFile(), got, sizeof(got)) == (long)strlen(book) &&
+                    strcmp(got, "Aa,P1,0810000001,a@x\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\nCc,P3,0810000003,c@x\n") == 0 &&
+                    countContactsTest(getContactsFile()) == 2, "T1: delete blanks just that row, same size");
+        TEST_ASSERT(rowReplace(getContactsFile(), 42, "Cc,P3,0810000003,c@x", "Cc,P3,0810000009,c@x") == 1 &&
+                    rowReplace(getContactsFile(), 0, "Aa,P1,0810000001,a@x", "Aa,P1,081,a@x") == 1 &&
+                    read_file(getContactsFile(), got, sizeof(got)) == (long)strlen(book) &&
+                    strncmp(got, "Aa,P1,081,a@x\n\n", 15) == 0 && strstr(got, "\nCc,P3,0810000009,c@x\n"),
+                    "T2: updates that fit are written over the old row");
+        unsigned long long rel0 = getRowCounter("relocated");
+        TEST_ASSERT(rowReplace(getContactsFile(), 42, "Cc,P3,0810000009,c@x", "Cc Longer,P3,0810000009,c@x") == 2 &&
+                    read_file(getContactsFile(), got, sizeof(got)) == (long)strlen(book) + 28 &&
+                    strstr(got, "\n\nCc Longer,P3,0810000009,c@x\n") && !strstr(got, "Cc,P3") &&
+                    countContactsTest(getContactsFile()) == 2 && getRowCounter("relocated") == rel0 + 1,
+                    "T3: a longer row moves to the end, old copy blanked");
+        TEST_ASSERT(rowDelete(getContactsFile(), 42, "Cc,P3,0810000009,c@x") == 0 &&
+                    rowDelete(getContactsFile(), 0, "Zz,P1,081,a@x") == 0, "T4: stale offsets and changed rows refused");
+
+        init = fopen(getContactsFile(), "a");
+        if (init) { fputs("Dd,P4,0810000004,d@x\n", init); fclose(init); }
+        unsigned long long up0 = getRowCounter("in_place"), builds0 = getRowCounter("builds");
+        long size0 = read_file(getContactsFile(), got, sizeof(got));
+        int ok = run_with_stdin_script("dd\n" "2\n" "P9\n" "y\n", updateContact);
+        TEST_ASSERT(ok == 1 && getRowCounter("in_place") == up0 + 1 && getRowCounter("builds") == builds0 &&
+                    read_file(getContactsFile(), got, sizeof(got)) == size0 && strstr(got, "Dd,P9,0810000004,d@x\n"),
+                    "T5: menu update edits in place, index caught up over the append");
+    }
+
+    // -----------------------------
+    // Group U: Range-copy rewrite
+    // -----------------------------
+    printf("\nGroup U: Range-copy rewrite\n");
+    {
+        // rows at offsets 0, 21, 43 (a blank line in between stays as it is)
+        FILE *init = fopen(getContactsFile(), "wb");
+        if (init) { fputs("Aa,P1,0810000001,a@x\nBb,P2,0810000002,b@x\n\nCc,P3,0810000003,c@x", init); fclose(init); }
+        char got[512], tmp[300];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", getContactsFile());
+        unsigned long long rw0 = getOpCounter("update", "rewrites");
+        TEST_ASSERT(bookRewriteRow(getContactsFile(), 21, "Bb,P2,0810000002,b@x", "Bb Renamed,P2,0810000002,b@x") == 1 &&
+                    read_file(getContactsFile(), got, sizeof(got)) > 0 &&
+                    strcmp(got, "Aa,P1,0810000001,a@x\nBb Renamed,P2,0810000002,b@x\n\nCc,P3,0810000003,c@x") == 0 &&
+                    getOpCounter("update", "rewrites") == rw0 + 1, "U1: prefix and suffix copied untouched around the new row");
+        TEST_ASSERT(bookRewriteRow(getContactsFile(), 5, "Cc,P3,0810000003,c@x", NULL) == 1 &&
+                    read_file(getContactsFile(), got, sizeof(got)) > 0 &&
+                    strcmp(got, "Aa,P1,0810000001,a@x\nBb Renamed,P2,0810000002,b@x\n\n") == 0,
+                    "U2: a wrong offset hint falls back to finding the row");
+        FILE *left = fopen(tmp, "rb");
+        if (left) fclose(left);
+        TEST_ASSERT(bookRewriteRow(getContactsFile(), -1, "Zz,P9,0,z@x", NULL) == 0 && !left &&
+                    read_file(getContactsFile(), got, sizeof(got)) > 0 &&
+                    strcmp(got, "Aa,P1,0810000001,a@x\nBb Renamed,P2,0810000002,b@x\n\n") == 0,
+                    "U3: missing row leaves the book alone, no temp file left over");
+
+        // another book: its temp file sits beside it, wherever the current book is
+        char book[256];
+        snprintf(book, sizeof(book), "%s", getContactsFile());
+        init = fopen("test_other.csv", "wb");
+        if (init) { fputs("Oo,P1,0810000001,o@x\n", init); fclose(init); }
+        setContactsFile("no_such_dir/test_unit.csv");
+        int r = bookRewriteRow("test_other.csv", 0, "Oo,P1,0810000001,o@x", "Oo Renamed,P1,0810000001,o@x");
+        setContactsFile(book);
+        TEST_ASSERT(r == 1 && read_file("test_other.csv", got, sizeof(got)) > 0 &&
+                    strcmp(got, "Oo Renamed,P1,0810000001,o@x\n") == 0, "U4: rewriting another book builds its temp beside it");
+        remove("test_other.csv");
+    }
+
+    // -----------------------------
+    // Group V: Sharded book
+    // -----------------------------
+    printf("\nGroup V: Sharded book\n");
+    {
+        const char *dir = "test_contacts.shards";
+        shardDestroy(dir);
+        FILE *init = fopen(getContactsFile(), "w");
+        for (int i = 0; init && i < 12; i++) fprintf(init, "Co%d,P%d,081-000-%04d,v%d@x.com\n", i, i, i, i);
+        if (init) fclose(init);
+        char got[512] = "", plan[256];
+        int ok = shardOpen(dir, 4) && shardImport(getContactsFile()) == 12 && shardAdd("No Phone", "P12", "", "np@x.com");
+        long n = shardQuery("company:co* OR company:\"no phone\"", page_collect, got, plan, sizeof(plan));
+        TEST_ASSERT(ok && shardCount() == 4 && n == 13 && strncmp(plan, "fan-out: 4 of 4", 15) == 0 &&
+                    strstr(got, "P12") && strstr(got, "P7"), "V1: rows spread over the shards, scans fan out to all");
+
+        unsigned long long routed0 = getShardCounter("routed"), read0 = getShardCounter("shards_read");
+        got[0] = '\0';
+        TEST_ASSERT(shardFindPhone("+66 81 000 0003", page_collect, got) == 1 && strcmp(got, "P3") == 0 &&
+                    getShardCounter("routed") == routed0 + 1 && getShardCounter("shards_read") == read0 + 1,
+                    "V2: phone lookup reads one shard (+66 folded like the uniqueness index)");
+
+        unsigned long long rw0 = getShardCounter("rewrites");
+        TEST_ASSERT(shardDelete("phone:0810000003") == 1 && getShardCounter("rewrites") == rw0 + 1 &&
+                    shardQuery("company:co*", NULL, NULL, NULL, 0) == 11, "V3: delete rewrites just the shard it lives on");
+
+        got[0] = '\0';
+        TEST_ASSERT(shardUpdate("company:co5", "phone", "089-999-9999") == 1 &&
+                    shardFindPhone("0899999999", page_collect, got) == 1 && strcmp(got, "P5") == 0 &&
+                    shardFindPhone("0810000005", NULL, NULL) == 0 && shardUpdate("company:co5", "fax", "1") == -1,
+                    "V4: update moves a row whose phone now hashes elsewhere");
+
+        char out[300];
+        snprintf(out, sizeof(out), "%s.export", getContactsFile());
+        shardClose();
+        TEST_ASSERT(!shardOpen(dir, 8) && shardOpen(dir, 0) && shardCount() == 4 && shardExport(out) == 12 &&
+                    countContactsTest(out) == 12, "V5: reopened with its own count, exports every row");
+        remove(out);
+        shardClose();
+        shardDestroy(dir);
+    }
+
+    // -----------------------------
+    // Group W: Concurrent key map
+    // -----------------------------
+    printf("\nGroup W: Concurrent key map\n");
+    {
+        KeyMap *m = keyMapCreate(0);
+        unsigned long long v = 0;
+        int ok = m && keyMapPut(m, 42, 7, NULL) == 1 && keyMapPut(m, 42, 9, &v) == 0 && v == 7 &&
+                 keyMapGet(m, 42, &v) && v == 7 && !keyMapGet(m, 43, NULL) && keyMapPut(m, 0, 0, NULL) == 1 &&
+                 keyMapGet(m, 0, &v) && v == 0;
+        TEST_ASSERT(ok, "W1: first put wins, later puts report the stored row id");
+
+        size_t count = 0, cap = 0;
+        unsigned long long resizes = 0;
+        for (unsigned long long k = 1; m && k <= 100000; k++) keyMapPut(m, k * 0x9E3779B97F4A7C15ULL, k, NULL);
+        for (unsigned long long k = 1; ok && k <= 100000; k++) ok = keyMapGet(m, k * 0x9E3779B97F4A7C15ULL, &v) && v == k;
+        if (m) keyMapStats(m, &count, &cap, &resizes);
+        TEST_ASSERT(ok && count == 100002 && resizes >= 7 && count * 10 <= cap * 7,
+                    "W2: grows from 1024 slots through every resize without losing a key");
+        keyMapFree(m);
+
+        m = keyMapCreate(0);
+        KmRace race[8];
+        pthread_t th[8];
+        for (int t = 0; t < 8; t++) { race[t].m = m; race[t].t = t; race[t].won = 0; }
+        for (int t = 0; t < 8; t++) pthread_create(&th[t], NULL, km_race, &race[t]);
+        long won = 0;
+        for (int t = 0; t < 8; t++) { pthread_join(th[t], NULL); won += race[t].won; }
+        ok = m != NULL;
+        for (unsigned long long k = 0; ok && k < 45000; k++) ok = keyMapGet(m, (k + 1) * 0x9E3779B97F4A7C15ULL, &v) && v == k;
+        if (m) keyMapStats(m, &count, NULL, &resizes);
+        TEST_ASSERT(ok && won == 45000 && count == 45000 && resizes > 0,
+                    "W3: 8 threads racing through resizes: each key inserted exactly once");
+        keyMapFree(m);
+
+        // rows at offsets 0, 25, 50, 78; row 3 repeats row 1's phone (+66 form), row 4 its email
+        FILE *init = fopen(getContactsFile(), "w");
+        if (init) {
+            fputs("Aa,P1,081-000-0001,a@x.c\nBb,P2,081-000-0002,b@x.c\nCc,P3,+66 81 000 0001,c@x.c\nDd,P4,,A@X.C\n", init);
+            fclose(init);
+        }
+        unsigned long long k1[2], k2[2], k4[2], v1 = 9, v2 = 9, v4 = 9;
+        keyMapKeys("0810000001", "a@x.c", k1);
+        keyMapKeys("081-000-0002", "b@x.c", k2);
+        keyMapKeys("", "A@X.C", k4);
+        KeyMap *ph = keyMapCreate(0), *em = keyMapCreate(0);
+        long dups = -1;
+        TEST_ASSERT(keyMapBuildBook(getContactsFile(), ph, em, 1, &dups) == 4 && dups == 2 &&
+                    keyMapGet(ph, k1[0], &v1) && v1 == 0 && keyMapGet(ph, k2[0], &v2) && v2 == 25 &&
+                    keyMapGet(em, k4[1], &v4) && v4 == 0 && k4[0] == 0, "W4: keys point at their first row");
+        keyMapFree(ph);
+        keyMapFree(em);
+        ph = keyMapCreate(0); em = keyMapCreate(0);
+        size_t np = 0, ne = 0;
+        long rows = keyMapBuildBook(getContactsFile(), ph, em, 3, &dups);
+        keyMapStats(ph, &np, NULL, NULL);
+        keyMapStats(em, &ne, NULL, NULL);
+        TEST_ASSERT(rows == 4 && dups == 2 && np == 2 && ne == 3 && keyMapGet(ph, k1[0], &v1) && (v1 == 0 || v1 == 50),
+                    "W5: parsed on 3 threads, same keys and duplicate count");
+        keyMapFree(ph);
+        keyMapFree(em);
+    }
+
+    // -----------------------------
+    // Group X: Pipelined scan
+    // -----------------------------
+    printf("\nGroup X: Pipelined scan\n");
+    {
+        // 6000 rows over several batches: a blank line, a CRLF row, no newline after the last row
+        FILE *init = fopen(getContactsFile(), "w");
+        if (init) {
+            for (int i = 0; i < 6000; i++)
+                fprintf(init, "Co%05d,P%05d,08%08d,e%05d@x.c%s", i, i, i, i,
+                        i == 5999 ? "" : i == 100 ? "\r\n" : i == 200 ? "\n\n" : "\n");
+            fclose(init);
+        }
+        long r_off = 0, r_on = 0;
+        unsigned long long threaded0 = getPipeCounter("threaded"), batches0 = getPipeCounter("batches");
+        PipeCheck off = pipe_scan(PIPE_OFF, NULL, &r_off);
+        TEST_ASSERT(r_off == 6000 && off.rows == 6000 && off.ordered && off.sum == 5999L * 6000 / 2 &&
+                    getPipeCounter("threaded") == threaded0 && getPipeCounter("batches") > batches0 + 1,
+                    "X1: inline, batch by batch: every row once, in file order");
+        PipeCheck on = pipe_scan(PIPE_ON, NULL, &r_on);
+        TEST_ASSERT(r_on == 6000 && on.rows == 6000 && on.ordered && on.sum == off.sum &&
+                    getPipeCounter("threaded") == threaded0 + 1, "X2: stages on their own threads, same rows, same order");
+        on = pipe_scan(PIPE_ON, pipe_every_other, &r_on);
+        TEST_ASSERT(r_on == 3000 && on.rows == 3000 && on.ordered && on.last == 5998,
+                    "X3: match stage drops rows, the formatter sees the rest in order");
+
+        setScanPipeline(PIPE_ON);
+        unsigned long long rows0 = getOpCounter("list", "rows_scanned"), hits0 = getOpCounter("list", "matches");
+        unsigned long long srows0 = getOpCounter("search", "rows_scanned"), shits0 = getOpCounter("search", "matches");
+        run_with_stdin_script("co0001\n", listContacts);
+        run_with_stdin_script("0800000123\n", searchContact);
+        setScanPipeline(PIPE_AUTO);
+        TEST_ASSERT(getOpCounter("list", "rows_scanned") == rows0 + 6001 && getOpCounter("list", "matches") == hits0 + 10 &&
+                    getOpCounter("search", "rows_scanned") == srows0 + 6001 && getOpCounter("search", "matches") == shits0 + 1,
+                    "X4: menu list and search through the pipeline: lines read and rows shown counted");
+    }
+
+    // -----------------------------
+    // Group Y: B+tree index
+    // -----------------------------
+    printf("\nGroup Y: B+tree index\n");
+    {
+        // 6000 rows, company "<a..f><row>" so each letter holds 1000 of them
+        FILE *init = fopen(getContactsFile(), "w");
+        if (init) {
+            for (int i = 0; i < 6000; i++) fprintf(init, "%c%05d,P%05d,08%08d,e%05d@x.c\n", "abcdef"[i % 6], i, i, i, i);
+            fclose(init);
+        }
+        char bpt[300], got[512] = "";
+        snprintf(bpt, sizeof(bpt), "%s.company.bpt", getContactsFile());
+        unsigned long long builds0 = getBtreeCounter("builds");
+        TEST_ASSERT(btreeFind(getContactsFile(), BTREE_COMPANY, "C00002", NULL, 1, page_collect, got) == 1 &&
+                    strcmp(got, "P00002") == 0 && getBtreeCounter("builds") > builds0 &&
+                    getBtreeCounter("keys") == 6000, "Y1: point lookup, case-insensitive, builds the index");
+
+        got[0] = '\0';
+        TEST_ASSERT(btreeFind(getContactsFile(), BTREE_COMPANY, "b0001", "b0001", 0, page_collect, got) == 2 &&
+                    strcmp(got, "P00013|P00019") == 0 && btreeFind(getContactsFile(), BTREE_COMPANY, "a", "b", 0, NULL, NULL) == 2000 &&
+                    btreeFind(getContactsFile(), BTREE_COMPANY, "e", NULL, 0, NULL, NULL) == 2000,
+                    "Y2: prefix and range walks (upper end takes its prefix)");
+
+        FILE *app = fopen(getContactsFile(), "a");
+        if (app) { fputs("A99999,PNEW,0899999999,new@x.c\n", app); fclose(app); }
+        unsigned long long appended0 = getBtreeCounter("appended");
+        builds0 = getBtreeCounter("builds");
+        got[0] = '\0';
+        TEST_ASSERT(btreeFind(getContactsFile(), BTREE_COMPANY, "a99999", NULL, 1, page_collect, got) == 1 &&
+                    strcmp(got, "PNEW") == 0 && getBtreeCounter("appended") == appended0 + 1 &&
+                    getBtreeCounter("builds") == builds0, "Y3: rows appended to the book are inserted, not rebuilt");
+
+        init = fopen(getContactsFile(), "w");
+        if (init) {
+            for (int i = 0; i < 6000; i++) fprintf(init, "%c%05d,P%05d,08%08d,e%05d@x.c\n", i == 2 ? 'z' : "abcdef"[i % 6], i, i, i, i);
+            fclose(init);
+        }
+        TEST_ASSERT(btreeFind(getContactsFile(), BTREE_COMPANY, "c00002", NULL, 1, NULL, NULL) == 0 &&
+                    btreeFind(getContactsFile(), BTREE_COMPANY, "z00002", NULL, 1, NULL, NULL) == 1 &&
+                    getBtreeCounter("builds") > builds0, "Y4: a rewritten book gets a fresh index");
+
+        setBtreeOptions(0, 16 * 4096);
+        unsigned long long evict0 = getBtreeCounter("evictions");
+        TEST_ASSERT(btreeFind(getContactsFile(), BTREE_COMPANY, "a", "f", 0, NULL, NULL) == 5999 &&
+                    getBtreeCounter("frames") == 16 && getBtreeCounter("height") >= 2 &&
+                    getBtreeCounter("pages") > 16 && getBtreeCounter("evictions") > evict0,
+                    "Y5: 16-frame pool: a tree bigger than the pool is walked by evicting pages");
+
+        char plan[256];
+        setBtreeOptions(0, 4LL << 20);
+        long scan = queryBook(getContactsFile(), "company:b..c AND email:e01*", NULL, NULL, plan, sizeof(plan));
+        setBtreeOptions(BTREE_COMPANY, 0);
+        unsigned long long bq0 = getQueryCounter("btree");
+        long indexed = queryBook(getContactsFile(), "company:b..c AND email:e01*", NULL, NULL, plan, sizeof(plan));
+        TEST_ASSERT(scan == 333 && indexed == scan && strncmp(plan, "index: btree", 12) == 0 &&
+                    getQueryCounter("btree") == bq0 + 1, "Y6: query with a company range answered from the index");
+        TEST_ASSERT(queryBook(getContactsFile(), "company:z* OR person:p00003", NULL, NULL, plan, sizeof(plan)) == 2 &&
+                    getQueryCounter("btree") == bq0 + 1 && strncmp(plan, "scan", 4) == 0,
+                    "Y7: an alternative without an indexed term falls back to a scan");
+
+        // back-date the book so the tree's stamp is trusted, then edit rows 7, 8, 9 (36 bytes each)
+        struct utimbuf old = { time(NULL) - 60, time(NULL) - 60 };
+        utime(getContactsFile(), &old);
+        btreeFind(getContactsFile(), BTREE_COMPANY, "a", NULL, 1, NULL, NULL);
+        builds0 = getBtreeCounter("builds");
+        unsigned long long edits0 = getBtreeCounter("edits");
+        int edited = rowReplace(getContactsFile(), 252, "b00007,P00007,0800000007,e00007@x.c",
+                                "q00007,P00007,0800000007,e00007@x.c") == 1 &&
+                     rowDelete(getContactsFile(), 288, "c00008,P00008,0800000008,e00008@x.c") == 1 &&
+                     rowReplace(getContactsFile(), 324, "d00009,P00009,0800000009,e00009@x.c",
+                                "r00009 moved,P00009,0800000009,e00009@x.c") == 2;
+        TEST_ASSERT(edited && btreeFind(getContactsFile(), BTREE_COMPANY, "Q00007", NULL, 1, NULL, NULL) == 1 &&
+                    btreeFind(getContactsFile(), BTREE_COMPANY, "b00007", NULL, 1, NULL, NULL) == 0 &&
+                    btreeFind(getContactsFile(), BTREE_COMPANY, "c00008", NULL, 1, NULL, NULL) == 0 &&
+                    btreeFind(getContactsFile(), BTREE_COMPANY, "r00009 moved", NULL, 1, NULL, NULL) == 1 &&
+                    btreeFind(getContactsFile(), BTREE_COMPANY, "d00009", NULL, 1, NULL, NULL) == 0 &&
+                    getBtreeCounter("edits") == edits0 + 3 && getBtreeCounter("builds") == builds0,
+                    "Y8: in-place deletes and updates are applied to the tree, no rebuild");
+        rowReplace(getContactsFile(), 252, "q00007,P00007,0800000007,e00007@x.c", "b00007,P00007,0800000007,e00007@x.c");
+        rowReplace(getContactsFile(), 252, "b00007,P00007,0800000007,e00007@x.c", "q00007,P00007,0800000007,e00007@x.c");
+        TEST_ASSERT(btreeFind(getContactsFile(), BTREE_COMPANY, "q00007", NULL, 1, NULL, NULL) == 1 &&
+                    getBtreeCounter("builds") == builds0, "Y9: a key edited back and forth is listed once");
+        setBtreeOptions(0, 0);
+        btreeClose();
+        remove(bpt);
+    }
+
+    // -----------------------------
+    // Group Z: Schema row codec
+    // -----------------------------
+    printf("\nGroup Z: Schema row codec\n");
+    {
+        static const char *lines[] = {
+            "Acme,Ann,081-111-1111,ann@acme.co", "\"Acme, Inc.\",\"Bob \"\"B\"\"\",+66 81 222 3333,b@x.c",
+            "OnlyCompany", "a,b", ",,,", "", "a,b,c,d,extra,columns", "\"unterminated, quote,x,y",
+            "บริษัท ไทย,สมชาย,02-123-4567,s@ไทย.th", "\"\",\"\",\"\",\"\"",
+        };
+        char big[MAX_LINE_LEN];
+        memset(big, 'x', 300); big[300] = '\0';              // longer than any field: cut the same way
+        big[150] = ',';
+        char f[4][MAX_FIELD_LEN];
+        struct Contact c;
+        int same = 1;
+        for (int i = 0; i <= (int)(sizeof(lines) / sizeof(lines[0])); i++) {
+            const char *l = i < (int)(sizeof(lines) / sizeof(lines[0])) ? lines[i] : big;
+            parseCsv4(l, f[0], sizeof(f[0]), f[1], sizeof(f[1]), f[2], sizeof(f[2]), f[3], sizeof(f[3]));
+            int filled = contactParse(l, &c);
+            same = same && !strcmp(f[0], c.company) && !strcmp(f[1], c.person) && !strcmp(f[2], c.phone) &&
+                   !strcmp(f[3], c.email) && filled == (*f[0] || *f[1] || *f[2] || *f[3]);
+        }
+        TEST_ASSERT(same, "Z1: generated parser gives parseCsv4's fields on quoted, short, long and extra-column rows");
+
+        char row[CONTACT_ROW_MAX], want[CONTACT_ROW_MAX], e[MAX_FIELD_LEN * 2];
+        struct Contact w = { "Acme, Inc.", "Bob \"B\"", "081", "b@x.c" };
+#define Z_COL(name, ID, label) w.name,
+        const char *cols[CONTACT_NFIELDS] = { CONTACT_FIELDS(Z_COL) };
+#undef Z_COL
+        size_t wl = 0;
+        for (int i = 0; i < CONTACT_NFIELDS; i++) {
+            escapeCSV(cols[i], e, sizeof(e));
+            wl += snprintf(want + wl, sizeof(want) - wl, "%s%s", i ? "," : "", e);
+        }
+        size_t n = contactFormat(&w, row, sizeof(row));
+        TEST_ASSERT(n == strlen(want) && !strcmp(row, want) && contactFormat(&w, row, 64) == 0,
+                    "Z2: generated writer escapes each column like escapeCSV, refuses a short buffer");
+
+        struct Contact a = { "ACME", "ann", "1", "x" }, b = { "acme", "Ann", "1", "x" }, d = { "acme", "bob", "0", "x" };
+        TEST_ASSERT(contactCompare(&a, &b) == 0 && contactCompare(&a, &d) < 0 && contactCompare(&d, &b) > 0,
+                    "Z3: comparator: case-insensitive, column by column in schema order");
+    }
+
+    // -----------------------------
+    // Group AA: E.164 phone keys
+    // -----------------------------
+    printf("\nGroup AA: E.164 phone keys\n");
+    {
+        static const char *same[] = { "+66 81 222 3333", "081-222-3333", "0066812223333", "66812223333",
+                                      "+66 (0)81 222 3333", "(081) 222.3333" };
+        char text[64], again[64];
+        int all = 1;
+        for (int i = 0; i < (int)(sizeof(same) / sizeof(same[0])); i++)
+            all = all && phoneE164(same[i]) == 66812223333LL && phoneKey(same[i]) == phoneKey(same[0]);
+        phoneKeyText("081-222-3333", text, sizeof(text));
+        phoneKeyText(text, again, sizeof(again));
+        TEST_ASSERT(all && strcmp(text, "+66812223333") == 0 && strcmp(again, text) == 0,
+                    "AA1: national, +66, 00 and bare forms are one E.164 number; key text is idempotent");
+
+        int intl = phoneE164("+1 212 555 0100") == 12125550100LL && phoneE164("02-123-4567") == 6621234567LL &&
+                   phoneKey("+1 212 555 0100") != phoneKey("02-123-4567");
+        setPhoneCountry(1);
+        intl = intl && phoneE164("(212) 555-0100") == 12125550100LL && phoneE164("081-222-3333") == 1812223333LL;
+        setPhoneCountry(66);
+        phoneKeyText("12345678901234567", text, sizeof(text));
+        TEST_ASSERT(intl && phoneE164("000") == 0 && phoneKey("000") != 0 && phoneKey("") == 0 &&
+                    phoneE164("12345678901234567") == 0 && strcmp(text, "12345678901234567") == 0,
+                    "AA2: foreign numbers, configurable default country, digit fallback past 15 digits");
+
+        FILE *init = fopen(getContactsFile(), "w");
+        if (init) {
+            fprintf(init, "Intl Co,Ann,+66 81 222 3333,ann@x.co\n"
+                          "Local Co,Bob,02-123-4567,bob@x.co\n"
+                          "US Co,Cid,+1 212 555 0100,cid@x.com\n");
+            fclose(init);
+        }
+        char plan[256], got[256] = "";
+        long total = 0;
+        int complete = 0;
+        TEST_ASSERT(queryBook(getContactsFile(), "phone:081-222-3333", NULL, NULL, plan, sizeof(plan)) == 1 &&
+                    queryBook(getContactsFile(), "phone:+6621234567", NULL, NULL, plan, sizeof(plan)) == 1 &&
+                    queryBook(getContactsFile(), "phone:0812*", NULL, NULL, plan, sizeof(plan)) == 1 &&
+                    queryBook(getContactsFile(), "phone:001212*", NULL, NULL, plan, sizeof(plan)) == 1 &&
+                    queryBook(getContactsFile(), "phone:*3333", NULL, NULL, plan, sizeof(plan)) == 1 &&
+                    bloomMayContain(getContactsFile(), BLOOM_PHONE, "001 212 555 0100"),
+                    "AA3: query terms, globs and the bloom filter compare E.164 numbers");
+
+        TEST_ASSERT(searchTopK(getContactsFile(), "0812223333", 5, rank_collect, got, &total, &complete) == 1 &&
+                    strcmp(got, "Intl Co") == 0 &&
+                    searchTopK(getContactsFile(), "2223333", 5, rank_collect, got, &total, &complete) == 1,
+                    "AA4: a national key finds the +66 row; digit substrings still match");
+
+        unsigned long long k1[2], k2[2];
+        keyMapKeys("0066 81 222 3333", "A@x.co", k1);
+        keyMapKeys("081-222-3333", "a@x.co", k2);
+        TEST_ASSERT(k1[0] == k2[0] && k1[1] == k2[1] &&
+                    run_with_stdin_script("0812223333\n" "y\n", deleteContact) == 1 &&
+                    countContactsTest(getContactsFile()) == 2, "AA5: key maps and delete match across forms");
+
+        // Saved keys are country-dependent: a filter, image or shard set built under +66 must not be
+        // trusted under +1, and an existing shard set keeps reading numbers with its own country.
+        char side[300];
+        snprintf(side, sizeof(side), "%s.idx", getContactsFile());
+        remove(side);
+        init = fopen(getContactsFile(), "w");
+        if (init) { fprintf(init, "Cc Co,Ann,081-222-3333,ann@cc.co\n"); fclose(init); }
+        int bloom_ok = queryBook(getContactsFile(), "phone:081-222-3333", NULL, NULL, plan, sizeof(plan)) == 1 &&
+                       bloomPersist();
+        setUniquePolicy(UNIQUE_PHONE, DUP_REJECT);
+        uniqueWarmUp();
+        uniquePersist();
+        setUniquePolicy(0, DUP_REJECT);
+        setPhoneCountry(1);
+        setUniquePolicy(UNIQUE_PHONE, DUP_REJECT);
+        unsigned long long im0 = getUniqueCounter("image_loads");
+        bloom_ok = bloom_ok && queryBook(getContactsFile(), "phone:081-222-3333", NULL, NULL, plan, sizeof(plan)) == 1;
+        int idx_ok = uniqueWarmUp() && getUniqueCounter("image_loads") == im0 &&
+                     appendContactRow("Dup", "P", "+1 812 223 333", "d@cc.co") == 0 &&
+                     appendContactRow("New", "P", "+66 81 222 3333", "e@cc.co") == 1;
+        setUniquePolicy(0, DUP_REJECT);
+        setPhoneCountry(66);
+
+        const char *dir = "test_contacts_cc.shards";
+        shardDestroy(dir);
+        int shard_ok = shardOpen(dir, 8) && shardAdd("Cc Co", "Ann", "081-222-3333", "ann@cc.co");
+        shardClose();
+        setPhoneCountry(1);
+        char who[512] = "";
+        shard_ok = shard_ok && shardOpen(dir, 0) && shardFindPhone("081-222-3333", page_collect, who) == 1 &&
+                   strcmp(who, "Ann") == 0;
+        shardClose();
+        shard_ok = shard_ok && phoneE164("081-222-3333") == 1812223333LL;
+        setPhoneCountry(66);
+        shardDestroy(dir);
+        TEST_ASSERT(bloom_ok && idx_ok && shard_ok,
+                    "AA6: bloom, idx and shard manifest record their phone country");
+    }
+
+    // -----------------------------
+    // Group AB: Group-by reports
+    // -----------------------------
+    printf("\nGroup AB: Group-by reports\n");
+    {
+        FILE *init = fopen(getContactsFile(), "w");
+        if (init) {
+            fprintf(init, "Acme Co,A,081-111-1111,a@Acme.com\n"
+                          "\"ACME  co.\",B,+66 89 111 1111,b@acme.com\n"
+                          "Beta,C,+1 212 555 0100,c@beta.co.th\n"
+                          "Acme Co,D,0891112222,\n"
+                          "Gamma,E,,e@BETA.co.th\n");
+            fclose(init);
+        }
+        char got[512] = "";
+        Report *r = reportBuild(getContactsFile());
+        reportTop(r, REPORT_COMPANY, 2, report_collect, got);
+        TEST_ASSERT(r && reportRows(r) == 5 && reportGroups(r, REPORT_COMPANY) == 3 &&
+                    strcmp(got, "acme co=3|beta=1") == 0, "AB1: companies grouped by normalizeKey, largest first");
+        got[0] = '\0';
+        reportTop(r, REPORT_DOMAIN, 0, report_collect, got);
+        TEST_ASSERT(strcmp(got, "acme.com=2|beta.co.th=2|(none)=1") == 0,
+                    "AB2: email domains lowercased, missing emails counted as (none)");
+        got[0] = '\0';
+        reportTop(r, REPORT_PREFIX, 0, report_collect, got);
+        TEST_ASSERT(strcmp(got, "+66 89=2|(none)=1|+1=1|+66 81=1") == 0,
+                    "AB3: phones by country code, plus operator block for the default country");
+
+        char out[300], line[256] = "";
+        snprintf(out, sizeof(out), "%s.report.json", getContactsFile());
+        FILE *jf = reportExport(r, 1, out) ? fopen(out, "r") : NULL;
+        if (jf) { if (!fgets(line, sizeof(line), jf)) line[0] = '\0'; fclose(jf); }
+        int json_ok = strncmp(line, "{\"rows\":5,", 10) == 0;
+        remove(out);
+        snprintf(out, sizeof(out), "%s.report.csv", getContactsFile());
+        TEST_ASSERT(json_ok && reportExport(r, 1, out) && countContactsTest(out) == 4,
+                    "AB4: top-N export as JSON or CSV (header + one row per dimension)");
+        remove(out);
+        reportFree(r);
+
+        init = fopen(getContactsFile(), "w");      // big enough to be split across workers
+        for (int i = 0; init && i < 40000; i++)
+            fprintf(init, "Company %d,Person %d,08%d-000-%04d,p%d@d%d.example.com\n", i % 7, i, i % 3, i % 10000, i, i % 5);
+        if (init) fclose(init);
+        setScanThreads(4);                          // split even on a one-CPU machine
+        r = reportBuild(getContactsFile());
+        setScanThreads(0);
+        got[0] = '\0';
+        reportTop(r, REPORT_PREFIX, 0, report_collect, got);
+        TEST_ASSERT(r && reportRows(r) == 40000 && reportParts(r) == 4 && reportGroups(r, REPORT_COMPANY) == 7 &&
+                    reportGroups(r, REPORT_DOMAIN) == 5 && strcmp(got, "+66 80=13334|+66 81=13333|+66 82=13333") == 0,
+                    "AB5: per-worker tables merge to the same totals on a split book");
+        reportFree(r);
+    }
+
+    // -----------------------------
+    // Group AC: As-you-type search
+    // -----------------------------
+    printf("\nGroup AC: As-you-type search\n");
+    {
+        FILE *init = fopen(getContactsFile(), "w");
+        if (init) {
+            fprintf(init, "Alpha Co,Ann,081-111-1111,ann@alpha.com\n"
+                          "\"Alpha, Inc.\",Bob,+66 89 222 2222,bob@alpha.co.th\n"
+                          "Beta,Alan,02-333-4444,alan@beta.com\n"
+                          "Alps Travel,Cid,0812223333,cid@alps.io\n"
+                          ",,,\n"
+                          "Gamma,Dee,,dee@gamma.com\n");
+            fclose(init);
+        }
+        char got[512] = "";
+        TypeAhead *ta = typeAheadOpen(getContactsFile());
+        long n1 = ta ? typeAheadSet(ta, "a") : -1, n2 = ta ? typeAheadSet(ta, "Al") : -1;
+        long n3 = ta ? typeAheadSet(ta, "alp") : -1;
+        if (ta) typeAheadResults(ta, 0, page_collect, got);
+        TEST_ASSERT(ta && typeAheadRows(ta) == 5 && n1 == 4 && n2 == 4 && n3 == 3 && strcmp(got, "Ann|Bob|Cid") == 0 &&
+                    typeAheadCounter(ta, "scans") == 1 && typeAheadCounter(ta, "narrowed") == 2,
+                    "AC1: each added character narrows the previous result, in book order");
+
+        unsigned long long tested = ta ? typeAheadCounter(ta, "tested") : 0;
+        long b1 = ta ? typeAheadSet(ta, "al") : -1, b2 = ta ? typeAheadSet(ta, "a") : -1;
+        TEST_ASSERT(ta && b1 == 4 && b2 == 4 && typeAheadCounter(ta, "cached") == 2 &&
+                    typeAheadCounter(ta, "tested") == tested, "AC2: backspace returns a cached set without testing rows");
+
+        long p1 = ta ? typeAheadSet(ta, "081") : -1, p2 = ta ? typeAheadSet(ta, "0812") : -1;
+        long p3 = ta ? typeAheadSet(ta, "+6681") : -1, p4 = ta ? typeAheadSet(ta, "al") : -1;
+        unsigned long long narrowed = ta ? typeAheadCounter(ta, "narrowed") : 0;
+        long p5 = ta ? typeAheadSet(ta, "al1") : -1, p6 = ta ? typeAheadSet(ta, "al") : -1;
+        TEST_ASSERT(p1 == 2 && p2 == 1 && p3 == 2 && p4 == 4 && p5 == 2 && p6 == 4 && ta &&
+                    typeAheadCounter(ta, "narrowed") == narrowed && typeAheadCounter(ta, "cached") == 3,
+                    "AC3: phone keys match digits and E.164; a key of another kind is not narrowed from");
+
+        got[0] = '\0';
+        long e1 = ta ? typeAheadSet(ta, "alan@B") : -1;
+        if (ta) typeAheadResults(ta, 0, page_collect, got);
+        long q1 = ta ? typeAheadSet(ta, "alpha,") : -1, q2 = ta ? typeAheadSet(ta, "") : -1;
+        TEST_ASSERT(e1 == 1 && strcmp(got, "Alan") == 0 && q1 == 1 && q2 == 0 && ta &&
+                    typeAheadResults(ta, 0, page_collect, got) == 0,
+                    "AC4: email keys are prefixes of the email; quoted fields match unescaped");
+        typeAheadClose(ta);
+
+        init = fopen(getContactsFile(), "w");      // big enough to be split across workers
+        for (int i = 0; init && i < 70000; i++)
+            fprintf(init, "%sCompany %d%s,Person %d,08%d-000-%04d,p%d@d%d.example.com\n", i % 9 ? "" : "\"",
+                    i % 97, i % 9 ? "" : "\"", i, i % 3, i % 10000, i, i % 5);
+        if (init) fclose(init);
+        setScanThreads(4);                          // split even on a one-CPU machine
+        TypeAhead *inc = typeAheadOpen(getContactsFile()), *fresh = typeAheadOpen(getContactsFile());
+        static const char *const typed[] = { "company 12", "0812", "+66 80", "p1@d2", "person 6999" };
+        int same = inc && fresh;
+        for (size_t t = 0; same && t < sizeof(typed) / sizeof(typed[0]); t++) {
+            char key[32];
+            size_t len = strlen(typed[t]);
+            for (size_t s = 1; same && s < 2 * len; s++) {       // type it, then delete it again
+                size_t k = s <= len ? s : 2 * len - s;
+                memcpy(key, typed[t], k);
+                key[k] = '\0';
+                typeAheadSet(fresh, "");
+                same = typeAheadSet(inc, key) == typeAheadSet(fresh, key);
+            }
+        }
+        setScanThreads(0);
+        TEST_ASSERT(same && typeAheadCounter(inc, "narrowed") > 0 && typeAheadCounter(inc, "cached") > 0 &&
+                    typeAheadCounter(inc, "split") > 0 && typeAheadCounter(fresh, "split") > 0,
+                    "AC5: narrowed and cached counts equal a search from scratch on a split book");
+        typeAheadClose(inc);
+        typeAheadClose(fresh);
+    }
+
+    // -----------------------------
+    // Group AD: io_uring book streams
+    // -----------------------------
+    printf("\nGroup AD: io_uring book streams\n");
+    {
+        FILE *init = fopen(getContactsFile(), "w");     // ~6.5 MB: past the io_uring threshold, short last read
+        for (int i = 0; init && i < 120000; i++)
+            fprintf(init, "%s %d,Person %d,081-%03d-%04d,p%d@d%d.example.com\n", i == 119999 ? "Last" : "Co", i % 211, i,
+                    i % 1000, i % 10000, i, i % 5);
+        if (init) fclose(init);
+        unsigned long long r0 = getBookIoCounter("uring_reads"), w0 = getBookIoCounter("uring_writes");
+        const char *cbk = "test_contacts.cbk", *back = "test_contacts.back.csv";
+        int same = cbkPack(getContactsFile(), cbk, 0) > 1 && cbkUnpack(cbk, back) == 120000 &&
+                   files_equal(getContactsFile(), back);
+        int uring = getBookIoCounter("uring_reads") > r0 && getBookIoCounter("uring_writes") > w0;
+        int stdio = getBookIoCounter("uring_reads") == r0 && getBookIoCounter("uring_writes") == w0;
+        TEST_ASSERT(same && (uring || stdio),      // stdio: no io_uring in this build or kernel
+                    "AD1: pack + unpack byte-identical through io_uring reads and writes (or stdio throughout)");
+        remove(cbk);
+        remove(back);
+
+        setScanThreads(4);                              // threaded pipeline even on a one-CPU machine
+        r0 = getBookIoCounter("uring_reads");
+        unsigned long long rows0 = getOpCounter("list", "rows_scanned"), hits0 = getOpCounter("list", "matches");
+        unsigned long long thr0 = getPipeCounter("threaded");
+        run_with_stdin_script("last\n", listContacts);
+        setScanThreads(0);
+        TEST_ASSERT(getOpCounter("list", "rows_scanned") == rows0 + 120000 && getOpCounter("list", "matches") == hits0 + 1 &&
+                    getPipeCounter("threaded") == thr0 + 1 && (!uring || getBookIoCounter("uring_reads") > r0),
+                    "AD2: list reads the whole book ahead on io_uring, big enough for the threaded pipeline");
+
+        char side[300];
+        snprintf(side, sizeof(side), "%s.bloom", getContactsFile());
+        setBookIo(BOOK_IO_URING);                       // catch-up seeks into the book
+        bloomMayContain(getContactsFile(), BLOOM_PHONE, "0810000000");
+        int saved = bloomPersist();
+        FILE *ext = fopen(getContactsFile(), "a");
+        if (ext) { fprintf(ext, "Late Co,Late,0829990099,late@d9.example.com\n"); fclose(ext); }
+        r0 = getBookIoCounter("uring_reads");
+        TEST_ASSERT(saved && bloomMayContain(getContactsFile(), BLOOM_PHONE, "0829990099") &&
+                    bloomMayContain(getContactsFile(), BLOOM_EMAIL, "late@d9.example.com") &&
+                    (!uring || getBookIoCounter("uring_reads") > r0),
+                    "AD3: filter catches up on appended rows read from an offset");
+        remove(side);
+
+        setBookIo(BOOK_IO_STDIO);
+        r0 = getBookIoCounter("uring_reads");
+        rows0 = getOpCounter("list", "rows_scanned");
+        run_with_stdin_script("last\n", listContacts);
+        setBookIo(BOOK_IO_AUTO);
+        TEST_ASSERT(getOpCounter("list", "rows_scanned") == rows0 + 120001 && getBookIoCounter("uring_reads") == r0,
+                    "AD4: CONTACTS_IO=stdio keeps every book on stdio");
+    }
+
     // cleanup
+    char side[300];
+    snprintf(side, sizeof(side), "%s.bloom", getContactsFile());
+    remove(side);
+    snprintf(side, sizeof(side), "%s.idx", getContactsFile());
+    remove(side);
     remove(getContactsFile());
     remove("test_contacts.csv");
     remove("test_contacts.tmp");
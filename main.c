@@ -1,8 +1,24 @@
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64              // 64-bit off_t for fseeko/lseek on 32-bit POSIX
+#endif
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE                       // fopencookie, for the io_uring book streams
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <errno.h>
 #include "test.h"
+#include "schema.h"
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
 
 
 #ifdef _WIN32
@@ -12,12 +28,36 @@
   #define DUP    _dup
   #define DUP2   _dup2
   #define FILENO _fileno
+  #define FSYNC  _commit
+  #define LSEEK  _lseeki64
+  #define FSEEK  _fseeki64                // stdio offsets past 2 GB (long is 32-bit here)
+  #define FTELL  _ftelli64
+  #include <fcntl.h>
+  #include <direct.h>
+  #define MKDIR(p) _mkdir(p)
+  #define RMDIR(p) _rmdir(p)
 #else
   #define DUP    dup
   #define DUP2   dup2
   #define FILENO fileno
+  #define FSYNC  fsync
+  #define LSEEK  lseek
+  #define FSEEK  fseeko
+  #define FTELL  ftello
+  #define O_BINARY 0
+  #define MKDIR(p) mkdir((p), 0755)
+  #define RMDIR(p) rmdir(p)
+  #include <fcntl.h>
   #include <termios.h>
   #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/syscall.h>
+  #if defined(__linux__) && defined(__NR_io_uring_setup) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+      #include <linux/io_uring.h>
+      #define BOOK_URING 1                // io_uring book streams (raw syscalls, no liburing)
+    #endif
+  #endif
   #define CLEAR_SCREEN "clear"
   static int getch(void) {
       struct termios oldt, newt;
@@ -32,15 +72,6 @@
   }
 #endif
 
-#define MAX_FIELD_LEN 100
-#define MAX_LINE_LEN  512
-
-struct Contact {
-    char company[MAX_FIELD_LEN];
-    char person [MAX_FIELD_LEN];
-    char phone  [MAX_FIELD_LEN];
-    char email  [MAX_FIELD_LEN];
-};
 
 static void trim_newline(char *s){
     if (!s) return;
@@ -97,6 +128,751 @@ static void makeTempPath(char *buf, size_t n) {
     snprintf(buf, n, "%s.tmp", getContactsFile());
 }
 
+// Put tmp in place of path. On POSIX rename() swaps them atomically, so a
+// reader sees the old file or the new one, never neither; Windows' rename()
+// refuses to replace, so there the old file has to go first.
+static int replaceFile(const char *tmp, const char *path) {
+#ifdef _WIN32
+    remove(path);
+#endif
+    return rename(tmp, path) == 0;
+}
+
+// monotonic clock in ns (winpthreads provides clock_gettime on MinGW)
+long long nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// ==== Tracing (Chrome trace_event JSON, opt-in via CONTACTS_TRACE=<file>) ====
+// Spans are complete events (begin + duration) pushed into a per-thread ring.
+// Only the owning thread writes its ring; the flusher reads up to the published
+// head and drops anything the writer may have lapped meanwhile, so neither side
+// takes a lock. When a ring wraps, the oldest spans are lost. A thread's ring
+// goes on a free list when it exits and the next new thread appends to it, so
+// rings are bounded by the threads tracing at once, not by threads ever made.
+#define TRACE_RING_SIZE   (1 << 16)
+#define TRACE_MAX_THREADS 256             // rings in use at the same time
+
+typedef struct { const char *name; long long ts, dur; } TraceEvent;
+typedef struct {
+    _Atomic unsigned long long head;      // total events ever written
+    int tid;
+    TraceEvent ev[TRACE_RING_SIZE];
+} TraceRing;
+
+static int g_trace_on;
+static long long g_trace_epoch;
+static pthread_mutex_t g_trace_mu = PTHREAD_MUTEX_INITIALIZER;   // registry only
+static TraceRing *g_trace_rings[TRACE_MAX_THREADS];
+static int g_trace_nrings;
+static TraceRing *g_trace_free[TRACE_MAX_THREADS];              // rings of exited threads
+static int g_trace_nfree;
+static pthread_key_t g_trace_key;
+static pthread_once_t g_trace_once = PTHREAD_ONCE_INIT;
+static _Thread_local TraceRing *t_ring;
+
+#define TRACE_BEGIN(t)      long long t = g_trace_on ? nowNs() : 0
+#define TRACE_END(t, name)  do { if (g_trace_on) traceSpan((name), (t)); } while (0)
+
+void setTraceEnabled(int on) {
+    if (on && !g_trace_epoch) g_trace_epoch = nowNs();
+    g_trace_on = on;
+}
+
+// key destructor: the exiting thread's spans stay in the ring until flushed or lapped
+static void traceRingRelease(void *p) {
+    pthread_mutex_lock(&g_trace_mu);
+    g_trace_free[g_trace_nfree++] = (TraceRing*)p;
+    pthread_mutex_unlock(&g_trace_mu);
+}
+
+static void traceKeyInit(void) { pthread_key_create(&g_trace_key, traceRingRelease); }
+
+static TraceRing* traceRing(void) {
+    if (t_ring) return t_ring;
+    pthread_once(&g_trace_once, traceKeyInit);
+    pthread_mutex_lock(&g_trace_mu);
+    TraceRing *r = g_trace_nfree ? g_trace_free[--g_trace_nfree] : NULL;
+    pthread_mutex_unlock(&g_trace_mu);
+    if (!r) {
+        r = (TraceRing*)calloc(1, sizeof(*r));
+        if (!r) return NULL;
+        pthread_mutex_lock(&g_trace_mu);
+        if (g_trace_nrings < TRACE_MAX_THREADS) { r->tid = g_trace_nrings + 1; g_trace_rings[g_trace_nrings++] = r; }
+        else { free(r); r = NULL; }
+        pthread_mutex_unlock(&g_trace_mu);
+        if (!r) return NULL;
+    }
+    pthread_setspecific(g_trace_key, r);
+    return t_ring = r;
+}
+
+// name must be a string literal (stored by pointer)
+static void traceSpan(const char *name, long long t0) {
+    TraceRing *r = traceRing();
+    if (!r) return;
+    unsigned long long h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    TraceEvent *e = &r->ev[h & (TRACE_RING_SIZE - 1)];
+    atomic_thread_fence(memory_order_release);   // head == h is visible before the slot is reused
+    e->name = name; e->ts = t0; e->dur = nowNs() - t0;
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+unsigned long long traceEventCount(void) {
+    unsigned long long n = 0;
+    pthread_mutex_lock(&g_trace_mu);
+    for (int i = 0; i < g_trace_nrings; i++) n += atomic_load(&g_trace_rings[i]->head);
+    pthread_mutex_unlock(&g_trace_mu);
+    return n;
+}
+
+int traceFlush(const char *path) {
+    char tmp[300];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) return 0;
+    setvbuf(fp, NULL, _IOFBF, 1 << 20);
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"contact_app\"}}");
+    pthread_mutex_lock(&g_trace_mu);
+    for (int i = 0; i < g_trace_nrings; i++) {
+        TraceRing *r = g_trace_rings[i];
+        unsigned long long end   = atomic_load_explicit(&r->head, memory_order_acquire);
+        unsigned long long begin = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+        for (unsigned long long k = begin; k < end; k++) {
+            TraceEvent e = r->ev[k & (TRACE_RING_SIZE - 1)];
+            // the writer may have lapped us while we copied: event k + TRACE_RING_SIZE
+            // goes into this slot while head is still k + TRACE_RING_SIZE, so that
+            // head already means the copy may be torn
+            atomic_thread_fence(memory_order_acquire);
+            unsigned long long now_head = atomic_load_explicit(&r->head, memory_order_relaxed);
+            if (k + TRACE_RING_SIZE <= now_head) continue;
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    e.name, r->tid, (e.ts - g_trace_epoch) / 1000.0, e.dur / 1000.0);
+        }
+    }
+    pthread_mutex_unlock(&g_trace_mu);
+    fprintf(fp, "\n]}\n");
+    if (fclose(fp) != 0) { remove(tmp); return 0; }
+    return replaceFile(tmp, path);
+}
+
+// ==== Book I/O: large sequential reads, batched writes, fsync before replace ====
+// stdio's default 4 KB buffer turns a big book into one read()/write() per few
+// rows. Use 1 MB buffers and let the kernel read ahead while we parse.
+//
+// On Linux the book streams can run on io_uring instead (raw io_uring_setup /
+// io_uring_enter, no liburing), wrapped with fopencookie so every fgets/fread/
+// fprintf caller is unchanged. A read stream keeps URING_DEPTH 1 MB reads in
+// flight ahead of the parser; a write stream submits each full 1 MB buffer as
+// it fills and, on close, the last buffer and an fsync as linked SQEs (the
+// fsync also drains every earlier write). Without io_uring (other systems, old
+// kernels, seccomp) the streams are plain stdio as above. CONTACTS_IO picks:
+// auto (default: writes, and reads of books of URING_MIN+), uring, stdio.
+#define BOOK_IO_BUF (1 << 20)
+
+enum { BOOK_IO_AUTO = 0, BOOK_IO_STDIO = 1, BOOK_IO_URING = 2 };
+static int g_book_io;                     // BOOK_IO_*
+static struct { _Atomic unsigned long long reads, writes, fallbacks; } g_bookio;
+
+#if defined(BOOK_URING)
+#define URING_DEPTH 4                     // 1 MB buffers in flight per stream
+#define URING_MIN   (4LL << 20)           // auto: smaller books are read through stdio
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned queued;                      // SQEs not yet passed to io_uring_enter
+} Uring;
+
+static void uringFree(Uring *r) {
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+    if (r->cq_map && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_len);
+    if (r->sq_map && r->sq_map != MAP_FAILED) munmap(r->sq_map, r->sq_len);
+    if (r->fd >= 0) close(r->fd);
+    r->fd = -1;
+}
+
+static int uringInit(Uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return 0;
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {     // older than 5.6: no IORING_OP_READ / WRITE
+        close(r->fd);
+        r->fd = -1;
+        errno = ENOSYS;
+        return 0;
+    }
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+    r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_map = single ? r->sq_map
+                       : mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                         r->fd, IORING_OFF_SQES);
+    if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED) { uringFree(r); return 0; }
+    char *sq = (char*)r->sq_map, *cq = (char*)r->cq_map;
+    r->sq_head  = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head  = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 1;
+}
+
+// Queue one read / write / fsync (op) of fd; data comes back with its completion.
+static void uringQueue(Uring *r, int op, int fd, void *buf, size_t len, long long off, unsigned flags,
+                       unsigned long long data) {
+    unsigned tail = *r->sq_tail, idx = tail & *r->sq_mask;   // we are the only producer
+    struct io_uring_sqe *e = &r->sqes[idx];
+    memset(e, 0, sizeof(*e));
+    e->opcode = (unsigned char)op;
+    e->flags = (unsigned char)flags;
+    e->fd = fd;
+    e->addr = (unsigned long long)(uintptr_t)buf;
+    e->len = (unsigned)len;
+    e->off = (unsigned long long)off;
+    e->user_data = data;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+}
+
+// Pass the queued SQEs to the kernel; with wait, block until a completion is ready.
+static int uringEnter(Uring *r, int wait) {
+    if (!wait && !r->queued) return 1;
+    for (;;) {
+        long n = syscall(__NR_io_uring_enter, r->fd, r->queued, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+                         NULL, 0);
+        if (n >= 0) { r->queued -= (unsigned)n < r->queued ? (unsigned)n : r->queued; return 1; }
+        if (errno != EINTR) return 0;
+    }
+}
+
+// Next completion, waiting for one if none is ready. 0 if the ring failed.
+static int uringReap(Uring *r, unsigned long long *data, int *res) {
+    for (;;) {
+        unsigned head = *r->cq_head;
+        if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe *c = &r->cqes[head & *r->cq_mask];
+            *data = c->user_data;
+            *res = c->res;
+            __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 1;
+        }
+        if (!uringEnter(r, 1)) return 0;
+    }
+}
+
+typedef struct { char *buf; long long off; size_t len, want; int busy; } UringSlot;
+
+typedef struct BookUring {
+    Uring r;
+    int fd, writing, err;
+    int syncing, synced;                  // write: the closing fsync is in flight / succeeded
+    long long size;                       // read: the book's size at open
+    long long next;                       // read: offset of the next chunk to queue; write: of the next buffer
+    long long pos;                        // read: offset of the next byte handed to stdio
+    UringSlot slot[URING_DEPTH];
+    int head;                             // slot holding pos (read) / being filled (write)
+    size_t used;                          // bytes of slot[head] handed out (read) / filled (write)
+    FILE *fp;
+    struct BookUring *link;               // open streams, for bookStreamSize
+} BookUring;
+
+static pthread_mutex_t g_uring_mu = PTHREAD_MUTEX_INITIALIZER;
+static BookUring *g_uring_open;
+static _Atomic int g_uring_broken;        // io_uring refused once: stay on stdio
+
+// One completion of u's ring into its slot (URING_DEPTH = the fsync). A short
+// read or write is finished here with pread / pwrite; a failure sets err.
+static int uringComplete(BookUring *u) {
+    unsigned long long data;
+    int res;
+    if (!uringReap(&u->r, &data, &res)) { u->err = 1; return 0; }
+    if (data >= URING_DEPTH) {            // the fsync; cancelled if the write linked before it fell short
+        u->syncing = 0;
+        u->synced = res == 0;
+        return 1;
+    }
+    UringSlot *s = &u->slot[data];
+    s->busy = 0;
+    size_t done = res > 0 ? (size_t)res : 0;
+    if (res < 0 && res != -EINTR && res != -EAGAIN) { u->err = 1; return 1; }
+    while (done < s->want) {
+        ssize_t n = u->writing ? pwrite(u->fd, s->buf + done, s->want - done, (off_t)(s->off + (long long)done))
+                               : pread(u->fd, s->buf + done, s->want - done, (off_t)(s->off + (long long)done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { u->err = 1; return 1; }
+        if (n == 0) break;                // read: the book shrank under us
+        done += (size_t)n;
+    }
+    s->len = done;
+    return 1;
+}
+
+static void uringQueueRead(BookUring *u, int i) {
+    UringSlot *s = &u->slot[i];
+    s->off = u->next;
+    s->len = 0;
+    s->want = u->next < u->size ? (size_t)(u->size - u->next < BOOK_IO_BUF ? u->size - u->next : BOOK_IO_BUF) : 0;
+    if (!s->want) return;
+    u->next += (long long)s->want;
+    s->busy = 1;
+    uringQueue(&u->r, IORING_OP_READ, u->fd, s->buf, s->want, s->off, 0, (unsigned long long)i);
+}
+
+// Wait out everything in flight (even after an error: the kernel still owns
+// those buffers). 0 if anything failed.
+static int uringDrain(BookUring *u) {
+    for (int i = 0; i < URING_DEPTH; i++) while (u->slot[i].busy) if (!uringComplete(u)) return 0;
+    while (u->syncing) if (!uringComplete(u)) return 0;
+    return !u->err;
+}
+
+// Restart the read-ahead at pos: every slot queued for the chunks from there on.
+static int uringRefill(BookUring *u) {
+    u->next = u->pos;
+    u->head = 0;
+    u->used = 0;
+    for (int i = 0; i < URING_DEPTH; i++) uringQueueRead(u, i);
+    return uringEnter(&u->r, 0);
+}
+
+static ssize_t uringRead(void *cookie, char *dst, size_t n) {
+    BookUring *u = (BookUring*)cookie;
+    size_t got = 0;
+    while (got < n && !u->err) {
+        UringSlot *s = &u->slot[u->head];
+        while (s->busy && !u->err) uringComplete(u);
+        if (u->err) break;
+        if (u->used == s->len) {
+            if (s->len < s->want || !s->want) break;          // end of the book
+            uringQueueRead(u, u->head);                       // slot consumed: queue the next chunk into it
+            if (!uringEnter(&u->r, 0)) { u->err = 1; break; }
+            u->head = (u->head + 1) % URING_DEPTH;
+            u->used = 0;
+            continue;
+        }
+        size_t c = s->len - u->used < n - got ? s->len - u->used : n - got;
+        memcpy(dst + got, s->buf + u->used, c);
+        u->used += c;
+        u->pos += (long long)c;
+        got += c;
+    }
+    return u->err && !got ? -1 : (ssize_t)got;
+}
+
+static int uringSeek(void *cookie, off64_t *off, int whence) {
+    BookUring *u = (BookUring*)cookie;
+    long long to = whence == SEEK_SET ? *off : whence == SEEK_CUR ? u->pos + *off : u->size + *off;
+    if (u->writing || to < 0) return -1;
+    if (to != u->pos) {                   // ftell asks with (0, SEEK_CUR): keep the read-ahead
+        if (!uringDrain(u)) return -1;
+        u->pos = to;
+        if (!uringRefill(u)) { u->err = 1; return -1; }
+    }
+    *off = to;
+    return 0;
+}
+
+// Queue slot[head]'s bytes as one write and move to the next free buffer.
+static int uringFlushSlot(BookUring *u, unsigned flags) {
+    UringSlot *s = &u->slot[u->head];
+    s->off = u->next;
+    s->want = u->used;
+    s->busy = 1;
+    u->next += (long long)u->used;
+    uringQueue(&u->r, IORING_OP_WRITE, u->fd, s->buf, s->want, s->off, flags, (unsigned long long)u->head);
+    u->head = (u->head + 1) % URING_DEPTH;
+    u->used = 0;
+    while (u->slot[u->head].busy && !u->err) uringComplete(u);
+    return !u->err;
+}
+
+static ssize_t uringWrite(void *cookie, const char *src, size_t n) {
+    BookUring *u = (BookUring*)cookie;
+    size_t put = 0;
+    while (put < n && !u->err) {
+        size_t c = BOOK_IO_BUF - u->used < n - put ? BOOK_IO_BUF - u->used : n - put;
+        memcpy(u->slot[u->head].buf + u->used, src + put, c);
+        u->used += c;
+        put += c;
+        if (u->used == BOOK_IO_BUF && (!uringFlushSlot(u, 0) || !uringEnter(&u->r, 0))) u->err = 1;
+    }
+    return u->err ? -1 : (ssize_t)n;
+}
+
+static int uringClose(void *cookie) {
+    BookUring *u = (BookUring*)cookie;
+    if (u->writing && !u->err) {
+        // last buffer, then an fsync that waits for it (link) and for every earlier write (drain)
+        if (!u->used || uringFlushSlot(u, IOSQE_IO_LINK)) {
+            uringQueue(&u->r, IORING_OP_FSYNC, u->fd, NULL, 0, 0, IOSQE_IO_DRAIN, URING_DEPTH);
+            u->syncing = 1;
+            if (!uringEnter(&u->r, 0)) u->err = 1;
+        }
+        uringDrain(u);
+        if (!u->err && !u->synced && FSYNC(u->fd) != 0) u->err = 1;   // a short last write cancelled it
+    } else {
+        uringDrain(u);
+    }
+    int ok = !u->err;
+    pthread_mutex_lock(&g_uring_mu);
+    for (BookUring **p = &g_uring_open; *p; p = &(*p)->link) if (*p == u) { *p = u->link; break; }
+    pthread_mutex_unlock(&g_uring_mu);
+    uringFree(&u->r);
+    if (close(u->fd) != 0) ok = 0;
+    for (int i = 0; i < URING_DEPTH; i++) free(u->slot[i].buf);
+    free(u);
+    return ok ? 0 : -1;
+}
+
+// The book at path as an io_uring stream, NULL to fall back to stdio.
+static FILE* uringOpen(const char *path, int writing) {
+    BookUring *u = (BookUring*)calloc(1, sizeof(*u));
+    if (!u) return NULL;
+    u->writing = writing;
+    u->fd = writing ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666) : open(path, O_RDONLY);
+    u->r.fd = -1;
+    struct stat sb;
+    int ok = u->fd >= 0 && (writing || fstat(u->fd, &sb) == 0);
+    if (ok && !writing) u->size = (long long)sb.st_size;
+    for (int i = 0; ok && i < URING_DEPTH; i++) ok = (u->slot[i].buf = (char*)malloc(BOOK_IO_BUF)) != NULL;
+    if (ok && !uringInit(&u->r, URING_DEPTH * 2)) {
+        ok = 0;
+        if (errno == ENOSYS || errno == EPERM || errno == EINVAL) g_uring_broken = 1;   // not just out of memory
+        atomic_fetch_add(&g_bookio.fallbacks, 1);
+    }
+    if (ok && !writing) ok = uringRefill(u);
+    static const cookie_io_functions_t k_uring_io = { uringRead, uringWrite, uringSeek, uringClose };
+    FILE *fp = ok ? fopencookie(u, writing ? "w" : "r", k_uring_io) : NULL;
+    if (!fp) {
+        if (u->r.fd >= 0) { uringDrain(u); uringFree(&u->r); }
+        if (u->fd >= 0) close(u->fd);
+        for (int i = 0; i < URING_DEPTH; i++) free(u->slot[i].buf);
+        free(u);
+        return NULL;
+    }
+    u->fp = fp;
+    pthread_mutex_lock(&g_uring_mu);
+    u->link = g_uring_open;
+    g_uring_open = u;
+    pthread_mutex_unlock(&g_uring_mu);
+    atomic_fetch_add(writing ? &g_bookio.writes : &g_bookio.reads, 1);
+    return fp;
+}
+
+// Whether to open path (of size, -1 for a write) on io_uring.
+static int uringWanted(long long size) {
+    if (g_book_io == BOOK_IO_STDIO || g_uring_broken) return 0;
+    return g_book_io == BOOK_IO_URING || size < 0 || size >= URING_MIN;
+}
+#endif
+
+// Size of the file behind a book stream (stdio or io_uring), -1 if unknown.
+static long long bookStreamSize(FILE *fp) {
+    struct stat sb;
+    int fd = FILENO(fp);
+    if (fd >= 0) return fstat(fd, &sb) == 0 ? (long long)sb.st_size : -1;
+    long long size = -1;
+#if defined(BOOK_URING)
+    pthread_mutex_lock(&g_uring_mu);
+    for (const BookUring *u = g_uring_open; u; u = u->link) if (u->fp == fp) { size = u->size; break; }
+    pthread_mutex_unlock(&g_uring_mu);
+#endif
+    return size;
+}
+
+void setBookIo(int mode) {
+    g_book_io = mode == BOOK_IO_STDIO || mode == BOOK_IO_URING ? mode : BOOK_IO_AUTO;
+}
+
+// counter by name: uring_reads, uring_writes (streams opened on io_uring), fallbacks
+unsigned long long getBookIoCounter(const char *name) {
+    if (strcmp(name, "uring_reads")  == 0) return atomic_load(&g_bookio.reads);
+    if (strcmp(name, "uring_writes") == 0) return atomic_load(&g_bookio.writes);
+    if (strcmp(name, "fallbacks")    == 0) return atomic_load(&g_bookio.fallbacks);
+    return 0;
+}
+
+void printBookIoStats(void) {
+    static const char *k_modes[] = { "auto", "stdio", "uring" };
+    printf("\n=== Book I/O (%s) ===\n", k_modes[g_book_io]);
+    printf("io_uring streams : %llu read, %llu written, %llu fell back to stdio\n",
+           getBookIoCounter("uring_reads"), getBookIoCounter("uring_writes"), getBookIoCounter("fallbacks"));
+}
+
+static FILE* bookOpenRead(const char *path) {
+    TRACE_BEGIN(t_open);
+    FILE *fp = NULL;
+#if defined(BOOK_URING)
+    struct stat sb;
+    if (g_book_io != BOOK_IO_STDIO && !g_uring_broken && stat(path, &sb) == 0 && uringWanted((long long)sb.st_size))
+        fp = uringOpen(path, 0);
+    if (fp) { TRACE_END(t_open, "open.read"); return fp; }
+#endif
+    fp = fopen(path, "r");
+    TRACE_END(t_open, "open.read");
+    if (!fp) return NULL;
+    setvbuf(fp, NULL, _IOFBF, BOOK_IO_BUF);
+#if defined(POSIX_FADV_SEQUENTIAL)
+    // sequential = bigger readahead window, willneed = start reads now (async)
+    posix_fadvise(FILENO(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(FILENO(fp), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    return fp;
+}
+
+static FILE* bookOpenWrite(const char *path, const char *mode) {
+    TRACE_BEGIN(t_open);
+    FILE *fp = NULL;
+#if defined(BOOK_URING)
+    if (mode[0] == 'w' && uringWanted(-1)) fp = uringOpen(path, 1);   // "w" / "wb" only: appends stay on stdio
+    if (fp) { TRACE_END(t_open, "open.write"); return fp; }
+#endif
+    fp = fopen(path, mode);
+    TRACE_END(t_open, "open.write");
+    if (!fp) return NULL;
+    setvbuf(fp, NULL, _IOFBF, BOOK_IO_BUF);
+    return fp;
+}
+
+// flush + fsync + close; the data must be on disk before the tmp file replaces the book
+// (an io_uring stream has no descriptor here: its close syncs behind the last write)
+static int bookSyncClose(FILE *fp) {
+    TRACE_BEGIN(t_sync);
+    int ok = (fflush(fp) == 0);
+    if (ok && FILENO(fp) >= 0 && FSYNC(FILENO(fp)) != 0) ok = 0;
+    if (fclose(fp) != 0) ok = 0;
+    TRACE_END(t_sync, "fsync+close");
+    return ok;
+}
+
+// ==== Hot-path counters ====
+// Every thread owns its counters (plain increments, no atomics on the hot path);
+// printOpStats() sums the running threads plus what exited threads left behind:
+// a thread's counters are folded into g_stats_retired and freed when it exits. Per-row phase timings
+// are sampled: one row in STATS_SAMPLE gets timestamps and its laps are scaled.
+// Whatever part of a scan is not attributed to parse/match/format/write is load
+// (fgets + the rest of the loop).
+enum { OP_ADD, OP_LIST, OP_SEARCH, OP_DELETE, OP_UPDATE, OP_SCAN, OP_COUNT };
+enum { PH_LOAD, PH_PARSE, PH_MATCH, PH_FORMAT, PH_WRITE, PH_COUNT };
+static const char *k_op_names[OP_COUNT]    = { "add", "list", "search", "delete", "update", "scan" };
+static const char *k_phase_names[PH_COUNT] = { "load", "parse", "match", "format", "write" };
+static const char *k_scan_spans[OP_COUNT]  = { "add.scan", "list.scan", "search.scan", "delete.scan", "update.scan", "scan.scan" };
+#define STATS_SAMPLE      8
+
+typedef struct {
+    unsigned long long calls, rows_scanned, bytes_read, bytes_written, matches, rewrites;
+    unsigned long long total_ns;
+    unsigned long long phase_ns[PH_COUNT];
+} OpCounters;
+
+typedef struct ThreadStats {
+    OpCounters op[OP_COUNT];
+    struct ThreadStats *prev, *next;   // live list, under g_stats_mu
+} ThreadStats;
+
+static pthread_mutex_t g_stats_mu = PTHREAD_MUTEX_INITIALIZER;
+static ThreadStats *g_stats_live;                  // threads still running
+static ThreadStats g_stats_retired;                // sum of the threads that exited
+static int g_stats_nthreads;                       // threads that ever counted anything
+static pthread_key_t g_stats_key;
+static pthread_once_t g_stats_once = PTHREAD_ONCE_INIT;
+static _Thread_local ThreadStats *t_stats;
+static _Thread_local ThreadStats t_stats_unlisted; // out of memory: counted, never reported
+
+static void statsAdd(ThreadStats *dst, const ThreadStats *src) {
+    for (int o = 0; o < OP_COUNT; o++) {
+        const OpCounters *a = &src->op[o];
+        OpCounters *b = &dst->op[o];
+        b->calls += a->calls;               b->rows_scanned += a->rows_scanned;
+        b->bytes_read += a->bytes_read;     b->bytes_written += a->bytes_written;
+        b->matches += a->matches;           b->rewrites += a->rewrites;
+        b->total_ns += a->total_ns;
+        for (int p = 0; p < PH_COUNT; p++) b->phase_ns[p] += a->phase_ns[p];
+    }
+}
+
+// key destructor: runs on the exiting thread once it can no longer count
+static void statsRetire(void *p) {
+    ThreadStats *ts = (ThreadStats*)p;
+    pthread_mutex_lock(&g_stats_mu);
+    statsAdd(&g_stats_retired, ts);
+    if (ts->prev) ts->prev->next = ts->next; else g_stats_live = ts->next;
+    if (ts->next) ts->next->prev = ts->prev;
+    pthread_mutex_unlock(&g_stats_mu);
+    free(ts);
+}
+
+static void statsKeyInit(void) { pthread_key_create(&g_stats_key, statsRetire); }
+
+static ThreadStats* threadStats(void) {
+    if (t_stats) return t_stats;
+    pthread_once(&g_stats_once, statsKeyInit);
+    ThreadStats *ts = (ThreadStats*)calloc(1, sizeof(*ts));
+    if (!ts) return t_stats = &t_stats_unlisted;
+    pthread_mutex_lock(&g_stats_mu);
+    ts->next = g_stats_live;
+    if (g_stats_live) g_stats_live->prev = ts;
+    g_stats_live = ts;
+    g_stats_nthreads++;
+    pthread_mutex_unlock(&g_stats_mu);
+    pthread_setspecific(g_stats_key, ts);
+    return t_stats = ts;
+}
+
+typedef struct {
+    OpCounters *c;
+    int       op;
+    const char *span;                // trace span name for the scan (default "<op>.scan")
+    long long scan_start, t_last;
+    long long scan_ns[PH_COUNT];     // sampled+scaled laps of the current scan
+    unsigned  row;
+    int       sampled;
+} OpTimer;
+
+static void opBegin(OpTimer *ot, int op) {
+    memset(ot, 0, sizeof(*ot));
+    ot->op = op;
+    ot->c = &threadStats()->op[op];
+    ot->c->calls++;
+}
+
+static void opScanBegin(OpTimer *ot) {
+    memset(ot->scan_ns, 0, sizeof(ot->scan_ns));
+    ot->row = 0;
+    ot->sampled = 0;
+    ot->scan_start = nowNs();
+}
+
+// call right after a line was read
+static void opRow(OpTimer *ot, const char *line) {
+    ot->c->rows_scanned++;
+    ot->c->bytes_read += strlen(line);
+    ot->sampled = (ot->row++ % STATS_SAMPLE) == 0;
+    if (ot->sampled) ot->t_last = nowNs();
+}
+
+static void opLap(OpTimer *ot, int phase) {
+    if (!ot->sampled) return;
+    long long now = nowNs();
+    ot->scan_ns[phase] += (now - ot->t_last) * STATS_SAMPLE;
+    ot->t_last = now;
+}
+
+static void opScanEnd(OpTimer *ot) {
+    long long window = nowNs() - ot->scan_start, attributed = 0;
+    for (int p = 0; p < PH_COUNT; p++) attributed += ot->scan_ns[p];
+    if (attributed > window) {          // sampling overshoot on tiny scans: scale back into the window
+        for (int p = 0; p < PH_COUNT; p++) ot->scan_ns[p] = ot->scan_ns[p] * window / attributed;
+        attributed = window;
+    }
+    ot->scan_ns[PH_LOAD] += window - attributed;
+    for (int p = 0; p < PH_COUNT; p++) ot->c->phase_ns[p] += (unsigned long long)ot->scan_ns[p];
+    ot->c->total_ns += (unsigned long long)window;
+    if (g_trace_on) traceSpan(ot->span ? ot->span : k_scan_spans[ot->op], ot->scan_start);   // the fgets/parse loop
+}
+
+// one-off (non-row) phase, e.g. fsync + rename at the end of a rewrite
+static void opTimed(OpTimer *ot, int phase, long long t0) {
+    long long ns = nowNs() - t0;
+    ot->c->phase_ns[phase] += (unsigned long long)ns;
+    ot->c->total_ns += (unsigned long long)ns;
+}
+
+static void aggregateOpStats(OpCounters out[OP_COUNT], int *nthreads) {
+    ThreadStats sum;
+    pthread_mutex_lock(&g_stats_mu);
+    sum = g_stats_retired;
+    for (const ThreadStats *ts = g_stats_live; ts; ts = ts->next) statsAdd(&sum, ts);
+    int n = g_stats_nthreads;
+    pthread_mutex_unlock(&g_stats_mu);
+    memcpy(out, sum.op, sizeof(OpCounters) * OP_COUNT);
+    if (nthreads) *nthreads = n;
+}
+
+// counter by name: calls, rows_scanned, bytes_read, bytes_written, matches, rewrites, total_ns
+unsigned long long getOpCounter(const char *op, const char *counter) {
+    OpCounters agg[OP_COUNT];
+    aggregateOpStats(agg, NULL);
+    for (int o = 0; o < OP_COUNT; o++) {
+        if (strcmp(op, k_op_names[o]) != 0) continue;
+        const OpCounters *c = &agg[o];
+        if (!strcmp(counter, "calls"))         return c->calls;
+        if (!strcmp(counter, "rows_scanned"))  return c->rows_scanned;
+        if (!strcmp(counter, "bytes_read"))    return c->bytes_read;
+        if (!strcmp(counter, "bytes_written")) return c->bytes_written;
+        if (!strcmp(counter, "matches"))       return c->matches;
+        if (!strcmp(counter, "rewrites"))      return c->rewrites;
+        if (!strcmp(counter, "total_ns"))      return c->total_ns;
+    }
+    return 0;
+}
+
+void printOpStats(void) {
+    OpCounters agg[OP_COUNT];
+    int nthreads = 0;
+    aggregateOpStats(agg, &nthreads);
+    printf("\n=== Operation Stats (%d thread(s)) ===\n", nthreads);
+    printf("%-7s %6s %10s %12s %12s %8s %8s", "op", "calls", "rows", "read(B)", "written(B)", "matches", "rewrite");
+    for (int p = 0; p < PH_COUNT; p++) printf(" %9s", k_phase_names[p]);
+    printf(" %9s\n", "total");
+    for (int o = 0; o < OP_COUNT; o++) {
+        const OpCounters *c = &agg[o];
+        if (!c->calls) continue;
+        printf("%-7s %6llu %10llu %12llu %12llu %8llu %8llu", k_op_names[o], c->calls, c->rows_scanned,
+               c->bytes_read, c->bytes_written, c->matches, c->rewrites);
+        for (int p = 0; p < PH_COUNT; p++) printf(" %7.2fms", c->phase_ns[p] / 1e6);
+        printf(" %7.2fms\n", c->total_ns / 1e6);
+    }
+}
+
+// Prometheus node_exporter textfile format; written to a tmp file and renamed in
+// place so the collector never sees a half-written file.
+int exportStatsProm(const char *path) {
+    static const char *counters[] = { "calls", "rows_scanned", "bytes_read", "bytes_written", "matches", "rewrites" };
+    char tmp[300];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) return 0;
+    OpCounters agg[OP_COUNT];
+    aggregateOpStats(agg, NULL);
+    for (size_t k = 0; k < sizeof(counters) / sizeof(counters[0]); k++) {
+        fprintf(fp, "# TYPE contacts_op_%s_total counter\n", counters[k]);
+        for (int o = 0; o < OP_COUNT; o++) {
+            const OpCounters *c = &agg[o];
+            unsigned long long v[] = { c->calls, c->rows_scanned, c->bytes_read, c->bytes_written, c->matches, c->rewrites };
+            fprintf(fp, "contacts_op_%s_total{op=\"%s\"} %llu\n", counters[k], k_op_names[o], v[k]);
+        }
+    }
+    fprintf(fp, "# TYPE contacts_op_phase_seconds_total counter\n");
+    for (int o = 0; o < OP_COUNT; o++)
+        for (int p = 0; p < PH_COUNT; p++)
+            fprintf(fp, "contacts_op_phase_seconds_total{op=\"%s\",phase=\"%s\"} %.9f\n",
+                    k_op_names[o], k_phase_names[p], agg[o].phase_ns[p] / 1e9);
+    fprintf(fp, "# TYPE contacts_op_seconds_total counter\n");
+    for (int o = 0; o < OP_COUNT; o++)
+        fprintf(fp, "contacts_op_seconds_total{op=\"%s\"} %.9f\n", k_op_names[o], agg[o].total_ns / 1e9);
+    if (fclose(fp) != 0) { remove(tmp); return 0; }
+    return replaceFile(tmp, path);
+}
+
 // ==== Declarations ====
 void addContact();
 void listContacts();
@@ -114,15 +890,232 @@ void unescapeCSV(char *str);
 int  validateEmail(const char *email);
 int  validatePhone(const char *phone);
 
+// append pipeline (group commit)
+enum { FSYNC_NONE = 0, FSYNC_INTERVAL = 1, FSYNC_ALWAYS = 2 };
+void setFsyncPolicy(int policy, int interval_ms);
+long long enqueueContactRow(const char *company, const char *person, const char *phone, const char *email);
+long long enqueueContactRowChecked(const char *company, const char *person, const char *phone, const char *email,
+                                   int *conflict);
+static void commitPendingRows(void (*fn)(const char *phone, const char *email));
+static int  commitIdle(void);
+int  commitAppends(long long upto_seq);
+int  appendContactRow(const char *company, const char *person, const char *phone, const char *email);
+unsigned long long getCommitCounter(const char *name);
+void printCommitStats(void);
+
+// hot-path counters
+unsigned long long getOpCounter(const char *op, const char *counter);
+void printOpStats(void);
+int  exportStatsProm(const char *path);
+
+// tracing
+void setTraceEnabled(int on);
+int  traceFlush(const char *path);
+unsigned long long traceEventCount(void);
+void showStats(void);
+static void statsProbeScan(void);
+
+// phone keys (E.164 number as a 64-bit integer; national numbers take the default country)
+void setPhoneCountry(int cc);
+long long phoneE164(const char *phone);
+void phoneKeyText(const char *phone, char *out, size_t cap);
+unsigned long long phoneKey(const char *phone);
+size_t phoneCanonPattern(const char *key, char *out, size_t cap);
+static unsigned long long bloomHash(const char *s);
+
+// bloom filters (phone / email existence)
+int  bloomMayContain(const char *filename, int which, const char *key);
+void bloomNoteFalsePositive(int which);
+void bloomNoteContact(const char *phone, const char *email);
+int  bloomPersist(void);
+void printBloomStats(void);
+
+// uniqueness on add
+enum { UNIQUE_PHONE = 1, UNIQUE_EMAIL = 2 };
+enum { DUP_WARN = 0, DUP_REJECT = 1, DUP_MERGE = 2 };
+void setUniquePolicy(int keys, int on_dup);
+int  uniqueWarmUp(void);
+int  uniquePersist(void);
+unsigned long long getUniqueCounter(const char *name);
+void printUniqueStats(void);
+
+// concurrent key map (lock-free, key hash -> row id; parallel index builds)
+typedef struct KeyMap KeyMap;
+KeyMap* keyMapCreate(size_t expect);
+void keyMapFree(KeyMap *m);
+int  keyMapPut(KeyMap *m, unsigned long long key, unsigned long long val, unsigned long long *old);
+int  keyMapGet(KeyMap *m, unsigned long long key, unsigned long long *val);
+void keyMapStats(KeyMap *m, size_t *count, size_t *cap, unsigned long long *resizes);
+void keyMapKeys(const char *phone, const char *email, unsigned long long key[2]);
+long keyMapBuildBook(const char *path, KeyMap *phone, KeyMap *email, int nthreads, long *dups);
+static long uidxScanBook(const char *path, long long size);
+
+// pipelined scan (read -> parse -> match -> format stages joined by SPSC rings)
+long scanPipeline(FILE *fp, int (*match)(const struct Contact *c, void *ctx), void *mctx,
+                  void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+                  void *ctx);
+static long pipeRun(FILE *fp, int (*match)(const struct Contact *c, void *ctx), void *mctx,
+                    void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                               void *ctx),
+                    void *ctx, OpTimer *ot);
+enum { PIPE_OFF = 0, PIPE_ON = 1, PIPE_AUTO = 2 };
+void setScanPipeline(int mode);
+unsigned long long getPipeCounter(const char *name);
+
+// book streams (io_uring read-ahead / batched writes on Linux, stdio elsewhere)
+void setBookIo(int mode);
+unsigned long long getBookIoCounter(const char *name);
+void printBookIoStats(void);
+
+// B+tree index on disk (company / email -> row offset, bounded buffer pool)
+enum { BTREE_COMPANY = 1, BTREE_EMAIL = 2 };
+long btreeFind(const char *book, int field, const char *lo, const char *hi, int exact,
+               void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+               void *ctx);
+int  btreeOffsets(const char *book, int field, const char *lo, const char *hi, int exact,
+                  unsigned long long **off, size_t *n, size_t *cap, size_t max);
+void setBtreeOptions(int fields, long long pool_bytes);
+static int btreeFields(void);
+void btreeClose(void);
+unsigned long long getBtreeCounter(const char *name);
+void printBtreeStats(void);
+static int btreeCommand(int argc, char **argv);
+
+// batch validation (bitmap of invalid rows)
+size_t validateColumns(const char *const *phones, const char *const *emails, size_t n, unsigned long long *invalid);
+static long validateBook(const char *path);
+
+// segmented storage (LSM store in a directory)
+void setLsmOptions(int memtable_rows, long long rate_bytes_per_s);
+int  lsmOpen(const char *dir);
+void lsmClose(void);
+int  lsmPut(const char *company, const char *person, const char *phone, const char *email);
+int  lsmDelete(const char *company, const char *person);
+int  lsmGet(const char *company, const char *person, char *phone, size_t np, char *email, size_t ne);
+long lsmScan(void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+             void *ctx);
+int  lsmFlush(void);
+int  lsmCompactNow(void);
+int  lsmSegmentCount(void);
+void lsmDestroy(const char *dir);
+unsigned long long getLsmCounter(const char *name);
+void printLsmStats(void);
+static int lsmCommand(int argc, char **argv);
+
+// block-compressed book (.cbk)
+size_t lzBound(size_t n);
+size_t lzCompress(const char *src, size_t n, char *dst, size_t cap);
+long lzDecompress(const char *src, size_t n, char *dst, size_t cap);
+long cbkPack(const char *csv, const char *out, int sort);
+long cbkUnpack(const char *path, const char *csv);
+long cbkScan(const char *path, int (*fn)(char *line, void *ctx), void *ctx);
+long cbkFind(const char *path, const char *company, int (*fn)(char *line, void *ctx), void *ctx);
+unsigned long long getCbkCounter(const char *name);
+static int cbkCommand(int argc, char **argv);
+
+// structured query (company:alpha* phone:081* OR domain:co.th)
+int  isStructuredQuery(const char *text);
+long queryBook(const char *path, const char *text,
+               void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+               void *ctx, char *plan, size_t plan_size);
+unsigned long long getQueryCounter(const char *name);
+void printQueryStats(void);
+static int queryCommand(int argc, char **argv);
+
+// ranked search (top K by match quality)
+long searchTopK(const char *path, const char *key, int k,
+                void (*fn)(int score, const char *company, const char *person, const char *phone, const char *email,
+                           void *ctx),
+                void *ctx, long *total, int *complete);
+void setSearchTopK(int k);
+static int searchCommand(int argc, char **argv);
+
+// workers for the parallel passes (0 = one per online CPU, the default)
+void setScanThreads(int n);
+
+// group-by reports (contacts per company / email domain / phone prefix, one parallel pass)
+enum { REPORT_COMPANY, REPORT_DOMAIN, REPORT_PREFIX, REPORT_DIMS };
+typedef struct Report Report;
+Report* reportBuild(const char *path);
+long    reportRows(const Report *r);
+int     reportParts(const Report *r);
+size_t  reportGroups(const Report *r, int dim);
+size_t  reportTop(const Report *r, int dim, size_t n, void (*fn)(const char *key, long long count, void *ctx),
+                  void *ctx);
+int     reportExport(const Report *r, size_t n, const char *path);
+void    reportFree(Report *r);
+static int reportCommand(int argc, char **argv);
+
+// as-you-type search (each key narrows the previous result set, backspace reuses a cached one)
+typedef struct TypeAhead TypeAhead;
+TypeAhead* typeAheadOpen(const char *path);
+long   typeAheadSet(TypeAhead *ta, const char *key);
+size_t typeAheadResults(const TypeAhead *ta, size_t n,
+                        void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                                   void *ctx),
+                        void *ctx);
+long   typeAheadRows(const TypeAhead *ta);
+unsigned long long typeAheadCounter(const TypeAhead *ta, const char *name);
+void   typeAheadClose(TypeAhead *ta);
+static long typeAheadRun(const char *path);
+static int  typeCommand(int argc, char **argv);
+
+long bookPage(const char *path, const char *query, const char *after, int limit,
+              void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+              void *ctx, char *next, size_t next_size);
+void setPageSize(int rows);
+static int  pageSize(void);
+static long pageThrough(const char *query,
+                        void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                                   void *ctx),
+                        void *ctx);
+static int pageCommand(int argc, char **argv);
+
+// row index (row id -> offset, length; deletes and updates edit one row in place)
+int  rowDelete(const char *path, long long off, const char *line);
+int  rowReplace(const char *path, long long off, const char *line, const char *repl);
+unsigned long long getRowCounter(const char *name);
+void printRowStats(void);
+int  bookRewriteRow(const char *path, long long off, const char *line, const char *repl);
+
+// sharded book (N CSV files in a directory, fan-out queries)
+int  shardOpen(const char *dir, int nshards);
+void shardClose(void);
+int  shardCount(void);
+void shardDestroy(const char *dir);
+int  shardAdd(const char *company, const char *person, const char *phone, const char *email);
+long shardImport(const char *csv);
+long shardExport(const char *csv);
+long shardQuery(const char *text,
+                void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+                void *ctx, char *plan, size_t plan_size);
+long shardFindPhone(const char *phone,
+                    void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                               void *ctx),
+                    void *ctx);
+long shardDelete(const char *text);
+long shardUpdate(const char *text, const char *field, const char *value);
+unsigned long long getShardCounter(const char *name);
+void printShardStats(void);
+static int shardCommand(int argc, char **argv);
+
 // small CSV parser for 4 fields handling quotes
-static void parseCsv4(const char *srcLine,
-                      char *f1, size_t n1,
-                      char *f2, size_t n2,
-                      char *f3, size_t n3,
-                      char *f4, size_t n4);
-
-// helpers for tests
-static void normalizePhone(const char *in, char *out, size_t out_size);
+void parseCsv4(const char *srcLine,
+               char *f1, size_t n1,
+               char *f2, size_t n2,
+               char *f3, size_t n3,
+               char *f4, size_t n4);
+
+// row codec generated from CONTACT_FIELDS
+int    contactParse(const char *line, struct Contact *c);
+void   contactFill(struct Contact *c, const char *company, const char *person, const char *phone, const char *email);
+size_t contactFormat(const struct Contact *c, char *out, size_t cap);
+int    contactCompare(const struct Contact *a, const struct Contact *b);
+static void contactPrintCard(const struct Contact *c);
+
+// helpers for tests / benchmarks
+void normalizePhone(const char *in, char *out, size_t out_size);
+void normalizeKey(char *s);
 // static int contactExistsByCompanyCI(const char *filename, const char *company);
 // static int contactExistsByPhoneNorm  (const char *filename, const char *phone_raw);
 // static int contactExistsByEmailCI    (const char *filename, const char *email_raw);
@@ -132,8 +1125,112 @@ static void normalizePhone(const char *in, char *out, size_t out_size);
 #define TEST_ASSERT(cond, name) do { if (cond){printf("  [PASS] %s\n", name); test_passed++;} else {printf("  [FAIL] %s\n", name); test_failed++;} } while(0)
 
 // ==== Main ====
-int main() {
+int main(int argc, char **argv) {
     int choice;
+    {   // CONTACTS_FSYNC = none | always | <ms>   (default: none, same as before)
+        const char *pol = getenv("CONTACTS_FSYNC");
+        if (pol && strcmp(pol, "always") == 0) setFsyncPolicy(FSYNC_ALWAYS, 0);
+        else if (pol && atoi(pol) > 0)         setFsyncPolicy(FSYNC_INTERVAL, atoi(pol));
+    }
+    {   // CONTACTS_UNIQUE = phone | email | phone,email   CONTACTS_ON_DUP = warn | reject (default) | merge
+        const char *u = getenv("CONTACTS_UNIQUE"), *d = getenv("CONTACTS_ON_DUP");
+        int keys = (u && strstr(u, "phone") ? UNIQUE_PHONE : 0) | (u && strstr(u, "email") ? UNIQUE_EMAIL : 0);
+        int on_dup = d && strcmp(d, "warn") == 0 ? DUP_WARN : d && strcmp(d, "merge") == 0 ? DUP_MERGE : DUP_REJECT;
+        if (keys) setUniquePolicy(keys, on_dup);
+    }
+    {   // CONTACTS_PHONE_COUNTRY = calling code national numbers (0XX..., no '+') belong to (default 66)
+        const char *cc = getenv("CONTACTS_PHONE_COUNTRY");
+        if (cc && *cc) setPhoneCountry(atoi(cc + (*cc == '+')));
+    }
+    {   // CONTACTS_LSM_RATE = compaction I/O budget of the segmented store in MB/s (0 = unlimited)
+        const char *r = getenv("CONTACTS_LSM_RATE");
+        if (r && *r) setLsmOptions(0, atoll(r) << 20);
+    }
+    {   // CONTACTS_SEARCH_TOP = K: plain search shows the K best-ranked matches (default: every match, file order)
+        const char *k = getenv("CONTACTS_SEARCH_TOP");
+        if (k && *k) setSearchTopK(atoi(k));
+    }
+    {   // CONTACTS_PAGE_SIZE = rows per page for list and query results in the menu (default: all at once)
+        const char *n = getenv("CONTACTS_PAGE_SIZE");
+        if (n && *n) setPageSize(atoi(n));
+    }
+    {   // CONTACTS_BTREE = company | email | company,email: structured queries on those fields read
+        // "<book>.<field>.bpt" pages instead of the whole book; CONTACTS_BTREE_POOL = its cache in MB (default 4)
+        const char *b = getenv("CONTACTS_BTREE"), *pool = getenv("CONTACTS_BTREE_POOL");
+        int fields = (b && strstr(b, "company") ? BTREE_COMPANY : 0) | (b && strstr(b, "email") ? BTREE_EMAIL : 0);
+        if (fields || (pool && *pool)) setBtreeOptions(fields, pool && *pool ? atoll(pool) << 20 : 0);
+    }
+    {   // CONTACTS_PIPELINE = on | off: list / search scan stages on their own threads
+        // (default: only for books of 1 MB+ on a multi-core machine)
+        const char *pl = getenv("CONTACTS_PIPELINE");
+        if (pl && strcmp(pl, "on") == 0)  setScanPipeline(PIPE_ON);
+        if (pl && strcmp(pl, "off") == 0) setScanPipeline(PIPE_OFF);
+    }
+    {   // CONTACTS_IO = auto | uring | stdio: how the book is streamed on Linux
+        // (default: io_uring for books of 4 MB+ and for rewrites, stdio otherwise)
+        const char *io = getenv("CONTACTS_IO");
+        if (io && strcmp(io, "uring") == 0) setBookIo(BOOK_IO_URING);
+        if (io && strcmp(io, "stdio") == 0) setBookIo(BOOK_IO_STDIO);
+    }
+
+    const char *prom_file  = getenv("CONTACTS_PROM_FILE");  // refreshed after every menu action
+    const char *trace_file = getenv("CONTACTS_TRACE");      // Chrome trace JSON, same refresh
+    if (trace_file && *trace_file) setTraceEnabled(1);
+
+    // non-interactive commands:
+    //   contact_app bench [rows] [json_path]
+    //   contact_app stats [prom_file]      (one timed scan of the book, then print/export counters)
+    //   contact_app validate [file]        (batch-check every phone/email, list the bad rows)
+    //   contact_app lsm <dir> <cmd> ...    (segmented store: import/export/get/del/compact/stats)
+    //   contact_app cbk <cmd> ...          (block-compressed book: pack/unpack/find/scan)
+    //   contact_app query "<expr>" [book]  (field:value terms with AND / OR, matches as CSV)
+    //   contact_app search <key> [k] [book] (k best-ranked matches as CSV, then the total)
+    //   contact_app report [--top n] [--out f.csv|f.json] [book]  (contacts per company / domain / phone prefix)
+    //   contact_app type [book]            (search as you type: each key narrows the last result)
+    //   contact_app page [--query q] [--after cursor] [--limit n] [book]  (one page as CSV, next cursor)
+    //   contact_app shard <dir> <cmd> ...  (sharded book: import/export/query/phone/del/set/stats)
+    //   contact_app btree <company|email> <cmd> ...  (B+tree index: build/stats/find/prefix/range)
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        return runBenchmarkSuite(argc >= 3 ? atol(argv[2]) : 0, argc >= 4 ? argv[3] : NULL) ? 0 : 1;
+    }
+    if (argc >= 2 && strcmp(argv[1], "validate") == 0) {
+        return validateBook(argc >= 3 ? argv[2] : getContactsFile()) == 0 ? 0 : 1;
+    }
+    if (argc >= 2 && strcmp(argv[1], "lsm") == 0) {
+        return lsmCommand(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "cbk") == 0) {
+        return cbkCommand(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "query") == 0) {
+        return queryCommand(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "search") == 0) {
+        return searchCommand(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "report") == 0) {
+        return reportCommand(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "type") == 0) {
+        return typeCommand(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "page") == 0) {
+        return pageCommand(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "shard") == 0) {
+        return shardCommand(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "btree") == 0) {
+        return btreeCommand(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "stats") == 0) {
+        statsProbeScan();
+        printOpStats();
+        printBloomStats();
+        if (trace_file && *trace_file) traceFlush(trace_file);
+        if (argc >= 3 && !exportStatsProm(argv[2])) { printf("[ERROR] Cannot write %s\n", argv[2]); return 1; }
+        return 0;
+    }
     while (1) {
         system(CLEAR_SCREEN);
         printf("===========================================\n");
@@ -146,6 +1243,8 @@ int main() {
         printf("5. Update Contact\n");
         printf("6. Run Unit Tests\n");
         printf("7. Run E2E Tests\n");
+        printf("8. Show Stats\n");
+        printf("9. Run Benchmarks\n");
         printf("0. Exit\n");
         printf("===========================================\n");
         printf("Enter your choice: ");
@@ -156,7 +1255,11 @@ int main() {
         }
 
         switch (choice) {
-            case 0: printf("\nThank you for using the system. Goodbye!\n"); exit(0);
+            case 0: commitAppends(-1);
+                    bloomPersist();
+                    uniquePersist();
+                    if (trace_file && *trace_file) traceFlush(trace_file);
+                    printf("\nThank you for using the system. Goodbye!\n"); exit(0);
             case 1: addContact();   break;
             case 2: listContacts(); break;
             case 3: deleteContact();break;
@@ -164,8 +1267,14 @@ int main() {
             case 5: updateContact();break;
             case 6: runUnitTests(); break;
             case 7: runE2ETests();  break;
+            case 8: showStats();    break;
+            case 9: runBenchmarks(); break;
             default: printf("\n[ERROR] Invalid choice! Please try again.\n");
         }
+        bloomPersist();
+        uniquePersist();
+        if (prom_file && *prom_file) exportStatsProm(prom_file);
+        if (trace_file && *trace_file) traceFlush(trace_file);
         printf("\nPress any key to continue...");
         getch();
     }
@@ -214,7 +1323,7 @@ static void toLowerInPlace(char *s) {
 }
 
 // Normalize for text keys: trim, lower, keep only [a-z0-9 ] and compress spaces
-static void normalizeKey(char *s) {
+void normalizeKey(char *s) {
     if (!s) return;
     trimWhitespace(s);
     toLowerInPlace(s);
@@ -228,13 +1337,38 @@ static void normalizeKey(char *s) {
     if (w > s && *(w-1) == ' ') --w;
     *w = '\0';
 }
+// Length of s, and whether it holds a byte that forces quoting (, " CR LF).
+// Stops early once such a byte is found; the length is only valid when not.
+// The vector loop only loads whole 16-byte blocks inside the string, so it
+// never reads past the NUL; the last partial block goes to the scalar tail.
+static size_t csvScanField(const char *s, int *special) {
+    size_t n = strlen(s), i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i sp = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(',')), _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))),
+                                  _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+        if (_mm_movemask_epi8(sp)) { *special = 1; return 0; }
+    }
+#endif
+    for (; i < n; i++)
+        if (s[i] == ',' || s[i] == '"' || s[i] == '\n' || s[i] == '\r') { *special = 1; return 0; }
+    *special = 0;
+    return n;
+}
+
 // Escape a CSV field (RFC4180-ish)
 void escapeCSV(const char *input, char *output, size_t output_size) {
     if (!input || !output || output_size == 0) return;
     size_t j = 0;
     int needs_quotes = 0;
-    for (size_t i = 0; input[i]; i++) {
-        if (input[i] == ',' || input[i] == '"' || input[i] == '\n' || input[i] == '\r') { needs_quotes = 1; break; }
+    size_t n = csvScanField(input, &needs_quotes);
+    if (!needs_quotes) {                  // nothing to escape: block copy, same cap as the loop below
+        if (output_size < 2) { output[0] = '\0'; return; }
+        if (n > output_size - 2) n = output_size - 2;
+        memcpy(output, input, n);
+        output[n] = '\0';
+        return;
     }
     if (needs_quotes && j < output_size - 1) output[j++] = '"';
     for (size_t i = 0; input[i] && j < output_size - 2; i++) {
@@ -300,7 +1434,7 @@ int validatePhone(const char *phone) {
 }
 
 // helper: digits-only normalization for phone matching
-static void normalizePhone(const char *in, char *out, size_t out_size) {
+void normalizePhone(const char *in, char *out, size_t out_size) {
     if (!in || !out || out_size == 0) return;
     size_t j = 0;
     for (size_t i = 0; in[i] && j + 1 < out_size; i++) {
@@ -310,11 +1444,11 @@ static void normalizePhone(const char *in, char *out, size_t out_size) {
 }
 
 // Parse CSV line into 4 fields with quotes support
-static void parseCsv4(const char *srcLine,
-                      char *f1, size_t n1,
-                      char *f2, size_t n2,
-                      char *f3, size_t n3,
-                      char *f4, size_t n4) {
+void parseCsv4(const char *srcLine,
+               char *f1, size_t n1,
+               char *f2, size_t n2,
+               char *f3, size_t n3,
+               char *f4, size_t n4) {
     f1[0]=f2[0]=f3[0]=f4[0]='\0';
     const char *src = srcLine;
     char *dsts[4] = { f1, f2, f3, f4 };
@@ -342,407 +1476,7575 @@ static void parseCsv4(const char *srcLine,
     unescapeCSV(f1); unescapeCSV(f2); unescapeCSV(f3); unescapeCSV(f4);
 }
 
-// ==== Add Contact ====
-void addContact() {
-    struct Contact c;
-    char temp[MAX_FIELD_LEN * 2];
-
-    printf("\n=== Add New Contact ===\n(Enter 0 at any field to cancel)\n\n");
+// ==== Phone keys (E.164 as a 64-bit integer) ====
+// Phones are stored as typed; everything that compares them (bloom filters,
+// uniqueness index, key maps, shard placement, delete, search, query) goes
+// through the E.164 number they denote, which fits a long long:
+// "+66 81 222 3333", "081-222-3333", "0066812223333" and "66812223333" are all
+// 66812223333. A number without '+' or 00 is national: its trunk 0 is dropped
+// and the default country (+66, CONTACTS_PHONE_COUNTRY) put in front, unless it
+// already starts with that code and is long enough to be international. A
+// "(0)" after the default code is dropped too. Only a phone with no digits
+// but zeros, or more than 15 of them, has no E.164 form; it keys on its digits.
+// Everything saved with phone keys in it (bloom filters, the .idx image, a
+// shard set's manifest) records the country it was built under.
+#define PHONE_E164_DIGITS 15
+
+static int  g_phone_cc = 66;
+static char g_phone_cc_text[8] = "66";
+
+void setPhoneCountry(int cc) {
+    if (cc < 1 || cc > 999) return;
+    g_phone_cc = cc;
+    snprintf(g_phone_cc_text, sizeof(g_phone_cc_text), "%d", cc);
+}
 
-    // Company
-    while (1) {
-        if (!read_line_prompt("Enter company name: ", temp, sizeof(temp))) {
-            printf("[CANCEL] Input canceled.\n"); return;
-        }
-        if (strcmp(temp, "0") == 0) { printf("[INFO] Add cancelled.\n"); return; }
-        sanitizeInput(temp);
-        if (!*temp) { printf("[ERROR] Company name cannot be empty!\n"); continue; }
-        if (strlen(temp) >= MAX_FIELD_LEN) { printf("[ERROR] Too long.\n"); continue; }
-        strncpy(c.company, temp, MAX_FIELD_LEN); c.company[MAX_FIELD_LEN-1] = '\0'; break;
+// 0 = no E.164 form (see above).
+long long phoneE164(const char *phone) {
+    char d[MAX_FIELD_LEN];
+    normalizePhone(phone ? phone : "", d, sizeof(d));
+    if (!d[strspn(d, "0")]) return 0;
+    const char *p = phone ? phone : "", *s = d, *cc = g_phone_cc_text;
+    while (*p && *p != '+' && !isdigit((unsigned char)*p)) p++;
+    size_t ccl = strlen(cc);
+    int intl = *p == '+';
+    if (!intl && s[0] == '0' && s[1] == '0') { s += 2; intl = 1; }
+    else if (!intl && strncmp(s, cc, ccl) == 0 && strlen(s) >= ccl + 8) intl = 1;
+    long long v = 0;
+    size_t len = 0;
+    if (!intl || strncmp(s, cc, ccl) == 0) {  // default country: code, then the number without trunk 0
+        v = g_phone_cc;
+        len = ccl;
+        if (intl) s += ccl;
+        while (*s == '0') s++;
     }
-
-    // Person
-    while (1) {
-        if (!read_line_prompt("Enter contact person: ", temp, sizeof(temp))) {
-            printf("[CANCEL] Input canceled.\n"); return;
-        }
-        if (strcmp(temp, "0") == 0) { printf("[INFO] Add cancelled.\n"); return; }
-        sanitizeInput(temp);
-        if (!*temp) { printf("[ERROR] Person name cannot be empty!\n"); continue; }
-        if (strlen(temp) >= MAX_FIELD_LEN) { printf("[ERROR] Too long.\n"); continue; }
-        strncpy(c.person, temp, MAX_FIELD_LEN); c.person[MAX_FIELD_LEN-1] = '\0'; break;
+    for (; *s; s++) {
+        if (++len > PHONE_E164_DIGITS) return 0;
+        v = v * 10 + (*s - '0');
     }
+    return v;
+}
 
-    // Phone
-    while (1) {
-        if (!read_line_prompt("Enter phone: ", temp, sizeof(temp))) {
-            printf("[CANCEL] Input canceled.\n"); return;
-        }
-        if (strcmp(temp, "0") == 0) { printf("[INFO] Add cancelled.\n"); return; }
-        sanitizeInput(temp);
-        if (!*temp) { printf("[ERROR] Phone cannot be empty!\n"); continue; }
-        if (!validatePhone(temp)) { printf("[ERROR] Invalid phone.\n"); continue; }
-        if (strlen(temp) >= MAX_FIELD_LEN) { printf("[ERROR] Too long.\n"); continue; }
-        strncpy(c.phone, temp, MAX_FIELD_LEN); c.phone[MAX_FIELD_LEN-1] = '\0'; break;
-    }
+// "+<E.164>", or the bare digits when there is none. Feeding the result back
+// in gives the same text, so a key can be canonicalized more than once.
+void phoneKeyText(const char *phone, char *out, size_t cap) {
+    long long v = phoneE164(phone);
+    if (v) snprintf(out, cap, "+%lld", v);
+    else   normalizePhone(phone ? phone : "", out, cap);
+}
 
-    // Email
-    while (1) {
-        if (!read_line_prompt("Enter email: ", temp, sizeof(temp))) {
-            printf("[CANCEL] Input canceled.\n"); return;
-        }
-        if (strcmp(temp, "0") == 0) { printf("[INFO] Add cancelled.\n"); return; }
-        sanitizeInput(temp);
-        if (!*temp) { printf("[ERROR] Email cannot be empty!\n"); continue; }
-        if (!validateEmail(temp)) { printf("[ERROR] Invalid email.\n"); continue; }
-        if (strlen(temp) >= MAX_FIELD_LEN) { printf("[ERROR] Too long.\n"); continue; }
-        strncpy(c.email, temp, MAX_FIELD_LEN); c.email[MAX_FIELD_LEN-1] = '\0'; break;
+// 64-bit fingerprint of the number (0 = no digits): the E.164 value mixed, so
+// the hash sets spread it like a string hash, else the digits hashed.
+unsigned long long phoneKey(const char *phone) {
+    unsigned long long h = (unsigned long long)phoneE164(phone);
+    if (!h) {
+        char d[MAX_FIELD_LEN];
+        normalizePhone(phone ? phone : "", d, sizeof(d));
+        return *d ? bloomHash(d) | 1 : 0;
     }
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+    return (h ^ (h >> 33)) | 1;
+}
 
-    // Summary
-    printf("\n--- Contact Summary ---\n");
-    printf("Company : %s\n", c.company);
-    printf("Contact : %s\n", c.person);
-    printf("Phone   : %s\n", c.phone);
-    printf("Email   : %s\n", c.email);
-    printf("----------------------\n");
-
-    if (!confirmAction("\nDo you want to save this contact?")) {
-        printf("[INFO] Contact not saved.\n");
-        return;
+// A search key or glob that starts like a number (0 trunk, 00 or '+') rewritten
+// to E.164 digits, '*' kept: "081-222*" -> "6681222*", "+1 212" -> "1212". It is
+// matched against a row's E.164 digits, so a national key finds the numbers
+// stored in international form and the other way round. "" (returns 0) when
+// the key has no such prefix; its plain digits already match both forms.
+size_t phoneCanonPattern(const char *key, char *out, size_t cap) {
+    char d[MAX_FIELD_LEN];
+    size_t n = 0;
+    *out = '\0';
+    while (*key == ' ' || *key == '(') key++;
+    for (const char *p = key; *p && n + 1 < sizeof(d); p++)
+        if (isdigit((unsigned char)*p) || *p == '*') d[n++] = *p;
+    d[n] = '\0';
+    const char *s = d, *cc = g_phone_cc_text;
+    size_t ccl = strlen(cc);
+    int intl = *key == '+';
+    if (!intl && s[0] == '0' && s[1] == '0') { s += 2; intl = 1; }
+    else if (!intl && s[0] != '0') return 0;
+    if (!*s || *s == '*') return 0;
+    if (!intl || (strncmp(s, cc, ccl) == 0 && s[ccl] == '0')) {
+        if (intl) s += ccl;
+        while (*s == '0') s++;
+        return (size_t)snprintf(out, cap, "%s%s", cc, s);
     }
+    return (size_t)snprintf(out, cap, "%s", s);
+}
 
-    // Save
-    FILE *fp = fopen(getContactsFile(), "a");
-    if (!fp) { printf("[ERROR] Cannot open file for writing!\n"); return; }
+// ==== Row codec (expanded from CONTACT_FIELDS) ====
+// parseCsv4 takes any four buffers and finds each field's end with strlen on
+// every byte. The routines below know the schema at compile time: one unrolled
+// step per column straight into struct Contact, each field copied a run at a
+// time. They read and write exactly what parseCsv4 / escapeCSV do.
+
+// One field from s into dst (cap bytes) by parseCsv4's rules: a quote toggles
+// quoting and is dropped, an unquoted comma ends the field, at most cap - 2
+// bytes are kept. Returns the start of the next field.
+static const char* csvTakeField(const char *s, char *dst, size_t cap) {
+    size_t n = 0;
+    int inq = 0;
+    for (;;) {
+        size_t k = strcspn(s, inq ? "\"" : ",\"");
+        size_t room = n + 2 < cap ? cap - 2 - n : 0;
+        memcpy(dst + n, s, k < room ? k : room);
+        n += k < room ? k : room;
+        s += k;
+        if (*s == '"') { inq = !inq; s++; continue; }
+        if (*s == ',') s++;
+        break;
+    }
+    dst[n] = '\0';
+    return s;
+}
 
-    char esc_company[MAX_FIELD_LEN * 2], esc_person [MAX_FIELD_LEN * 2];
-    char esc_phone  [MAX_FIELD_LEN * 2], esc_email  [MAX_FIELD_LEN * 2];
+// Returns 0 if every field came out empty (a blank or separator-only row).
+int contactParse(const char *line, struct Contact *c) {
+    const char *s = line;
+#define CONTACT_TAKE(name, ID, label) s = csvTakeField(s, c->name, sizeof(c->name));
+    CONTACT_FIELDS(CONTACT_TAKE)
+#undef CONTACT_TAKE
+#define CONTACT_SET(name, ID, label) || *c->name
+    return 0 CONTACT_FIELDS(CONTACT_SET);
+#undef CONTACT_SET
+}
 
-    escapeCSV(c.company, esc_company, sizeof(esc_company));
-    escapeCSV(c.person , esc_person , sizeof(esc_person ));
-    escapeCSV(c.phone  , esc_phone  , sizeof(esc_phone  ));
-    escapeCSV(c.email  , esc_email  , sizeof(esc_email  ));
+// Row from the four-string entry points; columns they don't name stay empty.
+void contactFill(struct Contact *c, const char *company, const char *person, const char *phone, const char *email) {
+    memset(c, 0, sizeof(*c));
+    snprintf(c->company, sizeof(c->company), "%s", company);
+    snprintf(c->person,  sizeof(c->person),  "%s", person);
+    snprintf(c->phone,   sizeof(c->phone),   "%s", phone);
+    snprintf(c->email,   sizeof(c->email),   "%s", email);
+}
 
-    fprintf(fp, "%s,%s,%s,%s\n", esc_company, esc_person, esc_phone, esc_email);
-    fclose(fp);
-    printf("\n[SUCCESS] Contact added successfully!\n");
+// Escaped, comma-separated row (no newline) into out; its length, 0 if cap is
+// below CONTACT_ROW_MAX. Each field is cut like escapeCSV into MAX_FIELD_LEN * 2.
+size_t contactFormat(const struct Contact *c, char *out, size_t cap) {
+    size_t n = 0;
+    if (cap < CONTACT_ROW_MAX) return 0;
+#define CONTACT_PUT(name, ID, label)                       \
+    if (CF_##ID) out[n++] = ',';                          \
+    escapeCSV(c->name, out + n, MAX_FIELD_LEN * 2);        \
+    n += strlen(out + n);
+    CONTACT_FIELDS(CONTACT_PUT)
+#undef CONTACT_PUT
+    return n;
 }
 
+// Fill the non-empty columns of from into into (a merge on duplicate).
+static void contactOverlay(struct Contact *into, const struct Contact *from) {
+#define CONTACT_OVER(name, ID, label) if (*from->name) strcpy(into->name, from->name);
+    CONTACT_FIELDS(CONTACT_OVER)
+#undef CONTACT_OVER
+}
 
-// ==== List ====
-void listContacts() {
-    char filter[MAX_FIELD_LEN];
-    printf("\n=== Contact List ===\n");
-    printf("Enter keyword to search company (or press Enter to show all, 0 to cancel): ");
-    if (!fgets(filter, sizeof(filter), stdin)) { printf("[ERROR] Failed to read input!\n"); return; }
-    filter[strcspn(filter, "\n")] = '\0';
-    trimWhitespace(filter);
-    if (strcmp(filter, "0") == 0) { printf("[INFO] List contacts cancelled.\n"); return; }
+// ASCII case-insensitive, column by column in schema order.
+static int fieldCmpCI(const char *a, const char *b) {
+    for (;; a++, b++) {
+        int x = tolower((unsigned char)*a), y = tolower((unsigned char)*b);
+        if (x != y || !x) return x - y;
+    }
+}
 
-    FILE *fp = fopen(getContactsFile(), "r");
-    if (!fp) { printf("[INFO] No contacts file found or cannot open.\n"); return; }
+int contactCompare(const struct Contact *a, const struct Contact *b) {
+    int r;
+#define CONTACT_CMP(name, ID, label) if ((r = fieldCmpCI(a->name, b->name)) != 0) return r;
+    CONTACT_FIELDS(CONTACT_CMP)
+#undef CONTACT_CMP
+    return 0;
+}
 
-    int use_filter = (int)(strlen(filter) > 0);
-    char filter_lower[MAX_FIELD_LEN] = "";
-    if (use_filter) {
-        strncpy(filter_lower, filter, MAX_FIELD_LEN - 1);
-        filter_lower[MAX_FIELD_LEN - 1] = '\0';
-        for (int i = 0; filter_lower[i]; i++) filter_lower[i] = (char)tolower((unsigned char)filter_lower[i]);
-    }
+static void contactPrintCard(const struct Contact *c) {
+#define CONTACT_SHOW(name, ID, label) printf("%-8s: %s\n", label, c->name);
+    CONTACT_FIELDS(CONTACT_SHOW)
+#undef CONTACT_SHOW
+}
 
-    char line[MAX_LINE_LEN];
-    int count = 0;
+// ==== Batch validation (whole phone / email columns at once) ====
+// Same verdicts as validatePhone / validateEmail, without the strchr/strrchr
+// passes: one pass per field collects the character classes it needs. With
+// SSE2 the pass runs 16 bytes at a time over the whole blocks inside the field
+// (never past the NUL) and the class table finishes the remainder; otherwise
+// the table does it all, byte by byte.
+
+// what the email rules need from one pass over the field
+typedef struct { long len, first_at, last_dot; int double_dot; } EmailShape;
+
+enum { CC_DIGIT = 1, CC_PHONE_SYM = 2, CC_AT = 4, CC_DOT = 8 };
+static const unsigned char k_char_class[256] = {
+    ['0'] = CC_DIGIT, ['1'] = CC_DIGIT, ['2'] = CC_DIGIT, ['3'] = CC_DIGIT, ['4'] = CC_DIGIT,
+    ['5'] = CC_DIGIT, ['6'] = CC_DIGIT, ['7'] = CC_DIGIT, ['8'] = CC_DIGIT, ['9'] = CC_DIGIT,
+    ['-'] = CC_PHONE_SYM, ['+'] = CC_PHONE_SYM, ['('] = CC_PHONE_SYM, [')'] = CC_PHONE_SYM,
+    [' '] = CC_PHONE_SYM, ['.'] = CC_PHONE_SYM | CC_DOT, ['@'] = CC_AT,
+};
+
+static int phoneValidBatch(const char *s) {
+    size_t n = strlen(s), i = 0;
+    int has_digit = 0;
+#if defined(__SSE2__)
+    const __m128i nine = _mm_set1_epi8(9);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+        unsigned digit = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(d, nine), d));
+        __m128i sym = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('-')), _mm_cmpeq_epi8(v, _mm_set1_epi8('+'))),
+                      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('(')), _mm_cmpeq_epi8(v, _mm_set1_epi8(')'))),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('.')))));
+        if ((digit | (unsigned)_mm_movemask_epi8(sym)) != 0xFFFFu) return 0;
+        if (digit) has_digit = 1;
+    }
+#endif
+    for (; i < n; i++) {
+        unsigned char c = k_char_class[(unsigned char)s[i]];
+        if (!(c & (CC_DIGIT | CC_PHONE_SYM))) return 0;
+        has_digit |= c & CC_DIGIT;
+    }
+    return has_digit != 0;
+}
+
+static EmailShape emailShape(const char *s) {
+    EmailShape e = { (long)strlen(s), -1, -1, 0 };
+    long i = 0;
+    int prev_dot = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= e.len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        unsigned at  = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('@')));
+        unsigned dot = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+        if (e.first_at < 0 && at) e.first_at = i + __builtin_ctz(at);
+        if (dot) {
+            e.last_dot = i + 31 - __builtin_clz(dot);
+            if ((dot & (dot >> 1)) || (prev_dot && (dot & 1))) e.double_dot = 1;
+        }
+        prev_dot = (dot >> 15) & 1;
+    }
+#endif
+    for (; i < e.len; i++) {
+        unsigned char c = k_char_class[(unsigned char)s[i]];
+        if ((c & CC_AT) && e.first_at < 0) e.first_at = i;
+        if (c & CC_DOT) { e.last_dot = i; if (prev_dot) e.double_dot = 1; }
+        prev_dot = (c & CC_DOT) != 0;
+    }
+    return e;
+}
+
+static int emailValidBatch(const char *s) {
+    EmailShape e = emailShape(s);
+    if (e.first_at <= 0) return 0;                    // no '@', or nothing before it
+    if (e.first_at + 1 >= e.len) return 0;            // empty domain
+    if (s[e.first_at + 1] == '.') return 0;           // domain starts with '.'
+    if (e.double_dot) return 0;
+    if (e.last_dot <= e.first_at) return 0;           // no '.' in the domain
+    return e.last_dot != e.len - 1;                   // must not end with '.'
+}
+
+// Bit i of invalid[] is set when row i fails the phone or the email check (a
+// NULL column is not checked). invalid needs (n + 63) / 64 words. Returns the
+// number of invalid rows.
+size_t validateColumns(const char *const *phones, const char *const *emails, size_t n, unsigned long long *invalid) {
+    size_t bad = 0;
+    for (size_t w = 0; w < (n + 63) / 64; w++) {
+        unsigned long long bits = 0;
+        size_t end = (w + 1) * 64 < n ? (w + 1) * 64 : n;
+        for (size_t i = w * 64; i < end; i++) {
+            int ok = (!phones || (phones[i] && *phones[i] && phoneValidBatch(phones[i]))) &&
+                     (!emails || (emails[i] && *emails[i] && emailValidBatch(emails[i])));
+            if (!ok) bits |= 1ULL << (i - w * 64);
+        }
+        invalid[w] = bits;
+        bad += (size_t)__builtin_popcountll(bits);
+    }
+    return bad;
+}
+
+// `contact_app validate [file]`: check every row's phone and email in batches.
+#define VALIDATE_BATCH 4096
+static long validateBook(const char *path) {
+    FILE *fp = bookOpenRead(path);
+    if (!fp) { printf("[ERROR] Cannot open %s\n", path); return -1; }
+    char (*ph)[MAX_FIELD_LEN] = malloc(sizeof(*ph) * VALIDATE_BATCH);
+    char (*em)[MAX_FIELD_LEN] = malloc(sizeof(*em) * VALIDATE_BATCH);
+    const char **pp = malloc(sizeof(*pp) * VALIDATE_BATCH), **ep = malloc(sizeof(*ep) * VALIDATE_BATCH);
+    long *lineno = malloc(sizeof(*lineno) * VALIDATE_BATCH);
+    if (!ph || !em || !pp || !ep || !lineno) {
+        free(ph); free(em); free(pp); free(ep); free(lineno); fclose(fp); return -1;
+    }
+    unsigned long long invalid[VALIDATE_BATCH / 64];
+    char line[MAX_LINE_LEN], f1[MAX_FIELD_LEN], f2[MAX_FIELD_LEN];
+    long ln = 0, rows = 0, bad = 0;
+    int eof = 0;
+    while (!eof) {
+        size_t n = 0;
+        while (n < VALIDATE_BATCH) {
+            if (!fgets(line, sizeof(line), fp)) { eof = 1; break; }
+            ln++;
+            line[strcspn(line, "\n\r")] = '\0';
+            if (!*line) continue;
+            parseCsv4(line, f1, sizeof(f1), f2, sizeof(f2), ph[n], sizeof(ph[n]), em[n], sizeof(em[n]));
+            pp[n] = ph[n]; ep[n] = em[n]; lineno[n] = ln;
+            n++;
+        }
+        rows += (long)n;
+        if (!validateColumns(pp, ep, n, invalid)) continue;
+        for (size_t i = 0; i < n; i++) {
+            if (!(invalid[i / 64] >> (i % 64) & 1)) continue;
+            printf("line %ld: phone '%s', email '%s'\n", lineno[i], ph[i], em[i]);
+            bad++;
+        }
+    }
+    fclose(fp);
+    free(ph); free(em); free(pp); free(ep); free(lineno);
+    printf("%ld row(s) checked, %ld invalid\n", rows, bad);
+    return bad;
+}
+
+// ==== Bulk CSV writer ====
+// Rewrites serialize rows straight into one large buffer and hand it to the
+// file in BOOK_IO_BUF chunks, instead of four escapeCSV calls into stack
+// buffers plus an fprintf per row. Fields that need no quoting (the common
+// case, found by csvScanField) are block-copied as they are.
+typedef struct {
+    FILE *fp;
+    char *buf; size_t len, cap;
+    unsigned long long bytes;             // everything handed to the writer
+    int   err;
+} CsvWriter;
+
+static int csvWriterOpen(CsvWriter *w, FILE *fp) {
+    w->fp = fp; w->len = 0; w->bytes = 0; w->err = 0;
+    w->cap = BOOK_IO_BUF;
+    w->buf = (char*)malloc(w->cap);
+    return w->buf != NULL;
+}
+
+static void csvWriterFlush(CsvWriter *w) {
+    if (w->len && fwrite(w->buf, 1, w->len, w->fp) != w->len) w->err = 1;
+    w->len = 0;
+}
+
+static void csvPutRaw(CsvWriter *w, const char *s, size_t n) {
+    if (!n) return;   // empty field: s may be a NULL column, nothing to copy
+    w->bytes += n;
+    if (w->len + n > w->cap) {
+        csvWriterFlush(w);
+        if (n > w->cap) { if (fwrite(s, 1, n, w->fp) != n) w->err = 1; return; }
+    }
+    memcpy(w->buf + w->len, s, n);
+    w->len += n;
+}
+
+static void csvPutField(CsvWriter *w, const char *s) {
+    int special;
+    size_t n = csvScanField(s, &special);
+    if (!special) { csvPutRaw(w, s, n); return; }
+    n = strlen(s);
+    if (w->len + 2 * n + 2 > w->cap) {
+        csvWriterFlush(w);
+        if (2 * n + 2 > w->cap) {         // absurdly long field: escape through a heap copy
+            char *tmp = (char*)malloc(2 * n + 3);
+            if (!tmp) { w->err = 1; return; }
+            escapeCSV(s, tmp, 2 * n + 3);
+            csvPutRaw(w, tmp, strlen(tmp));
+            free(tmp);
+            return;
+        }
+    }
+    char *d = w->buf + w->len;
+    *d++ = '"';
+    for (; *s; s++) { if (*s == '"') *d++ = '"'; *d++ = *s; }
+    *d++ = '"';
+    w->bytes += (unsigned long long)(d - (w->buf + w->len));
+    w->len = (size_t)(d - w->buf);
+}
+
+static void csvPutRow(CsvWriter *w, const struct Contact *c) {
+#define CONTACT_PUT(name, ID, label) csvPutField(w, c->name); csvPutRaw(w, CF_##ID + 1 < CONTACT_NFIELDS ? "," : "\n", 1);
+    CONTACT_FIELDS(CONTACT_PUT)
+#undef CONTACT_PUT
+}
+
+// an already-encoded row (kept verbatim by delete/merge passes)
+static void csvPutLine(CsvWriter *w, const char *line) {
+    csvPutRaw(w, line, strlen(line));
+    csvPutRaw(w, "\n", 1);
+}
+
+// Flush what is buffered and free the buffer; the FILE stays open.
+// Returns 0 if any write failed.
+static int csvWriterClose(CsvWriter *w) {
+    csvWriterFlush(w);
+    free(w->buf); w->buf = NULL;
+    return !w->err;
+}
+
+// ==== File stamps (cheap "has the book changed under us?" check) ====
+#ifdef _WIN32
+  #define STAMP_RACY_NS    2000000000LL   // FAT/NTFS mtime granularity is coarse
+#else
+  #define STAMP_RACY_NS    100000000LL
+#endif
+
+// size + mtime of the book, and when we looked at it. A stamp taken within the
+// mtime granularity of the last write can't tell a same-size rewrite in the same
+// tick apart (git's "racily clean" problem), so such stamps are re-verified.
+typedef struct { long long size, mtime_ns, taken_ns; } FileStamp;
+
+static int fileStamp(const char *path, FileStamp *st) {
+    struct stat sb;
+    if (stat(path, &sb) != 0) return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    st->size = (long long)sb.st_size;
+#if defined(__linux__)
+    st->mtime_ns = (long long)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+#else
+    st->mtime_ns = (long long)sb.st_mtime * 1000000000LL;
+#endif
+    st->taken_ns = (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+    return 1;
+}
+
+static int stampSame(const FileStamp *a, const FileStamp *b) {
+    return a->size == b->size && a->mtime_ns == b->mtime_ns;
+}
+
+static int stampTrusted(const FileStamp *have, const FileStamp *now) {
+    return stampSame(have, now) && have->taken_ns - have->mtime_ns >= STAMP_RACY_NS;
+}
+
+// We made the last change ourselves, so there is nothing to re-verify.
+static void stampOwnWrite(FileStamp *st) {
+    if (st->taken_ns - st->mtime_ns < STAMP_RACY_NS) st->taken_ns = st->mtime_ns + STAMP_RACY_NS;
+}
+
+// FNV-1a of the STAMP_TAIL bytes before `size`, 0 if they can't be read. Kept
+// next to a stamp, it tells "only appended to since" apart from "rewritten".
+#define STAMP_TAIL 4096
+static unsigned long long stampTailSum(const char *path, long long size) {
+    char buf[STAMP_TAIL];
+    long long from = size > STAMP_TAIL ? size - STAMP_TAIL : 0;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+    size_t n = 0;
+    if (FSEEK(fp, from, SEEK_SET) == 0) n = fread(buf, 1, (size_t)(size - from), fp);
+    fclose(fp);
+    if ((long long)n != size - from) return 0;
+    unsigned long long h = 1469598103934665603ULL;
+    for (size_t i = 0; i < n; i++) { h ^= (unsigned char)buf[i]; h *= 1099511628211ULL; }
+    return h | 1;
+}
+
+// Where to resume reading a book (stamped `now`) to bring something built from
+// it at (old, tail) up to date: old->size if it has only grown by appends (or
+// not changed at all), -1 if it was rewritten or can't be told apart from that.
+static long long stampAppendedFrom(const char *path, const FileStamp *old, unsigned long long tail, const FileStamp *now) {
+    if (!tail || now->size < old->size) return -1;
+    if (now->size == old->size && (now->mtime_ns != old->mtime_ns || !stampTrusted(old, now))) return -1;
+    return stampTailSum(path, old->size) == tail ? old->size : -1;
+}
+
+// Phone/email of every row from byte offset `from` on, fed to fn (index builds).
+// Returns the number of rows, -1 if the book can't be read.
+static long bookScanFrom(const char *path, long long from, void (*fn)(const char *phone, const char *email)) {
+    FILE *fp = bookOpenRead(path);
+    if (!fp) return -1;
+    if (from > 0 && FSEEK(fp, from, SEEK_SET) != 0) { fclose(fp); return -1; }
+    char line[MAX_LINE_LEN];
+    struct Contact c;
+    long rows = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n\r")] = '\0';
+        if (!*line) continue;
+        contactParse(line, &c);
+        fn(c.phone, c.email);
+        rows++;
+    }
+    fclose(fp);
+    return rows;
+}
+
+// Whole file as a private copy-on-write mapping (read into memory on Windows).
+static char* mapFile(const char *path, size_t *len) {
+#ifdef _WIN32
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    char *p = NULL;
+    long long n = FSEEK(fp, 0, SEEK_END) == 0 ? FTELL(fp) : -1;
+    if (n > 0 && FSEEK(fp, 0, SEEK_SET) == 0 && (p = (char*)malloc((size_t)n)) &&
+        fread(p, 1, (size_t)n, fp) != (size_t)n) { free(p); p = NULL; }
+    fclose(fp);
+    *len = p ? (size_t)n : 0;
+    return p;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat sb;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0)
+        p = mmap(NULL, (size_t)sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    *len = (size_t)sb.st_size;
+    return (char*)p;
+#endif
+}
+
+static void unmapFile(char *p, size_t len) {
+#ifdef _WIN32
+    (void)len; free(p);
+#else
+    if (p) munmap(p, len);
+#endif
+}
+
+// ==== Bloom filters (fast "definitely not in the book" for phone / email) ====
+// Blocked filters: all k probes of a key land in one 64-byte block, so a lookup
+// costs one cache line. Keys are the phone's E.164 text and the lowercased email.
+// The filters are persisted to "<book>.bloom" together with the book's size,
+// mtime and the default phone country; when those no longer match (someone
+// else wrote the book, or CONTACTS_PHONE_COUNTRY changed) the filter is rebuilt
+// with one scan, unless the book has only grown by appends: then just the new
+// rows are added. Deleted rows keep their bits until the next rebuild,
+// which only costs false positives.
+#define BLOOM_K            7
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_MIN_BLOCKS   64
+#define BLOOM_WORDS        8              // 8 x 64 bits = one 64-byte block
+enum { BLOOM_PHONE = 0, BLOOM_EMAIL = 1, BLOOM_COUNT };
+static const char *k_bloom_names[BLOOM_COUNT] = { "phone", "email" };
+
+typedef struct {
+    char magic[4];                        // "CBF4"
+    unsigned k, nblocks;
+    int cc;                               // g_phone_cc the phone keys were made under
+    FileStamp stamp;
+    unsigned long long tail;              // stampTailSum at stamp.size
+    unsigned long long keys[BLOOM_COUNT];
+} BloomFileHeader;
+
+static pthread_mutex_t g_bloom_mu = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    char path[256];                       // book the filters describe
+    int  loaded, dirty, writing;
+    int  cc;                              // phone country the filters were built under
+    FileStamp stamp;
+    unsigned nblocks;
+    unsigned long long *bits[BLOOM_COUNT];  // nblocks * BLOOM_WORDS each
+    unsigned long long keys[BLOOM_COUNT];
+    unsigned long long probes[BLOOM_COUNT], negatives[BLOOM_COUNT], false_pos[BLOOM_COUNT];
+    unsigned long long rebuilds, delta_rows;
+} g_bloom;
+
+static unsigned long long bloomHash(const char *s) {
+    unsigned long long h = 1469598103934665603ULL;            // FNV-1a + murmur finalizer
+    for (; *s; s++) { h ^= (unsigned char)*s; h *= 1099511628211ULL; }
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+// high 32 bits pick the block, k 9-bit slices of a remix pick bits inside it
+static unsigned long long* bloomBlock(unsigned long long *bits, unsigned nblocks, unsigned long long h) {
+    return bits + ((h >> 32) * nblocks >> 32) * BLOOM_WORDS;
+}
+
+static void bloomSet(unsigned long long *bits, unsigned nblocks, unsigned long long h) {
+    unsigned long long *blk = bloomBlock(bits, nblocks, h);
+    unsigned long long g = h * 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < BLOOM_K; i++) {
+        unsigned b = (unsigned)(g >> (i * 9)) & 511;
+        blk[b >> 6] |= 1ULL << (b & 63);
+    }
+}
+
+static int bloomTest(const unsigned long long *bits, unsigned nblocks, unsigned long long h) {
+    const unsigned long long *blk = bloomBlock((unsigned long long*)bits, nblocks, h);
+    unsigned long long g = h * 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < BLOOM_K; i++) {
+        unsigned b = (unsigned)(g >> (i * 9)) & 511;
+        if (!(blk[b >> 6] & (1ULL << (b & 63)))) return 0;
+    }
+    return 1;
+}
+
+static void bloomKeys(const char *phone, const char *email, char *pk, char *ek) {
+    phoneKeyText(phone, pk, MAX_FIELD_LEN);
+    size_t i = 0;
+    for (; email && email[i] && i < MAX_FIELD_LEN - 1; i++) ek[i] = (char)tolower((unsigned char)email[i]);
+    ek[i] = '\0';
+}
+
+static void bloomAddLocked(const char *phone, const char *email) {
+    char pk[MAX_FIELD_LEN], ek[MAX_FIELD_LEN];
+    bloomKeys(phone, email, pk, ek);
+    const char *key[BLOOM_COUNT] = { pk, ek };
+    for (int f = 0; f < BLOOM_COUNT; f++) {
+        if (!*key[f]) continue;
+        bloomSet(g_bloom.bits[f], g_bloom.nblocks, bloomHash(key[f]));
+        g_bloom.keys[f]++;
+    }
+    g_bloom.dirty = 1;
+    // twice the sized key count: FP rate has grown well past target, resize on next probe
+    unsigned long long cap = (unsigned long long)g_bloom.nblocks * 512 / BLOOM_BITS_PER_KEY;
+    if (g_bloom.keys[BLOOM_PHONE] > 2 * cap || g_bloom.keys[BLOOM_EMAIL] > 2 * cap) g_bloom.loaded = 0;
+}
+
+static int bloomAlloc(unsigned nblocks) {
+    for (int f = 0; f < BLOOM_COUNT; f++) {
+        free(g_bloom.bits[f]);
+        g_bloom.bits[f] = (unsigned long long*)calloc((size_t)nblocks * BLOOM_WORDS, sizeof(unsigned long long));
+        g_bloom.keys[f] = 0;
+    }
+    g_bloom.nblocks = nblocks;
+    return g_bloom.bits[BLOOM_PHONE] && g_bloom.bits[BLOOM_EMAIL];
+}
+
+static int bloomRebuildLocked(const char *path, const FileStamp *st) {
+    g_bloom.loaded = 0;
+    // rows are rarely shorter than 32 bytes, so size/32 over-estimates the key count
+    unsigned long long est = (unsigned long long)st->size / 32 + 1;
+    unsigned long long nb = est * BLOOM_BITS_PER_KEY / 512 + 1;
+    if (nb < BLOOM_MIN_BLOCKS) nb = BLOOM_MIN_BLOCKS;
+    if (nb > 0x7fffffffULL) nb = 0x7fffffffULL;
+    if (!bloomAlloc((unsigned)nb)) return 0;
+
+    TRACE_BEGIN(t_build);
+    long rows = bookScanFrom(path, 0, bloomAddLocked);
+    TRACE_END(t_build, "bloom.rebuild");
+    if (rows < 0) return 0;
+    strncpy(g_bloom.path, path, sizeof(g_bloom.path) - 1);
+    g_bloom.path[sizeof(g_bloom.path) - 1] = '\0';
+    g_bloom.stamp  = *st;                 // taken before the scan: a concurrent append shows up as stale
+    g_bloom.cc     = g_phone_cc;
+    g_bloom.loaded = 1;
+    g_bloom.dirty  = 1;
+    g_bloom.rebuilds++;
+    return 1;
+}
+
+static int bloomLoadLocked(const char *path, const FileStamp *st) {
+    char side[300];
+    snprintf(side, sizeof(side), "%s.bloom", path);
+    FILE *fp = fopen(side, "rb");
+    if (!fp) return 0;
+    BloomFileHeader h;
+    long long from = -1;
+    int ok = fread(&h, sizeof(h), 1, fp) == 1 && memcmp(h.magic, "CBF4", 4) == 0 &&
+             h.k == BLOOM_K && h.nblocks >= BLOOM_MIN_BLOCKS && h.cc == g_phone_cc &&
+             (from = stampAppendedFrom(path, &h.stamp, h.tail, st)) >= 0;
+    if (ok) ok = bloomAlloc(h.nblocks);
+    g_bloom.cc = g_phone_cc;
+    for (int f = 0; ok && f < BLOOM_COUNT; f++)
+        ok = fread(g_bloom.bits[f], sizeof(unsigned long long) * BLOOM_WORDS, h.nblocks, fp) == h.nblocks;
+    fclose(fp);
+    if (!ok) return 0;
+    for (int f = 0; f < BLOOM_COUNT; f++) g_bloom.keys[f] = h.keys[f];
+    g_bloom.dirty = 0;
+    if (from < st->size) {                // rows appended since the filter was saved
+        long rows = bookScanFrom(path, from, bloomAddLocked);
+        if (rows < 0) return 0;
+        g_bloom.delta_rows += (unsigned long long)rows;
+        g_bloom.dirty = 1;
+    }
+    strncpy(g_bloom.path, path, sizeof(g_bloom.path) - 1);
+    g_bloom.path[sizeof(g_bloom.path) - 1] = '\0';
+    g_bloom.stamp  = *st;
+    g_bloom.loaded = 1;
+    return 1;
+}
+
+// Make the in-memory filters describe `path` as it is now. 0 = no usable filter.
+static int bloomEnsureLocked(const char *path) {
+    if (g_bloom.writing) return 0;        // mid-write the file and filter disagree
+    FileStamp st;
+    if (!fileStamp(path, &st)) return 0;
+    if (g_bloom.loaded && strcmp(g_bloom.path, path) == 0 && g_bloom.cc == g_phone_cc &&
+        stampTrusted(&g_bloom.stamp, &st)) return 1;
+    if (bloomLoadLocked(path, &st)) return 1;
+    return bloomRebuildLocked(path, &st);
+}
+
+// 0 = key is definitely not in the book; 1 = maybe (or no filter available).
+// A phone key may be in any form of the number; an email must be lowercased.
+int bloomMayContain(const char *filename, int which, const char *key) {
+    if (which < 0 || which >= BLOOM_COUNT || !key || !*key) return 1;
+    char pk[MAX_FIELD_LEN];
+    if (which == BLOOM_PHONE) { phoneKeyText(key, pk, sizeof(pk)); key = pk; }
+    pthread_mutex_lock(&g_bloom_mu);
+    int r = 1;
+    if (bloomEnsureLocked(filename)) {
+        g_bloom.probes[which]++;
+        r = bloomTest(g_bloom.bits[which], g_bloom.nblocks, bloomHash(key));
+        if (!r) g_bloom.negatives[which]++;
+    }
+    pthread_mutex_unlock(&g_bloom_mu);
+    return r;
+}
+
+// caller got "maybe" from bloomMayContain and then found nothing in the book
+void bloomNoteFalsePositive(int which) {
+    if (which < 0 || which >= BLOOM_COUNT) return;
+    pthread_mutex_lock(&g_bloom_mu);
+    g_bloom.false_pos[which]++;
+    pthread_mutex_unlock(&g_bloom_mu);
+}
+
+// A row is about to be written to the current book. Setting bits early is safe:
+// the filter may only over-approximate.
+void bloomNoteContact(const char *phone, const char *email) {
+    pthread_mutex_lock(&g_bloom_mu);
+    if (g_bloom.loaded && strcmp(g_bloom.path, getContactsFile()) == 0) bloomAddLocked(phone, email);
+    pthread_mutex_unlock(&g_bloom_mu);
+}
+
+// Bracket every write we make to the current book. If the filter was in sync
+// before the write, it is re-stamped afterwards instead of being rebuilt.
+static int bloomWriteBegin(void) {
+    pthread_mutex_lock(&g_bloom_mu);
+    FileStamp st;
+    int fresh = g_bloom.loaded && strcmp(g_bloom.path, getContactsFile()) == 0 &&
+                fileStamp(g_bloom.path, &st) && stampSame(&st, &g_bloom.stamp);
+    g_bloom.writing++;
+    pthread_mutex_unlock(&g_bloom_mu);
+    return fresh;
+}
+
+static void bloomWriteEnd(int was_fresh) {
+    pthread_mutex_lock(&g_bloom_mu);
+    g_bloom.writing--;
+    if (g_bloom.loaded && strcmp(g_bloom.path, getContactsFile()) == 0) {
+        FileStamp st;
+        if (was_fresh && fileStamp(g_bloom.path, &st)) { stampOwnWrite(&st); g_bloom.stamp = st; g_bloom.dirty = 1; }
+        else g_bloom.loaded = 0;
+    }
+    pthread_mutex_unlock(&g_bloom_mu);
+}
+
+// Write the filters to "<book>.bloom" if they changed and still match the book.
+int bloomPersist(void) {
+    pthread_mutex_lock(&g_bloom_mu);
+    FileStamp st;
+    if (!g_bloom.loaded || !g_bloom.dirty || g_bloom.writing ||
+        !fileStamp(g_bloom.path, &st) || !stampSame(&st, &g_bloom.stamp)) {
+        pthread_mutex_unlock(&g_bloom_mu);
+        return 1;
+    }
+    char side[300], tmp[310];
+    snprintf(side, sizeof(side), "%s.bloom", g_bloom.path);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", side);
+    BloomFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "CBF4", 4);
+    h.k = BLOOM_K; h.nblocks = g_bloom.nblocks; h.cc = g_bloom.cc; h.stamp = g_bloom.stamp;
+    h.tail = stampTailSum(g_bloom.path, g_bloom.stamp.size);
+    for (int f = 0; f < BLOOM_COUNT; f++) h.keys[f] = g_bloom.keys[f];
+    FILE *fp = fopen(tmp, "wb");
+    int ok = fp != NULL;
+    if (ok) ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    for (int f = 0; ok && f < BLOOM_COUNT; f++)
+        ok = fwrite(g_bloom.bits[f], sizeof(unsigned long long) * BLOOM_WORDS, g_bloom.nblocks, fp) == g_bloom.nblocks;
+    if (fp && fclose(fp) != 0) ok = 0;
+    if (ok) ok = replaceFile(tmp, side);
+    if (!ok) remove(tmp);
+    else     g_bloom.dirty = 0;
+    pthread_mutex_unlock(&g_bloom_mu);
+    return ok;
+}
+
+// estimated FP rate = (fraction of bits set)^k; observed = FP / (FP + definite misses)
+void printBloomStats(void) {
+    pthread_mutex_lock(&g_bloom_mu);
+    printf("\n=== Bloom Filters ===\n");
+    if (!g_bloom.bits[BLOOM_PHONE]) { printf("(not built yet)\n"); pthread_mutex_unlock(&g_bloom_mu); return; }
+    printf("book         : %s%s\n", g_bloom.path, g_bloom.loaded ? "" : " (stale)");
+    printf("size         : %u blocks x 2 (%llu KB), k=%d, rebuilds=%llu, rows caught up=%llu\n", g_bloom.nblocks,
+           (unsigned long long)g_bloom.nblocks * 64 * 2 / 1024, BLOOM_K, g_bloom.rebuilds, g_bloom.delta_rows);
+    printf("%-6s %10s %10s %10s %10s %10s %10s\n", "filter", "keys", "probes", "neg", "false+", "est.fpr", "obs.fpr");
+    for (int f = 0; f < BLOOM_COUNT; f++) {
+        unsigned long long set = 0, total = (unsigned long long)g_bloom.nblocks * BLOOM_WORDS;
+        for (unsigned long long i = 0; i < total; i++) set += (unsigned long long)__builtin_popcountll(g_bloom.bits[f][i]);
+        double fill = (double)set / (double)(total * 64), est = 1.0;
+        for (int i = 0; i < BLOOM_K; i++) est *= fill;
+        unsigned long long absent = g_bloom.false_pos[f] + g_bloom.negatives[f];
+        printf("%-6s %10llu %10llu %10llu %10llu %9.4f%% %9.4f%%\n", k_bloom_names[f], g_bloom.keys[f],
+               g_bloom.probes[f], g_bloom.negatives[f], g_bloom.false_pos[f], est * 100.0,
+               absent ? 100.0 * (double)g_bloom.false_pos[f] / (double)absent : 0.0);
+    }
+    pthread_mutex_unlock(&g_bloom_mu);
+}
+
+// ==== Uniqueness on add (hash index over phone / email) ====
+// Off by default. When enabled, every queued row is checked against in-memory
+// open-addressing sets of 64-bit key fingerprints (phoneKey, so every form of
+// one number is one key; email lowercased). The sets are built with one
+// scan of the book and then kept current by the add path itself, so a bulk
+// insert stays O(1) amortized per row. Anything that rewrites the book (delete,
+// update, merge) drops the sets and the next add rebuilds them.
+//
+// The sets are also saved as "<book>.idx": a flat image (header + the two slot
+// arrays at fixed offsets, no pointers) that the next process maps directly
+// instead of scanning the book. It carries the book's size, mtime, a checksum
+// of its tail and the phone country the phone keys were made under; a book
+// that has since only grown costs a scan of the new rows, anything else (a
+// different country included) a full rebuild.
+#define UIDX_IMAGE_VERSION 3
+
+typedef struct {
+    char magic[4];                        // "CIX1"
+    unsigned version;
+    long long keys;                       // UNIQUE_* mask the sets were built for
+    long long cc;                         // g_phone_cc the phone keys were made under
+    FileStamp stamp;                      // book state the sets describe
+    unsigned long long tail;              // stampTailSum at stamp.size
+    unsigned long long cap[2], used[2];
+    unsigned long long off[2];            // slot arrays, bytes from the start of the image
+} UniqueImageHeader;
+enum { BOOK_APPEND = 0, BOOK_REWRITE = 1 };
+static const char *k_dup_names[] = { "warn", "reject", "merge" };
+
+static pthread_mutex_t g_uidx_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_uidx_cv = PTHREAD_COND_INITIALIZER;
+static struct {
+    int  keys, on_dup;                    // UNIQUE_* mask, DUP_*
+    char path[256];
+    int  loaded, writing, dirty;
+    int  cc;                              // phone country of the phone keys
+    FileStamp stamp;
+    unsigned long long tail;              // stampTailSum at stamp.size
+    unsigned long long *slot[2];          // [0] phone, [1] email; 0 = empty
+    size_t cap[2], used[2];
+    char  *map; size_t map_len;           // image the slots may still point into
+    unsigned long long checks, conflicts, rejected, merged, rebuilds, image_loads, delta_rows;
+} g_uidx;
+
+static int uidxInMap(const void *p) {
+    return g_uidx.map && (const char*)p >= g_uidx.map && (const char*)p < g_uidx.map + g_uidx.map_len;
+}
+
+static void uidxResetLocked(void) {
+    for (int f = 0; f < 2; f++) {
+        if (!uidxInMap(g_uidx.slot[f])) free(g_uidx.slot[f]);
+        g_uidx.slot[f] = NULL; g_uidx.cap[f] = g_uidx.used[f] = 0;
+    }
+    unmapFile(g_uidx.map, g_uidx.map_len);
+    g_uidx.map = NULL; g_uidx.map_len = 0;
+    g_uidx.cc = g_phone_cc;
+}
+
+static int uidxFind(int f, unsigned long long h) {
+    if (!g_uidx.cap[f]) return 0;
+    size_t mask = g_uidx.cap[f] - 1;
+    for (size_t i = (size_t)h & mask; g_uidx.slot[f][i]; i = (i + 1) & mask)
+        if (g_uidx.slot[f][i] == h) return 1;
+    return 0;
+}
+
+static void uidxInsert(int f, unsigned long long h) {
+    if ((g_uidx.used[f] + 1) * 10 > g_uidx.cap[f] * 7) {        // keep load <= 0.7
+        size_t ncap = g_uidx.cap[f] ? g_uidx.cap[f] * 2 : 1024;
+        unsigned long long *ns = (unsigned long long*)calloc(ncap, sizeof(*ns));
+        if (!ns) return;                  // stays correct, just misses this key
+        for (size_t i = 0; i < g_uidx.cap[f]; i++) {
+            unsigned long long v = g_uidx.slot[f][i];
+            if (!v) continue;
+            size_t j = (size_t)v & (ncap - 1);
+            while (ns[j]) j = (j + 1) & (ncap - 1);
+            ns[j] = v;
+        }
+        if (!uidxInMap(g_uidx.slot[f])) free(g_uidx.slot[f]);
+        g_uidx.slot[f] = ns; g_uidx.cap[f] = ncap;
+    }
+    size_t mask = g_uidx.cap[f] - 1, i = (size_t)h & mask;
+    while (g_uidx.slot[f][i]) { if (g_uidx.slot[f][i] == h) return; i = (i + 1) & mask; }
+    g_uidx.slot[f][i] = h;
+    g_uidx.used[f]++;
+    g_uidx.dirty = 1;
+}
+
+static void uidxHashes(const char *phone, const char *email, unsigned long long h[2]) {
+    unsigned long long k[2];
+    keyMapKeys(phone, email, k);
+    h[0] = (g_uidx.keys & UNIQUE_PHONE) ? k[0] : 0;
+    h[1] = (g_uidx.keys & UNIQUE_EMAIL) ? k[1] : 0;
+}
+
+static void uidxAdd(const char *phone, const char *email) {
+    unsigned long long h[2];
+    uidxHashes(phone, email, h);
+    for (int f = 0; f < 2; f++) if (h[f]) uidxInsert(f, h[f]);
+}
+
+static void uidxAdopt(const char *path, const FileStamp *st) {
+    strncpy(g_uidx.path, path, sizeof(g_uidx.path) - 1);
+    g_uidx.path[sizeof(g_uidx.path) - 1] = '\0';
+    g_uidx.stamp  = *st;
+    g_uidx.tail   = st->size >= 0 ? stampTailSum(path, st->size) : 0;
+    g_uidx.loaded = 1;
+}
+
+static int uidxRebuildLocked(const char *path) {
+    FileStamp st = { -1, -1, 0 };
+    int exists = fileStamp(path, &st);
+    uidxResetLocked();
+    if (exists) {
+        TRACE_BEGIN(t_build);
+        long rows = uidxScanBook(path, st.size);
+        TRACE_END(t_build, "unique.rebuild");
+        if (rows < 0) return 0;
+    }
+    commitPendingRows(uidxAdd);           // queued but not yet written
+    uidxAdopt(path, &st);
+    g_uidx.dirty = 1;
+    g_uidx.rebuilds++;
+    return 1;
+}
+
+// Catch the sets (built at g_uidx.stamp) up with rows appended since.
+static int uidxCatchUpLocked(const char *path, const FileStamp *st) {
+    long long from = stampAppendedFrom(path, &g_uidx.stamp, g_uidx.tail, st);
+    if (from < 0) return 0;
+    long rows = from < st->size ? bookScanFrom(path, from, uidxAdd) : 0;
+    if (rows < 0) return 0;
+    g_uidx.delta_rows += (unsigned long long)rows;
+    uidxAdopt(path, st);
+    return 1;
+}
+
+// Map "<book>.idx" if it was built for these keys and the book has at most
+// grown since. The slots are used in place (copy-on-write).
+static int uidxLoadImageLocked(const char *path) {
+    FileStamp st;
+    if (!fileStamp(path, &st)) return 0;
+    char side[300];
+    snprintf(side, sizeof(side), "%s.idx", path);
+    size_t len = 0;
+    char *map = mapFile(side, &len);
+    if (!map) return 0;
+    UniqueImageHeader h;
+    int ok = len >= sizeof(h);
+    if (ok) memcpy(&h, map, sizeof(h));
+    ok = ok && memcmp(h.magic, "CIX1", 4) == 0 && h.version == UIDX_IMAGE_VERSION && h.keys == g_uidx.keys &&
+         h.cc == g_phone_cc;
+    for (int f = 0; ok && f < 2; f++)
+        ok = (h.cap[f] & (h.cap[f] - 1)) == 0 && h.used[f] < h.cap[f] + (h.cap[f] == 0) && h.off[f] % 8 == 0 &&
+             h.off[f] <= len && h.cap[f] <= (len - h.off[f]) / 8;
+    if (!ok) { unmapFile(map, len); return 0; }
+
+    uidxResetLocked();
+    g_uidx.map = map; g_uidx.map_len = len;
+    for (int f = 0; f < 2; f++) {
+        g_uidx.slot[f] = h.cap[f] ? (unsigned long long*)(map + h.off[f]) : NULL;
+        g_uidx.cap[f]  = (size_t)h.cap[f];
+        g_uidx.used[f] = (size_t)h.used[f];
+    }
+    g_uidx.stamp = h.stamp;
+    g_uidx.tail  = h.tail;
+    if (!uidxCatchUpLocked(path, &st)) { uidxResetLocked(); return 0; }
+    commitPendingRows(uidxAdd);
+    g_uidx.dirty = g_uidx.dirty || !stampSame(&h.stamp, &st);
+    g_uidx.image_loads++;
+    return 1;
+}
+
+// Save the sets as "<book>.idx" when they changed and exactly describe the
+// book on disk (nothing queued, no write in flight).
+int uniquePersist(void) {
+    pthread_mutex_lock(&g_uidx_mu);
+    FileStamp st;
+    if (!g_uidx.keys || !g_uidx.loaded || !g_uidx.dirty || g_uidx.writing || !commitIdle() || !g_uidx.tail ||
+        !fileStamp(g_uidx.path, &st) || !stampSame(&st, &g_uidx.stamp)) {
+        pthread_mutex_unlock(&g_uidx_mu);
+        return 1;
+    }
+    char side[300], tmp[310];
+    snprintf(side, sizeof(side), "%s.idx", g_uidx.path);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", side);
+    UniqueImageHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "CIX1", 4);
+    h.version = UIDX_IMAGE_VERSION;
+    h.keys  = g_uidx.keys;
+    h.cc    = g_uidx.cc;
+    h.stamp = g_uidx.stamp;
+    h.tail  = g_uidx.tail;
+    unsigned long long off = sizeof(h);
+    for (int f = 0; f < 2; f++) {
+        h.cap[f] = g_uidx.cap[f]; h.used[f] = g_uidx.used[f];
+        h.off[f] = off;
+        off += h.cap[f] * 8;
+    }
+    FILE *fp = fopen(tmp, "wb");
+    int ok = fp && fwrite(&h, sizeof(h), 1, fp) == 1;
+    for (int f = 0; ok && f < 2; f++)
+        ok = !g_uidx.cap[f] || fwrite(g_uidx.slot[f], 8, g_uidx.cap[f], fp) == g_uidx.cap[f];   // empty set: slot is NULL
+    if (fp && fclose(fp) != 0) ok = 0;
+    if (ok) ok = replaceFile(tmp, side);
+    if (!ok) remove(tmp);
+    else     g_uidx.dirty = 0;
+    pthread_mutex_unlock(&g_uidx_mu);
+    return ok;
+}
+
+static int uidxEnsureLocked(const char *path) {
+    // our own write in flight: the sets already hold its rows, wait only if we have nothing
+    while (g_uidx.writing && !g_uidx.loaded) pthread_cond_wait(&g_uidx_cv, &g_uidx_mu);
+    if (g_uidx.loaded && strcmp(g_uidx.path, path) == 0 && (g_uidx.cc == g_phone_cc || g_uidx.writing)) {
+        if (g_uidx.writing) return 1;
+        // plain size+mtime here: re-verifying racy stamps would rescan on every add
+        // right after a rebuild, and a missed same-tick rewrite only lets one duplicate in
+        FileStamp st;
+        if (fileStamp(path, &st) ? stampSame(&g_uidx.stamp, &st) : g_uidx.stamp.size < 0) return 1;
+        if (g_uidx.stamp.size >= 0 && fileStamp(path, &st) && uidxCatchUpLocked(path, &st)) return 1;
+    }
+    return uidxLoadImageLocked(path) || uidxRebuildLocked(path);
+}
+
+// Build or load the sets for the current book now (instead of on the first add).
+int uniqueWarmUp(void) {
+    pthread_mutex_lock(&g_uidx_mu);
+    int ok = g_uidx.keys && uidxEnsureLocked(getContactsFile());
+    pthread_mutex_unlock(&g_uidx_mu);
+    return ok;
+}
+
+void setUniquePolicy(int keys, int on_dup) {
+    pthread_mutex_lock(&g_uidx_mu);
+    if (keys != g_uidx.keys) g_uidx.loaded = 0;
+    g_uidx.keys   = keys;
+    g_uidx.on_dup = on_dup;
+    pthread_mutex_unlock(&g_uidx_mu);
+}
+
+// Takes g_uidx_mu and returns 1 when a constraint is on; the caller checks,
+// queues and then calls uniqueRelease so check + queue is atomic.
+static int uniqueAcquire(void) {
+    pthread_mutex_lock(&g_uidx_mu);
+    if (g_uidx.keys) return 1;
+    pthread_mutex_unlock(&g_uidx_mu);
+    return 0;
+}
+
+static void uniqueRelease(void) { pthread_mutex_unlock(&g_uidx_mu); }
+
+// Returns the UNIQUE_* keys the row collides on and records its keys unless the
+// policy rejects it. *action receives the DUP_* to apply.
+static int uniqueAdmitLocked(const char *phone, const char *email, int *action) {
+    *action = g_uidx.on_dup;
+    g_uidx.checks++;
+    if (!uidxEnsureLocked(getContactsFile())) return 0;   // no index (I/O error): admit
+    unsigned long long h[2];
+    uidxHashes(phone, email, h);
+    int hit = (h[0] && uidxFind(0, h[0]) ? UNIQUE_PHONE : 0) | (h[1] && uidxFind(1, h[1]) ? UNIQUE_EMAIL : 0);
+    if (hit) {
+        g_uidx.conflicts++;
+        if (g_uidx.on_dup == DUP_REJECT) { g_uidx.rejected++; return hit; }
+        if (g_uidx.on_dup == DUP_MERGE) g_uidx.merged++;
+    }
+    for (int f = 0; f < 2; f++) if (h[f]) uidxInsert(f, h[f]);
+    return hit;
+}
+
+static int uniqueWriteBegin(void) {
+    pthread_mutex_lock(&g_uidx_mu);
+    FileStamp st;
+    int fresh = g_uidx.loaded && strcmp(g_uidx.path, getContactsFile()) == 0 &&
+                fileStamp(g_uidx.path, &st) && stampSame(&g_uidx.stamp, &st);
+    g_uidx.writing++;
+    pthread_mutex_unlock(&g_uidx_mu);
+    return fresh;
+}
+
+static void uniqueWriteEnd(int was_fresh, int kind) {
+    pthread_mutex_lock(&g_uidx_mu);
+    g_uidx.writing--;
+    if (g_uidx.loaded && strcmp(g_uidx.path, getContactsFile()) == 0) {
+        FileStamp st;
+        // an append only added rows the sets already hold; a rewrite may have dropped keys
+        if (kind == BOOK_APPEND && was_fresh && fileStamp(g_uidx.path, &st)) {
+            stampOwnWrite(&st);
+            g_uidx.stamp = st;
+            g_uidx.tail  = stampTailSum(g_uidx.path, st.size);
+        }
+        else g_uidx.loaded = 0;
+    }
+    pthread_cond_broadcast(&g_uidx_cv);
+    pthread_mutex_unlock(&g_uidx_mu);
+}
+
+unsigned long long getUniqueCounter(const char *name) {
+    pthread_mutex_lock(&g_uidx_mu);
+    unsigned long long v = 0;
+    if      (strcmp(name, "checks")    == 0) v = g_uidx.checks;
+    else if (strcmp(name, "conflicts") == 0) v = g_uidx.conflicts;
+    else if (strcmp(name, "rejected")  == 0) v = g_uidx.rejected;
+    else if (strcmp(name, "merged")    == 0) v = g_uidx.merged;
+    else if (strcmp(name, "rebuilds")  == 0) v = g_uidx.rebuilds;
+    else if (strcmp(name, "image_loads") == 0) v = g_uidx.image_loads;
+    else if (strcmp(name, "delta_rows")  == 0) v = g_uidx.delta_rows;
+    pthread_mutex_unlock(&g_uidx_mu);
+    return v;
+}
+
+void printUniqueStats(void) {
+    pthread_mutex_lock(&g_uidx_mu);
+    printf("\n=== Uniqueness ===\n");
+    if (!g_uidx.keys) { printf("constraint   : off\n"); pthread_mutex_unlock(&g_uidx_mu); return; }
+    printf("constraint   : %s%s%s, on duplicate: %s\n", g_uidx.keys & UNIQUE_PHONE ? "phone" : "",
+           g_uidx.keys == (UNIQUE_PHONE | UNIQUE_EMAIL) ? "+" : "", g_uidx.keys & UNIQUE_EMAIL ? "email" : "",
+           k_dup_names[g_uidx.on_dup]);
+    printf("index keys   : phone=%zu email=%zu%s\n", g_uidx.used[0], g_uidx.used[1], g_uidx.loaded ? "" : " (stale)");
+    printf("checks       : %llu\nconflicts    : %llu (rejected %llu, merged %llu)\nrebuilds     : %llu\n",
+           g_uidx.checks, g_uidx.conflicts, g_uidx.rejected, g_uidx.merged, g_uidx.rebuilds);
+    printf("image loads  : %llu (rows caught up: %llu)\n", g_uidx.image_loads, g_uidx.delta_rows);
+    pthread_mutex_unlock(&g_uidx_mu);
+}
+
+// Bracket every write we make to the current book so the derived in-memory
+// state (bloom filters, uniqueness sets) follows it instead of being rebuilt.
+static int bookWriteBegin(void) {
+    return bloomWriteBegin() | (uniqueWriteBegin() << 1);
+}
+
+static void bookWriteEnd(int fresh, int kind) {
+    bloomWriteEnd(fresh & 1);
+    uniqueWriteEnd((fresh >> 1) & 1, kind);
+}
+
+// ==== Append pipeline (group commit) ====
+// Appenders escape their row into the pending batch and wait. Whoever finds no
+// flush in progress becomes the leader: it takes the whole batch, writes it with
+// one write, fsyncs once according to the policy and wakes everyone it covered.
+// Rows admitted as merges (uniqueness policy "merge") ride in the same group;
+// a group that carries any turns into one rewrite of the book.
+// A failed group records its sequence range, so each waiter learns whether its
+// own rows were lost no matter how many groups completed before it woke.
+// Under the interval policy a group fsyncs only when the last sync is older
+// than the interval; a timer thread syncs whatever the groups left behind once
+// it comes due, so an idle book is never more than one interval unsynced.
+#define COMMIT_HIST_BUCKETS 32   // log2(us) buckets
+
+typedef struct { struct Contact c; int keys; } PendingMerge;
+typedef struct { long long first, last; } SeqRange;
+
+static pthread_mutex_t g_commit_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_commit_cv = PTHREAD_COND_INITIALIZER;
+static struct {
+    char  *buf; size_t len, cap;          // pending rows, already CSV-escaped
+    PendingMerge *merges; int nmerges, mcap;
+    long long enq_seq;                    // last sequence handed out
+    long long done_seq;                   // last sequence written (+synced per policy)
+    int   flushing;
+    int   policy, interval_ms;
+    long long last_sync_ns;
+    int   unsynced;                       // a group was written without fsync since the last sync
+    int   timer_started;
+    SeqRange *failed; int nfailed, fcap;  // sequence ranges of failed groups, ascending
+    unsigned long long groups, rows, syncs, timer_syncs;
+    unsigned long long hist[COMMIT_HIST_BUCKETS];
+} g_commit;
+
+// Deferred fsync for FSYNC_INTERVAL: sleeps until the oldest unsynced group is
+// one interval old, then syncs the book in place of a group (flushing is held,
+// so no write lands halfway through it).
+static void* commitTimer(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_commit_mu);
+    for (;;) {
+        if (g_commit.policy != FSYNC_INTERVAL || !g_commit.unsynced || g_commit.flushing) {
+            pthread_cond_wait(&g_commit_cv, &g_commit_mu);
+            continue;
+        }
+        long long due = g_commit.last_sync_ns + (long long)g_commit.interval_ms * 1000000LL, now = nowNs();
+        if (now < due) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            long long at = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec + (due - now);
+            ts.tv_sec = (time_t)(at / 1000000000LL); ts.tv_nsec = (long)(at % 1000000000LL);
+            pthread_cond_timedwait(&g_commit_cv, &g_commit_mu, &ts);
+            continue;
+        }
+        g_commit.flushing = 1;
+        g_commit.unsynced = 0;
+        pthread_mutex_unlock(&g_commit_mu);
+        FILE *fp = fopen(getContactsFile(), "r+b");   // never creates a book
+        int ok = fp && FSYNC(FILENO(fp)) == 0;
+        if (fp) fclose(fp);
+        pthread_mutex_lock(&g_commit_mu);
+        g_commit.flushing = 0;
+        g_commit.last_sync_ns = now;      // a failure retries one interval later
+        if (ok) { g_commit.syncs++; g_commit.timer_syncs++; }
+        else g_commit.unsynced = 1;
+        pthread_cond_broadcast(&g_commit_cv);
+    }
+    return NULL;
+}
+
+void setFsyncPolicy(int policy, int interval_ms) {
+    pthread_mutex_lock(&g_commit_mu);
+    g_commit.policy      = policy;
+    g_commit.interval_ms = interval_ms > 0 ? interval_ms : 0;
+    if (policy == FSYNC_INTERVAL && !g_commit.timer_started) {
+        pthread_t th;
+        if (pthread_create(&th, NULL, commitTimer, NULL) == 0) {
+            pthread_detach(th);
+            g_commit.timer_started = 1;
+        }
+    }
+    pthread_cond_broadcast(&g_commit_cv);
+    pthread_mutex_unlock(&g_commit_mu);
+}
+
+// Note a failed group [first, last]; ranges stay sorted and adjacent ones merge.
+static void commitNoteFailedLocked(long long first, long long last) {
+    if (g_commit.nfailed && g_commit.failed[g_commit.nfailed - 1].last + 1 >= first) {
+        g_commit.failed[g_commit.nfailed - 1].last = last;
+        return;
+    }
+    if (g_commit.nfailed == g_commit.fcap) {
+        int ncap = g_commit.fcap ? g_commit.fcap * 2 : 16;
+        SeqRange *nf = (SeqRange*)realloc(g_commit.failed, (size_t)ncap * sizeof(*nf));
+        if (!nf) {                        // can't record it: widen the last range instead (errs on "failed")
+            if (g_commit.nfailed) g_commit.failed[g_commit.nfailed - 1].last = last;
+            return;
+        }
+        g_commit.failed = nf; g_commit.fcap = ncap;
+    }
+    g_commit.failed[g_commit.nfailed++] = (SeqRange){ first, last };
+}
+
+// 1 when any row in [lo, hi] belonged to a failed group.
+static int commitFailedLocked(long long lo, long long hi) {
+    for (int i = g_commit.nfailed - 1; i >= 0 && g_commit.failed[i].last >= lo; i--)
+        if (g_commit.failed[i].first <= hi) return 1;
+    return 0;
+}
+
+static void commitHistAdd(long long ns) {
+    long long us = ns / 1000;
+    int b = 0;
+    while (us > 1 && b < COMMIT_HIST_BUCKETS - 1) { us >>= 1; b++; }
+    g_commit.hist[b]++;
+}
+
+// Queue one row. Returns its sequence number, 0 if the uniqueness policy
+// rejected it, -1 on error. *conflict (optional) gets the UNIQUE_* keys it
+// collided on.
+long long enqueueContactRowChecked(const char *company, const char *person, const char *phone, const char *email,
+                                   int *conflict) {
+    struct Contact c;
+    contactFill(&c, company, person, phone, email);
+    char row[CONTACT_ROW_MAX];
+    int n = (int)contactFormat(&c, row, sizeof(row));
+    row[n++] = '\n';
+    row[n] = '\0';
+    if (conflict) *conflict = 0;
+
+    int hit = 0, action = DUP_WARN;
+    int unique = uniqueAcquire();
+    if (unique) {
+        hit = uniqueAdmitLocked(phone, email, &action);
+        if (conflict) *conflict = hit;
+        if (hit && action == DUP_REJECT) { uniqueRelease(); return 0; }
+    }
+    bloomNoteContact(phone, email);
+
+    pthread_mutex_lock(&g_commit_mu);
+    if (hit && action == DUP_MERGE) {
+        if (g_commit.nmerges == g_commit.mcap) {
+            int ncap = g_commit.mcap ? g_commit.mcap * 2 : 16;
+            PendingMerge *nm = (PendingMerge*)realloc(g_commit.merges, (size_t)ncap * sizeof(*nm));
+            if (!nm) { pthread_mutex_unlock(&g_commit_mu); g_uidx.loaded = 0; uniqueRelease(); return -1; }
+            g_commit.merges = nm; g_commit.mcap = ncap;
+        }
+        PendingMerge *m = &g_commit.merges[g_commit.nmerges++];
+        m->c = c;
+        m->keys = hit;
+    } else {
+        if (g_commit.len + (size_t)n > g_commit.cap) {
+            size_t ncap = g_commit.cap ? g_commit.cap * 2 : 64 * 1024;
+            while (ncap < g_commit.len + (size_t)n) ncap *= 2;
+            char *nb = (char*)realloc(g_commit.buf, ncap);
+            if (!nb) {
+                pthread_mutex_unlock(&g_commit_mu);
+                if (unique) { g_uidx.loaded = 0; uniqueRelease(); }
+                return -1;
+            }
+            g_commit.buf = nb; g_commit.cap = ncap;
+        }
+        memcpy(g_commit.buf + g_commit.len, row, (size_t)n);
+        g_commit.len += (size_t)n;
+    }
+    long long seq = ++g_commit.enq_seq;
+    pthread_mutex_unlock(&g_commit_mu);
+    if (unique) uniqueRelease();
+    return seq;
+}
+
+long long enqueueContactRow(const char *company, const char *person, const char *phone, const char *email) {
+    return enqueueContactRowChecked(company, person, phone, email, NULL);
+}
+
+// Feed the phone/email of every queued-but-unwritten row to fn (index rebuilds).
+static void commitPendingRows(void (*fn)(const char *phone, const char *email)) {
+    char line[MAX_LINE_LEN];
+    struct Contact r;
+    pthread_mutex_lock(&g_commit_mu);
+    for (size_t off = 0; off < g_commit.len; ) {
+        const char *nl = memchr(g_commit.buf + off, '\n', g_commit.len - off);
+        size_t len = nl ? (size_t)(nl - (g_commit.buf + off)) : g_commit.len - off;
+        if (len < sizeof(line)) {
+            memcpy(line, g_commit.buf + off, len);
+            line[len] = '\0';
+            contactParse(line, &r);
+            fn(r.phone, r.email);
+        }
+        off += len + 1;
+    }
+    for (int i = 0; i < g_commit.nmerges; i++) fn(g_commit.merges[i].c.phone, g_commit.merges[i].c.email);
+    pthread_mutex_unlock(&g_commit_mu);
+}
+
+// 1 when nothing is queued or being written.
+static int commitIdle(void) {
+    pthread_mutex_lock(&g_commit_mu);
+    int idle = !g_commit.len && !g_commit.nmerges && !g_commit.flushing;
+    pthread_mutex_unlock(&g_commit_mu);
+    return idle;
+}
+
+// One pass over the book for a group that carries merges: each merge overwrites
+// the non-empty fields of the first row sharing one of its conflicting keys;
+// merges whose row is gone are appended, then the rest of the batch.
+static int commitRewriteWithMerges(const char *batch, size_t blen, const PendingMerge *m, int nm) {
+    OpCounters *oc = &threadStats()->op[OP_ADD];
+    char tmpfile[300];
+    makeTempPath(tmpfile, sizeof(tmpfile));
+    unsigned long long (*mk)[2] = malloc((size_t)nm * sizeof(*mk));
+    char *applied = (char*)calloc((size_t)nm, 1);
+    if (!mk || !applied) { free(mk); free(applied); return 0; }
+    for (int i = 0; i < nm; i++) keyMapKeys(m[i].c.phone, m[i].c.email, mk[i]);
+
+    FILE *rf = bookOpenRead(getContactsFile());   // may not exist yet
+    FILE *wf = bookOpenWrite(tmpfile, "w");
+    CsvWriter cw;
+    if (wf && !csvWriterOpen(&cw, wf)) { fclose(wf); wf = NULL; }
+    if (!wf) { if (rf) fclose(rf); free(mk); free(applied); return 0; }
+    char line[MAX_LINE_LEN];
+    while (rf && fgets(line, sizeof(line), rf)) {
+        oc->bytes_read += strlen(line);
+        line[strcspn(line, "\n\r")] = '\0';
+        if (!*line) continue;
+        struct Contact r;
+        contactParse(line, &r);
+        unsigned long long rk[2];
+        keyMapKeys(r.phone, r.email, rk);
+        int changed = 0;
+        for (int i = 0; i < nm; i++) {
+            if (applied[i]) continue;
+            if (!(((m[i].keys & UNIQUE_PHONE) && rk[0] && rk[0] == mk[i][0]) ||
+                  ((m[i].keys & UNIQUE_EMAIL) && rk[1] && rk[1] == mk[i][1]))) continue;
+            contactOverlay(&r, &m[i].c);
+            applied[i] = 1; changed = 1;
+        }
+        if (changed) csvPutRow(&cw, &r);
+        else         csvPutLine(&cw, line);
+    }
+    if (rf) fclose(rf);
+    for (int i = 0; i < nm; i++)
+        if (!applied[i]) csvPutRow(&cw, &m[i].c);
+    csvPutRaw(&cw, batch, blen);
+    free(mk); free(applied);
+    oc->bytes_written += cw.bytes;
+
+    int ok = csvWriterClose(&cw);
+    if (!bookSyncClose(wf) || !ok) { remove(tmpfile); return 0; }
+    if (!replaceFile(tmpfile, getContactsFile())) return 0;
+    oc->rewrites++;
+    return 1;
+}
+
+// Block until every row up to upto_seq (-1 = everything queued so far) is written.
+// Returns 1 on success, 0 if the group holding row upto_seq failed (with -1: if
+// any group holding a row queued before the call failed).
+int commitAppends(long long upto_seq) {
+    long long t0 = nowNs();
+    pthread_mutex_lock(&g_commit_mu);
+    long long lo = upto_seq;
+    if (upto_seq < 0) { upto_seq = g_commit.enq_seq; lo = g_commit.done_seq + 1; }
+
+    while (g_commit.done_seq < upto_seq) {
+        if (g_commit.flushing) { pthread_cond_wait(&g_commit_cv, &g_commit_mu); continue; }
+
+        // become the leader for everything queued right now
+        g_commit.flushing = 1;
+        char  *batch = g_commit.buf;
+        size_t blen  = g_commit.len;
+        PendingMerge *merges = g_commit.merges;
+        int nmerges = g_commit.nmerges;
+        g_commit.merges = NULL; g_commit.nmerges = g_commit.mcap = 0;
+        long long last = g_commit.enq_seq;
+        long long first = g_commit.done_seq + 1;
+        g_commit.buf = NULL; g_commit.len = g_commit.cap = 0;
+        int do_sync = 0;
+        long long now = nowNs();
+        if (g_commit.policy == FSYNC_ALWAYS) do_sync = 1;
+        else if (g_commit.policy == FSYNC_INTERVAL &&
+                 now - g_commit.last_sync_ns >= (long long)g_commit.interval_ms * 1000000LL) do_sync = 1;
+        pthread_mutex_unlock(&g_commit_mu);
+
+        int ok = 1;
+        threadStats()->op[OP_ADD].bytes_written += blen;
+        int cache_fresh = bookWriteBegin();
+        FILE *fp = NULL;
+        if (nmerges) ok = commitRewriteWithMerges(batch, blen, merges, nmerges);
+        else if (!(fp = fopen(getContactsFile(), "a"))) ok = 0;
+        else {
+            setvbuf(fp, NULL, _IONBF, 0);            // the batch goes out as one write
+            if (blen && fwrite(batch, 1, blen, fp) != blen) ok = 0;
+            if (ok && do_sync && FSYNC(FILENO(fp)) != 0) ok = 0;
+            if (fclose(fp) != 0) ok = 0;
+        }
+        bookWriteEnd(cache_fresh, nmerges ? BOOK_REWRITE : BOOK_APPEND);
+        free(batch);
+        free(merges);
+
+        pthread_mutex_lock(&g_commit_mu);
+        g_commit.flushing = 0;
+        g_commit.done_seq = last;
+        if (!ok) commitNoteFailedLocked(first, last);
+        g_commit.groups++;
+        g_commit.rows += (unsigned long long)(last - first + 1);
+        if (do_sync && ok) { g_commit.syncs++; g_commit.last_sync_ns = now; g_commit.unsynced = 0; }
+        else if (ok && !do_sync && !nmerges) g_commit.unsynced = 1;   // a merge rewrite is synced already
+        pthread_cond_broadcast(&g_commit_cv);
+    }
+    int ok = !commitFailedLocked(lo, upto_seq);
+    commitHistAdd(nowNs() - t0);
+    pthread_mutex_unlock(&g_commit_mu);
+    return ok;
+}
+
+int appendContactRow(const char *company, const char *person, const char *phone, const char *email) {
+    long long seq = enqueueContactRow(company, person, phone, email);
+    if (seq <= 0) return 0;
+    return commitAppends(seq);
+}
+
+unsigned long long getCommitCounter(const char *name) {
+    pthread_mutex_lock(&g_commit_mu);
+    unsigned long long v = 0;
+    if      (strcmp(name, "groups")      == 0) v = g_commit.groups;
+    else if (strcmp(name, "rows")        == 0) v = g_commit.rows;
+    else if (strcmp(name, "syncs")       == 0) v = g_commit.syncs;
+    else if (strcmp(name, "timer_syncs") == 0) v = g_commit.timer_syncs;
+    pthread_mutex_unlock(&g_commit_mu);
+    return v;
+}
+
+void printCommitStats(void) {
+    static const char *names[] = { "none", "interval", "always" };
+    pthread_mutex_lock(&g_commit_mu);
+    printf("\n=== Commit Stats ===\n");
+    printf("fsync policy : %s", names[g_commit.policy]);
+    if (g_commit.policy == FSYNC_INTERVAL) printf(" (%d ms)", g_commit.interval_ms);
+    printf("\ngroups       : %llu\nrows         : %llu\nfsyncs       : %llu (deferred: %llu)\n",
+           g_commit.groups, g_commit.rows, g_commit.syncs, g_commit.timer_syncs);
+    printf("\ncommit latency (us)\n");
+    for (int b = 0; b < COMMIT_HIST_BUCKETS; b++) {
+        if (!g_commit.hist[b]) continue;
+        printf("  < %-10llu : %llu\n", 1ULL << (b + 1), g_commit.hist[b]);
+    }
+    pthread_mutex_unlock(&g_commit_mu);
+}
+
+void showStats(void) {
+    char path[256];
+    printOpStats();
+    printCommitStats();
+    printBloomStats();
+    printUniqueStats();
+    printQueryStats();
+    printRowStats();
+    printBtreeStats();
+    printBookIoStats();
+    if (read_line_prompt("\nExport Prometheus textfile to (Enter to skip): ", path, sizeof(path))) {
+        trimWhitespace(path);
+        if (*path && strcmp(path, "0") != 0) {
+            if (exportStatsProm(path)) printf("[SUCCESS] Stats written to %s\n", path);
+            else                       printf("[ERROR] Cannot write %s\n", path);
+        }
+    }
+}
+
+// Timed read+parse of the whole book, used by `contact_app stats`.
+static void statsProbeScan(void) {
+    OpTimer ot; opBegin(&ot, OP_SCAN);
+    FILE *fp = bookOpenRead(getContactsFile());
+    if (!fp) { printf("[INFO] No contacts file found or cannot open.\n"); return; }
+    char line[MAX_LINE_LEN];
+    struct Contact c;
+    opScanBegin(&ot);
+    while (fgets(line, sizeof(line), fp)) {
+        opRow(&ot, line);
+        line[strcspn(line, "\n\r")] = '\0';
+        if (!*line) continue;
+        contactParse(line, &c);
+        opLap(&ot, PH_PARSE);
+    }
+    fclose(fp);
+    opScanEnd(&ot);
+}
+
+// ==== Segmented storage (LSM: memtable + sorted segments) ====
+// An alternative to rewriting one big CSV for write-heavy books. A store is a
+// directory:
+//   wal.csv         rows not yet in a segment (replayed into the memtable on open)
+//   seg-NNNNNN.csv  immutable segments, sorted by key
+//   MANIFEST        live segment ids, oldest first (replaced atomically)
+// Every segment line is an op byte ('+' row, '-' tombstone) followed by a normal
+// CSV row. The key is the lowercased company and person. Puts and deletes go to
+// the WAL and to a sorted in-memory table; a full memtable is written out as a
+// new segment. Reads look at the memtable, then the segments newest first. Once
+// LSM_COMPACT_TRIGGER segments pile up, a background thread merges the newest
+// similar-sized ones, dropping shadowed versions (and tombstones, once the
+// merge reaches the oldest segment). Its I/O is rate limited so foreground
+// reads keep their latency. Each segment keeps a sparse key index and a Bloom
+// filter, so a point get reads at most one small slice of the segments that
+// may hold the key.
+#define LSM_KEY_LEN          (MAX_FIELD_LEN * 2 + 2)
+#define LSM_LINE_LEN         (MAX_LINE_LEN * 2)
+#define LSM_MEMTABLE_ROWS    8192
+#define LSM_INDEX_EVERY      64            // sparse index: one key per 64 rows
+#define LSM_COMPACT_TRIGGER  8
+#define LSM_SIZE_RATIO       2
+#define LSM_MAX_SEGMENTS     32            // writers stall beyond this until compaction catches up
+#define LSM_RATE_DEFAULT     (32LL << 20)  // compaction I/O budget, bytes/s
+#define LSM_THROTTLE_CHUNK   (64 * 1024)
+
+typedef struct {
+    char key[LSM_KEY_LEN];
+    struct Contact c;
+    int  dead;                             // tombstone
+} LsmEntry;
+
+typedef struct {
+    unsigned id;
+    long rows;
+    long long bytes;
+    int nidx;
+    char (*idx_key)[LSM_KEY_LEN];          // key of every LSM_INDEX_EVERY-th row
+    long long *idx_off;                    // and its file offset
+    char last_key[LSM_KEY_LEN];
+    unsigned long long *hashes;            // while building; folded into the filter
+    unsigned long long *bloom; unsigned bloom_blocks;
+    int refs;                              // the live list holds one; readers take more
+    int obsolete;                          // compacted away: delete the file on last unref
+} LsmSegment;
+
+static pthread_mutex_t g_lsm_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_lsm_cv = PTHREAD_COND_INITIALIZER;
+static struct {
+    char dir[256];
+    int  open;
+    LsmEntry **mem; int nmem, memcap;      // sorted by key
+    int  mem_limit;
+    FILE *wal; CsvWriter walw;
+    LsmSegment *segs[LSM_MAX_SEGMENTS]; int nsegs;   // oldest first
+    unsigned next_id;
+    pthread_t compactor;
+    int  stop, force, compacting, compact_failed;
+    long long rate;                        // bytes/s, 0 = unlimited
+    unsigned long long puts, deletes, gets, mem_hits, seg_probes, seg_skips, flushes, stalls;
+    unsigned long long compactions, compact_bytes, throttle_ns, dropped;
+} g_lsm = { .mem_limit = LSM_MEMTABLE_ROWS, .rate = LSM_RATE_DEFAULT };
+
+void setLsmOptions(int memtable_rows, long long rate_bytes_per_s) {
+    pthread_mutex_lock(&g_lsm_mu);
+    if (memtable_rows > 0) g_lsm.mem_limit = memtable_rows;
+    g_lsm.rate = rate_bytes_per_s > 0 ? rate_bytes_per_s : 0;
+    pthread_mutex_unlock(&g_lsm_mu);
+}
+
+static void lsmKey(const char *company, const char *person, char *out) {
+    char a[MAX_FIELD_LEN], b[MAX_FIELD_LEN];
+    snprintf(a, sizeof(a), "%s", company);
+    snprintf(b, sizeof(b), "%s", person);
+    trimWhitespace(a); toLowerInPlace(a);
+    trimWhitespace(b); toLowerInPlace(b);
+    snprintf(out, LSM_KEY_LEN, "%s\x1f%s", a, b);
+}
+
+static void lsmPath(char *buf, size_t n, const char *name) {
+    snprintf(buf, n, "%s/%s", g_lsm.dir, name);
+}
+
+static void lsmSegPath(char *buf, size_t n, unsigned id) {
+    snprintf(buf, n, "%s/seg-%06u.csv", g_lsm.dir, id);
+}
+
+// one segment / WAL line ("+row" or "-row") into e; 0 for blank or malformed lines
+static int lsmParseLine(char *line, LsmEntry *e) {
+    line[strcspn(line, "\n\r")] = '\0';
+    if (line[0] != '+' && line[0] != '-') return 0;
+    contactParse(line + 1, &e->c);
+    e->dead = line[0] == '-';
+    lsmKey(e->c.company, e->c.person, e->key);
+    return 1;
+}
+
+static void lsmPutEntry(CsvWriter *w, const LsmEntry *e) {
+    csvPutRaw(w, e->dead ? "-" : "+", 1);
+    csvPutRow(w, &e->c);
+}
+
+static void lsmSegFree(LsmSegment *s) {
+    free(s->idx_key); free(s->idx_off); free(s->hashes); free(s->bloom); free(s);
+}
+
+static void lsmSegUnrefLocked(LsmSegment *s) {
+    if (--s->refs > 0) return;
+    if (s->obsolete) {
+        char path[300];
+        lsmSegPath(path, sizeof(path), s->id);
+        remove(path);
+    }
+    lsmSegFree(s);
+}
+
+// Account one row (in key order) written at off.
+static int lsmSegNoteRow(LsmSegment *s, const char *key, long long off) {
+    if (s->rows >= 16 && (s->rows & (s->rows - 1)) == 0) {
+        void *h = realloc(s->hashes, (size_t)s->rows * 2 * sizeof(*s->hashes));
+        if (!h) return 0;
+        s->hashes = h;
+    } else if (!s->hashes && !(s->hashes = malloc(16 * sizeof(*s->hashes)))) return 0;
+    s->hashes[s->rows++] = bloomHash(key);
+    snprintf(s->last_key, LSM_KEY_LEN, "%s", key);
+    if ((s->rows - 1) % LSM_INDEX_EVERY) return 1;
+    if ((s->nidx & (s->nidx - 1)) == 0) {  // grow at powers of two
+        int ncap = s->nidx ? s->nidx * 2 : 16;
+        void *k = realloc(s->idx_key, (size_t)ncap * sizeof(*s->idx_key));
+        if (!k) return 0;
+        s->idx_key = k;
+        void *o = realloc(s->idx_off, (size_t)ncap * sizeof(*s->idx_off));
+        if (!o) return 0;
+        s->idx_off = o;
+    }
+    snprintf(s->idx_key[s->nidx], LSM_KEY_LEN, "%s", key);
+    s->idx_off[s->nidx++] = off;
+    return 1;
+}
+
+// All rows noted: build the filter from the collected hashes. Without memory
+// for it the segment simply gets probed every time.
+static void lsmSegSeal(LsmSegment *s) {
+    s->bloom_blocks = (unsigned)((unsigned long long)s->rows * BLOOM_BITS_PER_KEY / (BLOOM_WORDS * 64)) + 1;
+    s->bloom = (unsigned long long*)calloc((size_t)s->bloom_blocks * BLOOM_WORDS, sizeof(*s->bloom));
+    for (long i = 0; s->bloom && i < s->rows; i++) bloomSet(s->bloom, s->bloom_blocks, s->hashes[i]);
+    free(s->hashes); s->hashes = NULL;
+}
+
+static int lsmSegMayContain(const LsmSegment *s, const char *key, unsigned long long h) {
+    if (!s->rows || strcmp(key, s->idx_key[0]) < 0 || strcmp(key, s->last_key) > 0) return 0;
+    return !s->bloom || bloomTest(s->bloom, s->bloom_blocks, h);
+}
+
+// Build the sparse index of an existing segment with one sequential read.
+static LsmSegment* lsmSegLoad(unsigned id) {
+    char path[300], line[LSM_LINE_LEN];
+    lsmSegPath(path, sizeof(path), id);
+    FILE *fp = bookOpenRead(path);
+    if (!fp) return NULL;
+    LsmSegment *s = (LsmSegment*)calloc(1, sizeof(*s));
+    LsmEntry *e = (LsmEntry*)malloc(sizeof(*e));
+    if (!s || !e) { free(s); free(e); fclose(fp); return NULL; }
+    s->id = id; s->refs = 1;
+    long long off = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        long long len = (long long)strlen(line);
+        if (lsmParseLine(line, e) && !lsmSegNoteRow(s, e->key, off)) { lsmSegFree(s); s = NULL; break; }
+        off += len;
+    }
+    if (s) { s->bytes = off; lsmSegSeal(s); }
+    free(e);
+    fclose(fp);
+    return s;
+}
+
+// Point lookup in one segment: binary search the sparse index, then read at
+// most LSM_INDEX_EVERY rows. 1 = key found (it may be a tombstone).
+static int lsmSegGet(const LsmSegment *s, const char *key, LsmEntry *out) {
+    int lo = 0, hi = s->nidx - 1, at = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(s->idx_key[mid], key) <= 0) { at = mid; lo = mid + 1; }
+        else hi = mid - 1;
+    }
+    if (at < 0) return 0;
+    char path[300], line[LSM_LINE_LEN];
+    lsmSegPath(path, sizeof(path), s->id);
+    FILE *fp = fopen(path, "r");
+    if (!fp || FSEEK(fp, s->idx_off[at], SEEK_SET) != 0) { if (fp) fclose(fp); return 0; }
+    int found = 0;
+    for (int n = 0; n < LSM_INDEX_EVERY && fgets(line, sizeof(line), fp); ) {
+        if (!lsmParseLine(line, out)) continue;
+        int cmp = strcmp(out->key, key);
+        if (cmp == 0) { found = 1; break; }
+        if (cmp > 0) break;
+        n++;
+    }
+    fclose(fp);
+    return found;
+}
+
+// ---- segment builder (memtable flush and compaction output) ----
+typedef struct {
+    LsmSegment *seg;
+    FILE *fp;
+    CsvWriter cw;
+    char tmp[300];
+    long long rate, t0, budget_mark;       // throttling (compaction only)
+    unsigned long long *read_bytes, throttled_ns;
+} LsmBuild;
+
+static int lsmBuildOpen(LsmBuild *b, unsigned id, long long rate) {
+    memset(b, 0, sizeof(*b));
+    b->seg = (LsmSegment*)calloc(1, sizeof(*b->seg));
+    if (!b->seg) return 0;
+    b->seg->id = id; b->seg->refs = 1;
+    snprintf(b->tmp, sizeof(b->tmp), "%s/seg-%06u.tmp", g_lsm.dir, id);
+    b->fp = bookOpenWrite(b->tmp, "w");
+    if (b->fp && !csvWriterOpen(&b->cw, b->fp)) { fclose(b->fp); b->fp = NULL; }
+    if (!b->fp) { free(b->seg); b->seg = NULL; return 0; }
+    b->rate = rate;
+    b->t0 = nowNs();
+    return 1;
+}
+
+// Sleep whenever the bytes moved so far (read + written) run ahead of the
+// budget. Checked every LSM_THROTTLE_CHUNK so short merges never sleep.
+static void lsmThrottle(LsmBuild *b) {
+    long long moved = (long long)b->cw.bytes + (b->read_bytes ? (long long)*b->read_bytes : 0);
+    if (!b->rate || moved - b->budget_mark < LSM_THROTTLE_CHUNK) return;
+    b->budget_mark = moved;
+    long long due = (long long)((double)moved * 1e9 / (double)b->rate);
+    long long ahead = due - (nowNs() - b->t0);
+    if (ahead <= 0) return;
+    struct timespec ts = { (time_t)(ahead / 1000000000LL), (long)(ahead % 1000000000LL) };
+    nanosleep(&ts, NULL);                  // winpthreads provides it on MinGW
+    b->throttled_ns += (unsigned long long)ahead;
+}
+
+static int lsmBuildAdd(LsmBuild *b, const LsmEntry *e) {
+    if (!lsmSegNoteRow(b->seg, e->key, (long long)b->cw.bytes)) return 0;
+    lsmPutEntry(&b->cw, e);
+    lsmThrottle(b);
+    return 1;
+}
+
+// fsync + rename into place. Returns the segment (one ref) or NULL.
+static LsmSegment* lsmBuildFinish(LsmBuild *b, int ok) {
+    LsmSegment *s = b->seg;
+    s->bytes = (long long)b->cw.bytes;
+    if (!csvWriterClose(&b->cw)) ok = 0;
+    if (!bookSyncClose(b->fp)) ok = 0;
+    char path[300];
+    lsmSegPath(path, sizeof(path), s->id);
+    if (ok && rename(b->tmp, path) != 0) ok = 0;
+    if (!ok) { remove(b->tmp); lsmSegFree(s); return NULL; }
+    lsmSegSeal(s);
+    return s;
+}
+
+static int lsmWriteManifestLocked(void) {
+    char path[300], tmp[300];
+    lsmPath(path, sizeof(path), "MANIFEST");
+    lsmPath(tmp, sizeof(tmp), "MANIFEST.tmp");
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) return 0;
+    fprintf(fp, "LSM1\n");
+    for (int i = 0; i < g_lsm.nsegs; i++) fprintf(fp, "%u\n", g_lsm.segs[i]->id);
+    if (!bookSyncClose(fp)) { remove(tmp); return 0; }
+    return replaceFile(tmp, path);
+}
+
+// ---- memtable ----
+static int lsmMemFind(const char *key, int *pos) {
+    int lo = 0, hi = g_lsm.nmem;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(g_lsm.mem[mid]->key, key);
+        if (cmp == 0) { *pos = mid; return 1; }
+        if (cmp < 0) lo = mid + 1; else hi = mid;
+    }
+    *pos = lo;
+    return 0;
+}
+
+static int lsmMemApply(const LsmEntry *e) {
+    int pos;
+    if (lsmMemFind(e->key, &pos)) { *g_lsm.mem[pos] = *e; return 1; }
+    if (g_lsm.nmem == g_lsm.memcap) {
+        int ncap = g_lsm.memcap ? g_lsm.memcap * 2 : 256;
+        LsmEntry **nm = (LsmEntry**)realloc(g_lsm.mem, (size_t)ncap * sizeof(*nm));
+        if (!nm) return 0;
+        g_lsm.mem = nm; g_lsm.memcap = ncap;
+    }
+    LsmEntry *ne = (LsmEntry*)malloc(sizeof(*ne));
+    if (!ne) return 0;
+    *ne = *e;
+    memmove(g_lsm.mem + pos + 1, g_lsm.mem + pos, (size_t)(g_lsm.nmem - pos) * sizeof(*g_lsm.mem));
+    g_lsm.mem[pos] = ne;
+    g_lsm.nmem++;
+    return 1;
+}
+
+static void lsmMemClear(void) {
+    for (int i = 0; i < g_lsm.nmem; i++) free(g_lsm.mem[i]);
+    g_lsm.nmem = 0;
+}
+
+static int lsmWalOpenLocked(const char *mode) {
+    char path[300];
+    lsmPath(path, sizeof(path), "wal.csv");
+    if (g_lsm.wal) { csvWriterClose(&g_lsm.walw); fclose(g_lsm.wal); }
+    g_lsm.wal = fopen(path, mode);
+    if (g_lsm.wal && !csvWriterOpen(&g_lsm.walw, g_lsm.wal)) { fclose(g_lsm.wal); g_lsm.wal = NULL; }
+    return g_lsm.wal != NULL;
+}
+
+// Memtable -> new newest segment, then the WAL can start over.
+// Stalls while the segment list is full and the compactor is catching up.
+static int lsmFlushLocked(void) {
+    if (!g_lsm.nmem) return 1;
+    while (g_lsm.nsegs >= LSM_MAX_SEGMENTS && !g_lsm.stop) {
+        g_lsm.stalls++;
+        pthread_cond_broadcast(&g_lsm_cv);
+        pthread_cond_wait(&g_lsm_cv, &g_lsm_mu);
+    }
+    if (g_lsm.nsegs >= LSM_MAX_SEGMENTS) return 0;
+    LsmBuild b;
+    if (!lsmBuildOpen(&b, g_lsm.next_id++, 0)) return 0;
+    int ok = 1;
+    for (int i = 0; i < g_lsm.nmem && ok; i++) ok = lsmBuildAdd(&b, g_lsm.mem[i]);
+    LsmSegment *s = lsmBuildFinish(&b, ok);
+    if (!s) return 0;
+    g_lsm.segs[g_lsm.nsegs++] = s;
+    if (!lsmWriteManifestLocked()) { g_lsm.nsegs--; s->obsolete = 1; lsmSegUnrefLocked(s); return 0; }
+    lsmMemClear();
+    g_lsm.flushes++;
+    if (g_lsm.nsegs >= LSM_COMPACT_TRIGGER) pthread_cond_broadcast(&g_lsm_cv);
+    return lsmWalOpenLocked("w");
+}
+
+static int lsmWriteLocked(const LsmEntry *e) {
+    if (!g_lsm.open || !g_lsm.wal) return 0;
+    lsmPutEntry(&g_lsm.walw, e);
+    csvWriterFlush(&g_lsm.walw);
+    int ok = !g_lsm.walw.err && fflush(g_lsm.wal) == 0;
+    if (ok && g_commit.policy == FSYNC_ALWAYS && FSYNC(FILENO(g_lsm.wal)) != 0) ok = 0;
+    if (!ok || !lsmMemApply(e)) return 0;
+    if (g_lsm.nmem >= g_lsm.mem_limit) return lsmFlushLocked();
+    return 1;
+}
+
+// ---- k-way merge (scan and compaction) ----
+// Sources are ordered newest first; for equal keys the newest one wins and the
+// older versions are skipped.
+typedef struct {
+    FILE *fp;                              // segment, or NULL for the memtable copy
+    LsmEntry *mem; int nmem, pos;
+    LsmEntry cur; int has;
+    unsigned long long *read_bytes;
+} LsmSource;
+
+static void lsmSourceNext(LsmSource *src) {
+    char line[LSM_LINE_LEN];
+    src->has = 0;
+    if (!src->fp) {
+        if (src->pos < src->nmem) { src->cur = src->mem[src->pos++]; src->has = 1; }
+        return;
+    }
+    while (fgets(line, sizeof(line), src->fp)) {
+        if (src->read_bytes) *src->read_bytes += strlen(line);
+        if (lsmParseLine(line, &src->cur)) { src->has = 1; return; }
+    }
+}
+
+static int lsmMerge(LsmSource *src, int n, int (*emit)(const LsmEntry *e, void *ctx), void *ctx) {
+    for (int i = 0; i < n; i++) lsmSourceNext(&src[i]);
+    for (;;) {
+        int best = -1;
+        for (int i = 0; i < n; i++)
+            if (src[i].has && (best < 0 || strcmp(src[i].cur.key, src[best].cur.key) < 0)) best = i;
+        if (best < 0) return 1;
+        if (!emit(&src[best].cur, ctx)) return 0;
+        char key[LSM_KEY_LEN];
+        memcpy(key, src[best].cur.key, sizeof(key));
+        for (int i = 0; i < n; i++)
+            while (src[i].has && strcmp(src[i].cur.key, key) == 0) lsmSourceNext(&src[i]);
+    }
+}
+
+// Reference the live segments (newest first) so they outlive a concurrent compaction.
+static int lsmRefSegmentsLocked(LsmSegment **out) {
+    int n = g_lsm.nsegs;
+    for (int i = 0; i < n; i++) { out[i] = g_lsm.segs[n - 1 - i]; out[i]->refs++; }
+    return n;
+}
+
+static int lsmOpenSources(LsmSource *src, LsmSegment **segs, int n, unsigned long long *read_bytes) {
+    for (int i = 0; i < n; i++) {
+        char path[300];
+        lsmSegPath(path, sizeof(path), segs[i]->id);
+        memset(&src[i], 0, sizeof(src[i]));
+        src[i].read_bytes = read_bytes;
+        if (!(src[i].fp = bookOpenRead(path))) {
+            while (i-- > 0) fclose(src[i].fp);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// ---- compaction ----
+typedef struct { LsmBuild *b; int bottom; unsigned long long dropped; } LsmCompactCtx;
+
+static int lsmCompactEmit(const LsmEntry *e, void *ctx) {
+    LsmCompactCtx *cc = (LsmCompactCtx*)ctx;
+    if (e->dead && cc->bottom) { cc->dropped++; return 1; }   // nothing older is left to shadow
+    return lsmBuildAdd(cc->b, e);
+}
+
+// Size-tiered pick: the newest run of segments where each older one is at most
+// LSM_SIZE_RATIO times everything newer than it, so a row is rewritten about
+// log(book / memtable) times rather than on every compaction. all = everything.
+static int lsmPickLocked(int all) {
+    int n = g_lsm.nsegs, lo = n - 1;
+    if (all) return 0;
+    long long newer = g_lsm.segs[n - 1]->bytes;
+    while (lo > 0 && g_lsm.segs[lo - 1]->bytes <= LSM_SIZE_RATIO * newer) newer += g_lsm.segs[--lo]->bytes;
+    return lo < n - 2 ? lo : n - 2;
+}
+
+// Merge segments [lo, nsegs) into one. Called and returns with g_lsm_mu held;
+// the merge itself runs unlocked, so reads and memtable flushes continue.
+// Tombstones are dropped only when the oldest segment takes part.
+// Returns 0 if the merge failed (the old segments stay live).
+static int lsmCompactLocked(int all) {
+    LsmSegment *in[LSM_MAX_SEGMENTS];
+    int n = g_lsm.nsegs;
+    if (n < 2) return 1;
+    int lo = lsmPickLocked(all), cnt = n - lo;
+    for (int i = 0; i < cnt; i++) { in[i] = g_lsm.segs[n - 1 - i]; in[i]->refs++; }   // newest first
+    unsigned id = g_lsm.next_id++;
+    long long rate = g_lsm.rate;
+    g_lsm.compacting = 1;
+    pthread_mutex_unlock(&g_lsm_mu);
+
+    LsmSource src[LSM_MAX_SEGMENTS];
+    LsmBuild b;
+    LsmCompactCtx cc = { &b, lo == 0, 0 };
+    unsigned long long read_bytes = 0;
+    LsmSegment *out = NULL;
+    int ok = lsmBuildOpen(&b, id, rate);
+    if (ok) {
+        b.read_bytes = &read_bytes;
+        if (lsmOpenSources(src, in, cnt, &read_bytes)) {
+            ok = lsmMerge(src, cnt, lsmCompactEmit, &cc);
+            for (int i = 0; i < cnt; i++) fclose(src[i].fp);
+        } else ok = 0;
+        out = lsmBuildFinish(&b, ok);
+    }
+
+    pthread_mutex_lock(&g_lsm_mu);
+    g_lsm.compacting = 0;
+    if (out) {
+        // segments [lo, n) are unchanged: flushes only append newer ones after them
+        LsmSegment *old[LSM_MAX_SEGMENTS];
+        int old_n = g_lsm.nsegs, keep = out->rows > 0, m = lo;
+        memcpy(old, g_lsm.segs, sizeof(old));
+        if (keep) g_lsm.segs[m++] = out;
+        for (int i = n; i < old_n; i++) g_lsm.segs[m++] = old[i];
+        g_lsm.nsegs = m;
+        if (lsmWriteManifestLocked()) {
+            for (int i = lo; i < n; i++) { old[i]->obsolete = 1; lsmSegUnrefLocked(old[i]); }
+            g_lsm.compactions++;
+            g_lsm.compact_bytes += (unsigned long long)out->bytes + read_bytes;
+            g_lsm.dropped += cc.dropped;
+            g_lsm.throttle_ns += b.throttled_ns;
+            if (!keep) { out->obsolete = 1; lsmSegUnrefLocked(out); }
+        } else {                           // keep serving the old set
+            memcpy(g_lsm.segs, old, sizeof(old));
+            g_lsm.nsegs = old_n;
+            out->obsolete = 1; lsmSegUnrefLocked(out);
+            out = NULL;
+        }
+    }
+    for (int i = 0; i < cnt; i++) lsmSegUnrefLocked(in[i]);
+    return ok && out;
+}
+
+static void* lsmCompactor(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_lsm_mu);
+    while (!g_lsm.stop) {
+        if (g_lsm.nsegs < LSM_COMPACT_TRIGGER && !g_lsm.force) {
+            pthread_cond_wait(&g_lsm_cv, &g_lsm_mu);
+            continue;
+        }
+        g_lsm.compact_failed = !lsmCompactLocked(g_lsm.force);
+        g_lsm.force = 0;
+        pthread_cond_broadcast(&g_lsm_cv);  // stalled writers, lsmCompactNow
+    }
+    pthread_mutex_unlock(&g_lsm_mu);
+    return NULL;
+}
+
+// ---- public API ----
+void lsmClose(void) {
+    pthread_mutex_lock(&g_lsm_mu);
+    if (!g_lsm.open) { pthread_mutex_unlock(&g_lsm_mu); return; }
+    g_lsm.stop = 1;
+    pthread_cond_broadcast(&g_lsm_cv);
+    pthread_mutex_unlock(&g_lsm_mu);
+    pthread_join(g_lsm.compactor, NULL);
+
+    pthread_mutex_lock(&g_lsm_mu);
+    lsmFlushLocked();
+    if (g_lsm.wal) { csvWriterClose(&g_lsm.walw); fclose(g_lsm.wal); }
+    g_lsm.wal = NULL;
+    lsmMemClear();
+    free(g_lsm.mem); g_lsm.mem = NULL; g_lsm.memcap = 0;
+    for (int i = 0; i < g_lsm.nsegs; i++) lsmSegUnrefLocked(g_lsm.segs[i]);
+    g_lsm.nsegs = 0;
+    g_lsm.open = 0;
+    pthread_mutex_unlock(&g_lsm_mu);
+}
+
+// Open (or create) the store in dir: load the manifest, index each segment,
+// replay the WAL, start the compactor.
+int lsmOpen(const char *dir) {
+    lsmClose();
+    MKDIR(dir);                            // fails harmlessly if it exists
+    pthread_mutex_lock(&g_lsm_mu);
+    snprintf(g_lsm.dir, sizeof(g_lsm.dir), "%s", dir);
+    g_lsm.next_id = 1;
+    g_lsm.stop = g_lsm.force = 0;
+    char path[300], line[LSM_LINE_LEN];
+    int ok = 1;
+
+    lsmPath(path, sizeof(path), "MANIFEST");
+    FILE *mf = fopen(path, "r");
+    if (mf) {
+        if (!fgets(line, sizeof(line), mf) || strncmp(line, "LSM1", 4) != 0) ok = 0;
+        while (ok && fgets(line, sizeof(line), mf)) {
+            unsigned id = (unsigned)strtoul(line, NULL, 10);
+            if (!id) continue;
+            LsmSegment *s = g_lsm.nsegs < LSM_MAX_SEGMENTS ? lsmSegLoad(id) : NULL;
+            if (!s) { ok = 0; break; }
+            g_lsm.segs[g_lsm.nsegs++] = s;
+            if (id >= g_lsm.next_id) g_lsm.next_id = id + 1;
+        }
+        fclose(mf);
+    }
+
+    lsmPath(path, sizeof(path), "wal.csv");
+    FILE *wf = ok ? fopen(path, "r") : NULL;
+    if (wf) {
+        LsmEntry e;
+        while (ok && fgets(line, sizeof(line), wf))
+            if (lsmParseLine(line, &e)) ok = lsmMemApply(&e);
+        fclose(wf);
+    }
+    if (ok && !lsmWalOpenLocked("a")) ok = 0;
+    if (ok && pthread_create(&g_lsm.compactor, NULL, lsmCompactor, NULL) != 0) ok = 0;
+    if (!ok) {
+        if (g_lsm.wal) { csvWriterClose(&g_lsm.walw); fclose(g_lsm.wal); }
+        g_lsm.wal = NULL;
+        lsmMemClear();
+        for (int i = 0; i < g_lsm.nsegs; i++) lsmSegUnrefLocked(g_lsm.segs[i]);
+        g_lsm.nsegs = 0;
+    }
+    g_lsm.open = ok;
+    pthread_mutex_unlock(&g_lsm_mu);
+    return ok;
+}
+
+// Insert or replace the row keyed by (company, person).
+static int lsmPutContact(const struct Contact *c) {
+    LsmEntry e;
+    e.c = *c;
+    e.dead = 0;
+    lsmKey(c->company, c->person, e.key);
+    pthread_mutex_lock(&g_lsm_mu);
+    int ok = lsmWriteLocked(&e);
+    if (ok) g_lsm.puts++;
+    pthread_mutex_unlock(&g_lsm_mu);
+    return ok;
+}
+
+int lsmPut(const char *company, const char *person, const char *phone, const char *email) {
+    struct Contact c;
+    contactFill(&c, company, person, phone, email);
+    return lsmPutContact(&c);
+}
+
+// Write a tombstone for (company, person); older versions stop being visible.
+int lsmDelete(const char *company, const char *person) {
+    LsmEntry e;
+    memset(&e.c, 0, sizeof(e.c));
+    snprintf(e.c.company, sizeof(e.c.company), "%s", company);
+    snprintf(e.c.person , sizeof(e.c.person ), "%s", person);
+    e.dead = 1;
+    lsmKey(company, person, e.key);
+    pthread_mutex_lock(&g_lsm_mu);
+    int ok = lsmWriteLocked(&e);
+    if (ok) g_lsm.deletes++;
+    pthread_mutex_unlock(&g_lsm_mu);
+    return ok;
+}
+
+// 1 and the row's phone/email if (company, person) is live, 0 otherwise.
+int lsmGet(const char *company, const char *person, char *phone, size_t np, char *email, size_t ne) {
+    char key[LSM_KEY_LEN];
+    lsmKey(company, person, key);
+    LsmEntry *e = (LsmEntry*)malloc(sizeof(*e));
+    if (!e) return 0;
+    LsmSegment *segs[LSM_MAX_SEGMENTS];
+    int n = 0, found = 0, pos;
+
+    pthread_mutex_lock(&g_lsm_mu);
+    g_lsm.gets++;
+    if (lsmMemFind(key, &pos)) { *e = *g_lsm.mem[pos]; found = 1; g_lsm.mem_hits++; }
+    else n = lsmRefSegmentsLocked(segs);
+    pthread_mutex_unlock(&g_lsm_mu);
+
+    unsigned long long h = bloomHash(key);
+    int probes = 0, skips = 0;
+    for (int i = 0; i < n && !found; i++) {
+        if (!lsmSegMayContain(segs[i], key, h)) { skips++; continue; }
+        probes++;
+        found = lsmSegGet(segs[i], key, e);
+    }
+
+    pthread_mutex_lock(&g_lsm_mu);
+    g_lsm.seg_probes += (unsigned long long)probes;
+    g_lsm.seg_skips  += (unsigned long long)skips;
+    for (int i = 0; i < n; i++) lsmSegUnrefLocked(segs[i]);
+    pthread_mutex_unlock(&g_lsm_mu);
+
+    int live = found && !e->dead;
+    if (live) {
+        if (phone) snprintf(phone, np, "%s", e->c.phone);
+        if (email) snprintf(email, ne, "%s", e->c.email);
+    }
+    free(e);
+    return live;
+}
+
+typedef struct {
+    void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx);
+    void *ctx;
+    CsvWriter *out;                       // or write whole rows here
+    long rows;
+} LsmScanCtx;
+
+static int lsmScanEmit(const LsmEntry *e, void *ctx) {
+    LsmScanCtx *sc = (LsmScanCtx*)ctx;
+    if (e->dead) return 1;
+    if (sc->out) csvPutRow(sc->out, &e->c);
+    else if (sc->fn) sc->fn(e->c.company, e->c.person, e->c.phone, e->c.email, sc->ctx);
+    sc->rows++;
+    return 1;
+}
+
+// Every live row in key order, to fn or (out set) as CSV rows. Returns the row
+// count, -1 on error.
+static long lsmScanTo(void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                                 void *ctx),
+                      void *ctx, CsvWriter *out) {
+    LsmSegment *segs[LSM_MAX_SEGMENTS];
+    LsmSource src[LSM_MAX_SEGMENTS + 1];
+    memset(&src[0], 0, sizeof(src[0]));
+
+    pthread_mutex_lock(&g_lsm_mu);
+    if (!g_lsm.open) { pthread_mutex_unlock(&g_lsm_mu); return -1; }
+    src[0].mem = (LsmEntry*)malloc((size_t)(g_lsm.nmem ? g_lsm.nmem : 1) * sizeof(LsmEntry));
+    if (src[0].mem) {
+        for (int i = 0; i < g_lsm.nmem; i++) src[0].mem[i] = *g_lsm.mem[i];
+        src[0].nmem = g_lsm.nmem;
+    }
+    int n = lsmRefSegmentsLocked(segs);
+    pthread_mutex_unlock(&g_lsm_mu);
+
+    LsmScanCtx sc = { fn, ctx, out, 0 };
+    int ok = src[0].mem && lsmOpenSources(src + 1, segs, n, NULL);
+    if (ok) {
+        ok = lsmMerge(src, n + 1, lsmScanEmit, &sc);
+        for (int i = 1; i <= n; i++) fclose(src[i].fp);
+    }
+    free(src[0].mem);
+
+    pthread_mutex_lock(&g_lsm_mu);
+    for (int i = 0; i < n; i++) lsmSegUnrefLocked(segs[i]);
+    pthread_mutex_unlock(&g_lsm_mu);
+    return ok ? sc.rows : -1;
+}
+
+long lsmScan(void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+             void *ctx) {
+    return lsmScanTo(fn, ctx, NULL);
+}
+
+int lsmFlush(void) {
+    pthread_mutex_lock(&g_lsm_mu);
+    int ok = g_lsm.open && lsmFlushLocked();
+    pthread_mutex_unlock(&g_lsm_mu);
+    return ok;
+}
+
+// Flush the memtable and merge everything into one segment; waits for it.
+int lsmCompactNow(void) {
+    pthread_mutex_lock(&g_lsm_mu);
+    int ok = g_lsm.open && lsmFlushLocked();
+    g_lsm.compact_failed = 0;
+    while (ok && g_lsm.nsegs > 1 && !g_lsm.stop && !g_lsm.compact_failed) {   // a merge already running may not cover every segment
+        g_lsm.force = 1;
+        pthread_cond_broadcast(&g_lsm_cv);
+        while (g_lsm.force && !g_lsm.stop) pthread_cond_wait(&g_lsm_cv, &g_lsm_mu);
+    }
+    ok = ok && g_lsm.nsegs <= 1;
+    pthread_mutex_unlock(&g_lsm_mu);
+    return ok;
+}
+
+int lsmSegmentCount(void) {
+    pthread_mutex_lock(&g_lsm_mu);
+    int n = g_lsm.nsegs;
+    pthread_mutex_unlock(&g_lsm_mu);
+    return n;
+}
+
+// Remove a (closed) store's files and its directory.
+void lsmDestroy(const char *dir) {
+    char path[300], line[64];
+    snprintf(path, sizeof(path), "%s/MANIFEST", dir);
+    FILE *mf = fopen(path, "r");
+    while (mf && fgets(line, sizeof(line), mf)) {
+        unsigned id = (unsigned)strtoul(line, NULL, 10);
+        if (!id) continue;
+        char seg[300];
+        snprintf(seg, sizeof(seg), "%s/seg-%06u.csv", dir, id);
+        remove(seg);
+    }
+    if (mf) fclose(mf);
+    remove(path);
+    snprintf(path, sizeof(path), "%s/wal.csv", dir);
+    remove(path);
+    RMDIR(dir);
+}
+
+unsigned long long getLsmCounter(const char *name) {
+    pthread_mutex_lock(&g_lsm_mu);
+    unsigned long long v =
+        strcmp(name, "puts")        == 0 ? g_lsm.puts        :
+        strcmp(name, "deletes")     == 0 ? g_lsm.deletes     :
+        strcmp(name, "gets")        == 0 ? g_lsm.gets        :
+        strcmp(name, "mem_hits")    == 0 ? g_lsm.mem_hits    :
+        strcmp(name, "seg_probes")  == 0 ? g_lsm.seg_probes  :
+        strcmp(name, "seg_skips")   == 0 ? g_lsm.seg_skips   :
+        strcmp(name, "flushes")     == 0 ? g_lsm.flushes     :
+        strcmp(name, "stalls")      == 0 ? g_lsm.stalls      :
+        strcmp(name, "compactions") == 0 ? g_lsm.compactions :
+        strcmp(name, "throttle_ns") == 0 ? g_lsm.throttle_ns :
+        strcmp(name, "dropped")     == 0 ? g_lsm.dropped     : 0;
+    pthread_mutex_unlock(&g_lsm_mu);
+    return v;
+}
+
+void printLsmStats(void) {
+    pthread_mutex_lock(&g_lsm_mu);
+    printf("\n=== Segmented Store (%s) ===\n", g_lsm.open ? g_lsm.dir : "closed");
+    printf("memtable     : %d / %d rows\n", g_lsm.nmem, g_lsm.mem_limit);
+    printf("segments     : %d", g_lsm.nsegs);
+    for (int i = 0; i < g_lsm.nsegs; i++) printf("%s%ld", i ? ", " : " (rows: ", g_lsm.segs[i]->rows);
+    printf("%s\n", g_lsm.nsegs ? ")" : "");
+    printf("puts/deletes : %llu / %llu\n", g_lsm.puts, g_lsm.deletes);
+    printf("gets         : %llu (memtable hits %llu, segment probes %llu, skipped by filter/range %llu)\n",
+           g_lsm.gets, g_lsm.mem_hits, g_lsm.seg_probes, g_lsm.seg_skips);
+    printf("flushes      : %llu (write stalls %llu)\n", g_lsm.flushes, g_lsm.stalls);
+    printf("compactions  : %llu%s, %.1f MB moved, %llu tombstones dropped, throttled %.1f ms\n",
+           g_lsm.compactions, g_lsm.compacting ? " (one running)" : "", (double)g_lsm.compact_bytes / (1 << 20),
+           g_lsm.dropped, g_lsm.throttle_ns / 1e6);
+    if (g_lsm.rate) printf("rate limit   : %.1f MB/s\n", (double)g_lsm.rate / (1 << 20));
+    else            printf("rate limit   : none\n");
+    pthread_mutex_unlock(&g_lsm_mu);
+}
+
+// contact_app lsm <dir> import <csv> | export <csv> | get <company> <person>
+//                       | del <company> <person> | compact | stats
+static int lsmCommand(int argc, char **argv) {
+    if (argc < 4) {
+        printf("usage: %s lsm <dir> import|export <csv> | get|del <company> <person> | compact | stats\n", argv[0]);
+        return 1;
+    }
+    const char *cmd = argv[3];
+    if (!lsmOpen(argv[2])) { printf("[ERROR] Cannot open store %s\n", argv[2]); return 1; }
+    int ok = 1;
+    if (strcmp(cmd, "import") == 0 && argc >= 5) {
+        FILE *fp = bookOpenRead(argv[4]);
+        char line[MAX_LINE_LEN];
+        struct Contact c;
+        long rows = 0;
+        if (!fp) { printf("[ERROR] Cannot open %s\n", argv[4]); ok = 0; }
+        while (ok && fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\n\r")] = '\0';
+            if (!*line) continue;
+            contactParse(line, &c);
+            ok = lsmPutContact(&c);
+            rows++;
+        }
+        if (fp) fclose(fp);
+        if (ok) printf("[SUCCESS] Imported %ld rows.\n", rows);
+    } else if (strcmp(cmd, "export") == 0 && argc >= 5) {
+        FILE *fp = bookOpenWrite(argv[4], "w");
+        CsvWriter cw;
+        if (fp && !csvWriterOpen(&cw, fp)) { fclose(fp); fp = NULL; }
+        if (!fp) { printf("[ERROR] Cannot write %s\n", argv[4]); ok = 0; }
+        else {
+            long rows = lsmScanTo(NULL, NULL, &cw);
+            int write_ok = csvWriterClose(&cw);
+            ok = bookSyncClose(fp) && write_ok && rows >= 0;
+            if (ok) printf("[SUCCESS] Exported %ld rows.\n", rows);
+        }
+    } else if (strcmp(cmd, "get") == 0 && argc >= 6) {
+        char phone[MAX_FIELD_LEN], email[MAX_FIELD_LEN];
+        ok = lsmGet(argv[4], argv[5], phone, sizeof(phone), email, sizeof(email));
+        if (ok) printf("%s,%s,%s,%s\n", argv[4], argv[5], phone, email);
+        else    printf("[INFO] Not found.\n");
+    } else if (strcmp(cmd, "del") == 0 && argc >= 6) {
+        ok = lsmDelete(argv[4], argv[5]);
+    } else if (strcmp(cmd, "compact") == 0) {
+        ok = lsmCompactNow();
+    } else if (strcmp(cmd, "stats") != 0) {
+        printf("[ERROR] Unknown lsm command: %s\n", cmd);
+        ok = 0;
+    }
+    if (strcmp(cmd, "stats") == 0 || strcmp(cmd, "compact") == 0) printLsmStats();
+    lsmClose();
+    return ok ? 0 : 1;
+}
+
+// ==== Compressed book (.cbk: independent LZ blocks + footer index) ====
+// Company names and email domains repeat a lot, so a book compresses well with
+// even a simple byte-oriented LZ77. Rows are cut into ~64 KB blocks of whole
+// lines, each compressed on its own:
+//   "CBK2" | block 0 | block 1 | ... | block entry[nblocks] | trailer
+// The footer records where every block lives, its row count, a checksum of the
+// raw bytes and the key (lowercased company) of its first row. Footer entries
+// (CBK_ENTRY_SIZE bytes) and the trailer (CBK_TRAILER_SIZE) are fixed-width
+// little-endian fields, whatever the host's padding or byte order; the trailer
+// carries CBK_VERSION, and a file of another version has to be repacked. Scans decode
+// blocks on all cores and hand the rows over in file order; a packed-sorted
+// book answers a company lookup from one block.
+#define CBK_BLOCK_RAW    (64 * 1024)
+#define CBK_MAX_THREADS  16
+#define CBK_SORTED       1u               // trailer flag: rows are in key order
+#define CBK_VERSION      2u
+#define CBK_ENTRY_SIZE   (8 + 5 * 4 + 8 + MAX_FIELD_LEN)
+#define CBK_TRAILER_SIZE (8 + 4 + 4 + 8 + 4 + 4)
+#define LZ_HASH_BITS     14
+#define LZ_MIN_MATCH     4
+#define LZ_MAX_OFFSET    65535
+#define LZ_TAIL          12               // last bytes always go out as literals
+
+typedef struct {
+    long long off;                        // compressed payload
+    unsigned  clen, rlen, rows, sum;      // sum = FNV-1a of the raw bytes
+    unsigned  raw;                        // 1 = stored uncompressed
+    long long first_row;
+    char      first_key[MAX_FIELD_LEN];
+} CbkBlock;
+
+typedef struct {
+    long long footer_off;
+    unsigned  nblocks, flags;
+    long long rows;
+} CbkTrailer;
+
+static unsigned char* cbkPutLE(unsigned char *p, unsigned long long v, int n) {
+    for (int i = 0; i < n; i++, v >>= 8) *p++ = (unsigned char)v;
+    return p;
+}
+
+static unsigned long long cbkGetLE(const unsigned char **p, int n) {
+    unsigned long long v = 0;
+    for (int i = n - 1; i >= 0; i--) v = v << 8 | (*p)[i];
+    *p += n;
+    return v;
+}
+
+// footer entry: off u64 | clen rlen rows sum raw u32 | first_row u64 | first_key
+static void cbkEncodeBlock(const CbkBlock *b, unsigned char *p) {
+    p = cbkPutLE(p, (unsigned long long)b->off, 8);
+    p = cbkPutLE(p, b->clen, 4); p = cbkPutLE(p, b->rlen, 4); p = cbkPutLE(p, b->rows, 4);
+    p = cbkPutLE(p, b->sum, 4);  p = cbkPutLE(p, b->raw, 4);
+    p = cbkPutLE(p, (unsigned long long)b->first_row, 8);
+    size_t k = strnlen(b->first_key, MAX_FIELD_LEN - 1);
+    memcpy(p, b->first_key, k);
+    memset(p + k, 0, MAX_FIELD_LEN - k);   // no stack bytes in the file
+}
+
+static void cbkDecodeBlock(const unsigned char *p, CbkBlock *b) {
+    b->off  = (long long)cbkGetLE(&p, 8);
+    b->clen = (unsigned)cbkGetLE(&p, 4); b->rlen = (unsigned)cbkGetLE(&p, 4); b->rows = (unsigned)cbkGetLE(&p, 4);
+    b->sum  = (unsigned)cbkGetLE(&p, 4); b->raw  = (unsigned)cbkGetLE(&p, 4);
+    b->first_row = (long long)cbkGetLE(&p, 8);
+    memcpy(b->first_key, p, MAX_FIELD_LEN);
+    b->first_key[MAX_FIELD_LEN - 1] = '\0';
+}
+
+// trailer: footer_off u64 | nblocks flags u32 | rows u64 | version u32 | "CBKF"
+static void cbkEncodeTrailer(const CbkTrailer *t, unsigned char *p) {
+    p = cbkPutLE(p, (unsigned long long)t->footer_off, 8);
+    p = cbkPutLE(p, t->nblocks, 4); p = cbkPutLE(p, t->flags, 4);
+    p = cbkPutLE(p, (unsigned long long)t->rows, 8);
+    p = cbkPutLE(p, CBK_VERSION, 4);
+    memcpy(p, "CBKF", 4);
+}
+
+static int cbkDecodeTrailer(const unsigned char *p, CbkTrailer *t) {
+    t->footer_off = (long long)cbkGetLE(&p, 8);
+    t->nblocks = (unsigned)cbkGetLE(&p, 4); t->flags = (unsigned)cbkGetLE(&p, 4);
+    t->rows = (long long)cbkGetLE(&p, 8);
+    return cbkGetLE(&p, 4) == CBK_VERSION && memcmp(p, "CBKF", 4) == 0;
+}
+
+static struct {
+    atomic_ullong blocks_read, bytes_in, bytes_out;
+} g_cbk;
+
+// Worst case output size of lzCompress for n input bytes.
+size_t lzBound(size_t n) { return n + n / 255 + 16; }
+
+static unsigned char* lzPutLen(unsigned char *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+// One sequence: token (literal length << 4 | match length - 4), extra literal
+// length bytes, literals, 2-byte offset, extra match length bytes. The last
+// sequence has literals only. Returns the compressed size, 0 if it won't fit.
+size_t lzCompress(const char *src_, size_t n, char *dst_, size_t cap) {
+    const unsigned char *src = (const unsigned char*)src_, *ip = src, *anchor = src, *end = src + n;
+    const unsigned char *mflimit = n > LZ_TAIL ? end - LZ_TAIL : src;
+    unsigned char *op = (unsigned char*)dst_, *oend = op + cap;
+    unsigned table[1u << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    while (ip < mflimit) {
+        unsigned v; memcpy(&v, ip, 4);
+        unsigned h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        const unsigned char *ref = src + table[h];
+        table[h] = (unsigned)(ip - src);
+        unsigned r;
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || (memcpy(&r, ref, 4), r != v)) { ip++; continue; }
+
+        const unsigned char *m = ip + LZ_MIN_MATCH, *rm = ref + LZ_MIN_MATCH;
+        while (m < end - 5 && *m == *rm) { m++; rm++; }
+        size_t lit = (size_t)(ip - anchor), ml = (size_t)(m - ip) - LZ_MIN_MATCH;
+        if ((size_t)(oend - op) < 1 + lit + lit / 255 + 1 + 2 + ml / 255 + 1) return 0;
+        unsigned char *tok = op++;
+        *tok = (unsigned char)((lit >= 15 ? 15 : lit) << 4 | (ml >= 15 ? 15 : ml));
+        if (lit >= 15) op = lzPutLen(op, lit - 15);
+        memcpy(op, anchor, lit); op += lit;
+        size_t off = (size_t)(ip - ref);
+        *op++ = (unsigned char)(off & 0xFF);
+        *op++ = (unsigned char)(off >> 8);
+        if (ml >= 15) op = lzPutLen(op, ml - 15);
+        ip = anchor = m;
+    }
+    size_t lit = (size_t)(end - anchor);
+    if ((size_t)(oend - op) < 1 + lit + lit / 255 + 1) return 0;
+    *op++ = (unsigned char)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) op = lzPutLen(op, lit - 15);
+    memcpy(op, anchor, lit); op += lit;
+    return (size_t)(op - (unsigned char*)dst_);
+}
+
+// Returns the decompressed size, -1 if the input is malformed or too big for dst.
+long lzDecompress(const char *src_, size_t n, char *dst_, size_t cap) {
+    const unsigned char *ip = (const unsigned char*)src_, *iend = ip + n;
+    unsigned char *dst = (unsigned char*)dst_, *op = dst, *oend = dst + cap;
+    while (ip < iend) {
+        unsigned tok = *ip++;
+        size_t lit = tok >> 4, ml = tok & 15;
+        if (lit == 15) { unsigned b; do { if (ip >= iend) return -1; b = *ip++; lit += b; } while (b == 255); }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit); op += lit; ip += lit;
+        if (ip == iend) break;            // last sequence: literals only
+        if (iend - ip < 2) return -1;
+        size_t off = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst)) return -1;
+        if (ml == 15) { unsigned b; do { if (ip >= iend) return -1; b = *ip++; ml += b; } while (b == 255); }
+        ml += LZ_MIN_MATCH;
+        if (ml > (size_t)(oend - op)) return -1;
+        const unsigned char *m = op - off;
+        if (off >= ml) memcpy(op, m, ml);
+        else for (size_t i = 0; i < ml; i++) op[i] = m[i];   // overlapping run
+        op += ml;
+    }
+    return (long)(op - dst);
+}
+
+static unsigned cbkSum(const char *p, size_t n) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < n; i++) { h ^= (unsigned char)p[i]; h *= 16777619u; }
+    return h;
+}
+
+static void cbkKey(const char *line, char *key, size_t n) {
+    struct Contact c;
+    contactParse(line, &c);
+    trimWhitespace(c.company); toLowerInPlace(c.company);
+    snprintf(key, n, "%s", c.company);
+}
+
+// ---- writer ----
+typedef struct {
+    FILE *fp;
+    char *raw, *comp; size_t rlen;
+    unsigned rows;
+    long long row, off;
+    CbkBlock *blocks; unsigned nblocks, bcap;
+    int err;
+} CbkWriter;
+
+static void cbkFlushBlock(CbkWriter *w) {
+    if (!w->rows) return;
+    if (w->nblocks == w->bcap) {
+        unsigned ncap = w->bcap ? w->bcap * 2 : 64;
+        CbkBlock *nb = (CbkBlock*)realloc(w->blocks, (size_t)ncap * sizeof(*nb));
+        if (!nb) { w->err = 1; return; }
+        w->blocks = nb; w->bcap = ncap;
+    }
+    CbkBlock *b = &w->blocks[w->nblocks];
+    size_t clen = lzCompress(w->raw, w->rlen, w->comp, lzBound(CBK_BLOCK_RAW));
+    b->raw  = clen == 0 || clen >= w->rlen;
+    b->clen = b->raw ? (unsigned)w->rlen : (unsigned)clen;
+    b->rlen = (unsigned)w->rlen;
+    b->rows = w->rows;
+    b->sum  = cbkSum(w->raw, w->rlen);
+    b->off  = w->off;
+    b->first_row = w->row - w->rows;
+    char first[MAX_LINE_LEN];
+    size_t fl = strcspn(w->raw, "\n");
+    if (fl >= sizeof(first)) fl = sizeof(first) - 1;
+    memcpy(first, w->raw, fl); first[fl] = '\0';
+    cbkKey(first, b->first_key, sizeof(b->first_key));
+    if (fwrite(b->raw ? w->raw : w->comp, 1, b->clen, w->fp) != b->clen) w->err = 1;
+    w->off += b->clen;
+    w->nblocks++;
+    w->rlen = 0; w->rows = 0;
+}
+
+// line without its newline; one is added
+static void cbkPutLine(CbkWriter *w, const char *line, size_t len) {
+    if (len + 1 > CBK_BLOCK_RAW) len = CBK_BLOCK_RAW - 1;
+    if (w->rlen + len + 1 > CBK_BLOCK_RAW) cbkFlushBlock(w);
+    memcpy(w->raw + w->rlen, line, len);
+    w->raw[w->rlen + len] = '\n';
+    w->rlen += len + 1;
+    w->rows++; w->row++;
+}
+
+typedef struct { const char *line; size_t len; long idx; char key[MAX_FIELD_LEN]; } CbkSortRow;
+
+static int cbkSortCmp(const void *a, const void *b) {
+    const CbkSortRow *x = (const CbkSortRow*)a, *y = (const CbkSortRow*)b;
+    int c = strcmp(x->key, y->key);
+    return c ? c : (x->idx > y->idx) - (x->idx < y->idx);
+}
+
+// Pack csv into a block-compressed book. sort = order rows by company so
+// cbkFind can binary search the footer. Returns the number of blocks, -1 on error.
+long cbkPack(const char *csv, const char *out, int sort) {
+    FILE *in = bookOpenRead(csv);
+    if (!in) return -1;
+    char tmp[300];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+    CbkWriter w;
+    memset(&w, 0, sizeof(w));
+    w.fp   = bookOpenWrite(tmp, "wb");
+    w.raw  = (char*)malloc(CBK_BLOCK_RAW);
+    w.comp = (char*)malloc(lzBound(CBK_BLOCK_RAW));
+    if (!w.fp || !w.raw || !w.comp || fwrite("CBK2", 1, 4, w.fp) != 4) w.err = 1;
+    w.off = 4;
+
+    char line[MAX_LINE_LEN];
+    char *all = NULL; size_t alen = 0, acap = 0;     // sort: every line, kept in memory
+    CbkSortRow *rows = NULL; long nrows = 0, rcap = 0;
+    while (!w.err && fgets(line, sizeof(line), in)) {
+        size_t len = strcspn(line, "\n\r");
+        line[len] = '\0';
+        if (!len) continue;
+        if (!sort) { cbkPutLine(&w, line, len); continue; }
+        if (alen + len + 1 > acap) {
+            size_t ncap = acap ? acap * 2 : BOOK_IO_BUF;
+            while (ncap < alen + len + 1) ncap *= 2;
+            char *na = (char*)realloc(all, ncap);
+            if (!na) { w.err = 1; break; }
+            all = na; acap = ncap;
+        }
+        if (nrows == rcap) {
+            long ncap = rcap ? rcap * 2 : 4096;
+            CbkSortRow *nr = (CbkSortRow*)realloc(rows, (size_t)ncap * sizeof(*nr));
+            if (!nr) { w.err = 1; break; }
+            rows = nr; rcap = ncap;
+        }
+        memcpy(all + alen, line, len + 1);
+        rows[nrows].line = (const char*)(uintptr_t)alen;   // offset until the buffer stops moving
+        rows[nrows].len = len;
+        rows[nrows].idx = nrows;
+        cbkKey(line, rows[nrows].key, sizeof(rows[nrows].key));
+        nrows++;
+        alen += len + 1;
+    }
+    fclose(in);
+    if (sort && !w.err) {
+        for (long i = 0; i < nrows; i++) rows[i].line = all + (uintptr_t)rows[i].line;
+        qsort(rows, (size_t)nrows, sizeof(*rows), cbkSortCmp);
+        for (long i = 0; i < nrows && !w.err; i++) cbkPutLine(&w, rows[i].line, rows[i].len);
+    }
+    free(all); free(rows);
+    if (!w.err) cbkFlushBlock(&w);
+
+    CbkTrailer t;
+    memset(&t, 0, sizeof(t));
+    t.footer_off = w.off;
+    t.nblocks = w.nblocks;
+    t.flags = sort ? CBK_SORTED : 0;
+    t.rows = w.row;
+    unsigned char ent[CBK_ENTRY_SIZE], trailer[CBK_TRAILER_SIZE];
+    for (unsigned i = 0; !w.err && i < w.nblocks; i++) {
+        cbkEncodeBlock(&w.blocks[i], ent);
+        if (fwrite(ent, sizeof(ent), 1, w.fp) != 1) w.err = 1;
+    }
+    cbkEncodeTrailer(&t, trailer);
+    if (!w.err && fwrite(trailer, sizeof(trailer), 1, w.fp) != 1) w.err = 1;
+    if (w.fp && !bookSyncClose(w.fp)) w.err = 1;
+    free(w.raw); free(w.comp); free(w.blocks);
+    if (!w.err && !replaceFile(tmp, out)) w.err = 1;
+    if (w.err) { remove(tmp); return -1; }
+    return (long)t.nblocks;
+}
+
+// ---- reader ----
+typedef struct {
+    char path[256];
+    CbkTrailer t;
+    CbkBlock *blocks;
+} CbkFile;
+
+static int cbkOpen(const char *path, CbkFile *f) {
+    memset(f, 0, sizeof(*f));
+    snprintf(f->path, sizeof(f->path), "%s", path);
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+    char magic[4];
+    unsigned char trailer[CBK_TRAILER_SIZE], ent[CBK_ENTRY_SIZE];
+    long long size = -1;
+    int ok = fread(magic, 1, 4, fp) == 4 && memcmp(magic, "CBK2", 4) == 0 &&
+             FSEEK(fp, -(long long)CBK_TRAILER_SIZE, SEEK_END) == 0 && (size = FTELL(fp)) >= 0 &&
+             fread(trailer, sizeof(trailer), 1, fp) == 1 && cbkDecodeTrailer(trailer, &f->t) &&
+             f->t.footer_off >= 4 && f->t.footer_off + (long long)f->t.nblocks * CBK_ENTRY_SIZE == size;
+    if (ok && f->t.nblocks) {
+        f->blocks = (CbkBlock*)malloc((size_t)f->t.nblocks * sizeof(CbkBlock));
+        ok = f->blocks && FSEEK(fp, f->t.footer_off, SEEK_SET) == 0;
+        for (unsigned i = 0; ok && i < f->t.nblocks; i++) {
+            ok = fread(ent, sizeof(ent), 1, fp) == 1;
+            if (ok) cbkDecodeBlock(ent, &f->blocks[i]);
+        }
+    }
+    fclose(fp);
+    if (!ok) { free(f->blocks); f->blocks = NULL; }
+    return ok;
+}
+
+static void cbkClose(CbkFile *f) { free(f->blocks); f->blocks = NULL; }
+
+// Read + decode block i into raw (CBK_BLOCK_RAW + 1 bytes, NUL-terminated).
+// comp is scratch of lzBound(CBK_BLOCK_RAW). 0 on I/O error or corruption.
+static int cbkReadBlock(const CbkFile *f, FILE *fp, unsigned i, char *comp, char *raw) {
+    const CbkBlock *b = &f->blocks[i];
+    if (b->rlen > CBK_BLOCK_RAW || b->clen > lzBound(CBK_BLOCK_RAW)) return 0;
+    char *dst = b->raw ? raw : comp;
+    if (FSEEK(fp, b->off, SEEK_SET) != 0 || fread(dst, 1, b->clen, fp) != b->clen) return 0;
+    if (!b->raw && lzDecompress(comp, b->clen, raw, CBK_BLOCK_RAW) != (long)b->rlen) return 0;
+    raw[b->rlen] = '\0';
+    atomic_fetch_add(&g_cbk.blocks_read, 1);
+    atomic_fetch_add(&g_cbk.bytes_in, b->clen);
+    atomic_fetch_add(&g_cbk.bytes_out, b->rlen);
+    return cbkSum(raw, b->rlen) == b->sum;
+}
+
+// Hand every line of a decoded block to fn (stops early when fn returns 0).
+static int cbkEachLine(char *raw, int (*fn)(char *line, void *ctx), void *ctx, long *rows) {
+    for (char *p = raw; *p; ) {
+        char *nl = strchr(p, '\n');
+        if (nl) *nl = '\0';
+        (*rows)++;
+        if (!fn(p, ctx)) return 0;
+        if (!nl) break;
+        p = nl + 1;
+    }
+    return 1;
+}
+
+// ---- parallel scan: workers decode blocks into a window of slots, the caller
+// consumes them strictly in block order, so output order matches the file ----
+typedef struct {
+    const CbkFile *f;
+    pthread_mutex_t mu;
+    pthread_cond_t  cv;
+    unsigned next, window;
+    struct { unsigned block; int state; char *raw; } *slot;   // state: 0 empty, 1 ready, -1 bad
+    int stop;
+} CbkScan;
+
+static void* cbkWorker(void *arg) {
+    CbkScan *s = (CbkScan*)arg;
+    char *comp = (char*)malloc(lzBound(CBK_BLOCK_RAW));
+    FILE *fp = fopen(s->f->path, "rb");
+    for (;;) {
+        pthread_mutex_lock(&s->mu);
+        unsigned b = s->next++;
+        while (!s->stop && b < s->f->t.nblocks && s->slot[b % s->window].block != b)
+            pthread_cond_wait(&s->cv, &s->mu);   // slot still holds block b - window
+        int done = s->stop || b >= s->f->t.nblocks;
+        pthread_mutex_unlock(&s->mu);
+        if (done) break;
+        int ok = comp && fp && cbkReadBlock(s->f, fp, b, comp, s->slot[b % s->window].raw);
+        pthread_mutex_lock(&s->mu);
+        s->slot[b % s->window].state = ok ? 1 : -1;
+        pthread_cond_broadcast(&s->cv);
+        pthread_mutex_unlock(&s->mu);
+    }
+    if (fp) fclose(fp);
+    free(comp);
+    return NULL;
+}
+
+static int g_scan_threads;     // setScanThreads; 0 = cpuCount() asks the OS
+
+// Workers for a parallel pass: the online CPUs unless setScanThreads fixed it.
+static int cpuCount(void) {
+    if (g_scan_threads > 0) return g_scan_threads;
+#ifdef _WIN32
+    const char *n = getenv("NUMBER_OF_PROCESSORS");
+    return n && atoi(n) > 0 ? atoi(n) : 4;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 4;
+#endif
+}
+
+void setScanThreads(int n) {
+    g_scan_threads = n > 0 ? n : 0;
+}
+
+// Every row in file order. Returns the row count, -1 on error or corruption.
+long cbkScan(const char *path, int (*fn)(char *line, void *ctx), void *ctx) {
+    CbkFile f;
+    if (!cbkOpen(path, &f)) return -1;
+    int nthreads = cpuCount();
+    if (nthreads > CBK_MAX_THREADS) nthreads = CBK_MAX_THREADS;
+    if ((unsigned)nthreads > f.t.nblocks) nthreads = (int)f.t.nblocks;
+    CbkScan s;
+    memset(&s, 0, sizeof(s));
+    s.f = &f;
+    s.window = (unsigned)(nthreads > 0 ? nthreads * 2 : 1);
+    s.slot = calloc(s.window, sizeof(*s.slot));
+    int ok = s.slot != NULL;
+    for (unsigned i = 0; ok && i < s.window; i++) {
+        s.slot[i].block = i;
+        if (!(s.slot[i].raw = (char*)malloc(CBK_BLOCK_RAW + 1))) ok = 0;
+    }
+    pthread_mutex_init(&s.mu, NULL);
+    pthread_cond_init(&s.cv, NULL);
+    pthread_t th[CBK_MAX_THREADS];
+    int started = 0;
+    for (; ok && started < nthreads; started++)
+        if (pthread_create(&th[started], NULL, cbkWorker, &s) != 0) { ok = 0; break; }
+
+    long rows = 0;
+    for (unsigned b = 0; ok && b < f.t.nblocks; b++) {
+        unsigned k = b % s.window;
+        pthread_mutex_lock(&s.mu);
+        while (s.slot[k].state == 0) pthread_cond_wait(&s.cv, &s.mu);
+        int st = s.slot[k].state;
+        pthread_mutex_unlock(&s.mu);
+        if (st < 0 || !cbkEachLine(s.slot[k].raw, fn, ctx, &rows)) ok = st >= 0 ? 2 : 0;
+        pthread_mutex_lock(&s.mu);
+        s.slot[k].state = 0;
+        s.slot[k].block = b + s.window;
+        pthread_cond_broadcast(&s.cv);
+        pthread_mutex_unlock(&s.mu);
+        if (ok == 2) break;               // fn asked to stop
+    }
+    pthread_mutex_lock(&s.mu);
+    s.stop = 1;
+    pthread_cond_broadcast(&s.cv);
+    pthread_mutex_unlock(&s.mu);
+    for (int i = 0; i < started; i++) pthread_join(th[i], NULL);
+    pthread_mutex_destroy(&s.mu);
+    pthread_cond_destroy(&s.cv);
+    for (unsigned i = 0; s.slot && i < s.window; i++) free(s.slot[i].raw);
+    free(s.slot);
+    cbkClose(&f);
+    return ok ? rows : -1;
+}
+
+typedef struct { const char *key; int (*fn)(char *line, void *ctx); void *ctx; long hits; } CbkFindCtx;
+
+static int cbkFindLine(char *line, void *ctx) {
+    CbkFindCtx *fc = (CbkFindCtx*)ctx;
+    char key[MAX_FIELD_LEN];
+    cbkKey(line, key, sizeof(key));
+    if (strcmp(key, fc->key) != 0) return 1;
+    fc->hits++;
+    return fc->fn ? fc->fn(line, fc->ctx) : 1;
+}
+
+// Rows whose company equals company (case-insensitive). A sorted book reads
+// only the blocks whose key range can hold it; otherwise it is a parallel scan.
+// Returns the number of matches, -1 on error.
+long cbkFind(const char *path, const char *company, int (*fn)(char *line, void *ctx), void *ctx) {
+    char key[MAX_FIELD_LEN];
+    snprintf(key, sizeof(key), "%s", company);
+    trimWhitespace(key); toLowerInPlace(key);
+    CbkFindCtx fc = { key, fn, ctx, 0 };
+    CbkFile f;
+    if (!cbkOpen(path, &f)) return -1;
+    if (!(f.t.flags & CBK_SORTED)) {
+        cbkClose(&f);
+        return cbkScan(path, cbkFindLine, &fc) < 0 ? -1 : fc.hits;
+    }
+    // first block that may hold key: the last one starting strictly before it
+    // (equal keys can spill over from there), else block 0
+    int lo = 0, hi = (int)f.t.nblocks - 1, at = 0;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(f.blocks[mid].first_key, key) < 0) { at = mid; lo = mid + 1; }
+        else hi = mid - 1;
+    }
+    char *comp = (char*)malloc(lzBound(CBK_BLOCK_RAW)), *raw = (char*)malloc(CBK_BLOCK_RAW + 1);
+    FILE *fp = fopen(path, "rb");
+    int ok = comp && raw && fp;
+    long rows = 0;
+    for (unsigned b = (unsigned)at; ok && b < f.t.nblocks && strcmp(f.blocks[b].first_key, key) <= 0; b++) {
+        ok = cbkReadBlock(&f, fp, b, comp, raw);
+        if (ok) cbkEachLine(raw, cbkFindLine, &fc, &rows);
+    }
+    if (fp) fclose(fp);
+    free(comp); free(raw);
+    cbkClose(&f);
+    return ok ? fc.hits : -1;
+}
+
+static int cbkUnpackLine(char *line, void *ctx) {
+    csvPutLine((CsvWriter*)ctx, line);
+    return 1;
+}
+
+long cbkUnpack(const char *path, const char *csv) {
+    char tmp[300];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", csv);
+    FILE *fp = bookOpenWrite(tmp, "w");
+    CsvWriter cw;
+    if (fp && !csvWriterOpen(&cw, fp)) { fclose(fp); fp = NULL; }
+    if (!fp) return -1;
+    long rows = cbkScan(path, cbkUnpackLine, &cw);
+    int write_ok = csvWriterClose(&cw);
+    if (!bookSyncClose(fp) || !write_ok || rows < 0) { remove(tmp); return -1; }
+    return replaceFile(tmp, csv) ? rows : -1;
+}
+
+unsigned long long getCbkCounter(const char *name) {
+    return strcmp(name, "blocks_read") == 0 ? atomic_load(&g_cbk.blocks_read) :
+           strcmp(name, "bytes_in")    == 0 ? atomic_load(&g_cbk.bytes_in)    :
+           strcmp(name, "bytes_out")   == 0 ? atomic_load(&g_cbk.bytes_out)   : 0;
+}
+
+static int cbkParseLine(char *line, void *ctx) {
+    struct Contact c;
+    contactParse(line, &c);
+    (*(long*)ctx)++;
+    return 1;
+}
+
+static int cbkPrintLine(char *line, void *ctx) {
+    (void)ctx;
+    printf("%s\n", line);
+    return 1;
+}
+
+// contact_app cbk pack <csv> <cbk> [--sort] | unpack <cbk> <csv> | find <cbk> <company> | scan <cbk>
+static int cbkCommand(int argc, char **argv) {
+    const char *cmd = argc >= 3 ? argv[2] : "";
+    if (strcmp(cmd, "pack") == 0 && argc >= 5) {
+        long long t0 = nowNs();
+        long n = cbkPack(argv[3], argv[4], argc >= 6 && strcmp(argv[5], "--sort") == 0);
+        if (n < 0) { printf("[ERROR] Cannot pack %s into %s\n", argv[3], argv[4]); return 1; }
+        FileStamp a, b;
+        if (fileStamp(argv[3], &a) && fileStamp(argv[4], &b) && a.size > 0)
+            printf("[SUCCESS] %ld blocks, %lld -> %lld bytes (%.1f%%) in %.1f ms\n", n, a.size, b.size,
+                   100.0 * (double)b.size / (double)a.size, (nowNs() - t0) / 1e6);
+        return 0;
+    }
+    if (strcmp(cmd, "unpack") == 0 && argc >= 5) {
+        long rows = cbkUnpack(argv[3], argv[4]);
+        if (rows < 0) { printf("[ERROR] Cannot unpack %s (missing or corrupt)\n", argv[3]); return 1; }
+        printf("[SUCCESS] Unpacked %ld rows.\n", rows);
+        return 0;
+    }
+    if (strcmp(cmd, "find") == 0 && argc >= 5) {
+        unsigned long long b0 = getCbkCounter("blocks_read");
+        long hits = cbkFind(argv[3], argv[4], cbkPrintLine, NULL);
+        if (hits < 0) { printf("[ERROR] Cannot read %s\n", argv[3]); return 1; }
+        printf("[INFO] %ld match(es), %llu block(s) read.\n", hits, getCbkCounter("blocks_read") - b0);
+        return 0;
+    }
+    if (strcmp(cmd, "scan") == 0 && argc >= 4) {
+        long parsed = 0;
+        long long t0 = nowNs();
+        long rows = cbkScan(argv[3], cbkParseLine, &parsed);
+        if (rows < 0) { printf("[ERROR] Cannot read %s (missing or corrupt)\n", argv[3]); return 1; }
+        double ms = (nowNs() - t0) / 1e6;
+        printf("rows        : %ld\nblocks      : %llu\ncompressed  : %llu bytes\nraw         : %llu bytes\n"
+               "time        : %.1f ms (%.0f rows/s, %d threads)\n", rows, getCbkCounter("blocks_read"),
+               getCbkCounter("bytes_in"), getCbkCounter("bytes_out"), ms, ms > 0 ? rows * 1e3 / ms : 0.0, cpuCount());
+        return 0;
+    }
+    printf("usage: %s cbk pack <csv> <cbk> [--sort] | unpack <cbk> <csv> | find <cbk> <company> | scan <cbk>\n", argv[0]);
+    return 1;
+}
+
+// ==== Add Contact ====
+void addContact() {
+    struct Contact c;
+    char temp[MAX_FIELD_LEN * 2];
+
+    printf("\n=== Add New Contact ===\n(Enter 0 at any field to cancel)\n\n");
+
+    // Company
+    while (1) {
+        if (!read_line_prompt("Enter company name: ", temp, sizeof(temp))) {
+            printf("[CANCEL] Input canceled.\n"); return;
+        }
+        if (strcmp(temp, "0") == 0) { printf("[INFO] Add cancelled.\n"); return; }
+        sanitizeInput(temp);
+        if (!*temp) { printf("[ERROR] Company name cannot be empty!\n"); continue; }
+        if (strlen(temp) >= MAX_FIELD_LEN) { printf("[ERROR] Too long.\n"); continue; }
+        strncpy(c.company, temp, MAX_FIELD_LEN); c.company[MAX_FIELD_LEN-1] = '\0'; break;
+    }
+
+    // Person
+    while (1) {
+        if (!read_line_prompt("Enter contact person: ", temp, sizeof(temp))) {
+            printf("[CANCEL] Input canceled.\n"); return;
+        }
+        if (strcmp(temp, "0") == 0) { printf("[INFO] Add cancelled.\n"); return; }
+        sanitizeInput(temp);
+        if (!*temp) { printf("[ERROR] Person name cannot be empty!\n"); continue; }
+        if (strlen(temp) >= MAX_FIELD_LEN) { printf("[ERROR] Too long.\n"); continue; }
+        strncpy(c.person, temp, MAX_FIELD_LEN); c.person[MAX_FIELD_LEN-1] = '\0'; break;
+    }
+
+    // Phone
+    while (1) {
+        if (!read_line_prompt("Enter phone: ", temp, sizeof(temp))) {
+            printf("[CANCEL] Input canceled.\n"); return;
+        }
+        if (strcmp(temp, "0") == 0) { printf("[INFO] Add cancelled.\n"); return; }
+        sanitizeInput(temp);
+        if (!*temp) { printf("[ERROR] Phone cannot be empty!\n"); continue; }
+        if (!validatePhone(temp)) { printf("[ERROR] Invalid phone.\n"); continue; }
+        if (strlen(temp) >= MAX_FIELD_LEN) { printf("[ERROR] Too long.\n"); continue; }
+        strncpy(c.phone, temp, MAX_FIELD_LEN); c.phone[MAX_FIELD_LEN-1] = '\0'; break;
+    }
+
+    // Email
+    while (1) {
+        if (!read_line_prompt("Enter email: ", temp, sizeof(temp))) {
+            printf("[CANCEL] Input canceled.\n"); return;
+        }
+        if (strcmp(temp, "0") == 0) { printf("[INFO] Add cancelled.\n"); return; }
+        sanitizeInput(temp);
+        if (!*temp) { printf("[ERROR] Email cannot be empty!\n"); continue; }
+        if (!validateEmail(temp)) { printf("[ERROR] Invalid email.\n"); continue; }
+        if (strlen(temp) >= MAX_FIELD_LEN) { printf("[ERROR] Too long.\n"); continue; }
+        strncpy(c.email, temp, MAX_FIELD_LEN); c.email[MAX_FIELD_LEN-1] = '\0'; break;
+    }
+
+    // Summary
+    printf("\n--- Contact Summary ---\n");
+    contactPrintCard(&c);
+    printf("----------------------\n");
+
+    if (!confirmAction("\nDo you want to save this contact?")) {
+        printf("[INFO] Contact not saved.\n");
+        return;
+    }
+
+    // Save (goes through the group-commit pipeline)
+    OpTimer ot; opBegin(&ot, OP_ADD);
+    long long t_write = nowNs();
+    int conflict = 0;
+    long long seq = enqueueContactRowChecked(c.company, c.person, c.phone, c.email, &conflict);
+    int saved = seq > 0 && commitAppends(seq);
+    opTimed(&ot, PH_WRITE, t_write);
+    const char *what = conflict == (UNIQUE_PHONE | UNIQUE_EMAIL) ? "phone and email"
+                     : conflict == UNIQUE_PHONE ? "phone" : "email";
+    if (seq == 0) {
+        printf("\n[ERROR] A contact with this %s already exists. Contact not saved.\n", what); return;
+    }
+    if (!saved) {
+        printf("[ERROR] Cannot open file for writing!\n"); return;
+    }
+    if (conflict && g_uidx.on_dup == DUP_MERGE) {
+        printf("\n[SUCCESS] Merged into the existing contact with this %s.\n", what); return;
+    }
+    if (conflict) printf("\n[WARNING] Another contact already has this %s.\n", what);
+    printf("\n[SUCCESS] Contact added successfully!\n");
+}
+
+
+// ==== List ====
+static void listPrintRow(const char *company, const char *person, const char *phone, const char *email, void *ctx) {
+    int *count = (int*)ctx;
+    printf("%-4d | %-20.20s | %-20.20s | %-15.15s | %-30.30s\n", ++*count, company, person, phone, email);
+}
+
+// Rows listed: company and person set, company containing the lowercased filter.
+static int listKeep(const struct Contact *c, void *ctx) {
+    const char *filter_lower = (const char*)ctx;
+    if (!*c->company || !*c->person) return 0;
+    if (!*filter_lower) return 1;
+    char company_lower[MAX_FIELD_LEN];
+    strncpy(company_lower, c->company, MAX_FIELD_LEN - 1); company_lower[MAX_FIELD_LEN - 1] = '\0';
+    for (int i = 0; company_lower[i]; i++) company_lower[i] = (char)tolower((unsigned char)company_lower[i]);
+    return strstr(company_lower, filter_lower) != NULL;
+}
+
+void listContacts() {
+    char filter[MAX_FIELD_LEN];
+    printf("\n=== Contact List ===\n");
+    printf("Enter keyword to search company (or press Enter to show all, 0 to cancel): ");
+    if (!fgets(filter, sizeof(filter), stdin)) { printf("[ERROR] Failed to read input!\n"); return; }
+    filter[strcspn(filter, "\n")] = '\0';
+    trimWhitespace(filter);
+    if (strcmp(filter, "0") == 0) { printf("[INFO] List contacts cancelled.\n"); return; }
+
+    int count = 0;
+    if (pageSize() > 0) {
+        // same company-contains filter, as a query so bookPage can resume it
+        char query[MAX_FIELD_LEN + 16] = "";
+        if (*filter) {
+            char *w = query + snprintf(query, sizeof(query), "company:\"*");
+            for (const char *r = filter; *r; r++) if (*r != '"') *w++ = *r;
+            strcpy(w, "*\"");
+        }
+        printf("\n%-4s | %-20s | %-20s | %-15s | %-30s\n", "No.", "Company", "Contact", "Phone", "Email");
+        printf("------------------------------------------------------------------------------------------------\n");
+        if (pageThrough(query, listPrintRow, &count) < 0) { printf("[INFO] No contacts file found or cannot open.\n"); return; }
+        if (count == 0) printf("[INFO] No contacts to show.\n");
+        else            printf("Total: %d contact(s) displayed\n", count);
+        return;
+    }
+
+    OpTimer ot; opBegin(&ot, OP_LIST);
+    FILE *fp = bookOpenRead(getContactsFile());
+    if (!fp) { printf("[INFO] No contacts file found or cannot open.\n"); return; }
+
+    int use_filter = (int)(strlen(filter) > 0);
+    char filter_lower[MAX_FIELD_LEN] = "";
+    if (use_filter) {
+        strncpy(filter_lower, filter, MAX_FIELD_LEN - 1);
+        filter_lower[MAX_FIELD_LEN - 1] = '\0';
+        for (int i = 0; filter_lower[i]; i++) filter_lower[i] = (char)tolower((unsigned char)filter_lower[i]);
+    }
 
     printf("\n%-4s | %-20s | %-20s | %-15s | %-30s\n", "No.", "Company", "Contact", "Phone", "Email");
     printf("------------------------------------------------------------------------------------------------\n");
 
-    while (fgets(line, sizeof(line), fp)) {
+    opScanBegin(&ot);
+    long shown = pipeRun(fp, listKeep, filter_lower, listPrintRow, &count, &ot);
+    fclose(fp);
+    opScanEnd(&ot);
+    if (shown < 0) printf("[ERROR] Out of memory, the list is incomplete!\n");
+
+    if (count == 0) {
+        if (use_filter) printf("[INFO] No contacts found with keyword '%s'.\n", filter);
+        else            printf("[INFO] No contacts in the system.\n");
+    } else {
+        printf("------------------------------------------------------------------------------------------------\n");
+        printf("Total: %d contact(s) displayed\n", count);
+    }
+}
+
+// ==== Row index (row id -> offset and length, so one edit writes one row) ====
+// Every non-empty line of the book has a row id: its slot in a table of
+// (offset, length) kept in file order. A delete overwrites the row with as many
+// '\n' as it had bytes: blank lines, which every reader already skips. An update
+// that fits in the old bytes is written over them, padded the same way. Only a
+// row that grows is appended and its old copy blanked. Either way one edit writes
+// one row and leaves the rest of the file alone. The table follows appends by
+// reading just the new tail and is rebuilt after any other change.
+typedef struct { long long off; int len; } RowSlot;     // len counts the line ending; 0 = dead
+
+enum { ROW_FAILED = 0, ROW_IN_PLACE = 1, ROW_RELOCATED = 2 };
+
+static pthread_mutex_t g_rows_mu = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    char path[256];
+    int  loaded;
+    FileStamp stamp;
+    unsigned long long tail;              // stampTailSum at stamp.size
+    RowSlot *slot;
+    long n, cap;
+    unsigned long long builds, caught_up, tombstones, in_place, relocated, fallbacks;
+} g_rows;
+
+static int bookPread(const char *path, long long off, char *buf, size_t n) {
+#ifdef _WIN32
+    FILE *fp = fopen(path, "rb");
+    int ok = fp && FSEEK(fp, off, SEEK_SET) == 0 && fread(buf, 1, n, fp) == n;
+    if (fp) fclose(fp);
+    return ok;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    int ok = pread(fd, buf, n, (off_t)off) == (ssize_t)n;
+    close(fd);
+    return ok;
+#endif
+}
+
+// n bytes over the book at off, synced like a rewrite would be
+static int bookPwrite(const char *path, long long off, const char *buf, size_t n) {
+#ifdef _WIN32
+    FILE *fp = fopen(path, "r+b");
+    int ok = fp && FSEEK(fp, off, SEEK_SET) == 0 && fwrite(buf, 1, n, fp) == n &&
+             fflush(fp) == 0 && FSYNC(FILENO(fp)) == 0;
+    if (fp && fclose(fp) != 0) ok = 0;
+    return ok;
+#else
+    int fd = open(path, O_WRONLY);
+    if (fd < 0) return 0;
+    int ok = pwrite(fd, buf, n, (off_t)off) == (ssize_t)n && FSYNC(fd) == 0;
+    if (close(fd) != 0) ok = 0;
+    return ok;
+#endif
+}
+
+// Append a slot for every non-empty line in [from, size).
+static int rowsAddLocked(const char *path, long long from, long long size) {
+    if (from >= size) return 1;
+    size_t len = 0;
+    char *map = mapFile(path, &len);
+    if (!map) return 0;
+    // anything appended after the stamp is left for the next catch-up
+    const char *end = map + ((long long)len > size ? (size_t)size : len);
+    for (const char *p = map + from; p < end; ) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        size_t n = nl ? (size_t)(nl - p) + 1 : (size_t)(end - p);
+        size_t body = n - (nl != NULL);
+        if (body && p[body - 1] == '\r') body--;
+        if (body) {
+            if (g_rows.n == g_rows.cap) {
+                long ncap = g_rows.cap ? g_rows.cap * 2 : 1024;
+                RowSlot *ns = (RowSlot*)realloc(g_rows.slot, (size_t)ncap * sizeof(*ns));
+                if (!ns) { unmapFile(map, len); return 0; }
+                g_rows.slot = ns; g_rows.cap = ncap;
+            }
+            g_rows.slot[g_rows.n].off = (long long)(p - map);
+            g_rows.slot[g_rows.n].len = (int)n;
+            g_rows.n++;
+        }
+        p += n;
+    }
+    unmapFile(map, len);
+    return 1;
+}
+
+static void rowsAdoptLocked(const char *path, const FileStamp *st) {
+    g_rows.stamp = *st;
+    g_rows.tail  = stampTailSum(path, st->size);
+    g_rows.loaded = 1;
+}
+
+static int rowsEnsureLocked(const char *path) {
+    FileStamp st;
+    if (!fileStamp(path, &st)) return 0;
+    if (g_rows.loaded && strcmp(g_rows.path, path) == 0) {
+        long long from = stampAppendedFrom(path, &g_rows.stamp, g_rows.tail, &st);
+        if (from >= 0) {
+            long n0 = g_rows.n;
+            if (!rowsAddLocked(path, from, st.size)) { g_rows.loaded = 0; return 0; }
+            g_rows.caught_up += (unsigned long long)(g_rows.n - n0);
+            rowsAdoptLocked(path, &st);
+            return 1;
+        }
+    }
+    g_rows.loaded = 0;
+    g_rows.n = 0;
+    snprintf(g_rows.path, sizeof(g_rows.path), "%s", path);
+    if (!rowsAddLocked(path, 0, st.size)) return 0;
+    g_rows.builds++;
+    rowsAdoptLocked(path, &st);
+    return 1;
+}
+
+// Row id of the live row starting at off, -1 if there is none.
+static long rowsFindLocked(long long off) {
+    long lo = 0, hi = g_rows.n - 1;
+    while (lo <= hi) {
+        long mid = lo + (hi - lo) / 2;
+        if      (g_rows.slot[mid].off < off) lo = mid + 1;
+        else if (g_rows.slot[mid].off > off) hi = mid - 1;
+        else return g_rows.slot[mid].len ? mid : -1;
+    }
+    return -1;
+}
+
+// The row at off as the caller saw it (line without its ending), or -1.
+static long rowsCheckLocked(const char *path, long long off, const char *line, char *buf) {
+    long id = rowsFindLocked(off);
+    if (id < 0 || g_rows.slot[id].len > MAX_LINE_LEN + 1) return -1;
+    size_t n = strlen(line), len = (size_t)g_rows.slot[id].len;
+    if (!bookPread(path, off, buf, len)) return -1;
+    if (len < n || memcmp(buf, line, n) != 0) return -1;
+    for (size_t i = n; i < len; i++) if (buf[i] != '\r' && buf[i] != '\n') return -1;
+    return id;
+}
+
+// Our own write changed nothing but the bytes we know about: keep the table
+// unless someone else appended in between.
+static void rowsWroteLocked(const char *path, long long expect_size) {
+    FileStamp st;
+    if (fileStamp(path, &st) && st.size == expect_size) { stampOwnWrite(&st); rowsAdoptLocked(path, &st); }
+    else g_rows.loaded = 0;
+}
+
+// keeps the B+trees in step with the edits below (B+tree section)
+static void bptRowEdited(const char *book, const FileStamp *before, unsigned long long before_tail,
+                         const FileStamp *after, unsigned long long after_tail, long long off, const char *row);
+
+// Blank the row at off, which must still read `line`. ROW_IN_PLACE when done,
+// ROW_FAILED if the row can't be found as it was (the caller rewrites instead).
+int rowDelete(const char *path, long long off, const char *line) {
+    char buf[MAX_LINE_LEN + 2];
+    pthread_mutex_lock(&g_rows_mu);
+    long id = rowsEnsureLocked(path) ? rowsCheckLocked(path, off, line, buf) : -1;
+    FileStamp before = g_rows.stamp;
+    unsigned long long before_tail = g_rows.tail;
+    int len = id >= 0 ? g_rows.slot[id].len : 0;
+    if (id >= 0) memset(buf, '\n', (size_t)len);
+    int ok = id >= 0 && bookPwrite(path, off, buf, (size_t)len);
+    if (ok) {
+        g_rows.slot[id].len = 0;
+        g_rows.tombstones++;
+        rowsWroteLocked(path, g_rows.stamp.size);
+        if (g_rows.loaded) bptRowEdited(path, &before, before_tail, &g_rows.stamp, g_rows.tail, off, NULL);
+    } else {
+        if (id >= 0) g_rows.loaded = 0;               // a failed write may have left anything behind
+        g_rows.fallbacks++;
+    }
+    pthread_mutex_unlock(&g_rows_mu);
+    return ok ? ROW_IN_PLACE : ROW_FAILED;
+}
+
+// Replace the row at off, which must still read `line`, with the encoded row
+// `repl` (no line ending). A row that fits is written over the old one
+// (ROW_IN_PLACE); a longer one is appended first and the old copy blanked after,
+// so a crash in between leaves a duplicate rather than a lost row (ROW_RELOCATED).
+int rowReplace(const char *path, long long off, const char *line, const char *repl) {
+    char buf[MAX_LINE_LEN + 2];
+    size_t rn = strlen(repl);
+    if (rn >= MAX_LINE_LEN) return ROW_FAILED;
+    pthread_mutex_lock(&g_rows_mu);
+    long id = rowsEnsureLocked(path) ? rowsCheckLocked(path, off, line, buf) : -1;
+    FileStamp before = g_rows.stamp;
+    unsigned long long before_tail = g_rows.tail;
+    int result = ROW_FAILED;
+    if (id >= 0 && rn + 1 <= (size_t)g_rows.slot[id].len) {
+        size_t len = (size_t)g_rows.slot[id].len;
+        memcpy(buf, repl, rn);
+        memset(buf + rn, '\n', len - rn);
+        if (bookPwrite(path, off, buf, len)) {
+            g_rows.slot[id].len = (int)rn + 1;
+            g_rows.in_place++;
+            rowsWroteLocked(path, g_rows.stamp.size);
+            if (g_rows.loaded) bptRowEdited(path, &before, before_tail, &g_rows.stamp, g_rows.tail, off, repl);
+            result = ROW_IN_PLACE;
+        } else g_rows.loaded = 0;
+    } else if (id >= 0) {
+        long long size = g_rows.stamp.size;
+        char last = '\n';
+        int lead = size > 0 && bookPread(path, size - 1, &last, 1) && last != '\n';
+        FILE *fp = fopen(path, "ab");
+        int ok = fp != NULL;
+        if (ok) {
+            setvbuf(fp, NULL, _IONBF, 0);
+            if (lead && fputc('\n', fp) == EOF) ok = 0;
+            if (ok && (fwrite(repl, 1, rn, fp) != rn || fputc('\n', fp) == EOF || FSYNC(FILENO(fp)) != 0)) ok = 0;
+            if (fclose(fp) != 0) ok = 0;
+        }
+        size_t len = (size_t)g_rows.slot[id].len;
+        memset(buf, '\n', len);
+        if (ok && bookPwrite(path, off, buf, len)) {
+            // someone else's append in between moves our row; the next lookup rebuilds
+            g_rows.slot[id].len = 0;
+            g_rows.relocated++;
+            g_rows.loaded = 0;
+            if (rowsAddLocked(path, size, size + lead + (long long)rn + 1))
+                rowsWroteLocked(path, size + lead + (long long)rn + 1);
+            if (g_rows.loaded) bptRowEdited(path, &before, before_tail, &g_rows.stamp, g_rows.tail, size + lead, repl);
+            // to a stamp check this looks like a plain append, which the saved
+            // uniqueness image would catch up over and keep the blanked keys
+            char side[300];
+            snprintf(side, sizeof(side), "%s.idx", path);
+            remove(side);
+            result = ROW_RELOCATED;
+        } else g_rows.loaded = 0;
+    }
+    if (result == ROW_FAILED) g_rows.fallbacks++;
+    pthread_mutex_unlock(&g_rows_mu);
+    return result;
+}
+
+unsigned long long getRowCounter(const char *name) {
+    pthread_mutex_lock(&g_rows_mu);
+    unsigned long long v = 0;
+    if      (strcmp(name, "builds")     == 0) v = g_rows.builds;
+    else if (strcmp(name, "caught_up")  == 0) v = g_rows.caught_up;
+    else if (strcmp(name, "tombstones") == 0) v = g_rows.tombstones;
+    else if (strcmp(name, "in_place")   == 0) v = g_rows.in_place;
+    else if (strcmp(name, "relocated")  == 0) v = g_rows.relocated;
+    else if (strcmp(name, "fallbacks")  == 0) v = g_rows.fallbacks;
+    pthread_mutex_unlock(&g_rows_mu);
+    return v;
+}
+
+void printRowStats(void) {
+    pthread_mutex_lock(&g_rows_mu);
+    printf("\n=== Row Index ===\n");
+    printf("rows         : %ld%s\n", g_rows.n, g_rows.loaded ? "" : " (stale)");
+    printf("builds       : %llu (rows caught up: %llu)\n", g_rows.builds, g_rows.caught_up);
+    printf("edits        : %llu deleted, %llu updated in place, %llu relocated, %llu rewrites\n",
+           g_rows.tombstones, g_rows.in_place, g_rows.relocated, g_rows.fallbacks);
+    pthread_mutex_unlock(&g_rows_mu);
+}
+
+// Copy n bytes from src at *off to the end of dst. Linux asks the kernel to do
+// it (copy_file_range: no trip through user space, and a reflink on XFS/Btrfs);
+// anything else, or a filesystem that refuses, goes through a buffer.
+static int copyRange(int src, int dst, long long *off, long long n) {
+#if defined(__linux__) && defined(SYS_copy_file_range)
+    while (n > 0) {
+        loff_t in = (loff_t)*off;
+        long r = syscall(SYS_copy_file_range, src, &in, dst, NULL, (size_t)(n > (1LL << 30) ? 1LL << 30 : n), 0u);
+        if (r <= 0) {
+            if (r < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) break;
+            return 0;
+        }
+        *off += r; n -= r;
+    }
+    if (n == 0) return 1;
+#endif
+    char *buf = (char*)malloc(BOOK_IO_BUF);
+    if (!buf) return 0;
+    int ok = LSEEK(src, *off, SEEK_SET) == *off;
+    while (ok && n > 0) {
+        long chunk = (long)(n > BOOK_IO_BUF ? BOOK_IO_BUF : n);
+        long r = (long)read(src, buf, (unsigned)chunk);
+        if (r <= 0 || write(dst, buf, (unsigned)r) != r) ok = 0;
+        else { *off += r; n -= r; }
+    }
+    free(buf);
+    return ok;
+}
+
+// The slow path for a row that can't be edited where it was: a new book made of
+// the bytes before the row, repl (nothing if NULL) and the bytes after it, then
+// renamed over the old one. Only the row is read and written by us; the rest
+// is copied kernel-side. off is where the caller saw the row (-1 = unknown, find
+// it). span names the trace spans of the copy and the rename. The new book is
+// built beside path, so the rename never crosses filesystems; the in-memory
+// caches are only told about it when path is the current book. Returns 1 if the
+// row was replaced, 0 if it is no longer in the book, -1 on an I/O error
+// (already reported).
+static int bookReplaceLine(const char *path, long long off, const char *old_line, const char *repl, OpTimer *ot,
+                           const char *const span[2]) {
+    FileStamp st;
+    if (!fileStamp(path, &st)) { printf("[ERROR] Cannot open contacts file!\n"); return -1; }
+    size_t n = strlen(old_line);
+    long long len = -1;
+    char line[MAX_LINE_LEN + 2];
+
+    // where the row is, and how long with its line ending
+    opScanBegin(ot);
+    if (off >= 0 && off + (long long)n <= st.size) {
+        size_t have = (size_t)(st.size - off < (long long)n + 2 ? st.size - off : (long long)n + 2);
+        if (bookPread(path, off, line, have) && memcmp(line, old_line, n) == 0) {
+            if (have == n)                                             len = (long long)n;
+            else if (line[n] == '\n')                                  len = (long long)n + 1;
+            else if (line[n] == '\r' && (have == n + 1 || line[n + 1] == '\n')) len = (long long)have;
+        }
+    }
+    if (len < 0) {
+        FILE *rf = bookOpenRead(path);
+        if (!rf) { opScanEnd(ot); printf("[ERROR] Cannot open contacts file!\n"); return -1; }
+        long long pos = 0;
+        while (len < 0 && fgets(line, sizeof(line), rf)) {
+            opRow(ot, line);
+            size_t ln = strlen(line);
+            char *end = line + strcspn(line, "\n\r");
+            char keep = *end;
+            *end = '\0';
+            if (strcmp(line, old_line) == 0) { off = pos; len = (long long)ln; }
+            *end = keep;
+            pos += (long long)ln;
+        }
+        fclose(rf);
+    }
+    opScanEnd(ot);
+    if (len < 0) return 0;
+
+    char tmpfile[300];
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", path);
+    long long t_commit = nowNs();
+    TRACE_BEGIN(t_copy);
+    int src = open(path, O_RDONLY | O_BINARY);
+    int dst = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    struct stat sb;
+    long long at = 0, tail = off + len;
+    int ok = src >= 0 && dst >= 0 && fstat(src, &sb) == 0 && (long long)sb.st_size >= tail &&
+             copyRange(src, dst, &at, off);
+    if (ok && repl) {
+        size_t rn = strlen(repl);
+        ok = write(dst, repl, (unsigned)rn) == (long)rn && write(dst, "\n", 1) == 1;
+        ot->c->bytes_written += rn + 1;
+    }
+    if (ok) ok = copyRange(src, dst, &tail, (long long)sb.st_size - tail);   // rows appended meanwhile too
+    if (ok && FSYNC(dst) != 0) ok = 0;
+    if (src >= 0) close(src);
+    if (dst >= 0 && close(dst) != 0) ok = 0;
+    TRACE_END(t_copy, span[0]);
+    if (ok) ot->c->bytes_written += (unsigned long long)(sb.st_size - len);
+    if (!ok) {
+        printf("[ERROR] Failed to write temporary file!\n");
+        remove(tmpfile);
+        return -1;
+    }
+
+    int current = strcmp(path, getContactsFile()) == 0;
+    int cache_fresh = current ? bookWriteBegin() : 0;
+    TRACE_BEGIN(t_rename);
+    ok = replaceFile(tmpfile, path);
+    TRACE_END(t_rename, span[1]);
+    if (current) bookWriteEnd(cache_fresh, BOOK_REWRITE);
+    if (!ok) {
+        printf("[ERROR] Failed to replace the contacts file!\n");
+        remove(tmpfile);
+        return -1;
+    }
+    opTimed(ot, PH_WRITE, t_commit);
+    ot->c->rewrites++;
+    return 1;
+}
+
+// bookReplaceLine outside the menus (tests, benchmarks), counted as an update.
+int bookRewriteRow(const char *path, long long off, const char *line, const char *repl) {
+    static const char *const spans[2] = { "rewrite.copy", "rewrite.rename" };
+    OpTimer ot; opBegin(&ot, OP_UPDATE);
+    return bookReplaceLine(path, off, line, repl, &ot, spans);
+}
+
+// ==== Delete (by company/person/email exact-insensitive, phone as E.164) ====
+void deleteContact() {
+    char key[MAX_FIELD_LEN];
+    printf("\n=== Delete Contact ===\n");
+    printf("Enter company / contact person / phone / email to delete (or 0 to cancel): ");
+    if (!fgets(key, sizeof(key), stdin)) { printf("[ERROR] Failed to read input!\n"); return; }
+    key[strcspn(key, "\n")] = '\0';
+    trimWhitespace(key);
+
+    if (strcmp(key, "0") == 0) { printf("[INFO] Delete cancelled.\n"); return; }
+    if (!*key) { printf("[ERROR] Keyword cannot be empty!\n"); return; }
+
+    char key_lower[MAX_FIELD_LEN];
+    strncpy(key_lower, key, MAX_FIELD_LEN - 1);
+    key_lower[MAX_FIELD_LEN - 1] = '\0';
+    for (int i = 0; key_lower[i]; i++) key_lower[i] = (char)tolower((unsigned char)key_lower[i]);
+
+    char key_phone_norm[MAX_FIELD_LEN];
+    normalizePhone(key, key_phone_norm, sizeof(key_phone_norm));
+    int key_is_phone = (int)(strlen(key_phone_norm) > 0);
+    long long key_e164 = key_is_phone ? phoneE164(key) : 0;
+    int key_is_email = (strchr(key, '@') != NULL);
+
+    char key_norm[MAX_FIELD_LEN];
+    strncpy(key_norm, key, MAX_FIELD_LEN - 1); key_norm[MAX_FIELD_LEN - 1] = '\0';
+    normalizeKey(key_norm);
+    OpTimer ot; opBegin(&ot, OP_DELETE);
+    FILE *rf = bookOpenRead(getContactsFile());
+    if (!rf) { printf("[ERROR] No contacts file found!\n"); return; }
+
+    typedef struct {
+        struct Contact c;
+        char rawline[MAX_LINE_LEN];
+        long long off;
+    } Row;
+
+    enum { MAX_MATCH = 1024 };
+    Row matches[MAX_MATCH];
+    int mcount = 0;
+
+    char line[MAX_LINE_LEN];
+    long long pos = 0;
+    opScanBegin(&ot);
+    while (fgets(line, sizeof(line), rf)) {
+        opRow(&ot, line);
+        long long at = pos;
+        pos += (long long)strlen(line);
+        line[strcspn(line, "\n\r")] = '\0';
+        if (!*line) continue;
+
+        struct Contact r;
+        int filled = contactParse(line, &r);
+        opLap(&ot, PH_PARSE);
+
+        if (!filled) continue;
+        const char *company = r.company, *person = r.person, *phone = r.phone, *email = r.email;
+
+        char company_lower[MAX_FIELD_LEN], person_lower[MAX_FIELD_LEN], email_lower[MAX_FIELD_LEN];
+        strncpy(company_lower, company, MAX_FIELD_LEN - 1); company_lower[MAX_FIELD_LEN - 1] = '\0';
+        strncpy(person_lower , person , MAX_FIELD_LEN - 1); person_lower [MAX_FIELD_LEN - 1] = '\0';
+        strncpy(email_lower  , email  , MAX_FIELD_LEN - 1); email_lower  [MAX_FIELD_LEN - 1] = '\0';
+        for (int i = 0; company_lower[i]; i++) company_lower[i] = (char)tolower((unsigned char)company_lower[i]);
+        for (int i = 0; person_lower [i]; i++) person_lower [i] = (char)tolower((unsigned char)person_lower [i]);
+        for (int i = 0; email_lower  [i]; i++) email_lower  [i] = (char)tolower((unsigned char)email_lower  [i]);
+
+        char phone_norm[MAX_FIELD_LEN];
+        normalizePhone(phone, phone_norm, sizeof(phone_norm));
+
+        
+        int match = 0;
+        if (key_is_phone) {
+            TRACE_BEGIN(t_stage);
+            if (*phone_norm && (key_e164 ? phoneE164(phone) == key_e164 : strcmp(phone_norm, key_phone_norm) == 0))
+                match = 1;
+            TRACE_END(t_stage, "delete.match.phone");
+        }
+        if (!match && key_is_email) {
+            TRACE_BEGIN(t_stage);
+            if (*email_lower && strstr(email_lower, key_lower) != NULL) match = 1; // CI substring for email
+            TRACE_END(t_stage, "delete.match.email");
+        }
+        if (!match) {
+            TRACE_BEGIN(t_stage);
+            // Build normalized text keys for robust company/person matching
+            char company_norm[MAX_FIELD_LEN]; strncpy(company_norm, company, MAX_FIELD_LEN - 1); company_norm[MAX_FIELD_LEN - 1] = '\0'; normalizeKey(company_norm);
+            char person_norm [MAX_FIELD_LEN]; strncpy(person_norm , person , MAX_FIELD_LEN - 1); person_norm [MAX_FIELD_LEN - 1] = '\0'; normalizeKey(person_norm);
+            if ((strstr(company_norm, key_norm) != NULL) || (strstr(person_norm, key_norm) != NULL)) {
+                match = 1;
+            }
+            TRACE_END(t_stage, "delete.match.text");
+        }
+        opLap(&ot, PH_MATCH);
+
+        if (match) {
+            ot.c->matches++;
+            if (mcount < MAX_MATCH) {
+                matches[mcount].c = r;
+                strncpy(matches[mcount].rawline, line, MAX_LINE_LEN - 1);
+                matches[mcount].rawline[MAX_LINE_LEN-1] = '\0';
+                matches[mcount].off = at;
+                mcount++;
+            }
+        }
+    }
+    fclose(rf);
+    opScanEnd(&ot);
+
+    if (mcount == 0) {
+        printf("\n[INFO] No record matches '%s'.\n", key);
+        return;
+    }
+
+    int choice_idx = 0;
+    if (mcount == 1) {
+        printf("\n--- Contact to Delete ---\n");
+        contactPrintCard(&matches[0].c);
+        printf("------------------------\n");
+        if (!confirmAction("\nAre you sure you want to delete this contact?")) {
+            printf("[INFO] Delete cancelled.\n");
+            return;
+        }
+        choice_idx = 1;
+    } else {
+        printf("\nMultiple records matched '%s'. Please choose one to delete:\n", key);
+        for (int i = 0; i < mcount; i++) {
+            printf("%d) Company: %s | Person: %s | Phone: %s | Email: %s\n",
+                   i + 1, matches[i].c.company, matches[i].c.person, matches[i].c.phone, matches[i].c.email);
+        }
+        printf("0) Cancel\n");
+
+        int sel = 0;
+        while (1) {
+            printf("Select [0-%d]: ", mcount);
+            int choice = -1;
+            if (!read_int_choice("Enter your choice: ", &choice)) {
+            choice = -1; // จะวิ่งไป default case
+            }
+
+            if (sel == 0) { printf("[INFO] Delete cancelled.\n"); return; }
+            if (sel >= 1 && sel <= mcount) {
+                printf("\n--- Contact to Delete ---\n");
+                contactPrintCard(&matches[sel-1].c);
+                printf("------------------------\n");
+                if (!confirmAction("\nAre you sure you want to delete this contact?")) {
+                    printf("[INFO] Delete cancelled.\n"); return;
+                }
+                choice_idx = sel;
+                break;
+            }
+            printf("[ERROR] Invalid selection. Try again.\n");
+        }
+    }
+
+    const Row *victim = &matches[choice_idx - 1];
+    long long t_commit = nowNs();
+    int cache_fresh = bookWriteBegin();
+    TRACE_BEGIN(t_patch);
+    int deleted = rowDelete(getContactsFile(), victim->off, victim->rawline) == ROW_IN_PLACE;
+    TRACE_END(t_patch, "delete.in_place");
+    bookWriteEnd(cache_fresh, deleted ? BOOK_REWRITE : BOOK_APPEND);   // nothing written: nothing to drop
+    if (deleted) {
+        opTimed(&ot, PH_WRITE, t_commit);
+        ot.c->bytes_written += strlen(victim->rawline) + 1;
+    } else {
+        static const char *const spans[2] = { "delete.copy", "delete.rename" };
+        int r = bookReplaceLine(getContactsFile(), victim->off, victim->rawline, NULL, &ot, spans);
+        if (r < 0) return;
+        deleted = r;
+    }
+
+    if (deleted) printf("\n[SUCCESS] Contact deleted successfully!\n");
+    else         printf("\n[INFO] Nothing was deleted.\n");
+}
+
+// ==== Parallel scan of a mapped book (whole-line ranges, one per worker) ====
+#define SCAN_MAX_THREADS 32
+#define SCAN_PAR_MIN     (1 << 20)    // smaller books are scanned on the calling thread
+
+typedef struct { const char *beg, *end; } BookRange;
+
+// Cut [map, map + len) into n line-aligned ranges (trailing ones may be empty).
+static void splitLines(const char *map, size_t len, int n, BookRange *r) {
+    const char *at = map, *stop = map + len;
+    for (int i = 0; i < n; i++) {
+        const char *end = map + len * (size_t)(i + 1) / (size_t)n;
+        if (i + 1 < n) {
+            const char *nl = end > at ? memchr(end, '\n', (size_t)(stop - end)) : NULL;
+            end = nl ? nl + 1 : (end > at ? stop : at);
+        }
+        r[i].beg = at; r[i].end = end;
+        at = end;
+    }
+}
+
+// Map the book and cut it into line-aligned ranges. Returns the number of
+// ranges (1 for an empty book, with *map = NULL), -1 if it can't be read.
+static int bookMapRanges(const char *path, char **map, size_t *len, BookRange *r) {
+    FileStamp st;
+    *map = NULL; *len = 0;
+    if (!fileStamp(path, &st)) return -1;
+    if (st.size > 0 && !(*map = mapFile(path, len))) return -1;
+    int n = *len >= SCAN_PAR_MIN ? cpuCount() : 1;
+    if (n > SCAN_MAX_THREADS) n = SCAN_MAX_THREADS;
+    splitLines(*map, *len, n, r);
+    return n;
+}
+
+// fn on n parts (part i at base + i * stride): part 0 on the calling thread,
+// and inline for any worker that can't be started.
+static void runParts(int n, void *(*fn)(void*), void *base, size_t stride) {
+    pthread_t th[SCAN_MAX_THREADS];
+    int started[SCAN_MAX_THREADS] = { 0 };
+    for (int i = 1; i < n; i++) started[i] = pthread_create(&th[i], NULL, fn, (char*)base + (size_t)i * stride) == 0;
+    fn(base);
+    for (int i = 1; i < n; i++) {
+        if (started[i]) pthread_join(th[i], NULL);
+        else fn((char*)base + (size_t)i * stride);
+    }
+}
+
+// Next non-empty line in [*p, end) without its line ending; 0 at the end.
+static size_t nextLine(const char **p, const char *end, const char **line) {
+    while (*p < end) {
+        const char *s = *p, *nl = memchr(s, '\n', (size_t)(end - s));
+        size_t n = nl ? (size_t)(nl - s) : (size_t)(end - s);
+        *p = s + n + 1;
+        if (n && s[n - 1] == '\r') n--;
+        if (n) { *line = s; return n; }
+    }
+    return 0;
+}
+
+// ==== Concurrent key map (lock-free open addressing: key hash -> row id) ====
+// For building the phone / email indexes from many parser threads at once.
+// Slots are (key, value) pairs claimed with one CAS on the key word; the value
+// (row id + 1, so 0 means "not published yet") is stored right after. Keys are
+// never removed, so put-if-absent is linearizable: the thread whose CAS lands
+// owns the key, everyone else finds it on the same probe chain.
+//
+// A table more than 70% full grows by cooperative migration: the first thread
+// to notice hangs a table twice the size off it, and every thread that runs
+// into the resize copies chunks of KMAP_CHUNK slots (closing the empty ones
+// with KMAP_MOVED so late inserts can't land behind the copy) before carrying
+// on in the new table. Retired tables stay allocated until the map is freed,
+// so readers never chase freed memory. The fill count is kept in striped,
+// cache-line sized counters and only summed every 64 inserts per stripe.
+#define KMAP_MIN_CAP   1024
+#define KMAP_CHUNK     4096             // slots copied per migration work unit
+#define KMAP_STRIPES   8
+#define KMAP_MOVED     (~0ULL)          // empty slot closed by a resize
+
+typedef struct { atomic_ullong key, val; } KeyMapSlot;
+typedef struct { atomic_size_t n; char pad[64 - sizeof(atomic_size_t)]; } KeyMapStripe;
+
+typedef struct KeyMapTable {
+    size_t cap;                         // power of two
+    KeyMapSlot *slot;
+    KeyMapStripe used[KMAP_STRIPES];
+    _Atomic(struct KeyMapTable*) next;  // set once a resize starts
+    atomic_size_t claimed, done;        // migration chunks handed out / finished
+    struct KeyMapTable *older;          // retired tables, freed with the map
+} KeyMapTable;
+
+struct KeyMap {
+    _Atomic(KeyMapTable*) cur;
+    atomic_ullong resizes, chunks;
+};
+
+static KeyMapTable* kmTableNew(size_t cap) {
+    KeyMapTable *t = (KeyMapTable*)calloc(1, sizeof(*t));
+    if (!t) return NULL;
+    t->slot = (KeyMapSlot*)calloc(cap, sizeof(*t->slot));
+    if (!t->slot) { free(t); return NULL; }
+    t->cap = cap;
+    return t;
+}
+
+static size_t kmUsed(KeyMapTable *t) {
+    size_t n = 0;
+    for (int s = 0; s < KMAP_STRIPES; s++) n += atomic_load(&t->used[s].n);
+    return n;
+}
+
+// 0 and KMAP_MOVED are slot markers: fold such keys onto a neighbour
+static unsigned long long kmKey(unsigned long long key) {
+    return key == 0 ? 1 : key == KMAP_MOVED ? KMAP_MOVED - 1 : key;
+}
+
+static unsigned long long kmWaitVal(KeyMapSlot *s) {
+    unsigned long long v;
+    while ((v = atomic_load(&s->val)) == 0) sched_yield();   // owner is between its two stores
+    return v;
+}
+
+// Room for expect keys below the resize threshold.
+KeyMap* keyMapCreate(size_t expect) {
+    size_t cap = KMAP_MIN_CAP;
+    while (cap / 10 * 7 < expect) cap *= 2;
+    KeyMap *m = (KeyMap*)calloc(1, sizeof(*m));
+    KeyMapTable *t = m ? kmTableNew(cap) : NULL;
+    if (!t) { free(m); return NULL; }
+    atomic_init(&m->cur, t);
+    return m;
+}
+
+void keyMapFree(KeyMap *m) {
+    if (!m) return;
+    KeyMapTable *t = atomic_load(&m->cur), *nx;
+    while ((nx = atomic_load(&t->next)) != NULL) t = nx;   // newest; the retired ones hang off it
+    while (t) {
+        KeyMapTable *older = t->older;
+        free(t->slot);
+        free(t);
+        t = older;
+    }
+    free(m);
+}
+
+static void kmStartResize(KeyMapTable *t) {
+    if (atomic_load(&t->next)) return;
+    KeyMapTable *nt = kmTableNew(t->cap * 2), *expect = NULL;
+    if (!nt) return;                    // keeps filling; a full table makes puts fail
+    nt->older = t;
+    if (!atomic_compare_exchange_strong(&t->next, &expect, nt)) { free(nt->slot); free(nt); }
+}
+
+// Copy t into t->next alongside every other thread that got here, then make
+// the new table current. Returns once all of t has been copied.
+static void kmHelpResize(KeyMap *m, KeyMapTable *t) {
+    KeyMapTable *nt = atomic_load(&t->next);
+    size_t nchunks = (t->cap + KMAP_CHUNK - 1) / KMAP_CHUNK, mask = nt->cap - 1, c;
+    while ((c = atomic_fetch_add(&t->claimed, 1)) < nchunks) {
+        size_t end = (c + 1) * KMAP_CHUNK < t->cap ? (c + 1) * KMAP_CHUNK : t->cap, moved = 0;
+        for (size_t i = c * KMAP_CHUNK; i < end; i++) {
+            KeyMapSlot *s = &t->slot[i];
+            unsigned long long k = atomic_load(&s->key);
+            while (k == 0 && !atomic_compare_exchange_weak(&s->key, &k, KMAP_MOVED)) {}
+            if (k == 0 || k == KMAP_MOVED) continue;
+            unsigned long long v = kmWaitVal(s), zero;
+            for (size_t j = (size_t)k & mask; ; j = (j + 1) & mask) {   // keys are unique here: first hole
+                zero = 0;
+                if (atomic_compare_exchange_strong(&nt->slot[j].key, &zero, k)) { atomic_store(&nt->slot[j].val, v); break; }
+            }
+            moved++;
+        }
+        atomic_fetch_add(&nt->used[c % KMAP_STRIPES].n, moved);
+        atomic_fetch_add(&t->done, 1);
+        atomic_fetch_add(&m->chunks, 1);
+    }
+    while (atomic_load(&t->done) < nchunks) sched_yield();      // chunks other threads still copy
+    KeyMapTable *expect = t;
+    if (atomic_compare_exchange_strong(&m->cur, &expect, nt)) atomic_fetch_add(&m->resizes, 1);
+}
+
+// Insert key -> val unless key is there already. Returns 1 if inserted, 0 if
+// present (*old, if given, receives its value), -1 if the map can't grow.
+int keyMapPut(KeyMap *m, unsigned long long key, unsigned long long val, unsigned long long *old) {
+    unsigned long long k = kmKey(key);
+    KeyMapTable *t = atomic_load(&m->cur);
+    for (;;) {
+        if (atomic_load(&t->next)) { kmHelpResize(m, t); t = atomic_load(&t->next); continue; }
+        size_t mask = t->cap - 1, i = (size_t)k & mask, probes = 0;
+        int closed = 0;
+        for (; probes <= mask; probes++, i = (i + 1) & mask) {
+            KeyMapSlot *s = &t->slot[i];
+            unsigned long long cur = atomic_load(&s->key);
+            if (cur == 0) {
+                if (atomic_compare_exchange_strong(&s->key, &cur, k)) {
+                    atomic_store(&s->val, val + 1);
+                    size_t n = atomic_fetch_add(&t->used[(i >> 6) % KMAP_STRIPES].n, 1) + 1;
+                    if (n % 64 == 0 && kmUsed(t) * 10 > t->cap * 7) kmStartResize(t);
+                    return 1;
+                }
+            }
+            if (cur == k) {
+                if (old) *old = kmWaitVal(s) - 1;
+                return 0;
+            }
+            if (cur == KMAP_MOVED) { closed = 1; break; }
+        }
+        if (!closed) {                  // every slot taken and no resize under way
+            kmStartResize(t);
+            if (!atomic_load(&t->next)) return -1;
+        }
+    }
+}
+
+// Value stored for key; returns 0 if there is none.
+int keyMapGet(KeyMap *m, unsigned long long key, unsigned long long *val) {
+    unsigned long long k = kmKey(key);
+    for (KeyMapTable *t = atomic_load(&m->cur); t; t = atomic_load(&t->next)) {
+        size_t mask = t->cap - 1, i = (size_t)k & mask;
+        for (size_t probes = 0; probes <= mask; probes++, i = (i + 1) & mask) {
+            unsigned long long cur = atomic_load(&t->slot[i].key);
+            if (cur == k) {
+                if (val) *val = kmWaitVal(&t->slot[i]) - 1;
+                return 1;
+            }
+            if (cur == 0 || cur == KMAP_MOVED) break;   // not here; a resize may have it in the next table
+        }
+    }
+    return 0;
+}
+
+void keyMapStats(KeyMap *m, size_t *count, size_t *cap, unsigned long long *resizes) {
+    KeyMapTable *t = atomic_load(&m->cur);
+    if (count)   *count = kmUsed(t);
+    if (cap)     *cap = t->cap;
+    if (resizes) *resizes = atomic_load(&m->resizes);
+}
+
+// The keys a row files under in the phone and email maps (0 = field empty):
+// phoneKey of the phone, email lowercased.
+void keyMapKeys(const char *phone, const char *email, unsigned long long key[2]) {
+    char pk[MAX_FIELD_LEN], ek[MAX_FIELD_LEN];
+    bloomKeys(NULL, email, pk, ek);
+    key[0] = phoneKey(phone);
+    key[1] = *ek ? bloomHash(ek) | 1 : 0;
+}
+
+// ---- parallel build: each parser thread inserts the rows of its range ----
+typedef struct {
+    KeyMap *map[2];
+    const char *base;
+    BookRange r;
+    long rows, dups;
+    int err;
+} KeyMapPart;
+
+static void* keyMapWorker(void *arg) {
+    KeyMapPart *w = (KeyMapPart*)arg;
+    char line[MAX_LINE_LEN];
+    struct Contact c;
+    const char *p = w->r.beg, *s;
+    for (size_t n; (n = nextLine(&p, w->r.end, &s)) > 0; ) {
+        size_t k = n < sizeof(line) ? n : sizeof(line) - 1;
+        memcpy(line, s, k);
+        line[k] = '\0';
+        contactParse(line, &c);
+        unsigned long long key[2];
+        keyMapKeys(c.phone, c.email, key);
+        for (int f = 0; f < 2; f++) {
+            if (!w->map[f] || !key[f]) continue;
+            int r = keyMapPut(w->map[f], key[f], (unsigned long long)(s - w->base), NULL);
+            if (r < 0) w->err = 1;
+            else if (r == 0) w->dups++;
+        }
+        w->rows++;
+    }
+    return NULL;
+}
+
+// Parse the book at path on nthreads threads (0 = one per core for a big
+// book) and file every row's phone / email key under the offset of the row.
+// When a key repeats, one of its rows keeps it (the first in the file on a
+// single thread; otherwise whichever thread got there first). Either map may
+// be NULL. Returns the rows read, -1 on error; *dups (optional) counts the
+// keys that were already present.
+long keyMapBuildBook(const char *path, KeyMap *phone, KeyMap *email, int nthreads, long *dups) {
+    FileStamp st;
+    char *map = NULL;
+    size_t len = 0;
+    if (!fileStamp(path, &st)) return -1;
+    if (st.size > 0 && !(map = mapFile(path, &len))) return -1;
+    if (nthreads <= 0) nthreads = len >= SCAN_PAR_MIN ? cpuCount() : 1;
+    if (nthreads > SCAN_MAX_THREADS) nthreads = SCAN_MAX_THREADS;
+    KeyMapPart part[SCAN_MAX_THREADS];
+    BookRange range[SCAN_MAX_THREADS];
+    splitLines(map, len, nthreads, range);
+    memset(part, 0, sizeof(part));
+    for (int i = 0; i < nthreads; i++) {
+        part[i].map[0] = phone; part[i].map[1] = email;
+        part[i].base = map; part[i].r = range[i];
+    }
+    TRACE_BEGIN(t_build);
+    runParts(nthreads, keyMapWorker, part, sizeof(part[0]));
+    TRACE_END(t_build, "keymap.build");
+    unmapFile(map, len);
+    long rows = 0, d = 0;
+    int err = 0;
+    for (int i = 0; i < nthreads; i++) { rows += part[i].rows; d += part[i].dups; err |= part[i].err; }
+    if (dups) *dups = d;
+    return err ? -1 : rows;
+}
+
+// Every key in the map (any order), for copying into another structure.
+static void keyMapForEach(KeyMap *m, void (*fn)(unsigned long long key, unsigned long long val, void *ctx), void *ctx) {
+    KeyMapTable *t = atomic_load(&m->cur);
+    for (size_t i = 0; i < t->cap; i++) {
+        unsigned long long k = atomic_load(&t->slot[i].key);
+        if (k && k != KMAP_MOVED) fn(k, atomic_load(&t->slot[i].val) - 1, ctx);
+    }
+}
+
+static void uidxAddKey(unsigned long long key, unsigned long long val, void *ctx) {
+    (void)val;
+    uidxInsert((int)(intptr_t)ctx, key);
+}
+
+// Every key of the book into the uniqueness sets. A big book on a multi-core
+// machine is parsed into key maps on all cores and the keys copied over;
+// otherwise one sequential scan. Returns the rows read, -1 on error. Caller
+// holds g_uidx_mu.
+static long uidxScanBook(const char *path, long long size) {
+    if (size < SCAN_PAR_MIN || cpuCount() < 2) return bookScanFrom(path, 0, uidxAdd);
+    KeyMap *m[2] = { NULL, NULL };
+    int ok = 1;
+    for (int f = 0; f < 2; f++)
+        if (g_uidx.keys & (f ? UNIQUE_EMAIL : UNIQUE_PHONE)) ok = ok && (m[f] = keyMapCreate((size_t)(size / 64))) != NULL;
+    long rows = ok ? keyMapBuildBook(path, m[0], m[1], 0, NULL) : bookScanFrom(path, 0, uidxAdd);
+    for (int f = 0; f < 2; f++) {
+        if (ok && rows >= 0 && m[f]) keyMapForEach(m[f], uidxAddKey, (void*)(intptr_t)f);
+        keyMapFree(m[f]);
+    }
+    return rows;
+}
+
+// ==== Pipelined scan (read -> parse -> match -> format, SPSC rings between stages) ====
+// The other way to put more cores on one scan: rather than cutting the book into
+// ranges, give every stage its own thread. The read stage fills batches with
+// whole lines, the parse stage splits them into rows, the match stage marks the
+// rows to keep, and the calling thread formats them, so output stays in file
+// order while the next batches are read and parsed behind it. Stages hand
+// batches on through single-producer/single-consumer rings, and the formatter
+// gives them back to the reader on a free ring: never more than PIPE_BATCHES
+// exist, and a slow consumer (a terminal) stalls the reader instead of letting
+// parsed rows pile up. A ring holds every batch, so a push never waits; a pop
+// polls PIPE_SPIN times, then sleeps until its producer signals.
+//
+// Small books and single-CPU machines run the same stages one batch at a time
+// on the calling thread.
+#define PIPE_RING        8             // slots per ring, >= PIPE_BATCHES
+#define PIPE_BATCHES     6
+#define PIPE_BATCH_BYTES (64 << 10)    // book bytes per batch
+#define PIPE_BATCH_ROWS  1024          // initial row capacity, doubled as needed
+#define PIPE_SPIN        64
+enum { PIPE_READ, PIPE_PARSE, PIPE_MATCH, PIPE_STAGES };
+
+static int g_pipe_mode = PIPE_AUTO;
+static atomic_ullong g_pipe_scans, g_pipe_threaded, g_pipe_batches, g_pipe_stalls;
+
+typedef struct {
+    unsigned head;                     // next slot to pop, consumer only
+    char pad0[64 - sizeof(unsigned)];
+    atomic_uint tail;                  // next slot to fill, written by the producer
+    atomic_int  sleeping;              // consumer is waiting on cv
+    char pad1[64 - sizeof(atomic_uint) - sizeof(atomic_int)];
+    pthread_mutex_t mu;
+    pthread_cond_t  cv;
+    void *slot[PIPE_RING];
+} SpscRing;
+
+typedef struct {
+    char *text; size_t len;            // whole lines (read stage)
+    struct Contact *row;               // parsed rows (parse stage)
+    unsigned char *keep;               // verdicts (match stage)
+    int nrows, cap;
+    unsigned long long lines;          // lines in text, blank ones included
+    int last;                          // nothing in the book after this batch
+} PipeBatch;
+
+typedef struct {
+    FILE *fp;
+    char *carry; size_t ncarry;        // partial last line of the previous read
+    int (*match)(const struct Contact *c, void *ctx);
+    void *mctx;
+    SpscRing ring[PIPE_STAGES + 1];    // ring[s] feeds stage s; ring[PIPE_STAGES] feeds the formatter
+    PipeBatch batch[PIPE_BATCHES];
+    long long busy_ns[PH_COUNT];       // one slot per stage, each written by its own thread
+    atomic_int failed;                 // a batch couldn't grow: rows were dropped
+} Pipe;
+
+typedef struct { Pipe *p; int stage; } PipeStage;
+
+static void ringInit(SpscRing *r) {
+    memset(r, 0, sizeof(*r));
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->sleeping, 0);
+    pthread_mutex_init(&r->mu, NULL);
+    pthread_cond_init(&r->cv, NULL);
+}
+
+static void ringDestroy(SpscRing *r) {
+    pthread_mutex_destroy(&r->mu);
+    pthread_cond_destroy(&r->cv);
+}
+
+static void ringPush(SpscRing *r, void *item) {
+    unsigned t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    r->slot[t % PIPE_RING] = item;
+    atomic_store(&r->tail, t + 1);               // seq_cst: ordered before the sleeping check
+    if (atomic_load(&r->sleeping)) {
+        pthread_mutex_lock(&r->mu);
+        pthread_cond_signal(&r->cv);
+        pthread_mutex_unlock(&r->mu);
+    }
+}
+
+static void* ringPop(SpscRing *r) {
+    for (int spin = 0; atomic_load_explicit(&r->tail, memory_order_acquire) == r->head; spin++) {
+        if (spin < PIPE_SPIN) { sched_yield(); continue; }
+        atomic_fetch_add_explicit(&g_pipe_stalls, 1, memory_order_relaxed);
+        pthread_mutex_lock(&r->mu);
+        atomic_store(&r->sleeping, 1);           // seq_cst: a push after this sees it and signals
+        while (atomic_load(&r->tail) == r->head) pthread_cond_wait(&r->cv, &r->mu);
+        atomic_store(&r->sleeping, 0);
+        pthread_mutex_unlock(&r->mu);
+        break;
+    }
+    return r->slot[r->head++ % PIPE_RING];
+}
+
+// Fill b with the next whole lines of the book. A batch that is one long line
+// goes out as it is, cut where the buffer ends (as fgets would cut it).
+static void pipeRead(Pipe *p, PipeBatch *b) {
+    memcpy(b->text, p->carry, p->ncarry);
+    size_t n = p->ncarry + fread(b->text + p->ncarry, 1, PIPE_BATCH_BYTES - p->ncarry, p->fp);
+    size_t keep = n;
+    b->last = n < PIPE_BATCH_BYTES;              // short read: end of the book (or a read error)
+    if (!b->last) {
+        while (keep && b->text[keep - 1] != '\n') keep--;
+        if (!keep) keep = n;
+    }
+    p->ncarry = n - keep;
+    memcpy(p->carry, b->text + keep, p->ncarry);
+    b->len = keep;
+}
+
+static void pipeParse(Pipe *p, PipeBatch *b) {
+    char line[MAX_LINE_LEN];
+    b->nrows = 0;
+    b->lines = 0;
+    for (const char *s = b->text, *end = b->text + b->len; s < end; ) {
+        const char *ln = s, *nl = memchr(s, '\n', (size_t)(end - s));
+        size_t n = nl ? (size_t)(nl - s) : (size_t)(end - s);
+        s += n + 1;
+        b->lines++;
+        if (n && ln[n - 1] == '\r') n--;
+        if (!n) continue;
+        if (b->nrows == b->cap) {
+            struct Contact *row = (struct Contact*)realloc(b->row, sizeof(*row) * (size_t)b->cap * 2);
+            unsigned char *keep = row ? (unsigned char*)realloc(b->keep, (size_t)b->cap * 2) : NULL;
+            if (row)  b->row = row;
+            if (keep) b->keep = keep;
+            if (!keep) { atomic_store(&p->failed, 1); break; }
+            b->cap *= 2;
+        }
+        if (n >= sizeof(line)) n = sizeof(line) - 1;
+        memcpy(line, ln, n);
+        line[n] = '\0';
+        contactParse(line, &b->row[b->nrows++]);
+    }
+}
+
+static void pipeMatch(Pipe *p, PipeBatch *b) {
+    for (int i = 0; i < b->nrows; i++) b->keep[i] = !p->match || p->match(&b->row[i], p->mctx);
+}
+
+static void pipeStep(Pipe *p, int stage, PipeBatch *b) {
+    static const char *const spans[PIPE_STAGES] = { "pipe.read", "pipe.parse", "pipe.match" };
+    static const int phase[PIPE_STAGES] = { PH_LOAD, PH_PARSE, PH_MATCH };
+    long long t0 = nowNs();
+    if (stage == PIPE_READ)       pipeRead(p, b);
+    else if (stage == PIPE_PARSE) pipeParse(p, b);
+    else                          pipeMatch(p, b);
+    p->busy_ns[phase[stage]] += nowNs() - t0;
+    if (g_trace_on) traceSpan(spans[stage], t0);
+}
+
+static void* pipeStageMain(void *arg) {
+    PipeStage *st = (PipeStage*)arg;
+    PipeBatch *b;
+    do {
+        b = (PipeBatch*)ringPop(&st->p->ring[st->stage]);
+        pipeStep(st->p, st->stage, b);
+        ringPush(&st->p->ring[st->stage + 1], b);
+    } while (!b->last);
+    return NULL;
+}
+
+// The formatter: fn on the kept rows of b. Returns the time it took.
+static long long pipeFormat(PipeBatch *b,
+                            void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                                       void *ctx),
+                            void *ctx, long *shown) {
+    long long t0 = nowNs();
+    for (int i = 0; i < b->nrows; i++) {
+        if (!b->keep[i]) continue;
+        fn(b->row[i].company, b->row[i].person, b->row[i].phone, b->row[i].email, ctx);
+        (*shown)++;
+    }
+    if (g_trace_on) traceSpan("pipe.format", t0);
+    return nowNs() - t0;
+}
+
+void setScanPipeline(int mode) {
+    g_pipe_mode = mode == PIPE_OFF || mode == PIPE_ON ? mode : PIPE_AUTO;
+}
+
+static void pipeFree(Pipe *p) {
+    for (int i = 0; i < PIPE_BATCHES; i++) {
+        free(p->batch[i].text);
+        free(p->batch[i].row);
+        free(p->batch[i].keep);
+    }
+    for (int r = 0; r <= PIPE_STAGES; r++) ringDestroy(&p->ring[r]);
+    free(p->carry);
+    free(p);
+}
+
+// Scan fp from where it stands: match (NULL keeps every row) on the match stage,
+// fn for each kept row in file order on the calling thread. Blank lines are
+// skipped before match sees them. Returns the rows passed to fn, -1 when out of
+// memory. With ot, rows, bytes, matches and the busy time of every stage go to
+// its counters; the stages overlap, so opScanEnd scales them into the scan window.
+static long pipeRun(FILE *fp, int (*match)(const struct Contact *c, void *ctx), void *mctx,
+                    void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                               void *ctx),
+                    void *ctx, OpTimer *ot) {
+    Pipe *p = (Pipe*)calloc(1, sizeof(*p));
+    if (!p) return -1;
+    for (int r = 0; r <= PIPE_STAGES; r++) ringInit(&p->ring[r]);
+    int ok = (p->carry = (char*)malloc(PIPE_BATCH_BYTES)) != NULL;
+    for (int i = 0; ok && i < PIPE_BATCHES; i++) {
+        PipeBatch *b = &p->batch[i];
+        b->cap = PIPE_BATCH_ROWS;
+        ok = (b->text = (char*)malloc(PIPE_BATCH_BYTES)) != NULL &&
+             (b->row = (struct Contact*)malloc(sizeof(*b->row) * PIPE_BATCH_ROWS)) != NULL &&
+             (b->keep = (unsigned char*)malloc(PIPE_BATCH_ROWS)) != NULL;
+    }
+    if (!ok) { pipeFree(p); return -1; }
+    p->fp = fp; p->match = match; p->mctx = mctx;
+    atomic_init(&p->failed, 0);
+
+    int threaded = g_pipe_mode == PIPE_ON ||
+                   (g_pipe_mode == PIPE_AUTO && cpuCount() >= 2 && bookStreamSize(fp) >= SCAN_PAR_MIN);
+    pthread_t th[PIPE_STAGES];
+    PipeStage st[PIPE_STAGES];
+    int first = PIPE_STAGES;                     // stages first.. run on their own threads
+    while (threaded && first > 0) {
+        st[first - 1].p = p; st[first - 1].stage = first - 1;
+        if (pthread_create(&th[first - 1], NULL, pipeStageMain, &st[first - 1]) != 0) break;
+        first--;
+    }
+
+    long shown = 0, batches = 0;
+    unsigned long long lines = 0, bytes = 0;
+    long long format_ns = 0;
+    PipeBatch *b = &p->batch[0];
+    if (first < PIPE_STAGES && first > 0) {      // a stage didn't start: end the ones that did, go inline
+        b->len = 0; b->last = 1;
+        ringPush(&p->ring[first], b);
+        b = (PipeBatch*)ringPop(&p->ring[PIPE_STAGES]);
+    }
+    if (first > 0) {
+        for (b->last = 0; !b->last; ) {
+            for (int s = 0; s < PIPE_STAGES; s++) pipeStep(p, s, b);
+            format_ns += pipeFormat(b, fn, ctx, &shown);
+            lines += b->lines; bytes += b->len; batches++;
+        }
+    } else {
+        for (int i = 0; i < PIPE_BATCHES; i++) ringPush(&p->ring[0], &p->batch[i]);
+        for (int last = 0; !last; ) {
+            b = (PipeBatch*)ringPop(&p->ring[PIPE_STAGES]);
+            format_ns += pipeFormat(b, fn, ctx, &shown);
+            lines += b->lines; bytes += b->len; batches++;
+            last = b->last;
+            ringPush(&p->ring[0], b);
+        }
+    }
+    for (int s = first; s < PIPE_STAGES; s++) pthread_join(th[s], NULL);
+
+    atomic_fetch_add(&g_pipe_scans, 1);
+    if (first == 0) atomic_fetch_add(&g_pipe_threaded, 1);
+    atomic_fetch_add(&g_pipe_batches, (unsigned long long)batches);
+    if (ot) {
+        ot->c->rows_scanned += lines;
+        ot->c->bytes_read   += bytes;
+        ot->c->matches      += (unsigned long long)shown;
+        p->busy_ns[PH_FORMAT] = format_ns;
+        for (int ph = 0; ph < PH_COUNT; ph++) ot->scan_ns[ph] += p->busy_ns[ph];
+    }
+    int failed = atomic_load(&p->failed);
+    pipeFree(p);
+    return failed ? -1 : shown;
+}
+
+long scanPipeline(FILE *fp, int (*match)(const struct Contact *c, void *ctx), void *mctx,
+                  void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+                  void *ctx) {
+    return pipeRun(fp, match, mctx, fn, ctx, NULL);
+}
+
+// counter by name: scans, threaded, batches, stalls (pops that had to sleep)
+unsigned long long getPipeCounter(const char *name) {
+    if (!strcmp(name, "scans"))    return atomic_load(&g_pipe_scans);
+    if (!strcmp(name, "threaded")) return atomic_load(&g_pipe_threaded);
+    if (!strcmp(name, "batches"))  return atomic_load(&g_pipe_batches);
+    if (!strcmp(name, "stalls"))   return atomic_load(&g_pipe_stalls);
+    return 0;
+}
+
+// ==== B+tree index (disk pages behind a bounded buffer pool: field -> row offset) ====
+// For books too big to index in memory. "<book>.company.bpt" (and, when asked
+// for, "<book>.email.bpt") map the lowercased field to the byte offset of each
+// row. Page 0 holds the meta block; leaves hold sorted (key, offset) entries
+// and link to the next leaf; inner pages hold the smallest entry of every child
+// but the leftmost. Keys are cut to BPT_KEY - 1 bytes and entries compare as
+// (key, offset), so a repeated company is just more entries. Rows found through
+// the tree are read back from the book and checked in full, which also drops
+// rows that were blanked since.
+//
+// Every page access goes through one buffer pool of BPT_PAGE frames with clock
+// eviction, sized by CONTACTS_BTREE_POOL: a lookup touches one page per level,
+// a range walks the leaf chain, and memory never grows with the book. A build
+// borrows the pool's frames to sort the keys in runs, merges the runs and
+// writes the tree bottom-up with one open page per level. The meta page keeps
+// the book's stamp: rows appended since are inserted on the next use, and our
+// own in-place deletes and updates (rowDelete / rowReplace) are applied as they
+// happen; any other change rebuilds the tree. Those edits leave the old entry
+// behind, to be dropped by the read-back check like any other stale row.
+#define BPT_PAGE        4096
+#define BPT_KEY         40
+#define BPT_FANOUT      ((BPT_PAGE - 16) / (int)sizeof(BptEnt))
+#define BPT_POOL_MIN    16                    // frames; a split pins three pages at most
+#define BPT_POOL_DEFAULT (4LL << 20)
+#define BPT_MAX_HEIGHT  16
+#define BPT_RUN_BUF     64                    // entries buffered per run while merging
+#define BPT_MAGIC       0x31545042u           // "BPT1"
+enum { BPT_COMPANY, BPT_EMAIL, BPT_FIELDS };
+static const char *k_bpt_fields[BPT_FIELDS] = { "company", "email" };
+
+typedef struct { char key[BPT_KEY]; unsigned long long off; unsigned child, pad; } BptEnt;
+
+typedef struct {
+    unsigned short leaf, n;
+    unsigned link;                            // leaf: next leaf (0 = last); inner: leftmost child
+    unsigned char pad[8];
+    BptEnt e[(BPT_PAGE - 16) / sizeof(BptEnt)];
+    unsigned char tail[(BPT_PAGE - 16) % sizeof(BptEnt)];
+} BptPage;
+
+typedef struct {
+    unsigned magic, field, root, height, npages, pad;
+    unsigned long long nkeys, tail;           // tail: stampTailSum at stamp.size
+    FileStamp stamp;                          // book the tree describes
+} BptMeta;
+
+typedef struct {
+    FILE *fp;
+    char path[300], book[256];
+    BptMeta m;
+} BTree;
+
+typedef struct {
+    BTree *t;                                 // NULL = free frame
+    unsigned page;
+    int pin, next;                            // next: hash chain
+    unsigned char ref, dirty;
+} BptFrame;
+
+static pthread_mutex_t g_bpt_mu = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    BptFrame *f;
+    char *mem;
+    int *bucket;
+    int n, nb, hand;
+    long long bytes;                          // the ceiling: n * BPT_PAGE <= bytes
+    unsigned long long hits, reads, writes, evictions;
+} g_bpool = { NULL, NULL, NULL, 0, 0, 0, BPT_POOL_DEFAULT, 0, 0, 0, 0 };
+static BTree g_bt[BPT_FIELDS];
+static int g_bpt_fields;                      // BTREE_* the query planner may use
+static struct { unsigned long long lookups, builds, appended, edits; } g_bpt;
+
+// ---- buffer pool ----
+static int bpHash(const BTree *t, unsigned page) {
+    return (int)((((unsigned long long)(uintptr_t)t >> 4) ^ page * 2654435761u) % (unsigned)g_bpool.nb);
+}
+
+static int bpInitLocked(void) {
+    if (g_bpool.f) return 1;
+    int n = (int)(g_bpool.bytes / BPT_PAGE);
+    if (n < BPT_POOL_MIN) n = BPT_POOL_MIN;
+    g_bpool.f = (BptFrame*)calloc((size_t)n, sizeof(BptFrame));
+    g_bpool.mem = (char*)malloc((size_t)n * BPT_PAGE);
+    g_bpool.bucket = (int*)malloc(sizeof(int) * (size_t)n * 2);
+    if (!g_bpool.f || !g_bpool.mem || !g_bpool.bucket) {
+        free(g_bpool.f); free(g_bpool.mem); free(g_bpool.bucket);
+        g_bpool.f = NULL; g_bpool.mem = NULL; g_bpool.bucket = NULL;
+        return 0;
+    }
+    g_bpool.n = n; g_bpool.nb = n * 2; g_bpool.hand = 0;
+    for (int i = 0; i < g_bpool.nb; i++) g_bpool.bucket[i] = -1;
+    return 1;
+}
+
+static int bpFind(const BTree *t, unsigned page) {
+    for (int i = g_bpool.bucket[bpHash(t, page)]; i >= 0; i = g_bpool.f[i].next)
+        if (g_bpool.f[i].t == t && g_bpool.f[i].page == page) return i;
+    return -1;
+}
+
+static void bpUnlink(int i) {
+    int *at = &g_bpool.bucket[bpHash(g_bpool.f[i].t, g_bpool.f[i].page)];
+    while (*at != i) at = &g_bpool.f[*at].next;
+    *at = g_bpool.f[i].next;
+    g_bpool.f[i].t = NULL;
+}
+
+static int bpWriteFrame(int i) {
+    BptFrame *fr = &g_bpool.f[i];
+    if (FSEEK(fr->t->fp, (long long)fr->page * BPT_PAGE, SEEK_SET) != 0 ||
+        fwrite(g_bpool.mem + (size_t)i * BPT_PAGE, BPT_PAGE, 1, fr->t->fp) != 1) return 0;
+    fr->dirty = 0;
+    g_bpool.writes++;
+    return 1;
+}
+
+// Clock: pass over frames that were used since the hand last came by, take the
+// first unpinned one that wasn't. -1 if every frame is pinned.
+static int bpVictim(void) {
+    for (int sweep = 0; sweep <= 2 * g_bpool.n; sweep++) {
+        int i = g_bpool.hand;
+        BptFrame *fr = &g_bpool.f[i];
+        g_bpool.hand = (i + 1) % g_bpool.n;
+        if (!fr->t) return i;
+        if (fr->pin) continue;
+        if (fr->ref) { fr->ref = 0; continue; }
+        if (fr->dirty && !bpWriteFrame(i)) return -1;
+        bpUnlink(i);
+        g_bpool.evictions++;
+        return i;
+    }
+    return -1;
+}
+
+// Page `page` of t, pinned; fresh = a new page, zeroed instead of read.
+static BptPage* bpGet(BTree *t, unsigned page, int fresh) {
+    int i = bpFind(t, page);
+    if (i >= 0) {
+        g_bpool.f[i].pin++;
+        g_bpool.f[i].ref = 1;
+        g_bpool.hits++;
+        return (BptPage*)(g_bpool.mem + (size_t)i * BPT_PAGE);
+    }
+    if ((i = bpVictim()) < 0) return NULL;
+    char *data = g_bpool.mem + (size_t)i * BPT_PAGE;
+    size_t got = 0;
+    if (!fresh) {
+        if (FSEEK(t->fp, (long long)page * BPT_PAGE, SEEK_SET) != 0) return NULL;
+        got = fread(data, 1, BPT_PAGE, t->fp);
+        g_bpool.reads++;
+    }
+    memset(data + got, 0, BPT_PAGE - got);
+    BptFrame *fr = &g_bpool.f[i];
+    int h = bpHash(t, page);
+    fr->t = t; fr->page = page; fr->pin = 1; fr->ref = 1; fr->dirty = (unsigned char)fresh;
+    fr->next = g_bpool.bucket[h];
+    g_bpool.bucket[h] = i;
+    return (BptPage*)data;
+}
+
+static void bpPut(BTree *t, unsigned page, int dirty) {
+    int i = bpFind(t, page);
+    if (i < 0) return;
+    g_bpool.f[i].pin--;
+    if (dirty) g_bpool.f[i].dirty = 1;
+}
+
+// Write t's dirty frames (t NULL: every tree's); drop = also free the frames.
+static int bpFlush(const BTree *t, int drop) {
+    int ok = 1;
+    for (int i = 0; g_bpool.f && i < g_bpool.n; i++) {
+        BptFrame *fr = &g_bpool.f[i];
+        if (!fr->t || (t && fr->t != t)) continue;
+        if (fr->dirty && !bpWriteFrame(i)) ok = 0;
+        if (drop) bpUnlink(i);
+    }
+    return ok;
+}
+
+// ---- keys and pages ----
+static void bptKey(const char *s, char key[BPT_KEY]) {
+    memset(key, 0, BPT_KEY);
+    for (int i = 0; i < BPT_KEY - 1 && s[i]; i++) key[i] = (char)tolower((unsigned char)s[i]);
+}
+
+static int bptCmp(const BptEnt *a, const char *key, unsigned long long off) {
+    int c = memcmp(a->key, key, BPT_KEY);
+    return c ? c : a->off < off ? -1 : a->off > off;
+}
+
+static int bptEntCmp(const void *a, const void *b) {
+    return bptCmp((const BptEnt*)a, ((const BptEnt*)b)->key, ((const BptEnt*)b)->off);
+}
+
+// First entry of p not below (key, off); with upper, first entry above it.
+static int bptSearch(const BptPage *p, const char *key, unsigned long long off, int upper) {
+    int lo = 0, hi = p->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2, c = bptCmp(&p->e[mid], key, off);
+        if (c < 0 || (upper && c == 0)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int bptMetaWrite(BTree *t) {
+    return FSEEK(t->fp, 0, SEEK_SET) == 0 && fwrite(&t->m, sizeof(t->m), 1, t->fp) == 1 && fflush(t->fp) == 0;
+}
+
+// The leaf that holds (or would hold) (key, off); path gets the inner pages
+// above it, root first. 0 on an I/O error (page 0 is the meta page).
+static unsigned bptDescend(BTree *t, const char *key, unsigned long long off, unsigned *path) {
+    unsigned page = t->m.root;
+    for (unsigned lvl = 0; lvl + 1 < t->m.height; lvl++) {
+        BptPage *p = bpGet(t, page, 0);
+        if (!p) return 0;
+        if (path) path[lvl] = page;
+        int i = bptSearch(p, key, off, 1);
+        unsigned next = i ? p->e[i - 1].child : p->link;
+        bpPut(t, page, 0);
+        page = next;
+    }
+    return page;
+}
+
+// Insert one entry, splitting full pages on the way back up.
+static int bptInsert(BTree *t, const char *key, unsigned long long off) {
+    unsigned path[BPT_MAX_HEIGHT];
+    unsigned page = bptDescend(t, key, off, path);
+    if (!page) return 0;
+    BptEnt ins;
+    memset(&ins, 0, sizeof(ins));
+    memcpy(ins.key, key, BPT_KEY);
+    ins.off = off;
+    for (int lvl = (int)t->m.height - 1; ; lvl--) {
+        BptPage *p = bpGet(t, page, 0);
+        if (!p) return 0;
+        int pos = bptSearch(p, ins.key, ins.off, !p->leaf);
+        if (p->n < BPT_FANOUT) {
+            memmove(&p->e[pos + 1], &p->e[pos], sizeof(BptEnt) * (size_t)(p->n - pos));
+            p->e[pos] = ins;
+            p->n++;
+            bpPut(t, page, 1);
+            break;
+        }
+        if (t->m.height == BPT_MAX_HEIGHT && lvl == 0) { bpPut(t, page, 0); return 0; }
+        BptEnt all[BPT_FANOUT + 1];
+        memcpy(all, p->e, sizeof(BptEnt) * (size_t)pos);
+        all[pos] = ins;
+        memcpy(all + pos + 1, p->e + pos, sizeof(BptEnt) * (size_t)(p->n - pos));
+        unsigned rpage = t->m.npages;
+        BptPage *r = bpGet(t, rpage, 1);
+        if (!r) { bpPut(t, page, 0); return 0; }
+        t->m.npages++;
+        int mid = (BPT_FANOUT + 1) / 2;
+        r->leaf = p->leaf;
+        p->n = (unsigned short)mid;
+        memcpy(p->e, all, sizeof(BptEnt) * (size_t)mid);
+        if (p->leaf) {                        // right half keeps its first entry; a copy goes up
+            r->n = (unsigned short)(BPT_FANOUT + 1 - mid);
+            memcpy(r->e, all + mid, sizeof(BptEnt) * r->n);
+            r->link = p->link;
+            p->link = rpage;
+        } else {                              // the middle entry moves up, its child leads the right half
+            r->n = (unsigned short)(BPT_FANOUT - mid);
+            memcpy(r->e, all + mid + 1, sizeof(BptEnt) * r->n);
+            r->link = all[mid].child;
+        }
+        ins = all[mid];
+        ins.child = rpage;
+        bpPut(t, rpage, 1);
+        bpPut(t, page, 1);
+        if (lvl == 0) {                       // the root split: grow a level
+            unsigned nroot = t->m.npages;
+            BptPage *root = bpGet(t, nroot, 1);
+            if (!root) return 0;
+            t->m.npages++;
+            root->leaf = 0;
+            root->n = 1;
+            root->link = page;
+            root->e[0] = ins;
+            bpPut(t, nroot, 1);
+            t->m.root = nroot;
+            t->m.height++;
+            break;
+        }
+        page = path[lvl - 1];
+    }
+    t->m.nkeys++;
+    return 1;
+}
+
+// ---- bulk build: sorted runs in the pool's memory, k-way merge, bottom-up load ----
+typedef struct {
+    BTree *t;
+    BptPage pg[BPT_MAX_HEIGHT];               // the open page of every level
+    BptEnt  min[BPT_MAX_HEIGHT];              // smallest entry under it
+    int     has[BPT_MAX_HEIGHT];              // inner page has its leftmost child
+    unsigned leaf_no;                         // page number reserved for the open leaf
+    unsigned long long written[BPT_MAX_HEIGHT];
+    int top, err;
+} BptLoad;
+
+static void bptWritePage(BptLoad *b, unsigned no, const BptPage *p) {
+    if (FSEEK(b->t->fp, (long long)no * BPT_PAGE, SEEK_SET) != 0 || fwrite(p, BPT_PAGE, 1, b->t->fp) != 1) b->err = 1;
+    g_bpool.writes++;
+}
+
+static void bptLoadPush(BptLoad *b, int lvl, const BptEnt *e, unsigned child);
+
+// Write level lvl's open page and hand its smallest entry to the level above.
+static void bptLoadClose(BptLoad *b, int lvl, int more) {
+    BptPage *p = &b->pg[lvl];
+    unsigned no;
+    if (lvl == 0) {                           // leaves are numbered ahead so each can link to the next
+        no = b->leaf_no;
+        p->link = more ? (b->leaf_no = b->t->m.npages++) : 0;
+    } else {
+        no = b->t->m.npages++;
+    }
+    bptWritePage(b, no, p);
+    b->written[lvl]++;
+    BptEnt sep = b->min[lvl];
+    memset(p, 0, sizeof(*p));
+    p->leaf = lvl == 0;
+    b->has[lvl] = 0;
+    if (b->top < lvl + 1) b->top = lvl + 1;
+    bptLoadPush(b, lvl + 1, &sep, no);
+}
+
+static void bptLoadPush(BptLoad *b, int lvl, const BptEnt *e, unsigned child) {
+    if (lvl >= BPT_MAX_HEIGHT) { b->err = 1; return; }
+    BptPage *p = &b->pg[lvl];
+    if (lvl == 0) {
+        if (p->n == BPT_FANOUT) bptLoadClose(b, 0, 1);
+        if (!p->n) b->min[0] = *e;
+        p->e[p->n] = *e;
+        p->e[p->n].child = 0;
+        p->n++;
+        return;
+    }
+    if (b->has[lvl] && p->n == BPT_FANOUT) bptLoadClose(b, lvl, 1);
+    if (!b->has[lvl]) { p->link = child; b->min[lvl] = *e; b->has[lvl] = 1; return; }
+    p->e[p->n] = *e;
+    p->e[p->n].child = child;
+    p->n++;
+}
+
+// Close every level; the first level holding a single page is the root.
+static void bptLoadFinish(BptLoad *b) {
+    for (int lvl = 0; !b->err; lvl++) {
+        if (lvl == b->top && b->written[lvl] == 0) {
+            unsigned no = lvl == 0 ? b->leaf_no : b->t->m.npages++;
+            if (lvl == 0) b->pg[0].link = 0;
+            bptWritePage(b, no, &b->pg[lvl]);
+            b->t->m.root = no;
+            b->t->m.height = (unsigned)lvl + 1;
+            return;
+        }
+        bptLoadClose(b, lvl, 0);
+    }
+}
+
+typedef struct { long long pos, end; int n, i; BptEnt buf[BPT_RUN_BUF]; } BptRun;
+
+static int bptRunNext(FILE *fp, BptRun *r) {
+    if (r->i < r->n) return 1;
+    if (r->pos >= r->end) return 0;
+    long long left = (r->end - r->pos) / (long long)sizeof(BptEnt);
+    r->n = (int)(left < BPT_RUN_BUF ? left : BPT_RUN_BUF);
+    r->i = 0;
+    if (FSEEK(fp, r->pos, SEEK_SET) != 0 || fread(r->buf, sizeof(BptEnt), (size_t)r->n, fp) != (size_t)r->n) return 0;
+    r->pos += (long long)r->n * (long long)sizeof(BptEnt);
+    return 1;
+}
+
+// Min-heap of run numbers by their current entry.
+static void bptHeapDown(BptRun *runs, int *heap, int n, int at) {
+    for (;;) {
+        int l = 2 * at + 1, m = at;
+        if (l < n && bptEntCmp(&runs[heap[l]].buf[runs[heap[l]].i], &runs[heap[m]].buf[runs[heap[m]].i]) < 0) m = l;
+        if (l + 1 < n && bptEntCmp(&runs[heap[l + 1]].buf[runs[heap[l + 1]].i], &runs[heap[m]].buf[runs[heap[m]].i]) < 0) m = l + 1;
+        if (m == at) return;
+        int tmp = heap[at]; heap[at] = heap[m]; heap[m] = tmp;
+        at = m;
+    }
+}
+
+static int bptMerge(BptLoad *b, FILE *rf, const long long *bound, int nruns) {
+    BptRun *runs = (BptRun*)malloc(sizeof(BptRun) * (size_t)nruns);
+    int *heap = (int*)malloc(sizeof(int) * (size_t)nruns), n = 0;
+    if (!runs || !heap) { free(runs); free(heap); return 0; }
+    for (int r = 0; r < nruns; r++) {
+        runs[r].pos = bound[r]; runs[r].end = bound[r + 1]; runs[r].n = runs[r].i = 0;
+        if (bptRunNext(rf, &runs[r])) heap[n++] = r;
+    }
+    for (int i = n / 2 - 1; i >= 0; i--) bptHeapDown(runs, heap, n, i);
+    while (n && !b->err) {
+        BptRun *r = &runs[heap[0]];
+        bptLoadPush(b, 0, &r->buf[r->i++], 0);
+        if (!bptRunNext(rf, r)) heap[0] = heap[--n];
+        bptHeapDown(runs, heap, n, 0);
+    }
+    free(runs);
+    free(heap);
+    return !b->err;
+}
+
+// One (key, offset) per line of the book from byte `from` on; fgets pieces of
+// over-long lines count as rows, the same way every reader splits them.
+static int bptBookRows(const char *book, long long from, int field,
+                       int (*fn)(const char *key, unsigned long long off, void *ctx), void *ctx) {
+    FILE *fp = bookOpenRead(book);
+    if (!fp) return 0;
+    if (from > 0 && FSEEK(fp, from, SEEK_SET) != 0) { fclose(fp); return 0; }
+    char line[MAX_LINE_LEN], key[BPT_KEY];
+    struct Contact c;
+    unsigned long long off = (unsigned long long)from;
+    int ok = 1;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        size_t n = strlen(line);
+        unsigned long long at = off;
+        off += n;
+        line[strcspn(line, "\n\r")] = '\0';
+        if (!*line) continue;
+        contactParse(line, &c);
+        bptKey(field == BPT_EMAIL ? c.email : c.company, key);
+        ok = fn(key, at, ctx);
+    }
+    fclose(fp);
+    return ok;
+}
+
+typedef struct {
+    BptEnt *buf; size_t n, cap;
+    unsigned long long total;
+    char path[310]; FILE *rf;                 // spilled runs, back to back
+    long long *bound; int nruns, cap_runs;    // run r is [bound[r], bound[r + 1])
+} BptSort;
+
+static int bptSortRun(BptSort *s) {
+    qsort(s->buf, s->n, sizeof(BptEnt), bptEntCmp);
+    if (s->nruns + 2 > s->cap_runs) {
+        int ncap = s->cap_runs ? s->cap_runs * 2 : 16;
+        long long *nb = (long long*)realloc(s->bound, sizeof(long long) * (size_t)ncap);
+        if (!nb) return 0;
+        s->bound = nb; s->cap_runs = ncap;
+    }
+    if (!s->nruns) s->bound[0] = 0;
+    if (fwrite(s->buf, sizeof(BptEnt), s->n, s->rf) != s->n) return 0;
+    s->bound[s->nruns + 1] = s->bound[s->nruns] + (long long)(s->n * sizeof(BptEnt));
+    s->nruns++;
+    s->n = 0;
+    return 1;
+}
+
+static int bptSortAdd(const char *key, unsigned long long off, void *ctx) {
+    BptSort *s = (BptSort*)ctx;
+    if (s->n == s->cap) {
+        if (!s->rf && !(s->rf = fopen(s->path, "w+b"))) return 0;
+        if (!bptSortRun(s)) return 0;
+    }
+    BptEnt *e = &s->buf[s->n++];
+    memset(e, 0, sizeof(*e));
+    memcpy(e->key, key, BPT_KEY);
+    e->off = off;
+    s->total++;
+    return 1;
+}
+
+static int bptBuildLocked(BTree *t, const FileStamp *st) {
+    TRACE_BEGIN(t_build);
+    bpFlush(NULL, 1);                         // the pool's frames become the sort buffer
+    BptSort s;
+    memset(&s, 0, sizeof(s));
+    s.buf = (BptEnt*)g_bpool.mem;
+    s.cap = (size_t)g_bpool.n * BPT_PAGE / sizeof(BptEnt);
+    snprintf(s.path, sizeof(s.path), "%s.runs", t->path);
+    memset(&t->m, 0, sizeof(t->m));
+    t->m.field = (unsigned)(t - g_bt);
+    t->m.npages = 1;
+    int ok = bptMetaWrite(t) && bptBookRows(t->book, 0, (int)t->m.field, bptSortAdd, &s);
+    BptLoad *b = ok ? (BptLoad*)calloc(1, sizeof(BptLoad)) : NULL;
+    if (b) {
+        b->t = t;
+        b->pg[0].leaf = 1;
+        b->leaf_no = t->m.npages++;
+        if (!s.rf) {
+            qsort(s.buf, s.n, sizeof(BptEnt), bptEntCmp);
+            for (size_t i = 0; i < s.n && !b->err; i++) bptLoadPush(b, 0, &s.buf[i], 0);
+        } else {
+            ok = (!s.n || bptSortRun(&s)) && bptMerge(b, s.rf, s.bound, s.nruns);
+        }
+        bptLoadFinish(b);
+        ok = ok && !b->err;
+        free(b);
+    } else {
+        ok = 0;
+    }
+    if (s.rf) { fclose(s.rf); remove(s.path); }
+    free(s.bound);
+    if (!ok) return 0;
+    t->m.magic = BPT_MAGIC;
+    t->m.nkeys = s.total;
+    t->m.stamp = *st;                         // taken before the scan: a concurrent append shows up as stale
+    t->m.tail = stampTailSum(t->book, st->size);
+    g_bpt.builds++;
+    TRACE_END(t_build, "btree.build");
+    return bptMetaWrite(t);
+}
+
+static int bptAppendRow(const char *key, unsigned long long off, void *ctx) {
+    g_bpt.appended++;
+    return bptInsert((BTree*)ctx, key, off);
+}
+
+static void bptCloseLocked(BTree *t) {
+    if (!t->fp) return;
+    bpFlush(t, 1);
+    fclose(t->fp);
+    t->fp = NULL;
+}
+
+// Point the closed t at book's tree file and read its meta page (zeroed if
+// there is none).
+static void bptAttachLocked(BTree *t, const char *book, int field) {
+    snprintf(t->book, sizeof(t->book), "%s", book);
+    snprintf(t->path, sizeof(t->path), "%s.%s.bpt", book, k_bpt_fields[field]);
+    memset(&t->m, 0, sizeof(t->m));
+    if ((t->fp = fopen(t->path, "r+b")) && fread(&t->m, sizeof(t->m), 1, t->fp) != 1) memset(&t->m, 0, sizeof(t->m));
+}
+
+// The tree of field for book as the book is now: opened, caught up with
+// appended rows or rebuilt. Caller holds g_bpt_mu.
+static BTree* bptOpenLocked(const char *book, int field) {
+    BTree *t = &g_bt[field];
+    FileStamp st;
+    if (!bpInitLocked() || !fileStamp(book, &st)) return NULL;
+    if (t->fp && strcmp(t->book, book) != 0) bptCloseLocked(t);
+    if (t->fp && t->m.magic == BPT_MAGIC && stampTrusted(&t->m.stamp, &st)) return t;
+    if (!t->fp) bptAttachLocked(t, book, field);
+    long long from = t->fp && t->m.magic == BPT_MAGIC && t->m.field == (unsigned)field
+                   ? stampAppendedFrom(book, &t->m.stamp, t->m.tail, &st) : -1;
+    int ok;
+    if (from >= 0) {
+        TRACE_BEGIN(t_append);
+        ok = from == st.size || bptBookRows(book, from, field, bptAppendRow, t);
+        ok = bpFlush(t, 0) && ok;
+        TRACE_END(t_append, "btree.append");
+        if (ok) {
+            t->m.stamp = st;
+            t->m.tail = stampTailSum(book, st.size);
+            ok = bptMetaWrite(t);
+        }
+    } else {
+        if (t->fp) { bpFlush(t, 1); fclose(t->fp); }
+        ok = (t->fp = fopen(t->path, "w+b")) != NULL && bptBuildLocked(t, &st);
+    }
+    if (!ok) {
+        if (t->fp) { bpFlush(t, 1); fclose(t->fp); t->fp = NULL; }
+        remove(t->path);
+        return NULL;
+    }
+    return t;
+}
+
+// Whether t already holds the entry (key, off).
+static int bptHas(BTree *t, const char *key, unsigned long long off) {
+    unsigned page = bptDescend(t, key, off, NULL);
+    BptPage *p = page ? bpGet(t, page, 0) : NULL;
+    if (!p) return 0;
+    int i = bptSearch(p, key, off, 0);
+    int has = i < p->n && bptCmp(&p->e[i], key, off) == 0;
+    bpPut(t, page, 0);
+    return has;
+}
+
+// One of our own row edits took book from `before` to `after`: the row at off
+// was blanked (row NULL) or now reads `row`. A tree that described `before`
+// gets the row's key, unless it already has that entry, and takes `after`, so
+// the edit costs one insert instead of a rebuild. Any other tree is left for
+// bptOpenLocked to judge. Called with g_rows_mu held.
+static void bptRowEdited(const char *book, const FileStamp *before, unsigned long long before_tail,
+                         const FileStamp *after, unsigned long long after_tail, long long off, const char *row) {
+    pthread_mutex_lock(&g_bpt_mu);
+    for (int f = 0; f < BPT_FIELDS && bpInitLocked(); f++) {
+        BTree *t = &g_bt[f];
+        if (t->fp && strcmp(t->book, book) != 0) continue;      // another book's tree stays open
+        if (!t->fp) bptAttachLocked(t, book, f);
+        if (!t->fp || t->m.magic != BPT_MAGIC || t->m.field != (unsigned)f || t->m.tail != before_tail ||
+            !stampTrusted(&t->m.stamp, before)) continue;
+        int ok = 1;
+        if (row) {
+            struct Contact c;
+            char key[BPT_KEY];
+            contactParse(row, &c);
+            bptKey(f == BPT_EMAIL ? c.email : c.company, key);
+            ok = bptHas(t, key, (unsigned long long)off) || bptInsert(t, key, (unsigned long long)off);
+            ok = bpFlush(t, 0) && ok;
+        }
+        if (ok) {
+            t->m.stamp = *after;
+            t->m.tail = after_tail;
+            g_bpt.edits++;
+        } else {
+            t->m.magic = 0;                   // half applied: the next use rebuilds
+        }
+        bptMetaWrite(t);
+    }
+    pthread_mutex_unlock(&g_bpt_mu);
+}
+
+// Lowercased field value v against a walk's bounds: equal to lo (exact), or
+// lo <= v and (v <= hi or v starts with hi).
+static int bptInBounds(const char *v, const char *lo, const char *hi, int exact) {
+    if (exact) return strcmp(v, lo) == 0;
+    return strcmp(v, lo) >= 0 && (!hi || strncmp(v, hi, strlen(hi)) <= 0);
+}
+
+// fn(offset) for the entries of t from lo on, in key order, while the key is
+// within the bounds (see bptInBounds; on the cut keys). Stops early when fn
+// returns 0. Returns entries visited, -1 on an I/O error.
+static long bptWalk(BTree *t, const char *lo, const char *hi, int exact,
+                    int (*fn)(unsigned long long off, void *ctx), void *ctx) {
+    char klo[BPT_KEY], khi[BPT_KEY];
+    bptKey(lo, klo);
+    if (hi) bptKey(hi, khi);
+    size_t nhi = hi ? strlen(khi) : 0;
+    unsigned page = bptDescend(t, klo, 0, NULL);
+    if (!page) return -1;
+    g_bpt.lookups++;
+    BptPage *p = bpGet(t, page, 0);
+    if (!p) return -1;
+    long seen = 0;
+    for (int i = bptSearch(p, klo, 0, 0); ; i++) {
+        if (i == p->n) {
+            unsigned next = p->link;
+            bpPut(t, page, 0);
+            if (!next) return seen;
+            if (!(p = bpGet(t, page = next, 0))) return -1;
+            i = -1;
+            continue;
+        }
+        const char *k = p->e[i].key;
+        if (exact ? memcmp(k, klo, BPT_KEY) != 0 : (hi && strncmp(k, khi, nhi) > 0)) break;
+        seen++;
+        if (!fn(p->e[i].off, ctx)) break;
+    }
+    bpPut(t, page, 0);
+    return seen;
+}
+
+typedef struct {
+    FILE *fp;
+    int field;
+    const char *lo, *hi;
+    int exact;
+    void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx);
+    void *ctx;
+    long hits;
+} BptFetch;
+
+// Read the row at off back from the book; report it if it still qualifies.
+static int bptFetchRow(unsigned long long off, void *ctx) {
+    BptFetch *f = (BptFetch*)ctx;
+    char line[MAX_LINE_LEN], v[MAX_FIELD_LEN];
+    struct Contact c;
+    if (FSEEK(f->fp, off, SEEK_SET) != 0 || !fgets(line, sizeof(line), f->fp)) return 1;
+    line[strcspn(line, "\n\r")] = '\0';
+    if (!*line) return 1;                     // blanked by a delete since
+    contactParse(line, &c);
+    snprintf(v, sizeof(v), "%s", f->field == BPT_EMAIL ? c.email : c.company);
+    toLowerInPlace(v);
+    if (!bptInBounds(v, f->lo, f->hi, f->exact)) return 1;
+    if (f->fn) f->fn(c.company, c.person, c.phone, c.email, f->ctx);
+    f->hits++;
+    return 1;
+}
+
+// Rows of book whose field (BTREE_COMPANY / BTREE_EMAIL) equals key (exact), or
+// lies in [lo, hi] where hi also takes everything that starts with it (hi NULL:
+// no upper end; a prefix p is [p, p]). Case-insensitive; rows come in key order.
+// Returns the number of rows, -1 if the index can't be built or read.
+long btreeFind(const char *book, int field, const char *lo, const char *hi, int exact,
+               void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+               void *ctx) {
+    int f = field == BTREE_EMAIL ? BPT_EMAIL : BPT_COMPANY;
+    char llo[MAX_FIELD_LEN], lhi[MAX_FIELD_LEN];
+    snprintf(llo, sizeof(llo), "%s", lo ? lo : "");
+    snprintf(lhi, sizeof(lhi), "%s", hi ? hi : "");
+    toLowerInPlace(llo);
+    toLowerInPlace(lhi);
+    BptFetch fetch = { NULL, f, llo, hi ? lhi : NULL, exact, fn, ctx, 0 };
+    pthread_mutex_lock(&g_bpt_mu);
+    BTree *t = bptOpenLocked(book, f);
+    long seen = -1;
+    if (t && (fetch.fp = fopen(book, "r"))) {
+        seen = bptWalk(t, llo, fetch.hi, exact, bptFetchRow, &fetch);
+        fclose(fetch.fp);
+    }
+    pthread_mutex_unlock(&g_bpt_mu);
+    return seen < 0 ? -1 : fetch.hits;
+}
+
+typedef struct { unsigned long long *off; size_t n, cap, max; } BptOffsets;
+
+static int bptCollect(unsigned long long off, void *ctx) {
+    BptOffsets *o = (BptOffsets*)ctx;
+    if (o->n == o->max) return 0;
+    if (o->n == o->cap) {
+        size_t ncap = o->cap ? o->cap * 2 : 256;
+        unsigned long long *no = (unsigned long long*)realloc(o->off, ncap * sizeof(*no));
+        if (!no) { o->max = o->n; return 0; }
+        o->off = no; o->cap = ncap;
+    }
+    o->off[o->n++] = off;
+    return 1;
+}
+
+// Offsets of the candidate rows for btreeFind's bounds, appended to *off / *n
+// (*cap: its allocated size). 0 if more than max would be needed or there is no
+// usable index: the caller scans instead.
+int btreeOffsets(const char *book, int field, const char *lo, const char *hi, int exact,
+                 unsigned long long **off, size_t *n, size_t *cap, size_t max) {
+    BptOffsets o = { *off, *n, *cap, max };
+    pthread_mutex_lock(&g_bpt_mu);
+    BTree *t = bptOpenLocked(book, field == BTREE_EMAIL ? BPT_EMAIL : BPT_COMPANY);
+    long seen = t ? bptWalk(t, lo, hi, exact, bptCollect, &o) : -1;
+    pthread_mutex_unlock(&g_bpt_mu);
+    *off = o.off; *n = o.n; *cap = o.cap;
+    return seen >= 0 && o.n < max;
+}
+
+// Fields the query planner may answer through a B+tree (BTREE_COMPANY |
+// BTREE_EMAIL, 0 = none) and the pool's memory ceiling (0 = keep).
+void setBtreeOptions(int fields, long long pool_bytes) {
+    pthread_mutex_lock(&g_bpt_mu);
+    g_bpt_fields = fields & (BTREE_COMPANY | BTREE_EMAIL);
+    if (pool_bytes > 0 && pool_bytes != g_bpool.bytes) {
+        for (int f = 0; f < BPT_FIELDS; f++) bptCloseLocked(&g_bt[f]);
+        free(g_bpool.f); free(g_bpool.mem); free(g_bpool.bucket);
+        g_bpool.f = NULL; g_bpool.mem = NULL; g_bpool.bucket = NULL;
+        g_bpool.bytes = pool_bytes;
+    }
+    pthread_mutex_unlock(&g_bpt_mu);
+}
+
+static int btreeFields(void) {
+    pthread_mutex_lock(&g_bpt_mu);
+    int f = g_bpt_fields;
+    pthread_mutex_unlock(&g_bpt_mu);
+    return f;
+}
+
+// Write back dirty pages and close the trees (their files stay).
+void btreeClose(void) {
+    pthread_mutex_lock(&g_bpt_mu);
+    for (int f = 0; f < BPT_FIELDS; f++) bptCloseLocked(&g_bt[f]);
+    pthread_mutex_unlock(&g_bpt_mu);
+}
+
+// counter by name: hits, reads, writes, evictions (pool), lookups, builds,
+// appended, edits, frames, height / keys / pages (company tree)
+unsigned long long getBtreeCounter(const char *name) {
+    pthread_mutex_lock(&g_bpt_mu);
+    unsigned long long v = 0;
+    if      (!strcmp(name, "hits"))      v = g_bpool.hits;
+    else if (!strcmp(name, "reads"))     v = g_bpool.reads;
+    else if (!strcmp(name, "writes"))    v = g_bpool.writes;
+    else if (!strcmp(name, "evictions")) v = g_bpool.evictions;
+    else if (!strcmp(name, "frames"))    v = (unsigned long long)g_bpool.n;
+    else if (!strcmp(name, "lookups"))   v = g_bpt.lookups;
+    else if (!strcmp(name, "builds"))    v = g_bpt.builds;
+    else if (!strcmp(name, "appended"))  v = g_bpt.appended;
+    else if (!strcmp(name, "edits"))     v = g_bpt.edits;
+    else if (!strcmp(name, "height"))    v = g_bt[BPT_COMPANY].m.height;
+    else if (!strcmp(name, "keys"))      v = g_bt[BPT_COMPANY].m.nkeys;
+    else if (!strcmp(name, "pages"))     v = g_bt[BPT_COMPANY].m.npages;
+    pthread_mutex_unlock(&g_bpt_mu);
+    return v;
+}
+
+void printBtreeStats(void) {
+    pthread_mutex_lock(&g_bpt_mu);
+    printf("\n=== B+tree Index ===\n");
+    printf("pool         : %d frame(s) x %d B (ceiling %lld KB)\n", g_bpool.n, BPT_PAGE, g_bpool.bytes >> 10);
+    printf("pages        : %llu hit(s), %llu read, %llu written, %llu evicted\n", g_bpool.hits, g_bpool.reads,
+           g_bpool.writes, g_bpool.evictions);
+    printf("lookups      : %llu, builds %llu, rows appended %llu, rows edited %llu\n", g_bpt.lookups, g_bpt.builds,
+           g_bpt.appended, g_bpt.edits);
+    for (int f = 0; f < BPT_FIELDS; f++) {
+        const BTree *t = &g_bt[f];
+        if (!t->fp) continue;
+        printf("%-12s : %llu key(s), height %u, %u page(s) (%s)\n", k_bpt_fields[f], t->m.nkeys, t->m.height,
+               t->m.npages, t->path);
+    }
+    pthread_mutex_unlock(&g_bpt_mu);
+}
+
+static void btreePrintCsv(const char *company, const char *person, const char *phone, const char *email, void *ctx) {
+    (void)ctx;
+    const char *f[4] = { company, person, phone, email };
+    char esc[MAX_FIELD_LEN * 2 + 3];
+    for (int i = 0; i < 4; i++) {
+        escapeCSV(f[i], esc, sizeof(esc));
+        printf("%s%c", esc, i < 3 ? ',' : '\n');
+    }
+}
+
+// contact_app btree <company|email> build|stats|find <key>|prefix <p>|range <lo> <hi> [book]
+static int btreeCommand(int argc, char **argv) {
+    const char *cmd = argc >= 4 ? argv[3] : "";
+    int nargs = !strcmp(cmd, "range") ? 2 : (!strcmp(cmd, "find") || !strcmp(cmd, "prefix")) ? 1 :
+                (!strcmp(cmd, "build") || !strcmp(cmd, "stats")) ? 0 : -1;
+    int field = argc >= 3 && !strcmp(argv[2], "email") ? BTREE_EMAIL : BTREE_COMPANY;
+    if (nargs < 0 || argc < 4 + nargs || (strcmp(argv[2], "company") != 0 && strcmp(argv[2], "email") != 0)) {
+        printf("usage: %s btree <company|email> build|stats|find <key>|prefix <p>|range <lo> <hi> [book]\n", argv[0]);
+        return 1;
+    }
+    const char *book = argc > 4 + nargs ? argv[4 + nargs] : getContactsFile();
+    long long t0 = nowNs();
+    unsigned long long reads0 = getBtreeCounter("reads");
+    long rows;
+    if (nargs == 0) {
+        pthread_mutex_lock(&g_bpt_mu);
+        rows = bptOpenLocked(book, field == BTREE_EMAIL ? BPT_EMAIL : BPT_COMPANY) ? 0 : -1;
+        pthread_mutex_unlock(&g_bpt_mu);
+    } else if (!strcmp(cmd, "find")) {
+        rows = btreeFind(book, field, argv[4], NULL, 1, btreePrintCsv, NULL);
+    } else if (!strcmp(cmd, "prefix")) {
+        rows = btreeFind(book, field, argv[4], argv[4], 0, btreePrintCsv, NULL);
+    } else {
+        rows = btreeFind(book, field, argv[4], argv[5], 0, btreePrintCsv, NULL);
+    }
+    if (rows < 0) { printf("[ERROR] Cannot index %s\n", book); btreeClose(); return 1; }
+    if (nargs) fprintf(stderr, "[INFO] %ld row(s) in %.1f ms, %llu page(s) read from disk\n", rows,
+                       (nowNs() - t0) / 1e6, getBtreeCounter("reads") - reads0);
+    if (!strcmp(cmd, "stats") || !strcmp(cmd, "build")) printBtreeStats();
+    btreeClose();
+    return 0;
+}
+
+// ==== Query (field:value terms with AND / OR, planned against the indexes) ====
+// Grammar:  expr := conj (OR conj)*    conj := factor ([AND] factor)*
+//           factor := '(' expr ')' | [field:]value
+// Fields are company, person (or name), phone, email and domain; a value with no
+// field matches the start of company, person or email, like the plain search.
+// Values may be "quoted" and use '*' as a wildcard; without one they compare
+// whole (case-insensitive, phones as E.164 numbers, a domain also matches its
+// subdomains). company, person and email also take a range lo..hi: lo <= value
+// and value <= hi or starting with hi, so company:a..c is every company from
+// "a" up to those starting with "c" (either end may be left out).
+//
+// The parser keeps the query in disjunctive normal form: up to QUERY_MAX_ALTS
+// conjunctions, each a bitmask of terms. The planner drops every conjunction
+// an index proves empty (the bloom filters answer exact phone / email terms),
+// so such a query never opens the book. With CONTACTS_BTREE, conjunctions that
+// all pin company (or email) to a value, prefix or range are answered from the
+// B+tree: only their candidate rows are read. Whatever is left runs as one scan,
+// split across threads for big books. Each live conjunction lends its longest
+// literal to a raw-line prefilter, so most rows are dropped before they are
+// parsed; survivors are checked against the full query.
+enum { QF_ANY, QF_COMPANY, QF_PERSON, QF_PHONE, QF_EMAIL, QF_DOMAIN, QF_COUNT };
+static const char *k_query_fields[QF_COUNT] = { "any", "company", "person", "phone", "email", "domain" };
+#define QUERY_MAX_TERMS   64
+#define QUERY_MAX_ALTS    16
+#define BPT_CAND_MAX      (1 << 20)             // more candidate rows than this: scan instead
+
+typedef struct {
+    int field, range;                      // range: pat..hi
+    char pat[MAX_FIELD_LEN], hi[MAX_FIELD_LEN];   // phone glob: hi = its E.164 form (phoneCanonPattern)
+    long long e164;                        // exact phone term
+} QueryTerm;
+typedef struct { int n; unsigned long long conj[QUERY_MAX_ALTS]; } QueryDnf;
+
+typedef struct {
+    QueryTerm term[QUERY_MAX_TERMS];
+    int       nterms;
+    QueryDnf  dnf;                          // after planning: live conjunctions only
+    char      lit[QUERY_MAX_ALTS][MAX_FIELD_LEN];   // prefilter literal per live conjunction
+    int       prefilter;
+    const char *src; size_t pos;            // parser
+    char      err[128];
+} Query;
+
+static pthread_mutex_t g_query_mu = PTHREAD_MUTEX_INITIALIZER;
+static struct { unsigned long long queries, pruned, index_only, btree, scans, rows, prefiltered; } g_query;
+
+static int qFail(Query *q, const char *msg) {
+    if (!*q->err) snprintf(q->err, sizeof(q->err), "%s at column %d", msg, (int)q->pos + 1);
+    return 0;
+}
+
+static void qSkipWs(Query *q) {
+    while (q->src[q->pos] == ' ' || q->src[q->pos] == '\t') q->pos++;
+}
+
+static int qIsStop(char c) {
+    return c == '\0' || c == ' ' || c == '\t' || c == '(' || c == ')';
+}
+
+// Consume keyword kw (upper case only, so "and" stays a search word).
+static int qKeyword(Query *q, const char *kw) {
+    qSkipWs(q);
+    size_t n = strlen(kw);
+    if (strncmp(q->src + q->pos, kw, n) != 0 || !qIsStop(q->src[q->pos + n])) return 0;
+    q->pos += n;
+    return 1;
+}
+
+// "field:" at p -> QF_*, with *n = length of the name; QF_ANY if there is no
+// "name:" prefix, -1 for an unknown name.
+static int qFieldAt(const char *p, size_t *n) {
+    char name[16];
+    size_t k = 0;
+    while (isalpha((unsigned char)p[k])) k++;
+    *n = k;
+    if (!k || p[k] != ':') return QF_ANY;
+    if (k >= sizeof(name)) return -1;
+    memcpy(name, p, k);
+    name[k] = '\0';
+    toLowerInPlace(name);
+    if (strcmp(name, "name") == 0) return QF_PERSON;
+    for (int f = 1; f < QF_COUNT; f++) if (strcmp(name, k_query_fields[f]) == 0) return f;
+    return -1;
+}
+
+static int qParseTerm(Query *q, QueryDnf *out) {
+    qSkipWs(q);
+    size_t n;
+    int field = qFieldAt(q->src + q->pos, &n);
+    if (field < 0) return qFail(q, "unknown field");
+    if (field != QF_ANY) q->pos += n + 1;
+    char val[MAX_FIELD_LEN];
+    size_t len = 0;
+    int quoted = q->src[q->pos] == '"';
+    if (quoted) {
+        const char *end = strchr(q->src + q->pos + 1, '"');
+        if (!end) return qFail(q, "unterminated quote");
+        len = (size_t)(end - (q->src + q->pos + 1));
+        if (len >= sizeof(val)) return qFail(q, "value too long");
+        memcpy(val, q->src + q->pos + 1, len);
+        q->pos += len + 2;
+    } else {
+        while (!qIsStop(q->src[q->pos + len])) len++;
+        if (len >= sizeof(val)) return qFail(q, "value too long");
+        memcpy(val, q->src + q->pos, len);
+        q->pos += len;
+    }
+    val[len] = '\0';
+    trimWhitespace(val);
+    if (!*val) return qFail(q, "empty value");
+    if (q->nterms == QUERY_MAX_TERMS) return qFail(q, "too many terms");
+
+    QueryTerm *t = &q->term[q->nterms];
+    t->field = field;
+    if (field == QF_PHONE) {                 // digits and wildcards; an exact number as its bloom key
+        size_t j = 0;
+        for (size_t i = 0; val[i] && j + 1 < sizeof(t->pat); i++)
+            if (isdigit((unsigned char)val[i]) || val[i] == '*') t->pat[j++] = val[i];
+        t->pat[j] = '\0';
+        if (!*t->pat) return qFail(q, "phone needs digits");
+        t->e164 = 0;
+        t->hi[0] = '\0';
+        if (strchr(t->pat, '*')) phoneCanonPattern(val, t->hi, sizeof(t->hi));
+        else { t->e164 = phoneE164(val); phoneKeyText(val, t->pat, sizeof(t->pat)); }
+    } else if ((field == QF_COMPANY || field == QF_PERSON || field == QF_EMAIL) && !quoted &&
+               strstr(val, "..") && !strchr(val, '*')) {
+        char *dots = strstr(val, "..");
+        *dots = '\0';
+        snprintf(t->pat, sizeof(t->pat), "%s", val);
+        snprintf(t->hi, sizeof(t->hi), "%s", dots + 2);
+        if (!*t->pat && !*t->hi) return qFail(q, "empty range");
+        toLowerInPlace(t->pat);
+        toLowerInPlace(t->hi);
+        t->range = 1;
+    } else {
+        size_t vl = strlen(val);
+        memcpy(t->pat, val, vl + 1);
+        if (field == QF_ANY && val[vl - 1] != '*' && vl + 1 < sizeof(t->pat)) { t->pat[vl] = '*'; t->pat[vl + 1] = '\0'; }
+        toLowerInPlace(t->pat);
+    }
+    out->n = 1;
+    out->conj[0] = 1ULL << q->nterms++;
+    return 1;
+}
+
+static int qParseOr(Query *q, QueryDnf *out);
+
+static int qParseFactor(Query *q, QueryDnf *out) {
+    qSkipWs(q);
+    if (q->src[q->pos] != '(') return qParseTerm(q, out);
+    q->pos++;
+    if (!qParseOr(q, out)) return 0;
+    qSkipWs(q);
+    if (q->src[q->pos] != ')') return qFail(q, "missing ')'");
+    q->pos++;
+    return 1;
+}
+
+static int qParseAnd(Query *q, QueryDnf *out) {
+    if (!qParseFactor(q, out)) return 0;
+    for (;;) {
+        size_t save = q->pos;
+        qSkipWs(q);
+        char c = q->src[q->pos];
+        if (c == '\0' || c == ')') return 1;
+        if (qKeyword(q, "OR")) { q->pos = save; return 1; }
+        qKeyword(q, "AND");
+        QueryDnf rhs, acc = { 0, { 0 } };
+        if (!qParseFactor(q, &rhs)) return 0;
+        if (out->n * rhs.n > QUERY_MAX_ALTS) return qFail(q, "too many OR alternatives");
+        for (int i = 0; i < out->n; i++)
+            for (int j = 0; j < rhs.n; j++) acc.conj[acc.n++] = out->conj[i] | rhs.conj[j];
+        *out = acc;
+    }
+}
+
+static int qParseOr(Query *q, QueryDnf *out) {
+    if (!qParseAnd(q, out)) return 0;
+    while (qKeyword(q, "OR")) {
+        QueryDnf rhs;
+        if (!qParseAnd(q, &rhs)) return 0;
+        if (out->n + rhs.n > QUERY_MAX_ALTS) return qFail(q, "too many OR alternatives");
+        for (int j = 0; j < rhs.n; j++) out->conj[out->n++] = rhs.conj[j];
+    }
+    return 1;
+}
+
+static int queryCompile(Query *q, const char *text) {
+    memset(q, 0, sizeof(*q));
+    q->src = text;
+    qSkipWs(q);
+    if (!*q->src || !q->src[q->pos]) return qFail(q, "empty query");
+    if (!qParseOr(q, &q->dnf)) return 0;
+    qSkipWs(q);
+    return q->src[q->pos] ? qFail(q, "unexpected text") : 1;
+}
+
+// Does the keyword use the query syntax (a known field: prefix, AND / OR, or
+// parentheses)? Plain keywords keep the old guess-the-field search.
+int isStructuredQuery(const char *text) {
+    for (const char *p = text; *p; p++) {
+        if (p != text && !qIsStop(p[-1])) continue;
+        if (*p == '(') return 1;
+        if ((strncmp(p, "AND", 3) == 0 || strncmp(p, "OR", 2) == 0) && p != text &&
+            qIsStop(p[*p == 'A' ? 3 : 2])) return 1;
+        size_t n;
+        if (qFieldAt(p, &n) > 0) return 1;
+    }
+    return 0;
+}
+
+// ---- matching ----
+// '*' matches any run of characters (also none), everything else itself.
+static int qGlob(const char *p, const char *s) {
+    const char *star = NULL, *resume = NULL;
+    while (*s) {
+        if (*p == '*') { star = ++p; resume = s; continue; }
+        if (*p && *p == *s) { p++; s++; continue; }
+        if (!star) return 0;
+        p = star;
+        s = ++resume;
+    }
+    while (*p == '*') p++;
+    return !*p;
+}
+
+typedef struct {
+    char company[MAX_FIELD_LEN], person[MAX_FIELD_LEN], phone[MAX_FIELD_LEN], email[MAX_FIELD_LEN];
+    const char *domain;
+    long long e164;
+    char e164_digits[24];                   // "" when the phone has no E.164 form
+} QueryRow;
+
+static void qRowLoad(QueryRow *r, const char *company, const char *person, const char *phone, const char *email) {
+    snprintf(r->company, sizeof(r->company), "%s", company); toLowerInPlace(r->company);
+    snprintf(r->person,  sizeof(r->person),  "%s", person);  toLowerInPlace(r->person);
+    snprintf(r->email,   sizeof(r->email),   "%s", email);   toLowerInPlace(r->email);
+    normalizePhone(phone, r->phone, sizeof(r->phone));
+    r->e164 = phoneE164(phone);
+    if (r->e164) snprintf(r->e164_digits, sizeof(r->e164_digits), "%lld", r->e164);
+    else         r->e164_digits[0] = '\0';
+    const char *at = strrchr(r->email, '@');
+    r->domain = at ? at + 1 : "";
+}
+
+static int qInRange(const QueryTerm *t, const char *s) {
+    return strcmp(s, t->pat) >= 0 && (!*t->hi || strncmp(s, t->hi, strlen(t->hi)) <= 0);
+}
+
+static int qTermMatch(const QueryTerm *t, const QueryRow *r) {
+    if (t->range) return qInRange(t, t->field == QF_COMPANY ? r->company : t->field == QF_PERSON ? r->person : r->email);
+    switch (t->field) {
+    case QF_COMPANY: return qGlob(t->pat, r->company);
+    case QF_PERSON:  return qGlob(t->pat, r->person);
+    case QF_PHONE:
+        if (!*r->phone) return 0;
+        if (!strchr(t->pat, '*')) return t->e164 ? r->e164 == t->e164 : !r->e164 && strcmp(r->phone, t->pat) == 0;
+        return qGlob(t->pat, r->phone) || (*t->hi && *r->e164_digits && qGlob(t->hi, r->e164_digits));
+    case QF_EMAIL:   return qGlob(t->pat, r->email);
+    case QF_DOMAIN: {
+        if (qGlob(t->pat, r->domain)) return 1;
+        size_t n = strlen(r->domain), m = strlen(t->pat);   // "co.th" also matches "mail.co.th"
+        return !strchr(t->pat, '*') && n > m && r->domain[n - m - 1] == '.' && strcmp(r->domain + n - m, t->pat) == 0;
+    }
+    default:
+        return qGlob(t->pat, r->company) || qGlob(t->pat, r->person) || qGlob(t->pat, r->email);
+    }
+}
+
+static int qMatch(const Query *q, const QueryRow *r) {
+    unsigned long long known = 0, hit = 0;  // terms are shared between conjunctions: test each once
+    for (int c = 0; c < q->dnf.n; c++) {
+        unsigned long long need = q->dnf.conj[c];
+        int ok = 1;
+        for (int i = 0; ok && i < q->nterms; i++) {
+            unsigned long long bit = 1ULL << i;
+            if (!(need & bit)) continue;
+            if (!(known & bit)) { known |= bit; if (qTermMatch(&q->term[i], r)) hit |= bit; }
+            ok = (hit & bit) != 0;
+        }
+        if (ok) return 1;
+    }
+    return 0;
+}
+
+// ---- planning ----
+// Lowercased literal every raw line matching t contains: its longest run
+// without '*'. Phones are stored with separators, so they give none.
+static size_t qTermLiteral(const QueryTerm *t, char *out, size_t size) {
+    *out = '\0';
+    if (t->field == QF_PHONE || t->range || strchr(t->pat, '"')) return 0;
+    size_t best = 0;
+    for (const char *p = t->pat; *p; ) {
+        size_t n = strcspn(p, "*");
+        if (n > best && n < size) { best = n; memcpy(out, p, n); out[n] = '\0'; }
+        p += n;
+        while (*p == '*') p++;
+    }
+    return best;
+}
+
+static int qContainsCI(const char *s, size_t len, const char *lit, size_t m) {
+    if (m == 0) return 1;
+    char lo = lit[0], up = (char)toupper((unsigned char)lit[0]);
+    for (size_t i = 0; i + m <= len; i++) {
+        if (s[i] != lo && s[i] != up) continue;
+        size_t k = 1;
+        while (k < m && tolower((unsigned char)s[i + k]) == (unsigned char)lit[k]) k++;
+        if (k == m) return 1;
+    }
+    return 0;
+}
+
+// Drop the conjunctions the bloom filters of the book at path prove empty (no
+// path: keep them all), then pick each survivor's prefilter literal. Returns
+// the number of conjunctions pruned.
+static int queryPlan(Query *q, const char *path) {
+    int probed[QUERY_MAX_TERMS] = { 0 };    // 0 = not asked, 1 = maybe, -1 = absent
+    QueryDnf live = { 0, { 0 } };
+    for (int c = 0; c < q->dnf.n; c++) {
+        int dead = 0;
+        for (int i = 0; !dead && i < q->nterms; i++) {
+            const QueryTerm *t = &q->term[i];
+            if (!path || !(q->dnf.conj[c] & (1ULL << i)) || t->range || strchr(t->pat, '*') ||
+                (t->field != QF_PHONE && t->field != QF_EMAIL)) continue;
+            if (!probed[i]) probed[i] = bloomMayContain(path, t->field == QF_PHONE ? BLOOM_PHONE : BLOOM_EMAIL, t->pat) ? 1 : -1;
+            dead = probed[i] < 0;
+        }
+        if (!dead) live.conj[live.n++] = q->dnf.conj[c];
+    }
+    int pruned = q->dnf.n - live.n;
+    q->dnf = live;
+    q->prefilter = live.n > 0;
+    for (int c = 0; c < live.n; c++) {
+        size_t best = 0;
+        for (int i = 0; i < q->nterms; i++) {
+            char lit[MAX_FIELD_LEN];
+            size_t n = (live.conj[c] & (1ULL << i)) ? qTermLiteral(&q->term[i], lit, sizeof(lit)) : 0;
+            if (n > best) { best = n; strcpy(q->lit[c], lit); }
+        }
+        if (!best) q->prefilter = 0;        // one conjunction without a literal lets every row through
+    }
+    return pruned;
+}
+
+// ---- execution through the B+tree: each live conjunction lends its best
+// company / email term (exact > prefix > range); the union of their candidate
+// rows is read back in file order and checked against the whole query ----
+static int qIndexTerm(const Query *q, unsigned long long conj, int fields) {
+    int best = -1, best_rank = 0;
+    for (int i = 0; i < q->nterms; i++) {
+        const QueryTerm *t = &q->term[i];
+        if (!(conj & (1ULL << i)) || !(t->field == QF_COMPANY ? fields & BTREE_COMPANY :
+                                       t->field == QF_EMAIL ? fields & BTREE_EMAIL : 0)) continue;
+        const char *star = strchr(t->pat, '*');
+        int rank = t->range ? 1 : !star ? 3 : star != t->pat && !star[1] ? 2 : 0;
+        if (rank > best_rank) { best = i; best_rank = rank; }
+    }
+    return best;
+}
+
+static int qOffsetCmp(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+// -2 = some conjunction has no usable term, or too many candidates: scan instead.
+static long queryIndexed(const Query *q, const char *path,
+                         void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                                    void *ctx),
+                         void *ctx, char *plan, size_t plan_size) {
+    int fields = btreeFields(), pick[QUERY_MAX_ALTS];
+    for (int c = 0; c < q->dnf.n; c++) if ((pick[c] = qIndexTerm(q, q->dnf.conj[c], fields)) < 0) return -2;
+    unsigned long long *off = NULL, reads0 = getBtreeCounter("reads");
+    size_t n = 0, cap = 0;
+    int ok = 1;
+    for (int c = 0; ok && c < q->dnf.n; c++) {
+        const QueryTerm *t = &q->term[pick[c]];
+        int field = t->field == QF_EMAIL ? BTREE_EMAIL : BTREE_COMPANY;
+        char pre[MAX_FIELD_LEN];
+        if (t->range) {
+            ok = btreeOffsets(path, field, t->pat, *t->hi ? t->hi : NULL, 0, &off, &n, &cap, BPT_CAND_MAX);
+        } else if (!strchr(t->pat, '*')) {
+            ok = btreeOffsets(path, field, t->pat, NULL, 1, &off, &n, &cap, BPT_CAND_MAX);
+        } else {
+            snprintf(pre, sizeof(pre), "%.*s", (int)(strchr(t->pat, '*') - t->pat), t->pat);
+            ok = btreeOffsets(path, field, pre, pre, 0, &off, &n, &cap, BPT_CAND_MAX);
+        }
+    }
+    FILE *fp = ok ? fopen(path, "r") : NULL;
+    if (!fp) { free(off); return -2; }
+    qsort(off, n, sizeof(*off), qOffsetCmp);
+    long hits = 0;
+    size_t rows = 0;
+    char line[MAX_LINE_LEN];
+    struct Contact rc;
+    QueryRow row;
+    for (size_t i = 0; i < n; i++) {
+        if (i && off[i] == off[i - 1]) continue;       // found by more than one conjunction
+        rows++;
+        if (FSEEK(fp, off[i], SEEK_SET) != 0 || !fgets(line, sizeof(line), fp)) continue;
         line[strcspn(line, "\n\r")] = '\0';
         if (!*line) continue;
+        contactParse(line, &rc);
+        qRowLoad(&row, rc.company, rc.person, rc.phone, rc.email);
+        if (!qMatch(q, &row)) continue;
+        if (fn) fn(rc.company, rc.person, rc.phone, rc.email, ctx);
+        hits++;
+    }
+    fclose(fp);
+    free(off);
+    pthread_mutex_lock(&g_query_mu);
+    g_query.btree++;
+    pthread_mutex_unlock(&g_query_mu);
+    const QueryTerm *t0 = &q->term[pick[0]];
+    snprintf(plan, plan_size, "index: btree %s '%s%s%s'%s, %zu candidate row(s), %llu page(s) read", k_query_fields[t0->field],
+             t0->pat, t0->range ? ".." : "", t0->range ? t0->hi : "", q->dnf.n > 1 ? " (+more)" : "", rows,
+             getBtreeCounter("reads") - reads0);
+    return hits;
+}
 
-        char company[MAX_FIELD_LEN] = "", person[MAX_FIELD_LEN] = "", phone[MAX_FIELD_LEN] = "", email[MAX_FIELD_LEN] = "";
-        parseCsv4(line, company, sizeof(company), person, sizeof(person), phone, sizeof(phone), email, sizeof(email));
+// ---- execution: each worker owns a range of whole lines and collects its
+// matching lines; the caller hands them out in file order ----
+typedef struct {
+    const Query *q;
+    BookRange r;
+    char  *out; size_t len, cap;
+    unsigned long long rows, skipped;
+    int    err;
+} QueryPart;
+
+static void* queryWorker(void *arg) {
+    QueryPart *w = (QueryPart*)arg;
+    const Query *q = w->q;
+    OpCounters *oc = &threadStats()->op[OP_SEARCH];
+    char line[MAX_LINE_LEN];
+    struct Contact rc;
+    QueryRow row;
+    const char *p = w->r.beg, *s;
+    for (size_t n; (n = nextLine(&p, w->r.end, &s)) > 0; ) {
+        w->rows++;
+        oc->rows_scanned++;
+        oc->bytes_read += n;
+        if (q->prefilter && !memchr(s, '"', n)) {   // quotes split literals apart: check those rows in full
+            int any = 0;
+            for (int c = 0; !any && c < q->dnf.n; c++) any = qContainsCI(s, n, q->lit[c], strlen(q->lit[c]));
+            if (!any) { w->skipped++; continue; }
+        }
+        size_t k = n < sizeof(line) ? n : sizeof(line) - 1;
+        memcpy(line, s, k);
+        line[k] = '\0';
+        if (!contactParse(line, &rc)) continue;
+        qRowLoad(&row, rc.company, rc.person, rc.phone, rc.email);
+        if (!qMatch(q, &row)) continue;
+        if (w->len + k + 1 > w->cap) {
+            size_t ncap = w->cap ? w->cap * 2 : 4096;
+            while (ncap < w->len + k + 1) ncap *= 2;
+            char *nb = (char*)realloc(w->out, ncap);
+            if (!nb) { w->err = 1; break; }
+            w->out = nb; w->cap = ncap;
+        }
+        memcpy(w->out + w->len, line, k);
+        w->out[w->len + k] = '\n';
+        w->len += k + 1;
+        oc->matches++;
+    }
+    return NULL;
+}
+
+// Run query text against the book at path; fn gets every matching row in file
+// order. plan (optional) receives a one-line description of how it ran, or the
+// parse error. Returns the number of matches, -1 on a bad query or unreadable book.
+long queryBook(const char *path, const char *text,
+               void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+               void *ctx, char *plan, size_t plan_size) {
+    char dummy[8];
+    if (!plan) { plan = dummy; plan_size = sizeof(dummy); }
+    *plan = '\0';
+    Query *q = (Query*)malloc(sizeof(*q));
+    if (!q) return -1;
+    if (!queryCompile(q, text)) {
+        snprintf(plan, plan_size, "%s", q->err);
+        free(q);
+        return -1;
+    }
+    int alts = q->dnf.n;
+    int pruned = queryPlan(q, path);
+    pthread_mutex_lock(&g_query_mu);
+    g_query.queries++;
+    g_query.pruned += (unsigned long long)pruned;
+    if (!q->dnf.n) g_query.index_only++;
+    pthread_mutex_unlock(&g_query_mu);
+    if (!q->dnf.n) {
+        snprintf(plan, plan_size, "index: bloom filter rules out all %d alternative(s), book not read", alts);
+        free(q);
+        return 0;
+    }
+    if (btreeFields()) {
+        long hits = queryIndexed(q, path, fn, ctx, plan, plan_size);
+        if (hits != -2) { free(q); return hits; }
+    }
+
+    char *map;
+    size_t len;
+    BookRange range[SCAN_MAX_THREADS];
+    int nthreads = bookMapRanges(path, &map, &len, range);
+    if (nthreads < 0) { free(q); return -1; }
+    QueryPart part[SCAN_MAX_THREADS];
+    memset(part, 0, sizeof(part));
+    for (int i = 0; i < nthreads; i++) { part[i].q = q; part[i].r = range[i]; }
+    TRACE_BEGIN(t_scan);
+    runParts(nthreads, queryWorker, part, sizeof(part[0]));
+    TRACE_END(t_scan, "query.scan");
+
+    long hits = 0;
+    int err = 0;
+    unsigned long long rows = 0, skipped = 0;
+    struct Contact hit;
+    for (int i = 0; i < nthreads; i++) {
+        rows += part[i].rows; skipped += part[i].skipped;
+        err |= part[i].err;
+        for (char *p = part[i].out, *end = part[i].out + part[i].len; p && p < end; ) {
+            char *nl = memchr(p, '\n', (size_t)(end - p));
+            *nl = '\0';
+            if (fn) {
+                contactParse(p, &hit);
+                fn(hit.company, hit.person, hit.phone, hit.email, ctx);
+            }
+            hits++;
+            p = nl + 1;
+        }
+        free(part[i].out);
+    }
+    unmapFile(map, len);
+
+    pthread_mutex_lock(&g_query_mu);
+    g_query.scans++;
+    g_query.rows += rows;
+    g_query.prefiltered += skipped;
+    pthread_mutex_unlock(&g_query_mu);
+    int n = snprintf(plan, plan_size, "scan: %d thread(s), %llu rows", nthreads, rows);
+    if (pruned && n > 0 && (size_t)n < plan_size)
+        n += snprintf(plan + n, plan_size - (size_t)n, ", bloom ruled out %d of %d alternative(s)", pruned, alts);
+    if (q->prefilter && n > 0 && (size_t)n < plan_size)
+        snprintf(plan + n, plan_size - (size_t)n, ", prefilter '%s'%s skipped %llu before parsing", q->lit[0],
+                 q->dnf.n > 1 ? " (+more)" : "", skipped);
+    free(q);
+    return err ? -1 : hits;
+}
+
+void printQueryStats(void) {
+    pthread_mutex_lock(&g_query_mu);
+    printf("\n=== Structured Queries ===\n");
+    printf("queries      : %llu (%llu answered by the index alone)\n", g_query.queries, g_query.index_only);
+    printf("alternatives : %llu ruled out by the bloom filter\n", g_query.pruned);
+    printf("btree        : %llu answered from the B+tree index\n", g_query.btree);
+    printf("scans        : %llu, %llu rows, %llu dropped by the prefilter\n", g_query.scans, g_query.rows,
+           g_query.prefiltered);
+    pthread_mutex_unlock(&g_query_mu);
+}
+
+unsigned long long getQueryCounter(const char *name) {
+    pthread_mutex_lock(&g_query_mu);
+    unsigned long long v = 0;
+    if      (strcmp(name, "queries")     == 0) v = g_query.queries;
+    else if (strcmp(name, "pruned")      == 0) v = g_query.pruned;
+    else if (strcmp(name, "index_only")  == 0) v = g_query.index_only;
+    else if (strcmp(name, "btree")       == 0) v = g_query.btree;
+    else if (strcmp(name, "scans")       == 0) v = g_query.scans;
+    else if (strcmp(name, "rows")        == 0) v = g_query.rows;
+    else if (strcmp(name, "prefiltered") == 0) v = g_query.prefiltered;
+    pthread_mutex_unlock(&g_query_mu);
+    return v;
+}
+
+static void queryPrintCsv(const char *company, const char *person, const char *phone, const char *email, void *ctx) {
+    (void)ctx;
+    const char *f[4] = { company, person, phone, email };
+    char esc[MAX_FIELD_LEN * 2 + 3];
+    for (int i = 0; i < 4; i++) {
+        escapeCSV(f[i], esc, sizeof(esc));
+        printf("%s%c", esc, i < 3 ? ',' : '\n');
+    }
+}
+
+// contact_app query "<expr>" [book]
+static int queryCommand(int argc, char **argv) {
+    if (argc < 3) {
+        printf("usage: %s query \"company:alpha* phone:081* OR domain:co.th\" [book]\n", argv[0]);
+        return 1;
+    }
+    const char *book = argc >= 4 ? argv[3] : getContactsFile();
+    char plan[256];
+    long long t0 = nowNs();
+    long hits = queryBook(book, argv[2], queryPrintCsv, NULL, plan, sizeof(plan));
+    bloomPersist();
+    if (hits < 0) {
+        if (*plan) printf("[ERROR] Bad query: %s\n", plan);
+        else       printf("[ERROR] Cannot read %s\n", book);
+        return 1;
+    }
+    fprintf(stderr, "[INFO] %ld match(es) in %.1f ms (%s)\n", hits, (nowNs() - t0) / 1e6, plan);
+    return 0;
+}
+
+// ==== Ranked search (top K by match quality, bounded heap per worker) ====
+// A row scores by its best field: exact > prefix > word prefix > substring,
+// company before person before email on equal quality (a keyword made of
+// digits and separators is also compared against the phone, as digits and,
+// when it starts with 0 / 00 / +, as an E.164 number). Each worker keeps only
+// its K best rows in a min-heap (worst on top), ties going to the earlier row.
+// Once a worker's heap is full of top-score rows, nothing later in its range
+// can get in, so it stops reading; the total is then a lower bound.
+enum { RANK_NONE, RANK_SUBSTRING, RANK_WORD, RANK_PREFIX, RANK_EXACT };
+static const char *k_rank_names[] = { "", "substring", "word prefix", "prefix", "exact" };
+static const char *k_rank_fields[] = { "phone", "email", "person", "company" };
+#define RANK_SCORE(level, field) ((level) * 4 + (field))   // field: index into k_rank_fields
+#define RANK_MAX   RANK_SCORE(RANK_EXACT, 3)
+#define SEARCH_TOP_MAX 1000
+
+static int g_search_top = 0;               // 0 = plain search prints every match
+
+typedef struct { int score; const char *s; size_t n; } RankHit;   // s points into the mapped book
+
+typedef struct {
+    const char *key; size_t klen;
+    const char *digits; size_t dlen;        // phone form of the key, "" if it has letters
+    const char *canon; size_t clen;         // its phoneCanonPattern, "" if none
+    BookRange r;
+    RankHit *heap; int k, n;
+    unsigned long long rows, skipped, matches;
+    int stopped;
+} RankPart;
+
+static int rankLevel(const char *field, const char *key, size_t klen) {
+    const char *p = strstr(field, key);
+    if (!p) return RANK_NONE;
+    if (p == field) return field[klen] ? RANK_PREFIX : RANK_EXACT;
+    for (; p; p = strstr(p + 1, key))
+        if (isspace((unsigned char)p[-1]) || ispunct((unsigned char)p[-1])) return RANK_WORD;
+    return RANK_SUBSTRING;
+}
+
+static int rankWorse(const RankHit *a, const RankHit *b) {
+    return a->score != b->score ? a->score < b->score : a->s > b->s;
+}
+
+static void rankSiftDown(RankHit *h, int n, int i) {
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < n && rankWorse(&h[l], &h[m])) m = l;
+        if (r < n && rankWorse(&h[r], &h[m])) m = r;
+        if (m == i) return;
+        RankHit t = h[i]; h[i] = h[m]; h[m] = t;
+        i = m;
+    }
+}
+
+static void rankOffer(RankPart *w, const RankHit *hit) {
+    if (w->n < w->k) {                      // not full yet: sift up
+        int i = w->n++;
+        w->heap[i] = *hit;
+        while (i > 0 && rankWorse(&w->heap[i], &w->heap[(i - 1) / 2])) {
+            RankHit t = w->heap[i]; w->heap[i] = w->heap[(i - 1) / 2]; w->heap[(i - 1) / 2] = t;
+            i = (i - 1) / 2;
+        }
+    } else if (rankWorse(&w->heap[0], hit)) {
+        w->heap[0] = *hit;
+        rankSiftDown(w->heap, w->n, 0);
+    }
+}
+
+static void* rankWorker(void *arg) {
+    RankPart *w = (RankPart*)arg;
+    OpCounters *oc = &threadStats()->op[OP_SEARCH];
+    char line[MAX_LINE_LEN];
+    struct Contact cols;
+    char *f[CONTACT_NFIELDS] = { cols.company, cols.person, cols.phone, cols.email };   // by CF_* column
+    const char *p = w->r.beg, *s;
+    for (size_t n; (n = nextLine(&p, w->r.end, &s)) > 0; ) {
+        w->rows++;
+        oc->rows_scanned++;
+        oc->bytes_read += n;
+        // every level needs the key inside some field; rows with quotes are checked in full
+        if (!w->dlen && !memchr(s, '"', n) && !qContainsCI(s, n, w->key, w->klen)) { w->skipped++; continue; }
+        size_t k = n < sizeof(line) ? n : sizeof(line) - 1;
+        memcpy(line, s, k);
+        line[k] = '\0';
+        contactParse(line, &cols);
+        RankHit hit = { 0, s, n };
+        const int fields[3] = { CF_COMPANY, CF_PERSON, CF_EMAIL }, weight[3] = { 3, 2, 1 };
+        for (int i = 0; i < 3; i++) {
+            toLowerInPlace(f[fields[i]]);
+            int lvl = rankLevel(f[fields[i]], w->key, w->klen);
+            if (lvl && RANK_SCORE(lvl, weight[i]) > hit.score) hit.score = RANK_SCORE(lvl, weight[i]);
+        }
+        if (w->dlen) {
+            char digits[MAX_FIELD_LEN];
+            normalizePhone(f[CF_PHONE], digits, sizeof(digits));
+            int lvl = *digits ? rankLevel(digits, w->digits, w->dlen) : RANK_NONE;
+            long long v = w->clen ? phoneE164(f[CF_PHONE]) : 0;
+            if (v) {
+                snprintf(digits, sizeof(digits), "%lld", v);
+                int c = rankLevel(digits, w->canon, w->clen);
+                if (c > lvl) lvl = c;
+            }
+            if (lvl && RANK_SCORE(lvl, 0) > hit.score) hit.score = RANK_SCORE(lvl, 0);
+        }
+        if (!hit.score) continue;
+        w->matches++;
+        oc->matches++;
+        rankOffer(w, &hit);
+        if (w->n == w->k && w->heap[0].score == RANK_MAX) { w->stopped = 1; break; }
+    }
+    return NULL;
+}
+
+// The k best rows for keyword key (case-insensitive) in rank order; fn gets
+// each with its score (RANK_SCORE). *total receives the number of matching
+// rows, *complete 0 when the scan stopped early and the total is a lower bound.
+// Returns the number of rows passed to fn, -1 if the book can't be read.
+long searchTopK(const char *path, const char *key, int k,
+                void (*fn)(int score, const char *company, const char *person, const char *phone, const char *email,
+                           void *ctx),
+                void *ctx, long *total, int *complete) {
+    char lkey[MAX_FIELD_LEN];
+    snprintf(lkey, sizeof(lkey), "%s", key);
+    trimWhitespace(lkey);
+    toLowerInPlace(lkey);
+    if (total) *total = 0;
+    if (complete) *complete = 1;
+    if (k <= 0 || !*lkey) return 0;
+    if (k > SEARCH_TOP_MAX) k = SEARCH_TOP_MAX;
+    char digits[MAX_FIELD_LEN] = "", canon[MAX_FIELD_LEN] = "";
+    int letters = 0;
+    for (const char *c = lkey; *c; c++) letters |= isalpha((unsigned char)*c) || *c == '@' || (unsigned char)*c >= 0x80;
+    if (!letters) normalizePhone(lkey, digits, sizeof(digits));
+    if (*digits) phoneCanonPattern(lkey, canon, sizeof(canon));
+
+    char *map;
+    size_t len;
+    BookRange range[SCAN_MAX_THREADS];
+    int nthreads = bookMapRanges(path, &map, &len, range);
+    if (nthreads < 0) return -1;
+    RankPart part[SCAN_MAX_THREADS];
+    memset(part, 0, sizeof(part));
+    RankHit *all = (RankHit*)malloc(sizeof(RankHit) * (size_t)k * (size_t)nthreads);
+    if (!all) { unmapFile(map, len); return -1; }
+    for (int i = 0; i < nthreads; i++) {
+        part[i].key = lkey; part[i].klen = strlen(lkey);
+        part[i].digits = digits; part[i].dlen = strlen(digits);
+        part[i].canon = canon; part[i].clen = strlen(canon);
+        part[i].r = range[i];
+        part[i].heap = all + (size_t)i * (size_t)k;
+        part[i].k = k;
+    }
+    TRACE_BEGIN(t_scan);
+    runParts(nthreads, rankWorker, part, sizeof(part[0]));
+    TRACE_END(t_scan, "search.rank");
+
+    // merge: pack the per-worker heaps, keep the k best, best first
+    int n = 0;
+    long matches = 0;
+    for (int i = 0; i < nthreads; i++) {
+        memmove(all + n, part[i].heap, sizeof(RankHit) * (size_t)part[i].n);
+        n += part[i].n;
+        matches += (long)part[i].matches;
+        if (part[i].stopped && complete) *complete = 0;
+    }
+    for (int i = n / 2 - 1; i >= 0; i--) rankSiftDown(all, n, i);
+    while (n > k) { all[0] = all[--n]; rankSiftDown(all, n, 0); }
+    for (int end = n - 1; end > 0; end--) {   // heap sort: the worst left goes to the back, best ends up first
+        RankHit t = all[0]; all[0] = all[end]; all[end] = t;
+        rankSiftDown(all, end, 0);
+    }
+    char line[MAX_LINE_LEN];
+    struct Contact rc;
+    for (int i = 0; fn && i < n; i++) {
+        const RankHit *h = &all[i];
+        size_t m = h->n < sizeof(line) ? h->n : sizeof(line) - 1;
+        memcpy(line, h->s, m);
+        line[m] = '\0';
+        contactParse(line, &rc);
+        fn(h->score, rc.company, rc.person, rc.phone, rc.email, ctx);
+    }
+    free(all);
+    unmapFile(map, len);
+    if (total) *total = matches;
+    return n;
+}
+
+// Describe a RANK_SCORE, e.g. "prefix company".
+static void rankDescribe(int score, char *out, size_t size) {
+    snprintf(out, size, "%s %s", k_rank_names[score / 4], k_rank_fields[score % 4]);
+}
+
+void setSearchTopK(int k) {
+    g_search_top = k < 0 ? 0 : k > SEARCH_TOP_MAX ? SEARCH_TOP_MAX : k;
+}
+
+static void rankPrintCsv(int score, const char *company, const char *person, const char *phone, const char *email,
+                         void *ctx) {
+    (void)ctx;
+    char why[32];
+    rankDescribe(score, why, sizeof(why));
+    printf("%s,", why);
+    queryPrintCsv(company, person, phone, email, NULL);
+}
+
+// contact_app search "<keyword>" [k] [book]
+static int searchCommand(int argc, char **argv) {
+    if (argc < 3) {
+        printf("usage: %s search <keyword> [k (default 20)] [book]\n", argv[0]);
+        return 1;
+    }
+    int k = argc >= 4 ? atoi(argv[3]) : 20;
+    const char *book = argc >= 5 ? argv[4] : getContactsFile();
+    long total = 0;
+    int complete = 1;
+    long long t0 = nowNs();
+    long shown = searchTopK(book, argv[2], k > 0 ? k : 20, rankPrintCsv, NULL, &total, &complete);
+    if (shown < 0) { printf("[ERROR] Cannot read %s\n", book); return 1; }
+    fprintf(stderr, "[INFO] top %ld of %s%ld match(es) in %.1f ms\n", shown, complete ? "" : "at least ", total,
+            (nowNs() - t0) / 1e6);
+    return 0;
+}
+
+// ==== Group-by reports (contacts per company, email domain and phone prefix) ====
+// One parallel pass over the mapped book: every worker parses its whole-line
+// range and counts into three open-addressing tables of its own (key hash,
+// count, key bytes in the worker's arena), so nothing is shared while the
+// book is read. The tables of workers 1.. are then folded into worker 0's.
+// Top N (by count, ties by key) is picked with a bounded heap per request, so
+// the ten largest of a million companies cost one pass instead of a sort.
+// Groups are normalizeKey(company), the lowercased email domain, and the
+// phone's country code followed, for the default country, by the two digits
+// after it ("+66 81", the operator block). Rows missing the field count as
+// "(none)", phones with no E.164 form as "(other)".
+#define REPORT_ARENA_BLOCK (1 << 16)
+static const char *k_report_dims[REPORT_DIMS] = { "company", "domain", "prefix" };
+
+typedef struct { unsigned long long hash; long long count; const char *key; } ReportSlot;   // key NULL = empty
+typedef struct { ReportSlot *slot; size_t cap, used; } ReportTable;
+typedef struct ReportArena { struct ReportArena *next; size_t used; char data[REPORT_ARENA_BLOCK]; } ReportArena;
+
+typedef struct {
+    BookRange r;
+    ReportTable t[REPORT_DIMS];
+    ReportArena *arena;
+    long rows;
+    int err;
+} ReportPart;
+
+struct Report {
+    long rows;
+    int parts;                               // workers that were given rows
+    ReportSlot *group[REPORT_DIMS];          // packed, in no particular order
+    size_t ngroups[REPORT_DIMS];
+    ReportArena *arena;                      // every worker's key bytes
+};
+
+static int reportGrow(ReportTable *t) {
+    size_t ncap = t->cap ? t->cap * 2 : 1024;
+    ReportSlot *ns = (ReportSlot*)calloc(ncap, sizeof(*ns));
+    if (!ns) return 0;
+    for (size_t i = 0; i < t->cap; i++) {
+        if (!t->slot[i].key) continue;
+        size_t j = (size_t)t->slot[i].hash & (ncap - 1);
+        while (ns[j].key) j = (j + 1) & (ncap - 1);
+        ns[j] = t->slot[i];
+    }
+    free(t->slot);
+    t->slot = ns; t->cap = ncap;
+    return 1;
+}
+
+// The slot for key in t; a new one is claimed with key still NULL and count 0
+// (the caller fills the key before the next lookup). NULL if t can't grow.
+static ReportSlot* reportSlot(ReportTable *t, const char *key, unsigned long long h) {
+    if ((t->used + 1) * 10 > t->cap * 7 && !reportGrow(t)) return NULL;   // keep load <= 0.7
+    size_t mask = t->cap - 1;
+    for (size_t i = (size_t)h & mask;; i = (i + 1) & mask) {
+        ReportSlot *s = &t->slot[i];
+        if (!s->key) { s->hash = h; t->used++; return s; }
+        if (s->hash == h && strcmp(s->key, key) == 0) return s;
+    }
+}
+
+static const char* reportIntern(ReportArena **a, const char *key) {
+    size_t n = strlen(key) + 1;
+    if (!*a || (*a)->used + n > REPORT_ARENA_BLOCK) {
+        ReportArena *b = (ReportArena*)malloc(sizeof(*b));
+        if (!b) return NULL;
+        b->next = *a; b->used = 0;
+        *a = b;
+    }
+    char *k = (*a)->data + (*a)->used;
+    memcpy(k, key, n);
+    (*a)->used += n;
+    return k;
+}
+
+// Length of the country code at the start of E.164 digits d (ITU-T E.164:
+// 1 and 7 take one digit, the pairs below two, every other code three).
+static size_t phoneCountryLen(const char *d) {
+    static const char two[] = "20 27 30 31 32 33 34 36 39 40 41 43 44 45 46 47 48 49 51 52 53 54 55 56 57 58 "
+                              "60 61 62 63 64 65 66 81 82 84 86 90 91 92 93 94 95 98 ";
+    if (d[0] == '1' || d[0] == '7') return 1;
+    for (const char *p = two; *p; p += 3) if (p[0] == d[0] && p[1] == d[1]) return 2;
+    return 3;
+}
+
+static void reportKey(int dim, const struct Contact *c, char *key, size_t cap) {
+    *key = '\0';
+    if (dim == REPORT_COMPANY) {
+        snprintf(key, cap, "%s", c->company);
+        normalizeKey(key);
+    } else if (dim == REPORT_DOMAIN) {
+        const char *at = strrchr(c->email, '@');
+        snprintf(key, cap, "%s", at ? at + 1 : "");
+        trimWhitespace(key);
+        toLowerInPlace(key);
+    } else if (*c->phone) {
+        long long v = phoneE164(c->phone);
+        char d[24];
+        snprintf(d, sizeof(d), "%lld", v);
+        size_t cl = phoneCountryLen(d);
+        if (!v) snprintf(key, cap, "(other)");
+        else if (cl == strlen(g_phone_cc_text) && strncmp(d, g_phone_cc_text, cl) == 0)
+            snprintf(key, cap, "+%.*s %.2s", (int)cl, d, d + cl);   // default country: code + operator block
+        else snprintf(key, cap, "+%.*s", (int)cl, d);
+    }
+    if (!*key) snprintf(key, cap, "(none)");
+}
+
+static void* reportWorker(void *arg) {
+    ReportPart *w = (ReportPart*)arg;
+    OpCounters *oc = &threadStats()->op[OP_SCAN];
+    char line[MAX_LINE_LEN], key[MAX_FIELD_LEN];
+    struct Contact c;
+    const char *p = w->r.beg, *s;
+    for (size_t n; !w->err && (n = nextLine(&p, w->r.end, &s)) > 0; ) {
+        oc->rows_scanned++;
+        oc->bytes_read += n;
+        size_t k = n < sizeof(line) ? n : sizeof(line) - 1;
+        memcpy(line, s, k);
+        line[k] = '\0';
+        if (!contactParse(line, &c)) continue;
+        w->rows++;
+        for (int d = 0; d < REPORT_DIMS && !w->err; d++) {
+            reportKey(d, &c, key, sizeof(key));
+            ReportSlot *slot = reportSlot(&w->t[d], key, bloomHash(key));
+            if (slot && !slot->key) slot->key = reportIntern(&w->arena, key);
+            if (!slot || !slot->key) { w->err = 1; break; }
+            slot->count++;
+        }
+    }
+    return NULL;
+}
+
+static int reportCmp(const void *a, const void *b) {
+    const ReportSlot *x = (const ReportSlot*)a, *y = (const ReportSlot*)b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return strcmp(x->key, y->key);
+}
+
+// Count every row of the book by company, email domain and phone prefix in
+// one pass. NULL if the book can't be read or memory runs out.
+Report* reportBuild(const char *path) {
+    char *map;
+    size_t len;
+    BookRange range[SCAN_MAX_THREADS];
+    int nthreads = bookMapRanges(path, &map, &len, range);
+    if (nthreads < 0) return NULL;
+    ReportPart part[SCAN_MAX_THREADS];
+    memset(part, 0, sizeof(part));
+    for (int i = 0; i < nthreads; i++) part[i].r = range[i];
+    TRACE_BEGIN(t_scan);
+    runParts(nthreads, reportWorker, part, sizeof(part[0]));
+    TRACE_END(t_scan, "report.scan");
+    unmapFile(map, len);
+
+    Report *r = (Report*)calloc(1, sizeof(*r));
+    int ok = r != NULL;
+    for (int i = 0; i < nthreads; i++) ok = ok && !part[i].err;
+    TRACE_BEGIN(t_merge);
+    for (int d = 0; ok && d < REPORT_DIMS; d++) {
+        ReportTable *into = &part[0].t[d];
+        for (int i = 1; ok && i < nthreads; i++) {   // keys stay in their worker's arena
+            for (size_t j = 0; ok && j < part[i].t[d].cap; j++) {
+                const ReportSlot *s = &part[i].t[d].slot[j];
+                if (!s->key) continue;
+                ReportSlot *m = reportSlot(into, s->key, s->hash);
+                if (!m) { ok = 0; break; }
+                if (!m->key) m->key = s->key;
+                m->count += s->count;
+            }
+        }
+        size_t n = 0;
+        for (size_t j = 0; ok && j < into->cap; j++) if (into->slot[j].key) into->slot[n++] = into->slot[j];
+        if (ok) { r->group[d] = into->slot; r->ngroups[d] = n; into->slot = NULL; }
+    }
+    TRACE_END(t_merge, "report.merge");
+    for (int i = 0; i < nthreads; i++) {
+        for (int d = 0; d < REPORT_DIMS; d++) free(part[i].t[d].slot);
+        if (r) { r->rows += part[i].rows; r->parts += part[i].rows > 0; }
+        while (part[i].arena) {
+            ReportArena *a = part[i].arena;
+            part[i].arena = a->next;
+            if (r) { a->next = r->arena; r->arena = a; }
+            else free(a);
+        }
+    }
+    if (!ok) { reportFree(r); return NULL; }
+    return r;
+}
+
+void reportFree(Report *r) {
+    if (!r) return;
+    for (int d = 0; d < REPORT_DIMS; d++) free(r->group[d]);
+    while (r->arena) { ReportArena *a = r->arena; r->arena = a->next; free(a); }
+    free(r);
+}
+
+long reportRows(const Report *r) { return r ? r->rows : 0; }
+
+int reportParts(const Report *r) { return r ? r->parts : 0; }
+
+size_t reportGroups(const Report *r, int dim) {
+    return r && dim >= 0 && dim < REPORT_DIMS ? r->ngroups[dim] : 0;
+}
+
+static void reportSiftDown(ReportSlot *h, size_t n, size_t i) {   // root = the worst group kept
+    for (;;) {
+        size_t l = 2 * i + 1, rt = l + 1, m = i;
+        if (l < n && reportCmp(&h[l], &h[m]) > 0) m = l;
+        if (rt < n && reportCmp(&h[rt], &h[m]) > 0) m = rt;
+        if (m == i) return;
+        ReportSlot t = h[i]; h[i] = h[m]; h[m] = t;
+        i = m;
+    }
+}
+
+// The *n largest groups of dim (0 = all), largest first, in a malloc'd array;
+// *n becomes how many there are. NULL if out of memory.
+static ReportSlot* reportRank(const Report *r, int dim, size_t *n) {
+    size_t have = reportGroups(r, dim), k = !*n || *n > have ? have : *n;
+    ReportSlot *h = (ReportSlot*)malloc((k ? k : 1) * sizeof(*h));
+    *n = 0;
+    if (!h) return NULL;
+    const ReportSlot *g = r->group[dim];
+    memcpy(h, g, k * sizeof(*h));
+    if (k < have) {
+        for (size_t i = k / 2; i-- > 0; ) reportSiftDown(h, k, i);
+        for (size_t i = k; i < have; i++)
+            if (reportCmp(&g[i], &h[0]) < 0) { h[0] = g[i]; reportSiftDown(h, k, 0); }
+    }
+    qsort(h, k, sizeof(*h), reportCmp);
+    *n = k;
+    return h;
+}
+
+// The n largest groups of dim (0 = all), largest first. Returns how many.
+size_t reportTop(const Report *r, int dim, size_t n, void (*fn)(const char *key, long long count, void *ctx),
+                 void *ctx) {
+    ReportSlot *top = reportRank(r, dim, &n);
+    for (size_t i = 0; fn && i < n; i++) fn(top[i].key, top[i].count, ctx);
+    free(top);
+    return n;
+}
+
+static void jsonPutString(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(fp, "\\%c", c);
+        else if (c < 0x20)         fprintf(fp, "\\u%04x", c);
+        else                       fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+// Write the n largest groups of every dimension (0 = all) to path: JSON when
+// it ends in ".json", else CSV rows "dimension,group,count". Returns 1 on success.
+int reportExport(const Report *r, size_t n, const char *path) {
+    if (!r) return 0;
+    size_t pl = strlen(path);
+    int json = pl >= 5 && strcmp(path + pl - 5, ".json") == 0;
+    char tmp[300];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) return 0;
+    if (json) fprintf(fp, "{\"rows\":%ld", r->rows);
+    else      fprintf(fp, "dimension,group,count\n");
+    int ok = 1;
+    for (int d = 0; d < REPORT_DIMS; d++) {
+        size_t m = n;
+        ReportSlot *top = reportRank(r, d, &m);
+        if (!top) ok = 0;
+        if (json) fprintf(fp, ",\n\"%s\":{\"groups\":%zu,\"top\":[", k_report_dims[d], r->ngroups[d]);
+        for (size_t i = 0; i < m; i++) {
+            const ReportSlot *g = &top[i];
+            if (json) {
+                fprintf(fp, "%s{\"key\":", i ? "," : "");
+                jsonPutString(fp, g->key);
+                fprintf(fp, ",\"count\":%lld}", g->count);
+            } else {
+                char esc[MAX_FIELD_LEN * 2 + 3];
+                escapeCSV(g->key, esc, sizeof(esc));
+                fprintf(fp, "%s,%s,%lld\n", k_report_dims[d], esc, g->count);
+            }
+        }
+        if (json) fprintf(fp, "]}");
+        free(top);
+    }
+    if (json) fprintf(fp, "}\n");
+    if (fclose(fp) != 0 || !ok) { remove(tmp); return 0; }
+    return replaceFile(tmp, path);
+}
 
-        if (!*company || !*person) continue;
+static void reportPrintRow(const char *key, long long count, void *ctx) {
+    (void)ctx;
+    printf("%10lld  %s\n", count, key);
+}
 
-        if (use_filter) {
-            char company_lower[MAX_FIELD_LEN];
-            strncpy(company_lower, company, MAX_FIELD_LEN - 1); company_lower[MAX_FIELD_LEN - 1] = '\0';
-            for (int i = 0; company_lower[i]; i++) company_lower[i] = (char)tolower((unsigned char)company_lower[i]);
-            if (!strstr(company_lower, filter_lower)) continue;
+// contact_app report [--top n] [--out file.csv|file.json] [book]
+static int reportCommand(int argc, char **argv) {
+    const char *book = getContactsFile(), *out = NULL;
+    int top = 10;
+    for (int i = 2; i < argc; i++) {
+        if      (strcmp(argv[i], "--top") == 0 && i + 1 < argc) top = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) out = argv[++i];
+        else if (argv[i][0] != '-') book = argv[i];
+        else {
+            printf("usage: %s report [--top n (default 10, 0 = all)] [--out file.csv|file.json] [book]\n", argv[0]);
+            return 1;
         }
+    }
+    long long t0 = nowNs();
+    Report *r = reportBuild(book);
+    if (!r) { printf("[ERROR] Cannot read %s\n", book); return 1; }
+    size_t n = top > 0 ? (size_t)top : 0;
+    for (int d = 0; d < REPORT_DIMS; d++) {
+        printf("%s%s: %zu group(s)\n", d ? "\n" : "", k_report_dims[d], reportGroups(r, d));
+        reportTop(r, d, n, reportPrintRow, NULL);
+    }
+    int ok = !out || reportExport(r, n, out);
+    if (!ok) printf("[ERROR] Cannot write %s\n", out);
+    fprintf(stderr, "[INFO] %ld row(s) in %.1f ms\n", reportRows(r), (nowNs() - t0) / 1e6);
+    reportFree(r);
+    return ok ? 0 : 1;
+}
 
-        count++;
-        printf("%-4d | %-20.20s | %-20.20s | %-15.15s | %-30.30s\n",
-               count, company, person, phone, email);
+// ==== Pages (keyset cursors over the book) ====
+// A cursor names the byte offset just past the last row handed out, plus the
+// write generation it belongs to: the book's size and mtime and a checksum of
+// its last STAMP_TAIL bytes at the time. Fetching the next page seeks straight
+// to the offset, so page N costs one page of rows, not N. A book that has
+// only been appended to since keeps its cursors valid (new rows show up on the
+// last pages); any other change makes bookPage return PAGE_STALE.
+enum { PAGE_ERROR = -1, PAGE_STALE = -2 };
+#define PAGE_MAX        1000
+#define PAGE_CURSOR_LEN 96
+
+static int g_page_size = 0;                // 0 = menus print everything at once
+
+typedef struct { long long offset; FileStamp gen; unsigned long long tail; } PageCursor;
+
+static void pageCursorFormat(const PageCursor *c, char *out, size_t size) {
+    snprintf(out, size, "c1.%llx.%llx.%llx.%llx", (unsigned long long)c->offset, (unsigned long long)c->gen.size,
+             (unsigned long long)c->gen.mtime_ns, c->tail);
+}
+
+static int pageCursorParse(const char *text, PageCursor *c) {
+    unsigned long long v[4];
+    char tail;
+    if (sscanf(text, "c1.%llx.%llx.%llx.%llx%c", &v[0], &v[1], &v[2], &v[3], &tail) != 4) return 0;
+    memset(c, 0, sizeof(*c));
+    c->offset = (long long)v[0]; c->gen.size = (long long)v[1]; c->gen.mtime_ns = (long long)v[2]; c->tail = v[3];
+    return c->offset >= 0 && c->offset <= c->gen.size;
+}
+
+// Up to limit rows after cursor `after` ("" or NULL = from the top) that
+// match query (query syntax; "" or NULL = every row with a company and a
+// person, like the list). next receives the cursor for the following page,
+// "" when the book has no more rows. Returns the number of rows passed to fn,
+// PAGE_STALE if the book was rewritten since `after` was issued, PAGE_ERROR
+// for a bad cursor or query or an unreadable book.
+long bookPage(const char *path, const char *query, const char *after, int limit,
+              void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+              void *ctx, char *next, size_t next_size) {
+    if (next && next_size) *next = '\0';
+    if (limit <= 0) return 0;
+    if (limit > PAGE_MAX) limit = PAGE_MAX;
+    PageCursor cur = { 0, { 0, 0, 0 }, 0 };
+    if (after && *after && !pageCursorParse(after, &cur)) return PAGE_ERROR;
+
+    FileStamp now;
+    if (!fileStamp(path, &now)) return PAGE_ERROR;
+    if (after && *after) {
+        // same generation, or appended to since: everything up to the old end is unchanged
+        int same = now.size > cur.gen.size || (now.size == cur.gen.size && now.mtime_ns == cur.gen.mtime_ns);
+        if (!same || stampTailSum(path, cur.gen.size) != cur.tail) return PAGE_STALE;
+    }
+    Query *q = NULL;
+    if (query && *query) {
+        if (!(q = (Query*)malloc(sizeof(*q)))) return PAGE_ERROR;
+        if (!queryCompile(q, query)) { free(q); return PAGE_ERROR; }
+        queryPlan(q, path);
+        if (!q->dnf.n) { free(q); return 0; }   // the indexes rule out every row
+    }
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp || (cur.offset > 0 && FSEEK(fp, cur.offset, SEEK_SET) != 0)) {
+        if (fp) fclose(fp);
+        free(q);
+        return PAGE_ERROR;
+    }
+    char line[MAX_LINE_LEN];
+    struct Contact rc;
+    QueryRow row;
+    long long pos = cur.offset;
+    long n = 0;
+    while (n < limit && fgets(line, sizeof(line), fp)) {
+        pos += (long long)strlen(line);
+        line[strcspn(line, "\n\r")] = '\0';
+        if (!*line) continue;
+        contactParse(line, &rc);
+        if (q) {
+            qRowLoad(&row, rc.company, rc.person, rc.phone, rc.email);
+            if (!qMatch(q, &row)) continue;
+        } else if (!*rc.company || !*rc.person) continue;
+        if (fn) fn(rc.company, rc.person, rc.phone, rc.email, ctx);
+        n++;
     }
     fclose(fp);
+    free(q);
+    if (next && next_size && n == limit && pos < now.size) {
+        PageCursor nc = { pos, now, stampTailSum(path, now.size) };
+        pageCursorFormat(&nc, next, next_size);
+    }
+    return n;
+}
 
-    if (count == 0) {
-        if (use_filter) printf("[INFO] No contacts found with keyword '%s'.\n", filter);
-        else            printf("[INFO] No contacts in the system.\n");
+void setPageSize(int rows) {
+    g_page_size = rows < 0 ? 0 : rows > PAGE_MAX ? PAGE_MAX : rows;
+}
+
+static int pageSize(void) { return g_page_size; }
+
+// Menu helper: show the rows matching query one page at a time, asking before
+// each next page. Returns the number of rows shown, -1 if nothing could be read.
+static long pageThrough(const char *query,
+                        void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                                   void *ctx),
+                        void *ctx) {
+    char cursor[PAGE_CURSOR_LEN] = "", next[PAGE_CURSOR_LEN], ans[16];
+    long shown = 0;
+    for (;;) {
+        long n = bookPage(getContactsFile(), query, cursor, g_page_size, fn, ctx, next, sizeof(next));
+        if (n == PAGE_STALE) { printf("[WARN] The book was rewritten meanwhile; start again for fresh pages.\n"); return shown; }
+        if (n < 0) return shown ? shown : -1;
+        shown += n;
+        if (!*next) return shown;
+        printf("-- %ld shown. Enter = next %d, q = stop: ", shown, g_page_size);
+        if (!fgets(ans, sizeof(ans), stdin) || ans[0] == 'q' || ans[0] == 'Q') return shown;
+        strcpy(cursor, next);
+    }
+}
+
+// contact_app page [--query <expr>] [--after <cursor>] [--limit n] [book]
+static int pageCommand(int argc, char **argv) {
+    const char *query = NULL, *after = NULL, *book = getContactsFile();
+    int limit = 50;
+    for (int i = 2; i < argc; i++) {
+        if      (strcmp(argv[i], "--query") == 0 && i + 1 < argc) query = argv[++i];
+        else if (strcmp(argv[i], "--after") == 0 && i + 1 < argc) after = argv[++i];
+        else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc) limit = atoi(argv[++i]);
+        else if (argv[i][0] != '-') book = argv[i];
+        else {
+            printf("usage: %s page [--query <expr>] [--after <cursor>] [--limit n (default 50)] [book]\n", argv[0]);
+            return 1;
+        }
+    }
+    char next[PAGE_CURSOR_LEN];
+    long n = bookPage(book, query, after, limit, queryPrintCsv, NULL, next, sizeof(next));
+    if (n == PAGE_STALE) { printf("[ERROR] Cursor is stale: %s was rewritten since it was issued\n", book); return 2; }
+    if (n < 0) { printf("[ERROR] Bad cursor or query, or cannot read %s\n", book); return 1; }
+    fprintf(stderr, "[INFO] %ld row(s), next: %s\n", n, *next ? next : "(end)");
+    return 0;
+}
+
+// ==== Sharded book (N CSV files in a directory, placed by phone / company) ====
+// A book split across a directory of ordinary books:
+//   SHARDS         "SHD2 <n> <country>" (written once, when the set is created)
+//   shard-NN.csv   the rows whose key hashes to NN
+// A row's key is its phone as E.164 text (phoneKeyText) or, for rows without a
+// phone, its normalized company. National numbers are read with the country in
+// the manifest, not CONTACTS_PHONE_COUNTRY: opening a set switches the default
+// country to it until the set is closed (an SHD2 manifest without one was
+// written under +66). Sets made before E.164 ("SHD1") placed phones by their
+// digits with 66XXXXXXXXX folded to 0XXXXXXXXX and keep doing so.
+// A query whose every alternative pins an exact phone reads just the shards
+// those phones hash to; anything else fans out: a pool of workers takes shards
+// off a shared counter, scans each like queryBook does, and the matches are
+// handed out in shard order. Deletes and updates rewrite only the shards the
+// query can reach, and only those holding a matching row are replaced; an
+// update that changes a row's key moves it to its new shard.
+#define SHARD_MAX      64
+#define SHARD_DEFAULT  8
+
+static pthread_mutex_t g_shard_mu = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    char dir[256];
+    int  n, open, version;                 // version: 1 = digit-keyed set, 2 = E.164
+    int  saved_cc;                         // default country to restore on close, 0 = none
+    unsigned long long adds, queries, routed, shards_read, rewrites, moved;
+} g_shard;
+
+static void shardPath(char *buf, size_t n, int i) {
+    snprintf(buf, n, "%s/shard-%02d.csv", g_shard.dir, i);
+}
+
+static int shardOfKey(const char *key) {
+    return (int)(bloomHash(key) % (unsigned long long)g_shard.n);
+}
+
+static int shardOfRow(const char *company, const char *phone) {
+    char pk[MAX_FIELD_LEN];
+    if (g_shard.version == 1) {
+        normalizePhone(phone ? phone : "", pk, sizeof(pk));
+        if (strlen(pk) == 11 && pk[0] == '6' && pk[1] == '6') {   // 66XXXXXXXXX -> 0XXXXXXXXX
+            memmove(pk + 1, pk + 2, 10);
+            pk[0] = '0';
+        }
+    } else phoneKeyText(phone, pk, sizeof(pk));
+    if (*pk) return shardOfKey(pk);
+    char key[MAX_FIELD_LEN + 2] = "c:";             // never mistaken for a phone
+    snprintf(key + 2, sizeof(key) - 2, "%s", company ? company : "");
+    normalizeKey(key + 2);
+    return shardOfKey(key);
+}
+
+// Shards q can match rows in: one per alternative that pins an exact phone,
+// every shard as soon as one alternative doesn't.
+static unsigned long long shardMask(const Query *q) {
+    unsigned long long all = g_shard.n == 64 ? ~0ULL : (1ULL << g_shard.n) - 1, mask = 0;
+    for (int c = 0; c < q->dnf.n; c++) {
+        int pinned = -1;
+        for (int i = 0; pinned < 0 && i < q->nterms; i++) {
+            const QueryTerm *t = &q->term[i];
+            if ((q->dnf.conj[c] & (1ULL << i)) && t->field == QF_PHONE && !strchr(t->pat, '*'))
+                pinned = shardOfRow(NULL, t->pat);
+        }
+        if (pinned < 0) return all;
+        mask |= 1ULL << pinned;
+    }
+    return mask;
+}
+
+// Close the set (nothing is held open between calls; this just forgets it).
+void shardClose(void) {
+    pthread_mutex_lock(&g_shard_mu);
+    g_shard.open = 0;
+    if (g_shard.saved_cc) setPhoneCountry(g_shard.saved_cc);
+    g_shard.saved_cc = 0;
+    pthread_mutex_unlock(&g_shard_mu);
+}
+
+// Open the shard set in dir, creating it with nshards shards (0 = SHARD_DEFAULT)
+// if there is none. An existing set keeps its count; asking for a different
+// one fails, as rows would have to move. Returns 1 on success.
+int shardOpen(const char *dir, int nshards) {
+    shardClose();
+    MKDIR(dir);                            // fails harmlessly if it exists
+    char path[300], tmp[310], line[64];
+    int have = 0, version = 2, cc = 0, fields = 0;
+    snprintf(path, sizeof(path), "%s/SHARDS", dir);
+    FILE *mf = fopen(path, "r");
+    if (mf) {
+        if (!fgets(line, sizeof(line), mf) || (fields = sscanf(line, "SHD%d %d %d", &version, &have, &cc)) < 2 ||
+            version < 1 || version > 2 || have < 1 || have > SHARD_MAX || (fields == 3 && (cc < 1 || cc > 999)))
+            have = -1;
+        if (version == 2 && fields == 2) cc = 66;
+        fclose(mf);
+    }
+    if (have < 0 || (have && nshards && nshards != have) || nshards < 0 || nshards > SHARD_MAX) return 0;
+
+    pthread_mutex_lock(&g_shard_mu);
+    snprintf(g_shard.dir, sizeof(g_shard.dir), "%s", dir);
+    g_shard.n = have ? have : nshards ? nshards : SHARD_DEFAULT;
+    g_shard.version = version;
+    if (cc && cc != g_phone_cc) {
+        g_shard.saved_cc = g_phone_cc;
+        setPhoneCountry(cc);
+    }
+    int ok = 1;
+    for (int i = 0; ok && i < g_shard.n; i++) {
+        char sp[300];
+        shardPath(sp, sizeof(sp), i);
+        FILE *fp = fopen(sp, "ab");
+        ok = fp && fclose(fp) == 0;
+    }
+    if (ok && !have) {                     // the manifest last: it marks the set complete
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        FILE *fp = bookOpenWrite(tmp, "w");
+        ok = fp && fprintf(fp, "SHD2 %d %d\n", g_shard.n, g_phone_cc) > 0;
+        if (fp && !bookSyncClose(fp)) ok = 0;
+        if (ok) ok = replaceFile(tmp, path);
+        if (!ok) remove(tmp);
+    }
+    g_shard.open = ok;
+    if (!ok && g_shard.saved_cc) {
+        setPhoneCountry(g_shard.saved_cc);
+        g_shard.saved_cc = 0;
+    }
+    pthread_mutex_unlock(&g_shard_mu);
+    return ok;
+}
+
+int shardCount(void) {
+    pthread_mutex_lock(&g_shard_mu);
+    int n = g_shard.open ? g_shard.n : 0;
+    pthread_mutex_unlock(&g_shard_mu);
+    return n;
+}
+
+// Remove a shard set and its directory (tests, benchmarks).
+void shardDestroy(const char *dir) {
+    char path[300], line[64];
+    int n = 0, version;
+    snprintf(path, sizeof(path), "%s/SHARDS", dir);
+    FILE *mf = fopen(path, "r");
+    if (mf) {
+        if (fgets(line, sizeof(line), mf) && sscanf(line, "SHD%d %d", &version, &n) != 2) n = 0;
+        fclose(mf);
+    }
+    for (int i = 0; i < n && i < SHARD_MAX; i++) {
+        snprintf(path, sizeof(path), "%s/shard-%02d.csv", dir, i);
+        remove(path);
+    }
+    snprintf(path, sizeof(path), "%s/SHARDS", dir);
+    remove(path);
+    RMDIR(dir);
+}
+
+// Append one row to the shard its key picks. Returns 1 on success.
+int shardAdd(const char *company, const char *person, const char *phone, const char *email) {
+    char path[300];
+    pthread_mutex_lock(&g_shard_mu);
+    if (!g_shard.open) { pthread_mutex_unlock(&g_shard_mu); return 0; }
+    shardPath(path, sizeof(path), shardOfRow(company, phone));
+    FILE *fp = fopen(path, "ab");
+    int ok = fp != NULL;
+    if (ok) {
+        char esc[4][MAX_FIELD_LEN * 2 + 3];
+        const char *f[4] = { company, person, phone, email };
+        for (int i = 0; i < 4; i++) escapeCSV(f[i], esc[i], sizeof(esc[i]));
+        ok = fprintf(fp, "%s,%s,%s,%s\n", esc[0], esc[1], esc[2], esc[3]) > 0;
+        if (fclose(fp) != 0) ok = 0;
+    }
+    if (ok) g_shard.adds++;
+    pthread_mutex_unlock(&g_shard_mu);
+    return ok;
+}
+
+// Spread the rows of an ordinary book over the shards (appended to what they
+// hold). Returns the rows imported, -1 on error.
+long shardImport(const char *csv) {
+    FILE *in = bookOpenRead(csv);
+    if (!in) return -1;
+    pthread_mutex_lock(&g_shard_mu);
+    FILE *out[SHARD_MAX] = { NULL };
+    int ok = g_shard.open;
+    for (int i = 0; ok && i < g_shard.n; i++) {
+        char path[300];
+        shardPath(path, sizeof(path), i);
+        ok = (out[i] = fopen(path, "ab")) != NULL;
+    }
+    char line[MAX_LINE_LEN];
+    struct Contact c;
+    long rows = 0;
+    while (ok && fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\n\r")] = '\0';
+        if (!*line) continue;
+        if (!contactParse(line, &c)) continue;
+        FILE *fp = out[shardOfRow(c.company, c.phone)];
+        ok = fputs(line, fp) >= 0 && fputc('\n', fp) != EOF;
+        rows++;
+    }
+    fclose(in);
+    for (int i = 0; i < g_shard.n; i++)
+        if (out[i] && !bookSyncClose(out[i])) ok = 0;
+    if (ok) g_shard.adds += (unsigned long long)rows;
+    pthread_mutex_unlock(&g_shard_mu);
+    return ok ? rows : -1;
+}
+
+// All rows, shard by shard, into one ordinary book. Returns the rows written,
+// -1 on error.
+long shardExport(const char *csv) {
+    pthread_mutex_lock(&g_shard_mu);
+    int ok = g_shard.open;
+    FILE *fp = ok ? bookOpenWrite(csv, "w") : NULL;
+    CsvWriter w;
+    if (fp && !csvWriterOpen(&w, fp)) { fclose(fp); fp = NULL; }
+    if (!fp) { pthread_mutex_unlock(&g_shard_mu); return -1; }
+    long rows = 0;
+    for (int i = 0; ok && i < g_shard.n; i++) {
+        char path[300];
+        size_t len = 0;
+        FileStamp st;
+        shardPath(path, sizeof(path), i);
+        if (!fileStamp(path, &st)) { ok = 0; break; }
+        char *map = st.size > 0 ? mapFile(path, &len) : NULL;
+        if (st.size > 0 && !map) { ok = 0; break; }
+        const char *p = map, *s;
+        for (size_t n; (n = nextLine(&p, map + len, &s)) > 0; rows++) {
+            csvPutRaw(&w, s, n);
+            csvPutRaw(&w, "\n", 1);
+        }
+        unmapFile(map, len);
+    }
+    pthread_mutex_unlock(&g_shard_mu);
+    if (!csvWriterClose(&w)) ok = 0;
+    if (!bookSyncClose(fp)) ok = 0;
+    return ok ? rows : -1;
+}
+
+// ---- fan-out: workers take the next shard off a shared counter ----
+typedef struct {
+    int n;
+    unsigned long long mask;
+    atomic_int next;
+    QueryPart part[SHARD_MAX];             // one per shard, merged in shard order
+} ShardScan;
+
+static void* shardScanWorker(void *arg) {
+    ShardScan *s = (ShardScan*)arg;
+    for (int i; (i = atomic_fetch_add(&s->next, 1)) < s->n; ) {
+        if (!((s->mask >> i) & 1)) continue;
+        char path[300];
+        size_t len = 0;
+        FileStamp st;
+        shardPath(path, sizeof(path), i);
+        if (!fileStamp(path, &st)) { s->part[i].err = 1; continue; }
+        char *map = st.size > 0 ? mapFile(path, &len) : NULL;
+        if (st.size > 0 && !map) { s->part[i].err = 1; continue; }
+        s->part[i].r.beg = map;
+        s->part[i].r.end = map + len;
+        queryWorker(&s->part[i]);
+        unmapFile(map, len);
+    }
+    return NULL;
+}
+
+// queryBook over the shard set: fn gets every matching row, shard by shard.
+// plan (optional) receives how it ran or the parse error. Returns the number of
+// matches, -1 on a bad query or an unreadable shard.
+long shardQuery(const char *text,
+                void (*fn)(const char *company, const char *person, const char *phone, const char *email, void *ctx),
+                void *ctx, char *plan, size_t plan_size) {
+    char dummy[8];
+    if (!plan) { plan = dummy; plan_size = sizeof(dummy); }
+    *plan = '\0';
+    ShardScan *s = (ShardScan*)calloc(1, sizeof(*s));
+    Query *q = (Query*)malloc(sizeof(*q));
+    if (!s || !q) { free(s); free(q); return -1; }
+    if (!queryCompile(q, text)) {
+        snprintf(plan, plan_size, "%s", q->err);
+        free(q); free(s);
+        return -1;
+    }
+    queryPlan(q, NULL);                    // prefilter literals only: the bloom filters know one book
+
+    pthread_mutex_lock(&g_shard_mu);
+    if (!g_shard.open) { pthread_mutex_unlock(&g_shard_mu); free(q); free(s); return -1; }
+    s->n = g_shard.n;
+    s->mask = shardMask(q);
+    atomic_init(&s->next, 0);
+    int reach = 0;
+    for (int i = 0; i < s->n; i++) { s->part[i].q = q; reach += (int)((s->mask >> i) & 1); }
+    int nthreads = cpuCount();
+    if (nthreads > reach) nthreads = reach;
+    if (nthreads > SCAN_MAX_THREADS) nthreads = SCAN_MAX_THREADS;
+    TRACE_BEGIN(t_scan);
+    runParts(nthreads, shardScanWorker, s, 0);
+    TRACE_END(t_scan, "shard.scan");
+
+    long hits = 0;
+    int err = 0;
+    unsigned long long rows = 0;
+    struct Contact c;
+    for (int i = 0; i < s->n; i++) {
+        QueryPart *w = &s->part[i];
+        rows += w->rows;
+        err |= w->err;
+        for (char *p = w->out, *end = w->out + w->len; p && p < end; ) {
+            char *nl = memchr(p, '\n', (size_t)(end - p));
+            *nl = '\0';
+            if (fn) {
+                contactParse(p, &c);
+                fn(c.company, c.person, c.phone, c.email, ctx);
+            }
+            hits++;
+            p = nl + 1;
+        }
+        free(w->out);
+    }
+    g_shard.queries++;
+    g_shard.shards_read += (unsigned long long)reach;
+    if (reach < s->n) g_shard.routed++;
+    snprintf(plan, plan_size, "%s: %d of %d shard(s), %d thread(s), %llu rows",
+             reach < s->n ? "routed by phone" : "fan-out", reach, s->n, nthreads, rows);
+    pthread_mutex_unlock(&g_shard_mu);
+    free(q); free(s);
+    return err ? -1 : hits;
+}
+
+// Every row with this phone (any form of the same E.164 number), from the one
+// shard it lives on.
+long shardFindPhone(const char *phone,
+                    void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                               void *ctx),
+                    void *ctx) {
+    char pk[MAX_FIELD_LEN], text[MAX_FIELD_LEN + 16];
+    phoneKeyText(phone, pk, sizeof(pk));
+    if (!*pk) return 0;
+    snprintf(text, sizeof(text), "phone:%s", pk);
+    return shardQuery(text, fn, ctx, NULL, 0);
+}
+
+// ---- deletes and updates: one shard at a time ----
+enum { SF_COMPANY, SF_PERSON, SF_PHONE, SF_EMAIL };
+typedef struct { int shard; char line[MAX_LINE_LEN * 2]; } ShardMove;   // room for four escaped fields
+
+// Rewrite shard i without the rows q matches (value == NULL) or with field set
+// to value in them. Updated rows that now belong to another shard go to *moves
+// instead. The shard is replaced only if a row matched. Returns the rows
+// touched, -1 on error. Caller holds g_shard_mu.
+static long shardRewriteLocked(int i, const Query *q, int field, const char *value,
+                               ShardMove **moves, size_t *nmoves, size_t *capmoves) {
+    char path[300], tmp[310];
+    size_t len = 0;
+    FileStamp st;
+    shardPath(path, sizeof(path), i);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (!fileStamp(path, &st)) return -1;
+    if (st.size == 0) return 0;
+    char *map = mapFile(path, &len);
+    if (!map) return -1;
+    FILE *fp = bookOpenWrite(tmp, "w");
+    CsvWriter w;
+    if (fp && !csvWriterOpen(&w, fp)) { fclose(fp); fp = NULL; }
+    if (!fp) { unmapFile(map, len); return -1; }
+
+    char line[MAX_LINE_LEN];
+    struct Contact c;
+    char *f[4] = { c.company, c.person, c.phone, c.email };
+    QueryRow row;
+    long touched = 0;
+    int ok = 1;
+    const char *p = map, *s;
+    for (size_t n; ok && (n = nextLine(&p, map + len, &s)) > 0; ) {
+        size_t k = n < sizeof(line) ? n : sizeof(line) - 1;
+        memcpy(line, s, k);
+        line[k] = '\0';
+        if (!contactParse(line, &c)) continue;
+        qRowLoad(&row, c.company, c.person, c.phone, c.email);
+        if (!qMatch(q, &row)) { csvPutRaw(&w, s, n); csvPutRaw(&w, "\n", 1); continue; }
+        touched++;
+        if (!value) continue;
+        snprintf(f[field], MAX_FIELD_LEN, "%s", value);
+        int to = shardOfRow(c.company, c.phone);
+        if (to == i) { csvPutRow(&w, &c); continue; }
+        if (*nmoves == *capmoves) {
+            size_t ncap = *capmoves ? *capmoves * 2 : 16;
+            ShardMove *nm = (ShardMove*)realloc(*moves, ncap * sizeof(**moves));
+            if (!nm) { ok = 0; break; }
+            *moves = nm; *capmoves = ncap;
+        }
+        ShardMove *m = &(*moves)[(*nmoves)++];
+        m->shard = to;
+        contactFormat(&c, m->line, sizeof(m->line));
+    }
+    unmapFile(map, len);
+    if (!csvWriterClose(&w)) ok = 0;
+    if (!bookSyncClose(fp)) ok = 0;
+    if (ok && touched) ok = replaceFile(tmp, path);
+    if (!ok || !touched) remove(tmp);
+    if (ok && touched) g_shard.rewrites++;
+    return ok ? touched : -1;
+}
+
+static long shardEdit(const char *text, int field, const char *value) {
+    Query *q = (Query*)malloc(sizeof(*q));
+    if (!q) return -1;
+    if (!queryCompile(q, text)) { free(q); return -1; }
+    queryPlan(q, NULL);
+    pthread_mutex_lock(&g_shard_mu);
+    if (!g_shard.open) { pthread_mutex_unlock(&g_shard_mu); free(q); return -1; }
+    unsigned long long mask = shardMask(q);
+    ShardMove *moves = NULL;
+    size_t nmoves = 0, capmoves = 0;
+    long total = 0;
+    for (int i = 0; total >= 0 && i < g_shard.n; i++) {
+        if (!((mask >> i) & 1)) continue;
+        long n = shardRewriteLocked(i, q, field, value, &moves, &nmoves, &capmoves);
+        total = n < 0 ? -1 : total + n;
+    }
+    for (size_t m = 0; total >= 0 && m < nmoves; m++) {   // after every rewrite, so a moved row isn't matched twice
+        char path[300];
+        shardPath(path, sizeof(path), moves[m].shard);
+        FILE *fp = fopen(path, "ab");
+        int ok = fp && fprintf(fp, "%s\n", moves[m].line) > 0;
+        if (fp && fclose(fp) != 0) ok = 0;
+        if (!ok) total = -1;
+    }
+    if (total >= 0) g_shard.moved += (unsigned long long)nmoves;
+    pthread_mutex_unlock(&g_shard_mu);
+    free(moves);
+    free(q);
+    return total;
+}
+
+// Delete every row the query matches. Returns the rows deleted, -1 on error.
+long shardDelete(const char *text) {
+    return shardEdit(text, 0, NULL);
+}
+
+// Set field ("company", "person", "phone" or "email") to value in every row the
+// query matches. Returns the rows updated, -1 on error or an unknown field.
+long shardUpdate(const char *text, const char *field, const char *value) {
+    static const char *const names[4] = { "company", "person", "phone", "email" };
+    for (int f = SF_COMPANY; f <= SF_EMAIL; f++)
+        if (strcmp(field, names[f]) == 0) return shardEdit(text, f, value ? value : "");
+    return -1;
+}
+
+unsigned long long getShardCounter(const char *name) {
+    pthread_mutex_lock(&g_shard_mu);
+    unsigned long long v = 0;
+    if      (strcmp(name, "adds")        == 0) v = g_shard.adds;
+    else if (strcmp(name, "queries")     == 0) v = g_shard.queries;
+    else if (strcmp(name, "routed")      == 0) v = g_shard.routed;
+    else if (strcmp(name, "shards_read") == 0) v = g_shard.shards_read;
+    else if (strcmp(name, "rewrites")    == 0) v = g_shard.rewrites;
+    else if (strcmp(name, "moved")       == 0) v = g_shard.moved;
+    pthread_mutex_unlock(&g_shard_mu);
+    return v;
+}
+
+void printShardStats(void) {
+    pthread_mutex_lock(&g_shard_mu);
+    printf("\n=== Sharded Book ===\n");
+    printf("shards       : %d in %s\n", g_shard.open ? g_shard.n : 0, g_shard.open ? g_shard.dir : "(none open)");
+    printf("rows added   : %llu\n", g_shard.adds);
+    printf("queries      : %llu (%llu routed by phone), %llu shard scans\n", g_shard.queries, g_shard.routed,
+           g_shard.shards_read);
+    printf("rewrites     : %llu shard(s), %llu row(s) moved to another shard\n", g_shard.rewrites, g_shard.moved);
+    pthread_mutex_unlock(&g_shard_mu);
+}
+
+// contact_app shard <dir> import <csv> [shards] | export <csv> | query "<expr>" | phone <number>
+//                         | del "<expr>" | set "<expr>" <field> <value> | stats
+static int shardCommand(int argc, char **argv) {
+    if (argc < 4) {
+        printf("usage: %s shard <dir> import <csv> [shards] | export <csv> | query \"<expr>\" | phone <number>\n"
+               "       | del \"<expr>\" | set \"<expr>\" company|person|phone|email <value> | stats\n", argv[0]);
+        return 1;
+    }
+    const char *cmd = argv[3];
+    int create = strcmp(cmd, "import") == 0 && argc >= 6 ? atoi(argv[5]) : 0;
+    if (!shardOpen(argv[2], create)) { printf("[ERROR] Cannot open shard set %s\n", argv[2]); return 1; }
+    int ok = 1;
+    if (strcmp(cmd, "import") == 0 && argc >= 5) {
+        long rows = shardImport(argv[4]);
+        ok = rows >= 0;
+        if (ok) printf("[SUCCESS] Imported %ld rows into %d shards.\n", rows, shardCount());
+        else    printf("[ERROR] Cannot import %s\n", argv[4]);
+    } else if (strcmp(cmd, "export") == 0 && argc >= 5) {
+        long rows = shardExport(argv[4]);
+        ok = rows >= 0;
+        if (ok) printf("[SUCCESS] Exported %ld rows.\n", rows);
+        else    printf("[ERROR] Cannot write %s\n", argv[4]);
+    } else if ((strcmp(cmd, "query") == 0 || strcmp(cmd, "phone") == 0) && argc >= 5) {
+        char plan[256] = "";
+        long hits = strcmp(cmd, "query") == 0 ? shardQuery(argv[4], queryPrintCsv, NULL, plan, sizeof(plan))
+                                              : shardFindPhone(argv[4], queryPrintCsv, NULL);
+        ok = hits >= 0;
+        if (ok) fprintf(stderr, "[INFO] %ld match(es)%s%s\n", hits, *plan ? "; " : "", plan);
+        else    printf("[ERROR] %s\n", *plan ? plan : "Cannot read the shards");
+    } else if (strcmp(cmd, "del") == 0 && argc >= 5) {
+        long n = shardDelete(argv[4]);
+        ok = n >= 0;
+        if (ok) printf("[SUCCESS] Deleted %ld row(s).\n", n);
+        else    printf("[ERROR] Bad query or cannot rewrite a shard\n");
+    } else if (strcmp(cmd, "set") == 0 && argc >= 7) {
+        long n = shardUpdate(argv[4], argv[5], argv[6]);
+        ok = n >= 0;
+        if (ok) printf("[SUCCESS] Updated %ld row(s).\n", n);
+        else    printf("[ERROR] Bad query or field, or cannot rewrite a shard\n");
+    } else if (strcmp(cmd, "stats") != 0) {
+        printf("[ERROR] Unknown shard command: %s\n", cmd);
+        ok = 0;
+    }
+    if (strcmp(cmd, "stats") == 0) printShardStats();
+    shardClose();
+    return ok ? 0 : 1;
+}
+
+// ==== Search (case-insensitive; company/person/email = prefix match, phone = substring) ====
+static void searchPrintRow(const char *company, const char *person, const char *phone, const char *email, void *ctx) {
+    (void)ctx;
+    printf("\nCompany : %s\n", company);
+    printf("Contact : %s\n", person);
+    printf("Phone   : %s\n", phone);
+    printf("Email   : %s\n", email);
+    printf("-----------------------------------\n");
+}
+
+static void searchPrintRanked(int score, const char *company, const char *person, const char *phone,
+                              const char *email, void *ctx) {
+    char why[32];
+    rankDescribe(score, why, sizeof(why));
+    printf("\nMatch   : %s", why);
+    searchPrintRow(company, person, phone, email, ctx);
+}
+
+// Plain keyword: phone digits = substring of the row's phone (a key starting
+// with 0 / 00 / + also of its E.164 digits, so 081... finds +66 81...), '@' =
+// email prefix, anything else = company or person prefix. All case-insensitive.
+typedef struct {
+    char lower[MAX_FIELD_LEN], phone_norm[MAX_FIELD_LEN], phone_canon[MAX_FIELD_LEN];
+    size_t len;
+    int is_phone, is_email;
+} PlainKey;
+
+static void plainKeyInit(PlainKey *pk, const char *key) {
+    strncpy(pk->lower, key, MAX_FIELD_LEN - 1);
+    pk->lower[MAX_FIELD_LEN - 1] = '\0';
+    for (int i = 0; pk->lower[i]; i++) pk->lower[i] = (char)tolower((unsigned char)pk->lower[i]);
+    pk->len = strlen(pk->lower);
+
+    normalizePhone(key, pk->phone_norm, sizeof(pk->phone_norm));
+    phoneCanonPattern(key, pk->phone_canon, sizeof(pk->phone_canon));
+
+    pk->is_phone = (int)(strlen(pk->phone_norm) > 0);   // ถ้ามีตัวเลขจน normalize แล้วไม่ว่าง
+    pk->is_email = (strchr(key, '@') != NULL);          // เดาจาก '@'
+}
+
+static int plainMatch(const struct Contact *c, void *ctx) {
+    const PlainKey *k = (const PlainKey*)ctx;
+    if (!*c->company && !*c->person && !*c->phone && !*c->email) return 0;
+
+    char company_lower[MAX_FIELD_LEN], person_lower[MAX_FIELD_LEN], email_lower[MAX_FIELD_LEN], phone_norm[MAX_FIELD_LEN];
+    strncpy(company_lower, c->company, MAX_FIELD_LEN - 1); company_lower[MAX_FIELD_LEN - 1] = '\0';
+    strncpy(person_lower , c->person , MAX_FIELD_LEN - 1); person_lower [MAX_FIELD_LEN - 1] = '\0';
+    strncpy(email_lower  , c->email  , MAX_FIELD_LEN - 1); email_lower  [MAX_FIELD_LEN - 1] = '\0';
+    for (int i = 0; company_lower[i]; i++) company_lower[i] = (char)tolower((unsigned char)company_lower[i]);
+    for (int i = 0; person_lower [i]; i++) person_lower [i] = (char)tolower((unsigned char)person_lower [i]);
+    for (int i = 0; email_lower  [i]; i++) email_lower  [i] = (char)tolower((unsigned char)email_lower  [i]);
+
+    normalizePhone(c->phone, phone_norm, sizeof(phone_norm));
+
+    int match = 0;
+    size_t klen = k->len;
+
+    TRACE_BEGIN(t_stage);
+    if (k->is_phone) {
+        if (*phone_norm && strstr(phone_norm, k->phone_norm) != NULL) match = 1;
+        long long v = !match && *phone_norm && *k->phone_canon ? phoneE164(c->phone) : 0;
+        if (v) {
+            char e164[24];
+            snprintf(e164, sizeof(e164), "%lld", v);
+            match = strstr(e164, k->phone_canon) != NULL;
+        }
+        TRACE_END(t_stage, "search.match.phone");
+    } else if (k->is_email) {
+        if (*email_lower && klen > 0 && strncmp(email_lower, k->lower, klen) == 0) match = 1;
+        TRACE_END(t_stage, "search.match.email");
     } else {
-        printf("------------------------------------------------------------------------------------------------\n");
-        printf("Total: %d contact(s) displayed\n", count);
+        if (!match && *company_lower && klen > 0 && strncmp(company_lower, k->lower, klen) == 0) match = 1;
+        if (!match && *person_lower  && klen > 0 && strncmp(person_lower , k->lower, klen) == 0) match = 1;
+        TRACE_END(t_stage, "search.match.text");
     }
+    return match;
 }
 
-// ==== Delete (by company/person/email exact-insensitive, phone normalized) ====
-void deleteContact() {
-    char key[MAX_FIELD_LEN];
-    printf("\n=== Delete Contact ===\n");
-    printf("Enter company / contact person / phone / email to delete (or 0 to cancel): ");
+void searchContact() {
+    char key[MAX_LINE_LEN];
+    printf("\n=== Search Contact ===\n");
+    printf("Enter keyword (company/person/phone/email), a query such as\n"
+           "company:alpha* phone:081* OR domain:co.th, / to search as you type, or 0 to cancel: ");
     if (!fgets(key, sizeof(key), stdin)) { printf("[ERROR] Failed to read input!\n"); return; }
     key[strcspn(key, "\n")] = '\0';
-    trimWhitespace(key);
+    sanitizeInput(key);
+    if (strcmp(key, "0") == 0) { printf("[INFO] Search cancelled.\n"); return; }
+    if (!*key) { printf("[ERROR] Search keyword cannot be empty!\n"); return; }
+    if (strcmp(key, "/") == 0) {
+        if (typeAheadRun(getContactsFile()) < 0) printf("[ERROR] No contacts file found!\n");
+        return;
+    }
+    if (isStructuredQuery(key) && g_page_size > 0) {
+        printf("\n--- Search Results ---\n");
+        long hits = pageThrough(key, searchPrintRow, NULL);
+        if (hits < 0)       printf("[ERROR] Bad query or no contacts file!\n");
+        else if (hits == 0) printf("[INFO] No matching contacts found.\n");
+        return;
+    }
+    if (isStructuredQuery(key)) {
+        char plan[256];
+        printf("\n--- Search Results ---\n");
+        OpTimer ot; opBegin(&ot, OP_SEARCH);
+        opScanBegin(&ot);
+        long hits = queryBook(getContactsFile(), key, searchPrintRow, NULL, plan, sizeof(plan));
+        opScanEnd(&ot);
+        if (hits < 0 && *plan) printf("[ERROR] Bad query: %s\n", plan);
+        else if (hits < 0)     printf("[ERROR] No contacts file found!\n");
+        else if (hits == 0)    printf("[INFO] No matching contacts found.\n");
+        if (hits >= 0) printf("[INFO] %ld match(es) (%s)\n", hits, plan);
+        return;
+    }
+    if (strlen(key) >= MAX_FIELD_LEN) key[MAX_FIELD_LEN - 1] = '\0';
+    if (g_search_top > 0) {
+        long total = 0;
+        int complete = 1;
+        printf("\n--- Search Results (best %d) ---\n", g_search_top);
+        OpTimer ot; opBegin(&ot, OP_SEARCH);
+        opScanBegin(&ot);
+        long shown = searchTopK(getContactsFile(), key, g_search_top, searchPrintRanked, NULL, &total, &complete);
+        opScanEnd(&ot);
+        if (shown < 0)       printf("[ERROR] No contacts file found!\n");
+        else if (total == 0) printf("[INFO] No matching contacts found.\n");
+        else printf("[INFO] Showing %ld of %s%ld match(es).\n", shown, complete ? "" : "at least ", total);
+        return;
+    }
 
-    if (strcmp(key, "0") == 0) { printf("[INFO] Delete cancelled.\n"); return; }
-    if (!*key) { printf("[ERROR] Keyword cannot be empty!\n"); return; }
+    // เตรียมคีย์เวิร์ด (lowercase / normalize)
+    PlainKey pk;
+    plainKeyInit(&pk, key);
 
-    char key_lower[MAX_FIELD_LEN];
-    strncpy(key_lower, key, MAX_FIELD_LEN - 1);
-    key_lower[MAX_FIELD_LEN - 1] = '\0';
-    for (int i = 0; key_lower[i]; i++) key_lower[i] = (char)tolower((unsigned char)key_lower[i]);
+    OpTimer ot; opBegin(&ot, OP_SEARCH);
+    FILE *fp = bookOpenRead(getContactsFile());
+    if (!fp) { printf("[ERROR] No contacts file found!\n"); return; }
 
-    char key_phone_norm[MAX_FIELD_LEN];
-    normalizePhone(key, key_phone_norm, sizeof(key_phone_norm));
-    int key_is_phone = (int)(strlen(key_phone_norm) > 0);
-    int key_is_email = (strchr(key, '@') != NULL);
+    printf("\n--- Search Results ---\n");
+    opScanBegin(&ot);
+    long found = pipeRun(fp, plainMatch, &pk, searchPrintRow, NULL, &ot);
+    opScanEnd(&ot);
 
-    char key_norm[MAX_FIELD_LEN];
-    strncpy(key_norm, key, MAX_FIELD_LEN - 1); key_norm[MAX_FIELD_LEN - 1] = '\0';
-    normalizeKey(key_norm);
-FILE *rf = fopen(getContactsFile(), "r");
-    if (!rf) { printf("[ERROR] No contacts file found!\n"); return; }
+    if (found < 0)       printf("[ERROR] Out of memory, the results are incomplete!\n");
+    else if (found == 0) printf("[INFO] No matching contacts found.\n");
+    fclose(fp);
+}
 
-    typedef struct {
-        char company[MAX_FIELD_LEN];
-        char person [MAX_FIELD_LEN];
-        char phone  [MAX_FIELD_LEN];
-        char email  [MAX_FIELD_LEN];
-        char rawline[MAX_LINE_LEN];
-    } Row;
+// ==== As-you-type search (each key narrows the previous result set) ====
+// typeAheadOpen maps the book once and notes where each row's fields start,
+// their first bytes lowercased, the phone's digits and which digits and digit
+// pairs occur in them (rows with quotes are parsed into an arena instead), so
+// a key is matched by plainMatch's rules without parsing a line, and a short
+// one without touching the book. A first text or email key tests only the
+// rows listed under its first byte, a key that extends the previous one only
+// the rows that matched it, and every key's result stays on a stack, so
+// backspace goes back to a cached set. The session sees the book as it was
+// when it was opened.
+#define TA_PAR_MIN  (1 << 16)    // smaller candidate sets are tested on the calling thread
+#define TA_SHOW     10           // rows printed after each key by typeAheadRun
+
+typedef struct {
+    unsigned long long at;       // row start in the mapping (in the text arena if text is set)
+    unsigned short pos[3];       // where person, phone and email start, from at
+    unsigned char flen[4];       // field lengths, capped as contactParse caps them
+    unsigned char text;
+    char head[3][4];             // first bytes of company, person and email, lowercased, 0-padded
+} TaRow;
+
+typedef struct {
+    PlainKey k;
+    unsigned *row;               // matching rows in book order
+    size_t n;
+} TaLevel;
+
+struct TypeAhead {
+    char *map;
+    size_t map_len;
+    TaRow *row;
+    unsigned *dig;                  // row i's "<phone digits>\0<E.164 digits>\0" in the digit arena
+    unsigned long long *pairs;      // row i's taPairs bits at pairs[2i .. 2i + 1]
+    size_t nrows, cap;
+    char *text, *digits;
+    size_t ntext, text_cap, ndigits, digits_cap;
+    unsigned *first[3];             // rows by the first byte of head[i], in book order
+    size_t first_at[3][257];        // byte c's rows are first[i][first_at[i][c] .. first_at[i][c + 1])
+    TaLevel level[MAX_FIELD_LEN];   // each level's key extends the one below; the top is the current result
+    int depth;
+    unsigned long long scans, narrowed, cached, tested, split;   // split: filters run on more than one worker
+};
 
-    enum { MAX_MATCH = 1024 };
-    Row matches[MAX_MATCH];
-    int mcount = 0;
+typedef struct {
+    const TypeAhead *ta;
+    const PlainKey *k;
+    unsigned long long raw[2], canon[2];   // the key's taPairs bits, a row without them can't match
+    int raw_exact;                         // ... and one with them does (keys of one or two digits)
+    const unsigned *in;          // candidate rows, NULL = every row
+    size_t beg, end, n;
+    unsigned *out;               // hits are written from out[beg]
+} TaPart;
+
+static const char* taField(const TypeAhead *ta, const TaRow *r, int f) {
+    return (r->text ? ta->text : ta->map) + r->at + (f ? r->pos[f - 1] : 0);
+}
 
-    char line[MAX_LINE_LEN];
-    while (fgets(line, sizeof(line), rf)) {
-        line[strcspn(line, "\n\r")] = '\0';
-        if (!*line) continue;
+// Field f (head h) starts with the key: the head settles keys of up to its
+// size, the field itself is read only past it.
+static int taPrefix(const TypeAhead *ta, const TaRow *r, int f, int h, const PlainKey *k) {
+    size_t n = k->len < sizeof(r->head[h]) ? k->len : sizeof(r->head[h]);
+    if (memcmp(r->head[h], k->lower, n) != 0) return 0;
+    if (k->len == n) return 1;
+    if (r->flen[f] < k->len) return 0;
+    const char *s = taField(ta, r, f);
+    for (size_t i = n; i < k->len; i++) if ((char)tolower((unsigned char)s[i]) != k->lower[i]) return 0;
+    return 1;
+}
 
-        char company[MAX_FIELD_LEN] = "", person[MAX_FIELD_LEN] = "", phone[MAX_FIELD_LEN] = "", email[MAX_FIELD_LEN] = "";
-        parseCsv4(line, company, sizeof(company), person, sizeof(person), phone, sizeof(phone), email, sizeof(email));
+// strstr for the short digit strings, without its per-call setup.
+static int taContains(const char *s, const char *pat) {
+    for (; *s; s++) {
+        if (*s != *pat) continue;
+        size_t i = 1;
+        while (pat[i] && s[i] == pat[i]) i++;
+        if (!pat[i]) return 1;
+    }
+    return 0;
+}
 
-        if (!*company && !*person && !*phone && !*email) continue;
+// Bits 0 .. 99 for the pairs of adjacent digits in s ("08", "81", ...),
+// 100 .. 109 for the digits themselves.
+static void taPairs(const char *s, unsigned long long m[2]) {
+    for (; *s; s++) {
+        if (!isdigit((unsigned char)s[0])) continue;
+        m[1] |= 1ULL << (100 - 64 + (s[0] - '0'));
+        if (!isdigit((unsigned char)s[1])) continue;
+        int p = (s[0] - '0') * 10 + (s[1] - '0');
+        m[p >> 6] |= 1ULL << (p & 63);
+    }
+}
 
-        char company_lower[MAX_FIELD_LEN], person_lower[MAX_FIELD_LEN], email_lower[MAX_FIELD_LEN];
-        strncpy(company_lower, company, MAX_FIELD_LEN - 1); company_lower[MAX_FIELD_LEN - 1] = '\0';
-        strncpy(person_lower , person , MAX_FIELD_LEN - 1); person_lower [MAX_FIELD_LEN - 1] = '\0';
-        strncpy(email_lower  , email  , MAX_FIELD_LEN - 1); email_lower  [MAX_FIELD_LEN - 1] = '\0';
-        for (int i = 0; company_lower[i]; i++) company_lower[i] = (char)tolower((unsigned char)company_lower[i]);
-        for (int i = 0; person_lower [i]; i++) person_lower [i] = (char)tolower((unsigned char)person_lower [i]);
-        for (int i = 0; email_lower  [i]; i++) email_lower  [i] = (char)tolower((unsigned char)email_lower  [i]);
+static int taHasPairs(const unsigned long long *m, const unsigned long long want[2]) {
+    return (m[0] & want[0]) == want[0] && (m[1] & want[1]) == want[1];
+}
 
-        char phone_norm[MAX_FIELD_LEN];
-        normalizePhone(phone, phone_norm, sizeof(phone_norm));
+// plainMatch on indexed row i; phone keys read only the digit arrays.
+static int taMatch(const TaPart *w, size_t i) {
+    const TypeAhead *ta = w->ta;
+    const PlainKey *k = w->k;
+    if (k->is_phone) {
+        const char *d = ta->digits + ta->dig[i];
+        const unsigned long long *m = ta->pairs + 2 * i;
+        if (!*d) return 0;
+        if (taHasPairs(m, w->raw) && (w->raw_exact || taContains(d, k->phone_norm))) return 1;
+        if (!*k->phone_canon || !taHasPairs(m, w->canon)) return 0;
+        d += strlen(d) + 1;
+        return taContains(d, k->phone_canon);
+    }
+    if (!k->len) return 0;
+    const TaRow *r = &ta->row[i];
+    if (k->is_email) return taPrefix(ta, r, 3, 2, k);
+    return taPrefix(ta, r, 0, 0, k) || taPrefix(ta, r, 1, 1, k);
+}
 
-        
-        int match = 0;
-        if (key_is_phone) {
-            if (*phone_norm && strcmp(phone_norm, key_phone_norm) == 0) match = 1;
-        }
-        if (!match && key_is_email) {
-            if (*email_lower && strstr(email_lower, key_lower) != NULL) match = 1; // CI substring for email
-        }
-        if (!match) {
-            // Build normalized text keys for robust company/person matching
-            char company_norm[MAX_FIELD_LEN]; strncpy(company_norm, company, MAX_FIELD_LEN - 1); company_norm[MAX_FIELD_LEN - 1] = '\0'; normalizeKey(company_norm);
-            char person_norm [MAX_FIELD_LEN]; strncpy(person_norm , person , MAX_FIELD_LEN - 1); person_norm [MAX_FIELD_LEN - 1] = '\0'; normalizeKey(person_norm);
-            if ((strstr(company_norm, key_norm) != NULL) || (strstr(person_norm, key_norm) != NULL)) {
-                match = 1;
-            }
-        }
+// b's key is a's with characters added.
+static int taExtends(const PlainKey *a, const PlainKey *b) {
+    return b->len >= a->len && memcmp(b->lower, a->lower, a->len) == 0;
+}
 
+// Every row matching b also matches a, so b can be answered from a's result.
+static int plainKeyNarrows(const PlainKey *a, const PlainKey *b) {
+    if (a->is_phone != b->is_phone || a->is_email != b->is_email) return 0;
+    if (!a->is_phone) return taExtends(a, b);
+    return strstr(b->phone_norm, a->phone_norm) &&
+           (!*b->phone_canon || (*a->phone_canon && strstr(b->phone_canon, a->phone_canon)));
+}
 
-        if (match) {
-            if (mcount < MAX_MATCH) {
-                strncpy(matches[mcount].company, company, MAX_FIELD_LEN - 1);
-                strncpy(matches[mcount].person , person , MAX_FIELD_LEN - 1);
-                strncpy(matches[mcount].phone  , phone  , MAX_FIELD_LEN - 1);
-                strncpy(matches[mcount].email  , email  , MAX_FIELD_LEN - 1);
-                matches[mcount].company[MAX_FIELD_LEN-1] = '\0';
-                matches[mcount].person [MAX_FIELD_LEN-1] = '\0';
-                matches[mcount].phone  [MAX_FIELD_LEN-1] = '\0';
-                matches[mcount].email  [MAX_FIELD_LEN-1] = '\0';
-                strncpy(matches[mcount].rawline, line, MAX_LINE_LEN - 1);
-                matches[mcount].rawline[MAX_LINE_LEN-1] = '\0';
-                mcount++;
-            }
-        }
+static long long taAppend(char **buf, size_t *n, size_t *cap, const char *s, size_t len) {
+    if (*n + len > *cap) {
+        size_t c = *cap ? *cap : (size_t)1 << 16;
+        while (c < *n + len) c *= 2;
+        char *p = (char*)realloc(*buf, c);
+        if (!p) return -1;
+        *buf = p; *cap = c;
     }
-    fclose(rf);
+    memcpy(*buf + *n, s, len);
+    *n += len;
+    return *n - len <= 0xFFFFFFFFu ? (long long)(*n - len) : -1;
+}
 
-    if (mcount == 0) {
-        printf("\n[INFO] No record matches '%s'.\n", key);
-        return;
+// Index one line: field offsets into the mapping, or the parsed fields in
+// the text arena when the line has quotes or is longer than a row buffer.
+static int taIndexRow(TypeAhead *ta, const char *s, size_t n) {
+    if (ta->nrows == ta->cap) {
+        size_t c = ta->cap ? ta->cap * 2 : 4096;
+        TaRow *p = c <= 0xFFFFFFFFu ? (TaRow*)realloc(ta->row, c * sizeof(*p)) : NULL;
+        if (p) ta->row = p;
+        unsigned *q = p ? (unsigned*)realloc(ta->dig, c * sizeof(*q)) : NULL;
+        if (q) ta->dig = q;
+        unsigned long long *m = q ? (unsigned long long*)realloc(ta->pairs, 2 * c * sizeof(*m)) : NULL;
+        if (!m) return 0;
+        ta->pairs = m; ta->cap = c;
     }
-
-    int choice_idx = 0;
-    if (mcount == 1) {
-        printf("\n--- Contact to Delete ---\n");
-        printf("Company : %s\n", matches[0].company);
-        printf("Contact : %s\n", matches[0].person);
-        printf("Phone   : %s\n", matches[0].phone);
-        printf("Email   : %s\n", matches[0].email);
-        printf("------------------------\n");
-        if (!confirmAction("\nAre you sure you want to delete this contact?")) {
-            printf("[INFO] Delete cancelled.\n");
-            return;
+    TaRow *r = &ta->row[ta->nrows];
+    char phone[MAX_FIELD_LEN];
+    memset(r, 0, sizeof(*r));
+    if (n < MAX_LINE_LEN && !memchr(s, '"', n)) {
+        const char *f = s, *stop = s + n;
+        for (int i = 0; i < 4; i++) {
+            const char *comma = f < stop ? (const char*)memchr(f, ',', (size_t)(stop - f)) : NULL;
+            size_t len = (size_t)((comma ? comma : stop) - f);
+            if (i) r->pos[i - 1] = (unsigned short)(f - s);
+            r->flen[i] = (unsigned char)(len < MAX_FIELD_LEN - 2 ? len : MAX_FIELD_LEN - 2);
+            f = comma ? comma + 1 : stop;
         }
-        choice_idx = 1;
+        if (!r->flen[0] && !r->flen[1] && !r->flen[2] && !r->flen[3]) return 1;
+        memcpy(phone, s + r->pos[1], r->flen[2]);
+        phone[r->flen[2]] = '\0';
+        r->at = (unsigned long long)(s - ta->map);
     } else {
-        printf("\nMultiple records matched '%s'. Please choose one to delete:\n", key);
-        for (int i = 0; i < mcount; i++) {
-            printf("%d) Company: %s | Person: %s | Phone: %s | Email: %s\n",
-                   i + 1, matches[i].company, matches[i].person, matches[i].phone, matches[i].email);
+        char line[MAX_LINE_LEN], rec[4 * MAX_FIELD_LEN];
+        struct Contact c;
+        size_t k = n < sizeof(line) ? n : sizeof(line) - 1;
+        memcpy(line, s, k);
+        line[k] = '\0';
+        if (!contactParse(line, &c)) return 1;
+        const char *field[4] = { c.company, c.person, c.phone, c.email };
+        size_t used = 0;
+        for (int i = 0; i < 4; i++) {
+            size_t len = strlen(field[i]);
+            if (i) r->pos[i - 1] = (unsigned short)used;
+            r->flen[i] = (unsigned char)len;
+            memcpy(rec + used, field[i], len + 1);
+            used += len + 1;
         }
-        printf("0) Cancel\n");
-
-        int sel = 0;
-        while (1) {
-            printf("Select [0-%d]: ", mcount);
-            int choice = -1;
-            if (!read_int_choice("Enter your choice: ", &choice)) {
-            choice = -1; // จะวิ่งไป default case
-            }
+        long long at = taAppend(&ta->text, &ta->ntext, &ta->text_cap, rec, used);
+        if (at < 0) return 0;
+        snprintf(phone, sizeof(phone), "%s", c.phone);
+        r->at = (unsigned long long)at;
+        r->text = 1;
+    }
+    static const int head_field[3] = { 0, 1, 3 };
+    for (int h = 0; h < 3; h++) {
+        const char *f = taField(ta, r, head_field[h]);
+        for (int i = 0; i < 4 && i < r->flen[head_field[h]]; i++) r->head[h][i] = (char)tolower((unsigned char)f[i]);
+    }
+    char d[2 * MAX_FIELD_LEN + 24];
+    normalizePhone(phone, d, MAX_FIELD_LEN);
+    size_t dl = strlen(d);
+    long long v = dl ? phoneE164(phone) : 0;
+    d[dl + 1] = '\0';
+    size_t el = v ? (size_t)snprintf(d + dl + 1, sizeof(d) - dl - 1, "%lld", v) : 0;
+    long long at = taAppend(&ta->digits, &ta->ndigits, &ta->digits_cap, d, dl + el + 2);
+    if (at < 0) return 0;
+    ta->dig[ta->nrows] = (unsigned)at;
+    unsigned long long *m = ta->pairs + 2 * ta->nrows;
+    m[0] = m[1] = 0;
+    taPairs(d, m);
+    taPairs(d + dl + 1, m);
+    ta->nrows++;
+    return 1;
+}
 
-            if (sel == 0) { printf("[INFO] Delete cancelled.\n"); return; }
-            if (sel >= 1 && sel <= mcount) {
-                printf("\n--- Contact to Delete ---\n");
-                printf("Company : %s\n", matches[sel-1].company);
-                printf("Contact : %s\n", matches[sel-1].person);
-                printf("Phone   : %s\n", matches[sel-1].phone);
-                printf("Email   : %s\n", matches[sel-1].email);
-                printf("------------------------\n");
-                if (!confirmAction("\nAre you sure you want to delete this contact?")) {
-                    printf("[INFO] Delete cancelled.\n"); return;
-                }
-                choice_idx = sel;
-                break;
-            }
-            printf("[ERROR] Invalid selection. Try again.\n");
+// The first[] lists: a counting sort of the rows on each head's first byte.
+static int taBuildFirst(TypeAhead *ta) {
+    for (int h = 0; h < 3; h++) {
+        size_t *at = ta->first_at[h], next[256];
+        memset(at, 0, sizeof(ta->first_at[h]));
+        for (size_t i = 0; i < ta->nrows; i++) {
+            unsigned char c = (unsigned char)ta->row[i].head[h][0];
+            if (c) at[c + 1]++;
+        }
+        for (int c = 0; c < 256; c++) at[c + 1] += at[c];
+        if (!(ta->first[h] = (unsigned*)malloc((at[256] ? at[256] : 1) * sizeof(unsigned)))) return 0;
+        memcpy(next, at, sizeof(next));
+        for (size_t i = 0; i < ta->nrows; i++) {
+            unsigned char c = (unsigned char)ta->row[i].head[h][0];
+            if (c) ta->first[h][next[c]++] = (unsigned)i;
         }
     }
+    return 1;
+}
 
-    char tmpfile[300];
-    makeTempPath(tmpfile, sizeof(tmpfile));
-    rf = fopen(getContactsFile(), "r");
-    if (!rf) { printf("[ERROR] Cannot open contacts file!\n"); return; }
-    FILE *wf = fopen(tmpfile, "w");
-    if (!wf) { fclose(rf); printf("[ERROR] Cannot create temporary file!\n"); return; }
+// Rows whose company or person (email, for an email key) starts with the
+// key's first byte, in book order. NULL if memory runs out.
+static unsigned* taSeed(const TypeAhead *ta, const PlainKey *k, size_t *n) {
+    unsigned char c = (unsigned char)k->lower[0];
+    int a = k->is_email ? 2 : 0, b = k->is_email ? 2 : 1;
+    const unsigned *x = ta->first[a] + ta->first_at[a][c], *xe = ta->first[a] + ta->first_at[a][c + 1];
+    const unsigned *y = ta->first[b] + ta->first_at[b][c], *ye = ta->first[b] + ta->first_at[b][c + 1];
+    if (a == b) y = ye;
+    unsigned *out = (unsigned*)malloc(((size_t)(xe - x) + (size_t)(ye - y) + 1) * sizeof(*out));
+    if (!out) return NULL;
+    size_t m = 0;
+    while (x < xe || y < ye) {
+        if (y == ye || (x < xe && *x < *y)) out[m++] = *x++;
+        else if (x == xe || *y < *x)        out[m++] = *y++;
+        else { out[m++] = *x++; y++; }
+    }
+    *n = m;
+    return out;
+}
 
-    int deleted = 0;
-    while (fgets(line, sizeof(line), rf)) {
-        line[strcspn(line, "\n\r")] = '\0';
-        if (!*line) continue;
-        if (!deleted && strcmp(line, matches[choice_idx - 1].rawline) == 0) {
-            deleted = 1; // skip
-            continue;
+// Index the book for as-you-type search. NULL if it can't be read or
+// memory runs out.
+TypeAhead* typeAheadOpen(const char *path) {
+    FileStamp st;
+    if (!fileStamp(path, &st)) return NULL;
+    TypeAhead *ta = (TypeAhead*)calloc(1, sizeof(*ta));
+    if (!ta) return NULL;
+    if (st.size > 0 && !(ta->map = mapFile(path, &ta->map_len))) { free(ta); return NULL; }
+    OpCounters *oc = &threadStats()->op[OP_SCAN];
+    int ok = 1;
+    TRACE_BEGIN(t_index);
+    if (ta->map) {
+        const char *p = ta->map, *s;
+        for (size_t n; ok && (n = nextLine(&p, ta->map + ta->map_len, &s)) > 0; ) {
+            oc->rows_scanned++;
+            oc->bytes_read += n;
+            ok = taIndexRow(ta, s, n);
         }
-        fprintf(wf, "%s\n", line);
     }
-    fclose(rf);
-    fclose(wf);
+    ok = ok && taBuildFirst(ta);
+    TRACE_END(t_index, "typeahead.index");
+    if (!ok) { typeAheadClose(ta); return NULL; }
+    return ta;
+}
 
-    if (remove(getContactsFile()) != 0) {
-        printf("[ERROR] Failed to remove old file!\n");
-        remove(tmpfile);
-        return;
-    }
-    if (rename(tmpfile, getContactsFile()) != 0) {
-        printf("[ERROR] Failed to rename temporary file!\n");
-        return;
+static void* taWorker(void *arg) {
+    TaPart *w = (TaPart*)arg;
+    for (size_t i = w->beg; i < w->end; i++) {
+        unsigned id = w->in ? w->in[i] : (unsigned)i;
+        if (taMatch(w, id)) w->out[w->beg + w->n++] = id;
     }
-
-    if (deleted) printf("\n[SUCCESS] Contact deleted successfully!\n");
-    else         printf("\n[INFO] Nothing was deleted.\n");
+    return NULL;
 }
 
-// ==== Search (case-insensitive; company/person/email = prefix match, phone = substring) ====
-void searchContact() {
-    char key[MAX_FIELD_LEN];
-    printf("\n=== Search Contact ===\n");
-    printf("Enter keyword (company/person/phone/email, or 0 to cancel): ");
-    if (!fgets(key, sizeof(key), stdin)) { printf("[ERROR] Failed to read input!\n"); return; }
-    key[strcspn(key, "\n")] = '\0';
-    sanitizeInput(key);
-    if (strcmp(key, "0") == 0) { printf("[INFO] Search cancelled.\n"); return; }
-    if (!*key) { printf("[ERROR] Search keyword cannot be empty!\n"); return; }
-
-    // เตรียมคีย์เวิร์ด (lowercase / normalize)
-    char key_lower[MAX_FIELD_LEN];
-    strncpy(key_lower, key, MAX_FIELD_LEN - 1);
-    key_lower[MAX_FIELD_LEN - 1] = '\0';
-    for (int i = 0; key_lower[i]; i++) key_lower[i] = (char)tolower((unsigned char)key_lower[i]);
-
-    char key_phone_norm[MAX_FIELD_LEN];
-    normalizePhone(key, key_phone_norm, sizeof(key_phone_norm));
-
-    int key_is_phone = (int)(strlen(key_phone_norm) > 0);   // ถ้ามีตัวเลขจน normalize แล้วไม่ว่าง
-    int key_is_email = (strchr(key, '@') != NULL);          // เดาจาก '@'
+// The rows among in[0 .. n) (rows 0 .. n when in is NULL) that match k, in
+// book order; *parts is the number of workers that tested them. NULL if
+// memory runs out.
+static unsigned* taFilter(const TypeAhead *ta, const PlainKey *k, const unsigned *in, size_t n, size_t *hits,
+                          int *parts) {
+    unsigned *out = (unsigned*)malloc((n ? n : 1) * sizeof(*out));
+    if (!out) return NULL;
+    int nthreads = n >= TA_PAR_MIN ? cpuCount() : 1;
+    if (nthreads > SCAN_MAX_THREADS) nthreads = SCAN_MAX_THREADS;
+    *parts = nthreads;
+    TaPart part[SCAN_MAX_THREADS];
+    memset(&part[0], 0, sizeof(part[0]));
+    if (k->is_phone) {
+        taPairs(k->phone_norm, part[0].raw);
+        taPairs(k->phone_canon, part[0].canon);
+        part[0].raw_exact = strlen(k->phone_norm) <= 2;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        if (i) part[i] = part[0];
+        part[i].ta = ta; part[i].k = k; part[i].in = in; part[i].out = out;
+        part[i].beg = n * (size_t)i / (size_t)nthreads;
+        part[i].end = n * (size_t)(i + 1) / (size_t)nthreads;
+    }
+    TRACE_BEGIN(t_filter);
+    runParts(nthreads, taWorker, part, sizeof(part[0]));
+    TRACE_END(t_filter, in ? "typeahead.narrow" : "typeahead.scan");
+    size_t m = part[0].n;
+    for (int i = 1; i < nthreads; i++) {
+        memmove(out + m, out + part[i].beg, part[i].n * sizeof(*out));
+        m += part[i].n;
+    }
+    unsigned *fit = (unsigned*)realloc(out, (m ? m : 1) * sizeof(*out));
+    *hits = m;
+    return fit ? fit : out;
+}
 
-    FILE *fp = fopen(getContactsFile(), "r");
-    if (!fp) { printf("[ERROR] No contacts file found!\n"); return; }
+static void taPop(TypeAhead *ta) {
+    free(ta->level[--ta->depth].row);
+}
 
-    char line[MAX_LINE_LEN];
-    int found = 0;
+// Make key the current search: answered from the cached result of the same
+// key, else by testing only the rows of the longest cached key it narrows,
+// else the rows listed under its first byte (every row, for a phone key).
+// Returns the number of matches, -1 if memory ran
+// out (there is no current result then).
+long typeAheadSet(TypeAhead *ta, const char *key) {
+    PlainKey k;
+    plainKeyInit(&k, key);
+    while (ta->depth > 0 && !taExtends(&ta->level[ta->depth - 1].k, &k)) taPop(ta);
+    if (!k.len) return 0;
+    if (ta->depth > 0 && ta->level[ta->depth - 1].k.len == k.len) {
+        ta->cached++;
+        return (long)ta->level[ta->depth - 1].n;
+    }
+    const TaLevel *from = NULL;
+    for (int i = ta->depth - 1; i >= 0 && !from; i--) {
+        if (plainKeyNarrows(&ta->level[i].k, &k)) from = &ta->level[i];
+    }
+    size_t n = 0, tested = from ? from->n : ta->nrows;
+    int parts = 1;
+    unsigned *seed = !from && !k.is_phone ? taSeed(ta, &k, &tested) : NULL;
+    if (!from && !k.is_phone && !seed) tested = ta->nrows;
+    unsigned *row = taFilter(ta, &k, from ? from->row : seed, tested, &n, &parts);
+    free(seed);
+    if (!row) {
+        while (ta->depth > 0) taPop(ta);
+        return -1;
+    }
+    if (from) ta->narrowed++;
+    else      ta->scans++;
+    ta->tested += tested;
+    ta->split += parts > 1;
+    TaLevel *l = &ta->level[ta->depth++];
+    l->k = k;
+    l->row = row;
+    l->n = n;
+    return (long)n;
+}
 
-    printf("\n--- Search Results ---\n");
-    while (fgets(line, sizeof(line), fp)) {
-        line[strcspn(line, "\n\r")] = '\0';
-        if (!*line) continue;
+// fn on the first n rows of the current result (all of them if n is 0).
+// Returns how many were passed.
+size_t typeAheadResults(const TypeAhead *ta, size_t n,
+                        void (*fn)(const char *company, const char *person, const char *phone, const char *email,
+                                   void *ctx),
+                        void *ctx) {
+    if (ta->depth == 0) return 0;
+    const TaLevel *l = &ta->level[ta->depth - 1];
+    if (n == 0 || n > l->n) n = l->n;
+    for (size_t i = 0; i < n; i++) {
+        const TaRow *r = &ta->row[l->row[i]];
+        if (r->text) {
+            fn(taField(ta, r, 0), taField(ta, r, 1), taField(ta, r, 2), taField(ta, r, 3), ctx);
+            continue;
+        }
+        const char *s = ta->map + r->at, *nl = (const char*)memchr(s, '\n', ta->map_len - r->at);
+        size_t len = nl ? (size_t)(nl - s) : ta->map_len - r->at;
+        if (len && s[len - 1] == '\r') len--;
+        char line[MAX_LINE_LEN];
+        struct Contact c;
+        memcpy(line, s, len);   // indexed in place only when shorter than MAX_LINE_LEN
+        line[len] = '\0';
+        contactParse(line, &c);
+        fn(c.company, c.person, c.phone, c.email, ctx);
+    }
+    return n;
+}
 
-        char company[MAX_FIELD_LEN] = "", person[MAX_FIELD_LEN] = "", phone[MAX_FIELD_LEN] = "", email[MAX_FIELD_LEN] = "";
-        parseCsv4(line, company, sizeof(company), person, sizeof(person), phone, sizeof(phone), email, sizeof(email));
-        if (!*company && !*person && !*phone && !*email) continue;
+long typeAheadRows(const TypeAhead *ta) { return (long)ta->nrows; }
 
-        char company_lower[MAX_FIELD_LEN], person_lower[MAX_FIELD_LEN], email_lower[MAX_FIELD_LEN], phone_norm[MAX_FIELD_LEN];
-        strncpy(company_lower, company, MAX_FIELD_LEN - 1); company_lower[MAX_FIELD_LEN - 1] = '\0';
-        strncpy(person_lower , person , MAX_FIELD_LEN - 1); person_lower [MAX_FIELD_LEN - 1] = '\0';
-        strncpy(email_lower  , email  , MAX_FIELD_LEN - 1); email_lower  [MAX_FIELD_LEN - 1] = '\0';
-        for (int i = 0; company_lower[i]; i++) company_lower[i] = (char)tolower((unsigned char)company_lower[i]);
-        for (int i = 0; person_lower [i]; i++) person_lower [i] = (char)tolower((unsigned char)person_lower [i]);
-        for (int i = 0; email_lower  [i]; i++) email_lower  [i] = (char)tolower((unsigned char)email_lower  [i]);
+unsigned long long typeAheadCounter(const TypeAhead *ta, const char *name) {
+    if (strcmp(name, "scans")    == 0) return ta->scans;
+    if (strcmp(name, "narrowed") == 0) return ta->narrowed;
+    if (strcmp(name, "cached")   == 0) return ta->cached;
+    if (strcmp(name, "tested")   == 0) return ta->tested;
+    if (strcmp(name, "split")    == 0) return ta->split;
+    return 0;
+}
 
-        normalizePhone(phone, phone_norm, sizeof(phone_norm));
+void typeAheadClose(TypeAhead *ta) {
+    if (!ta) return;
+    while (ta->depth > 0) taPop(ta);
+    if (ta->map) unmapFile(ta->map, ta->map_len);
+    for (int h = 0; h < 3; h++) free(ta->first[h]);
+    free(ta->row);
+    free(ta->dig);
+    free(ta->pairs);
+    free(ta->text);
+    free(ta->digits);
+    free(ta);
+}
 
-        int match = 0;
-        size_t klen = strlen(key_lower);
+static void typeAheadPrintRow(const char *company, const char *person, const char *phone, const char *email,
+                              void *ctx) {
+    (void)ctx;
+    printf("  %s | %s | %s | %s\n", company, person, phone, email);
+}
 
-        if (key_is_phone) {
-            if (*phone_norm && strstr(phone_norm, key_phone_norm) != NULL) match = 1;
-        } else if (key_is_email) {
-            if (*email_lower && klen > 0 && strncmp(email_lower, key_lower, klen) == 0) match = 1;
+// Search as the user types: one key at a time (Backspace deletes, Enter or
+// Esc ends), printing the match count, the time the key took and the first
+// TA_SHOW matches. Returns the number of keys handled, -1 if the book can't
+// be read.
+static long typeAheadRun(const char *path) {
+    TypeAhead *ta = typeAheadOpen(path);
+    if (!ta) return -1;
+    char key[MAX_FIELD_LEN] = "", trimmed[MAX_FIELD_LEN];
+    size_t n = 0;
+    long keys = 0;
+    printf("\n[INFO] %ld row(s) indexed. Type to search, Backspace deletes, Enter ends.\n", typeAheadRows(ta));
+    for (int ch; (ch = getch()) != EOF && ch != '\n' && ch != '\r' && ch != 27; ) {
+        if (ch == 127 || ch == '\b') {
+            while (n > 0 && ((unsigned char)key[n - 1] & 0xC0) == 0x80) n--;   // a whole UTF-8 character
+            if (n > 0) n--;
+        } else if ((unsigned char)ch >= 32 && n + 1 < sizeof(key)) {
+            key[n++] = (char)ch;
         } else {
-            if (!match && *company_lower && klen > 0 && strncmp(company_lower, key_lower, klen) == 0) match = 1;
-            if (!match && *person_lower  && klen > 0 && strncmp(person_lower , key_lower, klen) == 0) match = 1;
-        }
-
-        if (match) {
-            printf("\nCompany : %s\n", company);
-            printf("Contact : %s\n", person);
-            printf("Phone   : %s\n", phone);
-            printf("Email   : %s\n", email);
-            printf("-----------------------------------\n");
-            found = 1;
+            continue;
         }
+        key[n] = '\0';
+        keys++;
+        snprintf(trimmed, sizeof(trimmed), "%s", key);
+        sanitizeInput(trimmed);
+        long long t0 = nowNs();
+        long hits = typeAheadSet(ta, trimmed);
+        long long ns = nowNs() - t0;
+        if (hits < 0) { printf("\n[ERROR] Out of memory!\n"); continue; }
+        printf("\n> %s  (%ld match(es), %.2f ms)\n", key, hits, (double)ns / 1e6);
+        typeAheadResults(ta, TA_SHOW, typeAheadPrintRow, NULL);
+        if (hits > TA_SHOW) printf("  ... %ld more\n", hits - TA_SHOW);
     }
+    printf("\n[INFO] %ld key(s): %llu full scan(s), %llu narrowed, %llu from cache\n", keys,
+           typeAheadCounter(ta, "scans"), typeAheadCounter(ta, "narrowed"), typeAheadCounter(ta, "cached"));
+    typeAheadClose(ta);
+    return keys;
+}
 
-    if (!found) printf("[INFO] No matching contacts found.\n");
-    fclose(fp);
+static int typeCommand(int argc, char **argv) {
+    const char *book = argc >= 3 ? argv[2] : getContactsFile();
+    if (typeAheadRun(book) < 0) { printf("[ERROR] Cannot read %s\n", book); return 1; }
+    return 0;
 }
 
 // ==== Update (by company, case-insensitive) ====
@@ -763,167 +9065,155 @@ void updateContact() {
     key_norm[MAX_FIELD_LEN - 1] = '\0';   // <- FIX: ต้อง \0 ไม่ใช่ ' '
     normalizeKey(key_norm);
 
-    FILE *rf = fopen(getContactsFile(), "r");
+    OpTimer ot; opBegin(&ot, OP_UPDATE);
+    FILE *rf = bookOpenRead(getContactsFile());
     if (!rf) { printf("[ERROR] No contacts file found!\n"); return; }
 
-    char tmpfile[300]; 
-    makeTempPath(tmpfile, sizeof(tmpfile));
-    FILE *wf = fopen(tmpfile, "w");
-    if (!wf) { fclose(rf); printf("[ERROR] Cannot create temporary file!\n"); return; }
-
+    // first row of that company; the rest of the book is neither read nor written
     char line[MAX_LINE_LEN];
-    int updated = 0;
-
-    while (fgets(line, sizeof(line), rf)) {
+    struct Contact cur;                           // the whole row, so columns the menu doesn't edit survive
+    memset(&cur, 0, sizeof(cur));
+    long long pos = 0, at = -1;
+    opScanBegin(&ot);
+    while (at < 0 && fgets(line, sizeof(line), rf)) {
+        opRow(&ot, line);
+        long long start = pos;
+        pos += (long long)strlen(line);
         line[strcspn(line, "\n\r")] = '\0';
         if (!*line) continue;
 
-        char company[MAX_FIELD_LEN] = "";
-        char person [MAX_FIELD_LEN] = "";
-        char phone  [MAX_FIELD_LEN] = "";
-        char email  [MAX_FIELD_LEN] = "";
-        parseCsv4(line, company, sizeof(company),
-                        person,  sizeof(person),
-                        phone,   sizeof(phone),
-                        email,   sizeof(email));
+        contactParse(line, &cur);
+        opLap(&ot, PH_PARSE);
 
         char company_norm[MAX_FIELD_LEN];
-        strncpy(company_norm, company, MAX_FIELD_LEN - 1);
+        strncpy(company_norm, cur.company, MAX_FIELD_LEN - 1);
         company_norm[MAX_FIELD_LEN - 1] = '\0';
         normalizeKey(company_norm);
+        if (*cur.company && strcmp(company_norm, key_norm) == 0) at = start;
+        opLap(&ot, PH_MATCH);
+    }
+    fclose(rf);
+    opScanEnd(&ot);                               // don't count the user's think time
 
-        if (!updated && *company && strcmp(company_norm, key_norm) == 0) {
-            int choice = -1;                      // <- FIX: ไม่ประกาศซ้ำ
-            char buf[MAX_FIELD_LEN];
-
-            printf("\n--- Current Contact ---\n");
-            printf("Company : %s\n", company);
-            printf("Contact : %s\n", person);
-            printf("Phone   : %s\n", phone);
-            printf("Email   : %s\n", email);
-            printf("----------------------\n");
-
-            printf("\nUpdate which field?\n");
-            printf("1. Company\n");
-            printf("2. Contact Person\n");
-            printf("3. Phone\n");
-            printf("4. Email\n");
-            printf("0. Cancel\n");
-            if (!read_int_choice("Choice: ", &choice)) choice = 0;
-
-            if (choice == 0) {
-                printf("[INFO] Update cancelled.\n");
-                // write original
-                char e1[MAX_FIELD_LEN*2], e2[MAX_FIELD_LEN*2], e3[MAX_FIELD_LEN*2], e4[MAX_FIELD_LEN*2];
-                escapeCSV(company,e1,sizeof(e1)); escapeCSV(person,e2,sizeof(e2));
-                escapeCSV(phone,e3,sizeof(e3));   escapeCSV(email,e4,sizeof(e4));
-                fprintf(wf, "%s,%s,%s,%s\n", e1,e2,e3,e4);
-                continue;
-            }
+    int updated = 0;
+    if (at >= 0) {
+        ot.c->matches++;
+        int choice = -1;
+        char buf[MAX_FIELD_LEN];
+
+        printf("\n--- Current Contact ---\n");
+        contactPrintCard(&cur);
+        printf("----------------------\n");
+
+        printf("\nUpdate which field?\n");
+        printf("1. Company\n");
+        printf("2. Contact Person\n");
+        printf("3. Phone\n");
+        printf("4. Email\n");
+        printf("0. Cancel\n");
+        if (!read_int_choice("Choice: ", &choice)) choice = 0;
+
+        int  valid_update = 0;
+        struct Contact next = cur;
 
-            int  valid_update = 0;
-            char new_company[MAX_FIELD_LEN], new_person[MAX_FIELD_LEN];
-            char new_phone  [MAX_FIELD_LEN], new_email [MAX_FIELD_LEN];
-            strcpy(new_company, company);
-            strcpy(new_person,  person);
-            strcpy(new_phone,   phone);
-            strcpy(new_email,   email);
-
-            switch (choice) {
-                case 1: // Company
-                    while (1) {
-                        if (!read_line_prompt("New Company (0 to cancel): ", buf, sizeof(buf))) { 
-                            printf("[CANCEL] Input canceled.\n"); break; 
-                        }
-                        if (strcmp(buf, "0") == 0) break;
-                        sanitizeInput(buf);
-                        if (*buf && strlen(buf) < MAX_FIELD_LEN) { 
-                            strcpy(new_company, buf); valid_update = 1; break; 
-                        }
-                        printf("[ERROR] Invalid input! Try again.\n");
+        switch (choice) {
+            case 1: // Company
+                while (1) {
+                    if (!read_line_prompt("New Company (0 to cancel): ", buf, sizeof(buf))) { 
+                        printf("[CANCEL] Input canceled.\n"); break; 
                     }
-                    break;
-
-                case 2: // Contact Person
-                    while (1) {
-                        if (!read_line_prompt("New Contact (0 to cancel): ", buf, sizeof(buf))) { 
-                            printf("[CANCEL] Input canceled.\n"); break; 
-                        }
-                        if (strcmp(buf, "0") == 0) break;
-                        sanitizeInput(buf);
-                        if (*buf && strlen(buf) < MAX_FIELD_LEN) { 
-                            strcpy(new_person, buf); valid_update = 1; break; 
-                        }
-                        printf("[ERROR] Invalid input! Try again.\n");
+                    if (strcmp(buf, "0") == 0) break;
+                    sanitizeInput(buf);
+                    if (*buf && strlen(buf) < MAX_FIELD_LEN) { 
+                        strcpy(next.company, buf); valid_update = 1; break; 
                     }
-                    break;
-
-                case 3: // Phone
-                    while (1) {
-                        if (!read_line_prompt("New Phone (0 to cancel): ", buf, sizeof(buf))) { 
-                            printf("[CANCEL] Input canceled.\n"); break; 
-                        }
-                        if (strcmp(buf, "0") == 0) break;
-                        sanitizeInput(buf);
-                        if (validatePhone(buf) && *buf && strlen(buf) < MAX_FIELD_LEN) { 
-                            strcpy(new_phone, buf); valid_update = 1; break; 
-                        }
-                        printf("[ERROR] Invalid phone format! Try again.\n");
+                    printf("[ERROR] Invalid input! Try again.\n");
+                }
+                break;
+
+            case 2: // Contact Person
+                while (1) {
+                    if (!read_line_prompt("New Contact (0 to cancel): ", buf, sizeof(buf))) { 
+                        printf("[CANCEL] Input canceled.\n"); break; 
                     }
-                    break;
-
-                case 4: // Email
-                    while (1) {
-                        if (!read_line_prompt("New Email (0 to cancel): ", buf, sizeof(buf))) {
-                            printf("[CANCEL] Input canceled.\n"); break;
-                        }
-                        if (strcmp(buf, "0") == 0) break;
-                        sanitizeInput(buf);
-                        if (validateEmail(buf) && *buf && strlen(buf) < MAX_FIELD_LEN) { 
-                            strcpy(new_email, buf); valid_update = 1; break; 
-                        }
-                        printf("[ERROR] Invalid email format! Try again.\n");
+                    if (strcmp(buf, "0") == 0) break;
+                    sanitizeInput(buf);
+                    if (*buf && strlen(buf) < MAX_FIELD_LEN) { 
+                        strcpy(next.person, buf); valid_update = 1; break; 
                     }
-                    break;
+                    printf("[ERROR] Invalid input! Try again.\n");
+                }
+                break;
 
-                default:
-                    printf("[INFO] Update cancelled.\n");
-                    break;
-            }
+            case 3: // Phone
+                while (1) {
+                    if (!read_line_prompt("New Phone (0 to cancel): ", buf, sizeof(buf))) { 
+                        printf("[CANCEL] Input canceled.\n"); break; 
+                    }
+                    if (strcmp(buf, "0") == 0) break;
+                    sanitizeInput(buf);
+                    if (validatePhone(buf) && *buf && strlen(buf) < MAX_FIELD_LEN) { 
+                        strcpy(next.phone, buf); valid_update = 1; break; 
+                    }
+                    printf("[ERROR] Invalid phone format! Try again.\n");
+                }
+                break;
 
-            if (valid_update) {
-                printf("\n--- Updated Contact Preview ---\n");
-                printf("Company : %s\n", new_company);
-                printf("Contact : %s\n", new_person);
-                printf("Phone   : %s\n", new_phone);
-                printf("Email   : %s\n", new_email);
-                printf("-------------------------------\n");
-
-                if (confirmAction("\nDo you want to save these changes?")) {
-                    strcpy(company, new_company);
-                    strcpy(person,  new_person);
-                    strcpy(phone,   new_phone);
-                    strcpy(email,   new_email);
-                    updated = 1;
-                    printf("[SUCCESS] Changes will be saved.\n");
-                } else {
-                    printf("[INFO] Changes discarded.\n");
+            case 4: // Email
+                while (1) {
+                    if (!read_line_prompt("New Email (0 to cancel): ", buf, sizeof(buf))) {
+                        printf("[CANCEL] Input canceled.\n"); break;
+                    }
+                    if (strcmp(buf, "0") == 0) break;
+                    sanitizeInput(buf);
+                    if (validateEmail(buf) && *buf && strlen(buf) < MAX_FIELD_LEN) { 
+                        strcpy(next.email, buf); valid_update = 1; break; 
+                    }
+                    printf("[ERROR] Invalid email format! Try again.\n");
                 }
-            }
+                break;
+
+            default:
+                printf("[INFO] Update cancelled.\n");
+                break;
         }
 
-        // write record (updated or not)
-        char e1[MAX_FIELD_LEN*2], e2[MAX_FIELD_LEN*2], e3[MAX_FIELD_LEN*2], e4[MAX_FIELD_LEN*2];
-        escapeCSV(company,e1,sizeof(e1)); escapeCSV(person,e2,sizeof(e2));
-        escapeCSV(phone,e3,sizeof(e3));   escapeCSV(email,e4,sizeof(e4));
-        fprintf(wf, "%s,%s,%s,%s\n", e1,e2,e3,e4);
+        if (valid_update) {
+            printf("\n--- Updated Contact Preview ---\n");
+            contactPrintCard(&next);
+            printf("-------------------------------\n");
+
+            if (confirmAction("\nDo you want to save these changes?")) {
+                cur = next;
+                updated = 1;
+                bloomNoteContact(cur.phone, cur.email);
+                printf("[SUCCESS] Changes will be saved.\n");
+            } else {
+                printf("[INFO] Changes discarded.\n");
+            }
+        }
     }
 
-    fclose(rf);
-    fclose(wf);
-
-    if (remove(getContactsFile()) != 0) { printf("[ERROR] Failed to remove old file!\n"); remove(tmpfile); return; }
-    if (rename(tmpfile, getContactsFile()) != 0) { printf("[ERROR] Failed to rename temporary file!\n"); return; }
+    if (updated) {
+        char repl[CONTACT_ROW_MAX];
+        contactFormat(&cur, repl, sizeof(repl));
+
+        long long t_commit = nowNs();
+        int cache_fresh = bookWriteBegin();
+        TRACE_BEGIN(t_patch);
+        int edited = rowReplace(getContactsFile(), at, line, repl);
+        TRACE_END(t_patch, "update.in_place");
+        bookWriteEnd(cache_fresh, edited ? BOOK_REWRITE : BOOK_APPEND);   // nothing written: nothing to drop
+        if (edited) {
+            opTimed(&ot, PH_WRITE, t_commit);
+            ot.c->bytes_written += strlen(repl) + 1;
+        } else {
+            static const char *const spans[2] = { "update.copy", "update.rename" };
+            int r = bookReplaceLine(getContactsFile(), at, line, repl, &ot, spans);
+            if (r < 0) return;
+            updated = r;
+        }
+    }
 
     if (updated) printf("\n[SUCCESS] Contact updated successfully!\n");
     else         printf("\n[INFO] No changes made.\n");
@@ -933,16 +9223,16 @@ void updateContact() {
 static int saveRowToFile(const char* filename,
                          const char* company, const char* person,
                          const char* phone,   const char* email) {
+    struct Contact c;
+    contactFill(&c, company, person, phone, email);
+    char row[CONTACT_ROW_MAX];
+    size_t n = contactFormat(&c, row, sizeof(row));   // one row: no CsvWriter buffer to fill
+    row[n++] = '\n';
     FILE *fp = fopen(filename, "a");
     if (!fp) return 0;
-    char a[MAX_FIELD_LEN*2], b[MAX_FIELD_LEN*2], c[MAX_FIELD_LEN*2], d[MAX_FIELD_LEN*2];
-    escapeCSV(company, a, sizeof(a));
-    escapeCSV(person , b, sizeof(b));
-    escapeCSV(phone  , c, sizeof(c));
-    escapeCSV(email  , d, sizeof(d));
-    fprintf(fp, "%s,%s,%s,%s\n", a,b,c,d);
-    fclose(fp);
-    return 1;
+    int ok = fwrite(row, 1, n, fp) == n;
+    if (fclose(fp) != 0) ok = 0;
+    return ok;
 }
 
 static int deleteByCompanyCI_File(const char* filename, const char* company) {
@@ -952,7 +9242,8 @@ static int deleteByCompanyCI_File(const char* filename, const char* company) {
     for (int i = 0; key_lower[i]; i++) key_lower[i] = (char)tolower((unsigned char)key_lower[i]);
 
     FILE *rf = fopen(filename, "r"); if (!rf) return 0;
-    FILE *wf = fopen("contacts.tmp", "w"); if (!wf) { fclose(rf); return 0; }
+    FILE *wf = bookOpenWrite("contacts.tmp", "w"); if (!wf) { fclose(rf); return 0; }
+    CsvWriter cw; if (!csvWriterOpen(&cw, wf)) { fclose(rf); fclose(wf); return 0; }
 
     char line[MAX_LINE_LEN]; int deleted = 0;
     while (fgets(line, sizeof(line), rf)) {
@@ -973,8 +9264,9 @@ static int deleteByCompanyCI_File(const char* filename, const char* company) {
         for (int i = 0; comp_lower[i]; i++) comp_lower[i] = (char)tolower((unsigned char)comp_lower[i]);
 
         if (!deleted && strcmp(comp_lower, key_lower) == 0) { deleted = 1; continue; }
-        fprintf(wf, "%s\n", line);
+        csvPutLine(&cw, line);
     }
+    csvWriterClose(&cw);
     fclose(rf); fclose(wf);
 
     remove(filename);
@@ -984,7 +9276,8 @@ static int deleteByCompanyCI_File(const char* filename, const char* company) {
 
 static int deleteByPhoneNorm_File(const char* filename, const char* phone_raw) {
     FILE *rf = fopen(filename, "r"); if (!rf) return 0;
-    FILE *wf = fopen("contacts.tmp", "w"); if (!wf) { fclose(rf); return 0; }
+    FILE *wf = bookOpenWrite("contacts.tmp", "w"); if (!wf) { fclose(rf); return 0; }
+    CsvWriter cw; if (!csvWriterOpen(&cw, wf)) { fclose(rf); fclose(wf); return 0; }
 
     char key_norm[MAX_FIELD_LEN]; normalizePhone(phone_raw, key_norm, sizeof(key_norm));
     int deleted = 0;
@@ -1011,9 +9304,10 @@ static int deleteByPhoneNorm_File(const char* filename, const char* phone_raw) {
         char pn[MAX_FIELD_LEN]; normalizePhone(phone, pn, sizeof(pn));
 
         if (!deleted && *pn && strcmp(pn, key_norm) == 0) { deleted = 1; continue; }
-        fprintf(wf, "%s\n", line);
+        csvPutLine(&cw, line);
     }
 
+    csvWriterClose(&cw);
     fclose(rf); fclose(wf);
     remove(filename);
     rename("contacts.tmp", filename);
@@ -0,0 +1,37 @@
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#define MAX_FIELD_LEN 100
+#define MAX_LINE_LEN  512
+
+// The record schema: one X(member, ID, label) per CSV column, in file order.
+// struct Contact, the CF_* column numbers and the row codec in main.c
+// (contactParse, contactFormat, csvPutRow, contactCompare, contactPrintCard)
+// are all expanded from this list, so each is a fixed-arity, unrolled routine
+// for exactly these columns. main.c, the unit tests and the benchmarks all
+// include this header, so they agree on the layout of struct Contact.
+// Paths that hold a whole row (scans, group commit and its merges, LSM, the
+// update menu, shard rewrites) pass struct Contact and carry a new column with
+// no change. The older entry points that take the four columns as separate
+// strings (enqueueContactRow/appendContactRow, the row callbacks, qRowLoad,
+// uniqueness and bloom keys) go through contactFill and leave a column they
+// don't name empty; those signatures must grow a parameter before such a
+// column can be set through them.
+#define CONTACT_FIELDS(X)           \
+    X(company, COMPANY, "Company")  \
+    X(person,  PERSON,  "Contact")  \
+    X(phone,   PHONE,   "Phone")    \
+    X(email,   EMAIL,   "Email")
+
+#define CONTACT_MEMBER(name, ID, label) char name[MAX_FIELD_LEN];
+#define CONTACT_INDEX(name, ID, label)  CF_##ID,
+
+struct Contact {
+    CONTACT_FIELDS(CONTACT_MEMBER)
+};
+enum { CONTACT_FIELDS(CONTACT_INDEX) CONTACT_NFIELDS };
+
+// longest row contactFormat writes: every field escaped, commas, '\n', NUL
+#define CONTACT_ROW_MAX (CONTACT_NFIELDS * MAX_FIELD_LEN * 2 + 2)
+
+#endif
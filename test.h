@@ -4,6 +4,10 @@
 // entry ของ unit test
 void runUnitTests(void);
 
+// entry ของ benchmark (Benchmark.c)
+void runBenchmarks(void);
+int  runBenchmarkSuite(long rows, const char *json_path);
+
 // ฟังก์ชันที่ E2E ใน main.c เรียกใช้
 int countContactsTest(const char *filename);
 int contactExistsByCompanyCI(const char *filename, const char *company);